@@ -0,0 +1,147 @@
+/**
+ * collectd - contrib/devel/match_regex_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+/*
+ * Checks the literal prefilter and the memo of the `regex' match against
+ * plain regexec(3).
+ *
+ * This program is not built by default. After building the daemon, build
+ * and run it in the `src' directory with:
+ *
+ *   gcc -DHAVE_CONFIG_H -I. -o match_regex_test \
+ *     ../contrib/devel/match_regex_test.c \
+ *     collectd-plugin.o collectd-common.o collectd-configfile.o \
+ *     collectd-filter_chain.o collectd-meta_data.o collectd-types_list.o \
+ *     collectd-utils_avltree.o collectd-utils_cache.o \
+ *     collectd-utils_complain.o collectd-utils_heap.o \
+ *     collectd-utils_llist.o collectd-utils_time.o collectd-utils_subst.o \
+ *     liboconfig/.libs/liboconfig.a -lltdl -lpthread -lm
+ *   ./match_regex_test
+ */
+
+#include "match_regex.c"
+
+/* Normally defined in collectd.c */
+char hostname_g[DATA_MAX_NAME_LEN] = "localhost";
+cdtime_t interval_g;
+int timeout_g = 2;
+
+static int failures = 0;
+
+static void check (const char *re_str, const char *string) /* {{{ */
+{
+	oconfig_value_t value;
+	oconfig_item_t child;
+	oconfig_item_t ci;
+	regex_t re;
+	value_list_t vl;
+	void *user_data = NULL;
+	int expected;
+	int i;
+
+	/* The reference result: plain regexec(3) without any shortcuts. */
+	if (regcomp (&re, re_str, REG_EXTENDED | REG_NOSUB) != 0)
+	{
+		fprintf (stderr, "FAIL: cannot compile `%s'\n", re_str);
+		failures++;
+		return;
+	}
+	expected = (regexec (&re, string, 0, NULL, 0) == 0)
+		? FC_MATCH_MATCHES : FC_MATCH_NO_MATCH;
+	regfree (&re);
+
+	memset (&value, 0, sizeof (value));
+	value.type = OCONFIG_TYPE_STRING;
+	value.value.string = (char *) re_str;
+
+	memset (&child, 0, sizeof (child));
+	child.key = "TypeInstance";
+	child.values = &value;
+	child.values_num = 1;
+
+	memset (&ci, 0, sizeof (ci));
+	ci.key = "Match";
+	ci.children = &child;
+	ci.children_num = 1;
+
+	if (mr_create (&ci, &user_data) != 0)
+	{
+		fprintf (stderr, "FAIL: mr_create (`%s') failed\n", re_str);
+		failures++;
+		return;
+	}
+
+	memset (&vl, 0, sizeof (vl));
+	sstrncpy (vl.type_instance, string, sizeof (vl.type_instance));
+
+	/* The second round is answered from the memo. */
+	for (i = 0; i < 2; i++)
+	{
+		int status = mr_match (NULL, &vl, NULL, &user_data);
+
+		if (status != expected)
+		{
+			mr_match_t *m = user_data;
+
+			fprintf (stderr, "FAIL: `%s' on `%s' (round %i): got %i, "
+					"expected %i (prefix `%s', substring `%s')\n",
+					re_str, string, i + 1, status, expected,
+					(m->type_instance->prefix != NULL)
+					? m->type_instance->prefix : "",
+					(m->type_instance->substring != NULL)
+					? m->type_instance->substring : "");
+			failures++;
+			break;
+		}
+	}
+
+	mr_destroy (&user_data);
+} /* }}} void check */
+
+int main (void) /* {{{ */
+{
+	check ("^foo", "foobar");
+	check ("^foo", "barfoo");
+	check ("bar$", "foobar");
+	check ("^foo\\.bar", "foo.bar");
+	check ("^foo\\.bar", "fooxbar");
+	check ("fo*bar", "fbar");
+	check ("foo(bar)?baz", "foobaz");
+	check ("[[:digit:]]+-idle", "cpu0-idle");
+	check ("a\\+b", "a+b");
+	check ("a|b", "b");
+
+	/* Word boundaries and buffer anchors are not literal characters. */
+	check ("\\<foo\\>", "foo");
+	check ("\\<foo\\>", "a foo b");
+	check ("\\<foo\\>", "foobar");
+	check ("\\bidle\\b", "cpu idle");
+	check ("^\\`eth", "eth0");
+	check ("0\\'", "eth0");
+	check ("\\<eth[0-9]+\\>", "eth0");
+
+	if (failures > 0)
+	{
+		printf ("%i check(s) failed.\n", failures);
+		return (1);
+	}
+
+	printf ("All checks passed.\n");
+	return (0);
+} /* }}} int main */
+
+/* vim: set sw=4 ts=4 tw=78 noexpandtab fdm=marker : */
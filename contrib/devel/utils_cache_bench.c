@@ -0,0 +1,170 @@
+/**
+ * collectd - contrib/devel/utils_cache_bench.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+/*
+ * Measures the throughput of the value cache for different numbers of
+ * threads. Each thread updates its own set of identifiers with `uc_update'
+ * and reads the rates back with `uc_get_rate', like the network plugin and a
+ * write plugin do for every received value list.
+ *
+ * This program is not built by default. After building the daemon, build
+ * and run it in the `src' directory with:
+ *
+ *   gcc -O2 -DHAVE_CONFIG_H -I. -o utils_cache_bench \
+ *     ../contrib/devel/utils_cache_bench.c collectd-utils_cache.o \
+ *     collectd-plugin.o collectd-common.o collectd-configfile.o \
+ *     collectd-filter_chain.o collectd-meta_data.o collectd-types_list.o \
+ *     collectd-utils_avltree.o collectd-utils_complain.o \
+ *     collectd-utils_heap.o collectd-utils_llist.o collectd-utils_time.o \
+ *     collectd-utils_subst.o liboconfig/.libs/liboconfig.a \
+ *     -lltdl -lpthread -lm
+ *   ./utils_cache_bench [max threads] [identifiers] [rounds]
+ */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_cache.h"
+
+#include <pthread.h>
+
+/* Normally defined in collectd.c */
+char hostname_g[DATA_MAX_NAME_LEN] = "localhost";
+cdtime_t interval_g;
+int timeout_g = 2;
+
+static data_source_t bench_dsrc[2] = {
+	{ "rx", DS_TYPE_DERIVE, 0, NAN },
+	{ "tx", DS_TYPE_DERIVE, 0, NAN }
+};
+static data_set_t bench_ds = { "if_octets", 2, bench_dsrc };
+
+static int identifiers_num = 100000;
+static int rounds_num = 20;
+static int threads_num = 1;
+
+/* Each run uses a host name of its own, so every run starts with an empty
+ * cache for its identifiers. */
+static int run_id = 0;
+
+static void *bench_thread (void *arg) /* {{{ */
+{
+	int thread_id = (int) (long) arg;
+	value_t values[2];
+	value_list_t vl = VALUE_LIST_INIT;
+	int round;
+	int i;
+
+	vl.values = values;
+	vl.values_len = 2;
+	vl.interval = interval_g;
+	sstrncpy (vl.plugin, "interface", sizeof (vl.plugin));
+	sstrncpy (vl.type, "if_octets", sizeof (vl.type));
+
+	for (round = 0; round < rounds_num; round++)
+	{
+		vl.time = TIME_T_TO_CDTIME_T (1000000000 + 10 * round);
+
+		for (i = thread_id; i < identifiers_num; i += threads_num)
+		{
+			gauge_t *rates;
+
+			ssnprintf (vl.host, sizeof (vl.host), "run%i-host%i",
+					run_id, i / 100);
+			ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+					"eth%i", i % 100);
+			values[0].derive = (derive_t) (round * i);
+			values[1].derive = (derive_t) (2 * round * i);
+
+			if (uc_update (&bench_ds, &vl) != 0)
+			{
+				fprintf (stderr, "uc_update failed.\n");
+				exit (EXIT_FAILURE);
+			}
+
+			rates = uc_get_rate (&bench_ds, &vl);
+			if (rates == NULL)
+			{
+				fprintf (stderr, "uc_get_rate failed.\n");
+				exit (EXIT_FAILURE);
+			}
+			sfree (rates);
+		}
+	}
+
+	return ((void *) 0);
+} /* }}} void *bench_thread */
+
+static double bench_run (int num) /* {{{ */
+{
+	pthread_t threads[num];
+	cdtime_t start;
+	cdtime_t end;
+	long i;
+
+	threads_num = num;
+	run_id++;
+
+	start = cdtime ();
+	for (i = 0; i < num; i++)
+	{
+		if (pthread_create (threads + i, NULL, bench_thread,
+					(void *) i) != 0)
+		{
+			fprintf (stderr, "pthread_create failed.\n");
+			exit (EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < num; i++)
+		pthread_join (threads[i], NULL);
+	end = cdtime ();
+
+	return (((double) identifiers_num) * ((double) rounds_num)
+			/ CDTIME_T_TO_DOUBLE (end - start));
+} /* }}} double bench_run */
+
+int main (int argc, char **argv) /* {{{ */
+{
+	int max_threads = 8;
+	int num;
+
+	if (argc > 1)
+		max_threads = atoi (argv[1]);
+	if (argc > 2)
+		identifiers_num = atoi (argv[2]);
+	if (argc > 3)
+		rounds_num = atoi (argv[3]);
+	if ((max_threads < 1) || (identifiers_num < 1) || (rounds_num < 1))
+	{
+		fprintf (stderr, "Usage: %s [max threads] [identifiers] [rounds]\n",
+				argv[0]);
+		return (EXIT_FAILURE);
+	}
+
+	interval_g = TIME_T_TO_CDTIME_T (10);
+	uc_init ();
+
+	printf ("%i identifiers, %i rounds, uc_update + uc_get_rate per value "
+			"list\n", identifiers_num, rounds_num);
+	printf ("%8s %16s\n", "threads", "value lists/s");
+	for (num = 1; num <= max_threads; num *= 2)
+		printf ("%8i %16.0f\n", num, bench_run (num));
+
+	return (EXIT_SUCCESS);
+} /* }}} int main */
+
+/* vim: set sw=4 ts=4 tw=78 noexpandtab fdm=marker : */
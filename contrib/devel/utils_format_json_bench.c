@@ -0,0 +1,150 @@
+/**
+ * collectd - contrib/devel/utils_format_json_bench.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ **/
+
+/*
+ * Measures how many value lists per second `format_json_value_list' writes
+ * into a buffer of the size used by the write_http plugin. When the buffer is
+ * full it is finalized and started again, like write_http does when sending.
+ * To compare two versions of the formatter, build this program with the
+ * `utils_format_json.c' of each tree.
+ *
+ * This program is not built by default. After building the daemon, build
+ * and run it in the `src' directory with:
+ *
+ *   gcc -O2 -DHAVE_CONFIG_H -I. -o utils_format_json_bench \
+ *     ../contrib/devel/utils_format_json_bench.c utils_format_json.c \
+ *     collectd-plugin.o collectd-common.o collectd-configfile.o \
+ *     collectd-filter_chain.o collectd-meta_data.o collectd-types_list.o \
+ *     collectd-utils_avltree.o collectd-utils_cache.o \
+ *     collectd-utils_complain.o collectd-utils_heap.o \
+ *     collectd-utils_llist.o collectd-utils_time.o collectd-utils_subst.o \
+ *     liboconfig/.libs/liboconfig.a -lltdl -lpthread -lm
+ *   ./utils_format_json_bench [value lists]
+ */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+#include "utils_format_json.h"
+
+/* Normally defined in collectd.c */
+char hostname_g[DATA_MAX_NAME_LEN] = "localhost";
+cdtime_t interval_g;
+int timeout_g = 2;
+
+static data_source_t load_dsrc[3] = {
+	{ "shortterm", DS_TYPE_GAUGE, 0, 100 },
+	{ "midterm",   DS_TYPE_GAUGE, 0, 100 },
+	{ "longterm",  DS_TYPE_GAUGE, 0, 100 }
+};
+static data_set_t load_ds = { "load", 3, load_dsrc };
+
+static data_source_t if_octets_dsrc[2] = {
+	{ "rx", DS_TYPE_DERIVE, 0, NAN },
+	{ "tx", DS_TYPE_DERIVE, 0, NAN }
+};
+static data_set_t if_octets_ds = { "if_octets", 2, if_octets_dsrc };
+
+int main (int argc, char **argv) /* {{{ */
+{
+	static char buffer[65536];
+	size_t buffer_fill;
+	size_t buffer_free;
+	value_t values[3];
+	value_list_t vl = VALUE_LIST_INIT;
+	long value_lists_num = 2000000;
+	long buffers_num = 1;
+	cdtime_t start;
+	cdtime_t end;
+	long i;
+
+	if (argc > 1)
+		value_lists_num = atol (argv[1]);
+	if (value_lists_num < 1)
+	{
+		fprintf (stderr, "Usage: %s [value lists]\n", argv[0]);
+		return (EXIT_FAILURE);
+	}
+
+	interval_g = TIME_T_TO_CDTIME_T (10);
+
+	vl.values = values;
+	vl.interval = interval_g;
+	sstrncpy (vl.host, "host.example.com", sizeof (vl.host));
+
+	buffer_fill = 0;
+	buffer_free = sizeof (buffer);
+	format_json_initialize (buffer, &buffer_fill, &buffer_free);
+
+	start = cdtime ();
+	for (i = 0; i < value_lists_num; i++)
+	{
+		const data_set_t *ds;
+		int status;
+
+		/* Alternate between two types, like a mix of plugins would. */
+		if ((i % 2) == 0)
+		{
+			ds = &load_ds;
+			sstrncpy (vl.plugin, "load", sizeof (vl.plugin));
+			vl.plugin_instance[0] = 0;
+			sstrncpy (vl.type, "load", sizeof (vl.type));
+			values[0].gauge = 0.01 * (double) (i % 1000);
+			values[1].gauge = 0.02 * (double) (i % 1000);
+			values[2].gauge = 0.03 * (double) (i % 1000);
+		}
+		else
+		{
+			ds = &if_octets_ds;
+			sstrncpy (vl.plugin, "interface", sizeof (vl.plugin));
+			ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+					"eth%li", i % 4);
+			sstrncpy (vl.type, "if_octets", sizeof (vl.type));
+			values[0].derive = (derive_t) (1000 * i);
+			values[1].derive = (derive_t) (3000 * i);
+		}
+		vl.values_len = ds->ds_num;
+		vl.time = TIME_T_TO_CDTIME_T (1300000000) + (cdtime_t) (i * 12345);
+
+		status = format_json_value_list (buffer, &buffer_fill, &buffer_free,
+				ds, &vl, /* store_rates = */ 0);
+		if (status == -ENOMEM)
+		{
+			format_json_finalize (buffer, &buffer_fill, &buffer_free);
+			format_json_initialize (buffer, &buffer_fill, &buffer_free);
+			buffers_num++;
+			status = format_json_value_list (buffer, &buffer_fill,
+					&buffer_free, ds, &vl, /* store_rates = */ 0);
+		}
+		if (status != 0)
+		{
+			fprintf (stderr, "format_json_value_list failed with status %i.\n",
+					status);
+			return (EXIT_FAILURE);
+		}
+	}
+	format_json_finalize (buffer, &buffer_fill, &buffer_free);
+	end = cdtime ();
+
+	printf ("%li value lists in %li buffers of %zu bytes: %.0f value lists/s\n",
+			value_lists_num, buffers_num, sizeof (buffer),
+			((double) value_lists_num) / CDTIME_T_TO_DOUBLE (end - start));
+
+	return (EXIT_SUCCESS);
+} /* }}} int main */
+
+/* vim: set sw=4 ts=4 tw=78 noexpandtab fdm=marker : */
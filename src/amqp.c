@@ -30,6 +30,7 @@
 #include "common.h"
 #include "plugin.h"
 #include "utils_cmd_putval.h"
+#include "utils_complain.h"
 #include "utils_format_json.h"
 
 #include <pthread.h>
@@ -47,6 +48,9 @@
 
 #define CAMQP_CHANNEL 1
 
+/* Routing key of batched messages if no "RoutingKey" has been configured. */
+#define CAMQP_BATCH_ROUTING_KEY "collectd"
+
 /*
  * Data types
  */
@@ -69,6 +73,25 @@ struct camqp_config_s
     _Bool   store_rates;
     int     format;
 
+    /* publish only, batching: if buffer_size is non-zero, value lists are
+     * collected in "buffer" and a publisher thread sends full buffers as one
+     * message each. */
+    size_t   buffer_size;
+    cdtime_t flush_interval;
+    char    *buffer;
+    size_t   buffer_fill;
+    cdtime_t buffer_init_time;
+    char    *send_buffer;
+    size_t   send_buffer_fill;
+    pthread_mutex_t buffer_lock;
+    pthread_cond_t  buffer_cond;
+    pthread_t publisher_thread;
+    _Bool     publisher_running;
+    _Bool     flush_requested;
+    _Bool     shutdown;
+    c_complain_t drop_complaint; /* publisher cannot keep up */
+    c_complain_t send_complaint; /* publishing a batch failed */
+
     /* subscribe only */
     char   *exchange_type;
     char   *queue;
@@ -118,6 +141,18 @@ static void camqp_config_free (void *ptr) /* {{{ */
     if (conf == NULL)
         return;
 
+    /* The publisher thread sends the remaining buffer before it exits. */
+    if (conf->publisher_running)
+    {
+        pthread_mutex_lock (&conf->buffer_lock);
+        conf->shutdown = 1;
+        pthread_cond_signal (&conf->buffer_cond);
+        pthread_mutex_unlock (&conf->buffer_lock);
+
+        pthread_join (conf->publisher_thread, /* retval = */ NULL);
+        conf->publisher_running = 0;
+    }
+
     camqp_close_connection (conf);
 
     sfree (conf->name);
@@ -129,6 +164,8 @@ static void camqp_config_free (void *ptr) /* {{{ */
     sfree (conf->exchange_type);
     sfree (conf->queue);
     sfree (conf->routing_key);
+    sfree (conf->buffer);
+    sfree (conf->send_buffer);
 
     sfree (conf);
 } /* }}} void camqp_config_free */
@@ -522,11 +559,24 @@ static int camqp_read_body (camqp_config_t *conf, /* {{{ */
 
     if (strcasecmp ("text/collectd", content_type) == 0)
     {
-        status = handle_putval (stderr, body);
-        if (status != 0)
-            ERROR ("amqp plugin: handle_putval failed with status %i.",
-                    status);
-        return (status);
+        char *line;
+        char *saveptr = NULL;
+        int ret = 0;
+
+        /* Batched messages contain one PUTVAL command per line. */
+        for (line = strtok_r (body, "\n", &saveptr);
+                line != NULL;
+                line = strtok_r (NULL, "\n", &saveptr))
+        {
+            status = handle_putval (stderr, line);
+            if (status != 0)
+            {
+                ERROR ("amqp plugin: handle_putval failed with status %i.",
+                        status);
+                ret = status;
+            }
+        }
+        return (ret);
     }
     else if (strcasecmp ("application/json", content_type) == 0)
     {
@@ -721,6 +771,228 @@ static int camqp_write_locked (camqp_config_t *conf, /* {{{ */
     return (status);
 } /* }}} int camqp_write_locked */
 
+/*
+ * Batched publishing
+ */
+/* XXX: You must hold "conf->buffer_lock" when calling this function! */
+static void camqp_swap_buffers (camqp_config_t *conf) /* {{{ */
+{
+    char *tmp;
+
+    tmp = conf->send_buffer;
+    conf->send_buffer = conf->buffer;
+    conf->send_buffer_fill = conf->buffer_fill;
+
+    conf->buffer = tmp;
+    conf->buffer[0] = 0;
+    conf->buffer_fill = 0;
+} /* }}} void camqp_swap_buffers */
+
+static void *camqp_publisher_thread (void *user_data) /* {{{ */
+{
+    camqp_config_t *conf = user_data;
+    const char *routing_key;
+
+    routing_key = (conf->routing_key != NULL)
+        ? conf->routing_key : CAMQP_BATCH_ROUTING_KEY;
+
+    pthread_mutex_lock (&conf->buffer_lock);
+    while (42)
+    {
+        cdtime_t flush_interval = (conf->flush_interval > 0)
+            ? conf->flush_interval : interval_g;
+        char *buffer;
+        size_t buffer_fill;
+        int status;
+
+        /* Wait until a full buffer has been handed over, the current buffer
+         * is one flush interval old or a flush has been requested. The
+         * write callback signals when it adds the first value list, so the
+         * deadline is picked up right away. */
+        while (!conf->shutdown && !conf->flush_requested
+                && (conf->send_buffer_fill == 0))
+        {
+            struct timespec ts_wait;
+
+            if (conf->buffer_fill == 0)
+            {
+                pthread_cond_wait (&conf->buffer_cond, &conf->buffer_lock);
+                continue;
+            }
+
+            if (cdtime () >= (conf->buffer_init_time + flush_interval))
+                break;
+
+            CDTIME_T_TO_TIMESPEC (conf->buffer_init_time + flush_interval,
+                    &ts_wait);
+            pthread_cond_timedwait (&conf->buffer_cond, &conf->buffer_lock,
+                    &ts_wait);
+        }
+
+        conf->flush_requested = 0;
+
+        if ((conf->send_buffer_fill == 0) && (conf->buffer_fill > 0))
+            camqp_swap_buffers (conf);
+
+        if (conf->send_buffer_fill == 0)
+        {
+            if (conf->shutdown)
+                break;
+            continue;
+        }
+
+        buffer = conf->send_buffer;
+        buffer_fill = conf->send_buffer_fill;
+        pthread_mutex_unlock (&conf->buffer_lock);
+
+        status = 0;
+        if (conf->format == CAMQP_FORMAT_JSON)
+        {
+            size_t buffer_free = conf->buffer_size - buffer_fill;
+
+            status = format_json_finalize (buffer, &buffer_fill, &buffer_free);
+            if (status != 0)
+                ERROR ("amqp plugin: format_json_finalize failed.");
+        }
+
+        if (status == 0)
+        {
+            pthread_mutex_lock (&conf->lock);
+            status = camqp_write_locked (conf, buffer, routing_key);
+            pthread_mutex_unlock (&conf->lock);
+        }
+
+        pthread_mutex_lock (&conf->buffer_lock);
+        conf->send_buffer_fill = 0;
+
+        if (status != 0)
+            c_complain (LOG_WARNING, &conf->send_complaint,
+                    "amqp plugin: Publishing to \"%s\" failed. "
+                    "Dropping values.", conf->name);
+        else
+            c_release (LOG_INFO, &conf->send_complaint,
+                    "amqp plugin: Values for \"%s\" are being published "
+                    "again.", conf->name);
+    } /* while (42) */
+    pthread_mutex_unlock (&conf->buffer_lock);
+
+    return ((void *) 0);
+} /* }}} void *camqp_publisher_thread */
+
+static int camqp_write_batch (camqp_config_t *conf, /* {{{ */
+        const data_set_t *ds, const value_list_t *vl)
+{
+    char line[4096];
+    size_t line_len;
+    int status;
+
+    if (conf->format == CAMQP_FORMAT_COMMAND)
+    {
+        status = create_putval (line, sizeof (line) - 1, ds, vl);
+        if (status != 0)
+        {
+            ERROR ("amqp plugin: create_putval failed with status %i.",
+                    status);
+            return (status);
+        }
+        line_len = strlen (line);
+        line[line_len] = '\n';
+        line_len++;
+        line[line_len] = 0;
+    }
+    else if (conf->format == CAMQP_FORMAT_JSON)
+    {
+        size_t bfree = sizeof (line);
+        size_t bfill = 0;
+
+        /* This yields the value list with a leading comma, which
+         * format_json_finalize replaces with the opening bracket. */
+        format_json_initialize (line, &bfill, &bfree);
+        status = format_json_value_list (line, &bfill, &bfree,
+                ds, vl, conf->store_rates);
+        if (status != 0)
+        {
+            ERROR ("amqp plugin: format_json_value_list failed "
+                    "with status %i.", status);
+            return (status);
+        }
+        line_len = bfill;
+    }
+    else
+    {
+        ERROR ("amqp plugin: Invalid format (%i).", conf->format);
+        return (-1);
+    }
+
+    pthread_mutex_lock (&conf->buffer_lock);
+
+    if (!conf->publisher_running)
+    {
+        status = pthread_create (&conf->publisher_thread, /* attr = */ NULL,
+                camqp_publisher_thread, conf);
+        if (status != 0)
+        {
+            char errbuf[1024];
+            pthread_mutex_unlock (&conf->buffer_lock);
+            ERROR ("amqp plugin: pthread_create failed: %s",
+                    sstrerror (status, errbuf, sizeof (errbuf)));
+            return (status);
+        }
+        conf->publisher_running = 1;
+    }
+
+    /* Leave room for the closing bracket and the null byte. */
+    if ((conf->buffer_fill + line_len + 2) > conf->buffer_size)
+    {
+        if (conf->send_buffer_fill != 0)
+        {
+            c_complain (LOG_WARNING, &conf->drop_complaint,
+                    "amqp plugin: The publisher of \"%s\" cannot keep up. "
+                    "Dropping values.", conf->name);
+            pthread_mutex_unlock (&conf->buffer_lock);
+            return (-1);
+        }
+
+        camqp_swap_buffers (conf);
+        pthread_cond_signal (&conf->buffer_cond);
+    }
+
+    c_release (LOG_INFO, &conf->drop_complaint,
+            "amqp plugin: The publisher of \"%s\" has caught up.",
+            conf->name);
+
+    /* The publisher sleeps without a deadline while the buffer is empty. */
+    if (conf->buffer_fill == 0)
+    {
+        conf->buffer_init_time = cdtime ();
+        pthread_cond_signal (&conf->buffer_cond);
+    }
+
+    memcpy (conf->buffer + conf->buffer_fill, line, line_len + 1);
+    conf->buffer_fill += line_len;
+
+    pthread_mutex_unlock (&conf->buffer_lock);
+
+    return (0);
+} /* }}} int camqp_write_batch */
+
+static int camqp_flush (cdtime_t timeout __attribute__((unused)), /* {{{ */
+        const char *identifier __attribute__((unused)),
+        user_data_t *user_data)
+{
+    camqp_config_t *conf = user_data->data;
+
+    pthread_mutex_lock (&conf->buffer_lock);
+    if (conf->buffer_fill > 0)
+    {
+        conf->flush_requested = 1;
+        pthread_cond_signal (&conf->buffer_cond);
+    }
+    pthread_mutex_unlock (&conf->buffer_lock);
+
+    return (0);
+} /* }}} int camqp_flush */
+
 static int camqp_write (const data_set_t *ds, const value_list_t *vl, /* {{{ */
         user_data_t *user_data)
 {
@@ -732,6 +1004,9 @@ static int camqp_write (const data_set_t *ds, const value_list_t *vl, /* {{{ */
     if ((ds == NULL) || (vl == NULL) || (conf == NULL))
         return (EINVAL);
 
+    if (conf->buffer_size > 0)
+        return (camqp_write_batch (conf, ds, vl));
+
     memset (buffer, 0, sizeof (buffer));
 
     if (conf->routing_key != NULL)
@@ -848,6 +1123,12 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
     /* publish only */
     conf->delivery_mode = CAMQP_DM_VOLATILE;
     conf->store_rates = 0;
+    conf->buffer_size = 0;
+    conf->flush_interval = 0;
+    pthread_mutex_init (&conf->buffer_lock, /* attr = */ NULL);
+    pthread_cond_init (&conf->buffer_cond, /* attr = */ NULL);
+    C_COMPLAIN_INIT (&conf->drop_complaint);
+    C_COMPLAIN_INIT (&conf->send_complaint);
     /* subscribe only */
     conf->exchange_type = NULL;
     conf->queue = NULL;
@@ -905,6 +1186,20 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
             status = cf_util_get_boolean (child, &conf->store_rates);
         else if ((strcasecmp ("Format", child->key) == 0) && publish)
             status = camqp_config_set_format (child, conf);
+        else if ((strcasecmp ("BufferSize", child->key) == 0) && publish)
+        {
+            int tmp = 0;
+            status = cf_util_get_int (child, &tmp);
+            if ((status == 0) && (tmp > 0) && (tmp < 4096))
+            {
+                WARNING ("amqp plugin: The minimum \"BufferSize\" is 4096 "
+                        "bytes.");
+                tmp = 4096;
+            }
+            conf->buffer_size = (tmp > 0) ? ((size_t) tmp) : 0;
+        }
+        else if ((strcasecmp ("FlushInterval", child->key) == 0) && publish)
+            status = cf_util_get_cdtime (child, &conf->flush_interval);
         else
             WARNING ("amqp plugin: Ignoring unknown "
                     "configuration option \"%s\".", child->key);
@@ -944,12 +1239,33 @@ static int camqp_config_connection (oconfig_item_t *ci, /* {{{ */
 
         ssnprintf (cbname, sizeof (cbname), "amqp/%s", conf->name);
 
+        if (conf->buffer_size > 0)
+        {
+            conf->buffer = malloc (conf->buffer_size);
+            conf->send_buffer = malloc (conf->buffer_size);
+            if ((conf->buffer == NULL) || (conf->send_buffer == NULL))
+            {
+                ERROR ("amqp plugin: malloc failed.");
+                camqp_config_free (conf);
+                return (ENOMEM);
+            }
+            conf->buffer[0] = 0;
+            conf->send_buffer[0] = 0;
+        }
+
         status = plugin_register_write (cbname, camqp_write, &ud);
         if (status != 0)
         {
             camqp_config_free (conf);
             return (status);
         }
+
+        if (conf->buffer_size > 0)
+        {
+            /* The write callback owns "conf" and frees it. */
+            ud.free_func = NULL;
+            plugin_register_flush (cbname, camqp_flush, &ud);
+        }
     }
     else
     {
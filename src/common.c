@@ -1336,3 +1336,18 @@ int strtoderive (const char *string, derive_t *ret_value) /* {{{ */
 	*ret_value = tmp;
 	return (0);
 } /* }}} int strtoderive */
+
+uint32_t fnv1a_hash (const void *data, size_t len) /* {{{ */
+{
+	const unsigned char *ptr = data;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (uint32_t) ptr[i];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+} /* }}} uint32_t fnv1a_hash */
@@ -306,4 +306,8 @@ int service_name_to_port_number (const char *service_name);
  * failure. If failure is returned, ret_value is not touched. */
 int strtoderive (const char *string, derive_t *ret_value);
 
+/* Returns the 32 bit FNV-1a hash of the `len' bytes at `data'. It is fast and
+ * spreads similar identifiers well, but is not suitable for cryptography. */
+uint32_t fnv1a_hash (const void *data, size_t len);
+
 #endif /* COMMON_H */
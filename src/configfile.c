@@ -98,6 +98,11 @@ static cf_global_option_t cf_global_options[] =
 	{"FQDNLookup",  NULL, "true"},
 	{"Interval",    NULL, "10"},
 	{"ReadThreads", NULL, "5"},
+	{"ReadTimeout", NULL, "0"},
+	{"WriteThreads", NULL, "5"},
+	{"WriteQueueLimitHigh", NULL, NULL},
+	{"WriteQueueLimitLow",  NULL, NULL},
+	{"CollectInternalStats", NULL, "false"},
 	{"Timeout",     NULL, "2"},
 	{"PreCacheChain",  NULL, "PreCache"},
 	{"PostCacheChain", NULL, "PostCache"}
@@ -381,6 +386,46 @@ static int dispatch_block_plugin (oconfig_item_t *ci)
 }
 
 
+static int dispatch_block_read_group (oconfig_item_t *ci)
+{
+	const char *name;
+	int threads_num = 1;
+	cdtime_t timeout = 0;
+	int i;
+
+	if ((ci->values_num != 1)
+			|| (ci->values[0].type != OCONFIG_TYPE_STRING))
+	{
+		WARNING ("The `ReadGroup' block needs exactly one string "
+				"argument.");
+		return (-1);
+	}
+
+	name = ci->values[0].value.string;
+
+	for (i = 0; i < ci->children_num; i++)
+	{
+		oconfig_item_t *child = ci->children + i;
+
+		if (strcasecmp ("Threads", child->key) == 0)
+			cf_util_get_int (child, &threads_num);
+		else if (strcasecmp ("Timeout", child->key) == 0)
+			cf_util_get_cdtime (child, &timeout);
+		else
+			WARNING ("Ignoring unknown ReadGroup option \"%s\" "
+					"for group \"%s\".", child->key, name);
+	}
+
+	if (threads_num < 1)
+	{
+		WARNING ("ReadGroup \"%s\": `Threads' must be at least one.",
+				name);
+		threads_num = 1;
+	}
+
+	return (plugin_set_read_group (name, threads_num, timeout));
+} /* int dispatch_block_read_group */
+
 static int dispatch_block (oconfig_item_t *ci)
 {
 	if (strcasecmp (ci->key, "LoadPlugin") == 0)
@@ -389,6 +434,8 @@ static int dispatch_block (oconfig_item_t *ci)
 		return (dispatch_block_plugin (ci));
 	else if (strcasecmp (ci->key, "Chain") == 0)
 		return (fc_configure (ci));
+	else if (strcasecmp (ci->key, "ReadGroup") == 0)
+		return (dispatch_block_read_group (ci));
 
 	return (0);
 }
@@ -828,6 +875,30 @@ const char *global_option_get (const char *option)
 			: cf_global_options[i].def);
 } /* char *global_option_get */
 
+long global_option_get_long (const char *option, long default_value)
+{
+	const char *str;
+	char *endptr = NULL;
+	double value;
+
+	str = global_option_get (option);
+	if (str == NULL)
+		return (default_value);
+
+	/* Numbers from the config file are stored as "%lf", so use strtod(3)
+	 * rather than strtol(3) here. */
+	errno = 0;
+	value = strtod (str, &endptr);
+	if ((errno != 0) || (endptr == str) || (*endptr != 0))
+	{
+		ERROR ("global_option_get_long: Unable to parse the value "
+				"of `%s' (\"%s\") as a number.", option, str);
+		return (default_value);
+	}
+
+	return ((long) value);
+} /* long global_option_get_long */
+
 void cf_unregister (const char *type)
 {
 	cf_callback_t *this, *prev;
@@ -86,6 +86,9 @@ int cf_read (char *filename);
 
 int global_option_set (const char *option, const char *value);
 const char *global_option_get (const char *option);
+/* Returns the global option parsed as an integer, or `default_value' if the
+ * option is not set or cannot be parsed. */
+long global_option_get_long (const char *option, long default_value);
 
 /* Assures the config option is a string, duplicates it and returns the copy in
  * "ret_string". If necessary "*ret_string" is freed first. Returns zero upon
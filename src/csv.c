@@ -26,6 +26,11 @@
 #include "common.h"
 #include "utils_cache.h"
 #include "utils_parse_option.h"
+#include "utils_avltree.h"
+
+#include <pthread.h>
+
+#define CSV_MAX_OPEN_FILES 128
 
 /*
  * Private variables
@@ -33,13 +38,58 @@
 static const char *config_keys[] =
 {
 	"DataDir",
-	"StoreRates"
+	"StoreRates",
+	"MaxOpenFiles"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
 static char *datadir   = NULL;
 static int store_rates = 0;
 static int use_stdio   = 0;
+static int max_open_files = CSV_MAX_OPEN_FILES;
+
+/*
+ * Open files are kept in a tree, indexed by file name, and in a doubly linked
+ * list ordered by last use. When more than `max_open_files' files are open,
+ * the least recently used ones that are not in use are closed. Lines are
+ * written to the stdio buffers and flushed once they are older than the
+ * interval, on `flush' and on shutdown.
+ *
+ * `csv_lock' protects the tree, the list and the reference counts. Each file
+ * has its own lock, which is held while writing to or flushing its stdio
+ * buffer, so writes to different files don't wait for each other. A file that
+ * is closed while still in use, e.g. when the date changes, is freed by the
+ * last user.
+ */
+struct csv_file_s;
+typedef struct csv_file_s csv_file_t;
+struct csv_file_s
+{
+	char *filename;
+	FILE *fh;
+	pthread_mutex_t lock;
+
+	/* Time the oldest line not yet flushed was written, zero if there is
+	 * none. Protected by `lock'. */
+	cdtime_t dirty_since;
+
+	int refcount;
+	_Bool closed;
+
+	csv_file_t *prev; /* more recently used */
+	csv_file_t *next; /* less recently used */
+};
+
+static c_avl_tree_t *csv_files = NULL;
+static csv_file_t   *csv_files_head = NULL;
+static csv_file_t   *csv_files_tail = NULL;
+static cdtime_t      csv_last_flush = 0;
+
+/* The date suffix of the file names is only recomputed once a day. */
+static char   csv_date[16] = "";
+static time_t csv_date_expires = 0;
+
+static pthread_mutex_t csv_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int value_list_to_string (char *buffer, int buffer_len,
 		const data_set_t *ds, const value_list_t *vl)
@@ -164,24 +214,6 @@ static int value_list_to_filename (char *buffer, int buffer_len,
 		return (-1);
 	offset += status;
 
-	if (!use_stdio)
-	{
-		time_t now;
-		struct tm stm;
-
-		/* TODO: Find a way to minimize the calls to `localtime_r',
-		 * since they are pretty expensive.. */
-		now = time (NULL);
-		if (localtime_r (&now, &stm) == NULL)
-		{
-			ERROR ("csv plugin: localtime_r failed");
-			return (1);
-		}
-
-		strftime (buffer + offset, buffer_len - offset,
-				"-%Y-%m-%d", &stm);
-	}
-
 	return (0);
 } /* int value_list_to_filename */
 
@@ -252,6 +284,17 @@ static int csv_config (const char *key, const char *value)
 		else
 			store_rates = 0;
 	}
+	else if (strcasecmp ("MaxOpenFiles", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			WARNING ("csv plugin: Invalid value for MaxOpenFiles: %s",
+					value);
+			return (1);
+		}
+		max_open_files = tmp;
+	}
 	else
 	{
 		return (-1);
@@ -259,15 +302,331 @@ static int csv_config (const char *key, const char *value)
 	return (0);
 } /* int csv_config */
 
+/* Must hold csv_lock */
+static void csv_file_unlink (csv_file_t *f) /* {{{ */
+{
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		csv_files_head = f->next;
+
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	else
+		csv_files_tail = f->prev;
+
+	f->prev = NULL;
+	f->next = NULL;
+} /* }}} void csv_file_unlink */
+
+/* Must hold csv_lock */
+static void csv_file_link_head (csv_file_t *f) /* {{{ */
+{
+	f->prev = NULL;
+	f->next = csv_files_head;
+	if (csv_files_head != NULL)
+		csv_files_head->prev = f;
+	csv_files_head = f;
+	if (csv_files_tail == NULL)
+		csv_files_tail = f;
+} /* }}} void csv_file_link_head */
+
+/* Closing the file releases the lock taken in `csv_file_open', after the
+ * stdio buffer has been written. Nobody may be using the file any more. */
+static void csv_file_destroy (csv_file_t *f) /* {{{ */
+{
+	if (fclose (f->fh) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: fclose (%s) failed: %s", f->filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+
+	pthread_mutex_destroy (&f->lock);
+	sfree (f->filename);
+	sfree (f);
+} /* }}} void csv_file_destroy */
+
+/* Must hold csv_lock. If the file is still in use, it is destroyed by
+ * `csv_file_release' once the last user is done with it. */
+static void csv_file_close (csv_file_t *f) /* {{{ */
+{
+	csv_file_unlink (f);
+	c_avl_remove (csv_files, f->filename, NULL, NULL);
+	f->closed = 1;
+
+	if (f->refcount == 0)
+		csv_file_destroy (f);
+} /* }}} void csv_file_close */
+
+/* Must hold csv_lock */
+static void csv_file_release (csv_file_t *f) /* {{{ */
+{
+	assert (f->refcount > 0);
+	f->refcount--;
+
+	if ((f->refcount == 0) && f->closed)
+		csv_file_destroy (f);
+} /* }}} void csv_file_release */
+
+/* Closes the least recently used files until at most `max_open_files' are
+ * open. Files that are in use are skipped, so the limit may be exceeded for a
+ * moment: if such a file was opened again before its last user released it,
+ * closing the old handle would drop the lock held through the new one.
+ * Must hold csv_lock. */
+static void csv_file_evict (void) /* {{{ */
+{
+	csv_file_t *f = csv_files_tail;
+
+	while ((f != NULL) && (c_avl_size (csv_files) > max_open_files))
+	{
+		csv_file_t *prev = f->prev;
+
+		if (f->refcount == 0)
+			csv_file_close (f);
+		f = prev;
+	}
+} /* }}} void csv_file_evict */
+
+/* Must hold csv_lock */
+static void csv_file_close_all (void) /* {{{ */
+{
+	while (csv_files_tail != NULL)
+		csv_file_close (csv_files_tail);
+} /* }}} void csv_file_close_all */
+
+/* Must hold f->lock */
+static void csv_file_flush (csv_file_t *f) /* {{{ */
+{
+	if (f->dirty_since == 0)
+		return;
+
+	if (fflush (f->fh) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: fflush (%s) failed: %s", f->filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+	}
+	f->dirty_since = 0;
+} /* }}} void csv_file_flush */
+
+/* Must hold csv_lock. Flushes all files with lines older than `max_age'. */
+static void csv_file_flush_all (cdtime_t max_age) /* {{{ */
+{
+	csv_file_t *f;
+	cdtime_t now;
+
+	now = cdtime ();
+	for (f = csv_files_head; f != NULL; f = f->next)
+	{
+		pthread_mutex_lock (&f->lock);
+		if ((f->dirty_since != 0) && ((now - f->dirty_since) >= max_age))
+			csv_file_flush (f);
+		pthread_mutex_unlock (&f->lock);
+	}
+
+	csv_last_flush = now;
+} /* }}} void csv_file_flush_all */
+
+/* Must hold csv_lock. Updates `csv_date' and closes all open files when the
+ * date, and with it the name of all files, has changed. */
+static int csv_update_date (void) /* {{{ */
+{
+	time_t now;
+	struct tm stm;
+	char date[sizeof (csv_date)];
+
+	now = time (NULL);
+	if (now < csv_date_expires)
+		return (0);
+
+	if (localtime_r (&now, &stm) == NULL)
+	{
+		ERROR ("csv plugin: localtime_r failed");
+		return (-1);
+	}
+
+	strftime (date, sizeof (date), "-%Y-%m-%d", &stm);
+
+	/* Next midnight. mktime(3) normalizes the day of month and figures
+	 * out daylight saving time for us. */
+	stm.tm_mday++;
+	stm.tm_hour = 0;
+	stm.tm_min = 0;
+	stm.tm_sec = 0;
+	stm.tm_isdst = -1;
+	csv_date_expires = mktime (&stm);
+	if (csv_date_expires == ((time_t) -1))
+		csv_date_expires = now + 1;
+
+	if (strcmp (date, csv_date) != 0)
+	{
+		if (csv_date[0] != 0)
+		{
+			DEBUG ("csv plugin: Date changed from \"%s\" to \"%s\", "
+					"closing %i open file(s).", csv_date, date,
+					c_avl_size (csv_files));
+		}
+		csv_file_close_all ();
+		sstrncpy (csv_date, date, sizeof (csv_date));
+	}
+
+	return (0);
+} /* }}} int csv_update_date */
+
+/* Must hold csv_lock */
+static csv_file_t *csv_file_open (const char *filename, /* {{{ */
+		const data_set_t *ds)
+{
+	struct stat  statbuf;
+	csv_file_t  *f;
+	struct flock fl;
+	int          status;
+
+	if (stat (filename, &statbuf) == -1)
+	{
+		if (errno == ENOENT)
+		{
+			if (csv_create_file (filename, ds))
+				return (NULL);
+		}
+		else
+		{
+			char errbuf[1024];
+			ERROR ("stat(%s) failed: %s", filename,
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			return (NULL);
+		}
+	}
+	else if (!S_ISREG (statbuf.st_mode))
+	{
+		ERROR ("stat(%s): Not a regular file!",
+				filename);
+		return (NULL);
+	}
+
+	f = malloc (sizeof (*f));
+	if (f == NULL)
+	{
+		ERROR ("csv plugin: malloc failed.");
+		return (NULL);
+	}
+	memset (f, 0, sizeof (*f));
+	pthread_mutex_init (&f->lock, /* attr = */ NULL);
+
+	f->filename = strdup (filename);
+	if (f->filename == NULL)
+	{
+		ERROR ("csv plugin: strdup failed.");
+		pthread_mutex_destroy (&f->lock);
+		sfree (f);
+		return (NULL);
+	}
+
+	f->fh = fopen (filename, "a");
+	if (f->fh == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: fopen (%s) failed: %s", filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		pthread_mutex_destroy (&f->lock);
+		sfree (f->filename);
+		sfree (f);
+		return (NULL);
+	}
+
+	/* The lock is held for as long as the file is open. */
+	memset (&fl, '\0', sizeof (fl));
+	fl.l_start  = 0;
+	fl.l_len    = 0; /* till end of file */
+	fl.l_pid    = getpid ();
+	fl.l_type   = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	status = fcntl (fileno (f->fh), F_SETLK, &fl);
+	if (status != 0)
+	{
+		char errbuf[1024];
+		ERROR ("csv plugin: flock (%s) failed: %s", filename,
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		fclose (f->fh);
+		pthread_mutex_destroy (&f->lock);
+		sfree (f->filename);
+		sfree (f);
+		return (NULL);
+	}
+
+	status = c_avl_insert (csv_files, f->filename, f);
+	if (status != 0)
+	{
+		ERROR ("csv plugin: c_avl_insert (%s) failed.", filename);
+		fclose (f->fh);
+		pthread_mutex_destroy (&f->lock);
+		sfree (f->filename);
+		sfree (f);
+		return (NULL);
+	}
+	csv_file_link_head (f);
+
+	return (f);
+} /* }}} csv_file_t *csv_file_open */
+
+/* Must hold csv_lock. The returned file has to be handed back using
+ * `csv_file_release'. */
+static csv_file_t *csv_file_get (const char *filename, /* {{{ */
+		const data_set_t *ds)
+{
+	csv_file_t *f = NULL;
+
+	if (c_avl_get (csv_files, filename, (void *) &f) == 0)
+	{
+		if (f != csv_files_head)
+		{
+			csv_file_unlink (f);
+			csv_file_link_head (f);
+		}
+	}
+	else
+	{
+		f = csv_file_open (filename, ds);
+		if (f == NULL)
+			return (NULL);
+	}
+
+	f->refcount++;
+	csv_file_evict ();
+
+	return (f);
+} /* }}} csv_file_t *csv_file_get */
+
+static int csv_init (void) /* {{{ */
+{
+	if (use_stdio)
+		return (0);
+
+	pthread_mutex_lock (&csv_lock);
+	if (csv_files == NULL)
+		csv_files = c_avl_create ((void *) strcmp);
+	pthread_mutex_unlock (&csv_lock);
+
+	if (csv_files == NULL)
+	{
+		ERROR ("csv plugin: c_avl_create failed.");
+		return (-1);
+	}
+
+	return (0);
+} /* }}} int csv_init */
+
 static int csv_write (const data_set_t *ds, const value_list_t *vl,
 		user_data_t __attribute__((unused)) *user_data)
 {
-	struct stat  statbuf;
 	char         filename[512];
+	size_t       filename_len;
 	char         values[4096];
-	FILE        *csv;
-	int          csv_fd;
-	struct flock fl;
+	csv_file_t  *csv;
+	cdtime_t     now;
 	int          status;
 
 	if (0 != strcmp (ds->type, vl->type)) {
@@ -277,6 +636,7 @@ static int csv_write (const data_set_t *ds, const value_list_t *vl,
 
 	if (value_list_to_filename (filename, sizeof (filename), ds, vl) != 0)
 		return (-1);
+	filename_len = strlen (filename);
 
 	DEBUG ("csv plugin: csv_write: filename = %s;", filename);
 
@@ -306,68 +666,96 @@ static int csv_write (const data_set_t *ds, const value_list_t *vl,
 		return (0);
 	}
 
-	if (stat (filename, &statbuf) == -1)
+	pthread_mutex_lock (&csv_lock);
+
+	if (csv_files == NULL)
 	{
-		if (errno == ENOENT)
-		{
-			if (csv_create_file (filename, ds))
-				return (-1);
-		}
-		else
-		{
-			char errbuf[1024];
-			ERROR ("stat(%s) failed: %s", filename,
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-			return (-1);
-		}
+		pthread_mutex_unlock (&csv_lock);
+		return (-1);
 	}
-	else if (!S_ISREG (statbuf.st_mode))
+
+	if (csv_update_date () != 0)
 	{
-		ERROR ("stat(%s): Not a regular file!",
-				filename);
+		pthread_mutex_unlock (&csv_lock);
 		return (-1);
 	}
 
-	csv = fopen (filename, "a");
-	if (csv == NULL)
+	status = ssnprintf (filename + filename_len,
+			sizeof (filename) - filename_len, "%s", csv_date);
+	if ((status < 0)
+			|| ((size_t) status >= sizeof (filename) - filename_len))
 	{
-		char errbuf[1024];
-		ERROR ("csv plugin: fopen (%s) failed: %s", filename,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
+		pthread_mutex_unlock (&csv_lock);
+		ERROR ("csv plugin: File name too long: %s", filename);
 		return (-1);
 	}
-	csv_fd = fileno (csv);
-
-	memset (&fl, '\0', sizeof (fl));
-	fl.l_start  = 0;
-	fl.l_len    = 0; /* till end of file */
-	fl.l_pid    = getpid ();
-	fl.l_type   = F_WRLCK;
-	fl.l_whence = SEEK_SET;
 
-	status = fcntl (csv_fd, F_SETLK, &fl);
-	if (status != 0)
+	csv = csv_file_get (filename, ds);
+	if (csv == NULL)
 	{
-		char errbuf[1024];
-		ERROR ("csv plugin: flock (%s) failed: %s", filename,
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (csv);
+		pthread_mutex_unlock (&csv_lock);
 		return (-1);
 	}
 
-	fprintf (csv, "%s\n", values);
+	/* Files that are not being written to any more are flushed here, too. */
+	now = cdtime ();
+	if ((now - csv_last_flush) >= interval_g)
+		csv_file_flush_all (/* max_age = */ interval_g);
 
-	/* The lock is implicitely released. I we don't release it explicitely
-	 * because the `FILE *' may need to flush a cache first */
-	fclose (csv);
+	pthread_mutex_unlock (&csv_lock);
+
+	pthread_mutex_lock (&csv->lock);
+	fprintf (csv->fh, "%s\n", values);
+	if (csv->dirty_since == 0)
+		csv->dirty_since = now;
+	else if ((now - csv->dirty_since) >= interval_g)
+		csv_file_flush (csv);
+	pthread_mutex_unlock (&csv->lock);
+
+	pthread_mutex_lock (&csv_lock);
+	csv_file_release (csv);
+	pthread_mutex_unlock (&csv_lock);
 
 	return (0);
 } /* int csv_write */
 
+static int csv_flush (cdtime_t __attribute__((unused)) timeout, /* {{{ */
+		const char __attribute__((unused)) *identifier,
+		user_data_t __attribute__((unused)) *user_data)
+{
+	if (use_stdio)
+	{
+		fflush (use_stdio == 1 ? stdout : stderr);
+		return (0);
+	}
+
+	pthread_mutex_lock (&csv_lock);
+	csv_file_flush_all (/* max_age = */ 0);
+	pthread_mutex_unlock (&csv_lock);
+
+	return (0);
+} /* }}} int csv_flush */
+
+static int csv_shutdown (void) /* {{{ */
+{
+	pthread_mutex_lock (&csv_lock);
+	if (csv_files != NULL)
+	{
+		csv_file_close_all ();
+		c_avl_destroy (csv_files);
+		csv_files = NULL;
+	}
+	pthread_mutex_unlock (&csv_lock);
+
+	return (0);
+} /* }}} int csv_shutdown */
+
 void module_register (void)
 {
 	plugin_register_config ("csv", csv_config,
 			config_keys, config_keys_num);
+	plugin_register_init ("csv", csv_init);
 	plugin_register_write ("csv", csv_write, /* user_data = */ NULL);
+	plugin_register_flush ("csv", csv_flush, /* user_data = */ NULL);
+	plugin_register_shutdown ("csv", csv_shutdown);
 } /* void module_register */
@@ -872,8 +872,8 @@ static int cx_config_add_url (oconfig_item_t *ci) /* {{{ */
     ssnprintf (cb_name, sizeof (cb_name), "curl_xml-%s-%s",
                db->instance, db->url);
 
-    plugin_register_complex_read (/* group = */ NULL, cb_name, cx_read,
-                                  /* interval = */ NULL, &ud);
+    plugin_register_complex_read (/* group = */ "curl_xml", cb_name,
+                                  cx_read, /* interval = */ NULL, &ud);
   }
   else
   {
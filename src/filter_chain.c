@@ -26,6 +26,8 @@
 #include "common.h"
 #include "filter_chain.h"
 
+#include <pthread.h>
+
 /*
  * Data types
  */
@@ -62,6 +64,42 @@ struct fc_rule_s
   fc_match_t  *matches;
   fc_target_t *targets;
   fc_rule_t *next;
+
+  /* Statistics, only updated if `fc_record_statistics' is set. `stats_time'
+   * is the time spent evaluating the rule's matches. */
+  derive_t stats_matched;
+  derive_t stats_not_matched;
+  cdtime_t stats_time;
+  pthread_mutex_t stats_lock;
+}; /* }}} */
+
+/* Chains are compiled into a flat array of operations when they are
+ * configured:
+ *
+ *   FC_OP_RULE    Start of a rule. `next' is the index of the operation
+ *                 following the rule, where execution continues if one of
+ *                 the rule's matches does not match.
+ *   FC_OP_MATCH   Call a match.
+ *   FC_OP_TARGET  Call a target.
+ *   FC_OP_JUMP    The built-in `jump' target with the destination chain
+ *                 already resolved.
+ *   FC_OP_DEFAULT Start of the chain's default targets.
+ */
+#define FC_OP_RULE    0
+#define FC_OP_MATCH   1
+#define FC_OP_TARGET  2
+#define FC_OP_JUMP    3
+#define FC_OP_DEFAULT 4
+struct fc_op_s;
+typedef struct fc_op_s fc_op_t; /* {{{ */
+struct fc_op_s
+{
+  int type;
+  size_t next;
+  fc_rule_t   *rule;
+  fc_match_t  *match;
+  fc_target_t *target;
+  fc_chain_t  *chain;
 }; /* }}} */
 
 /* List of chains, used for `chain_list_head' */
@@ -71,6 +109,9 @@ struct fc_chain_s /* {{{ */
   fc_rule_t   *rules;
   fc_target_t *targets;
   fc_chain_t  *next;
+
+  fc_op_t *program;
+  size_t   program_len;
 }; /* }}} */
 
 /*
@@ -80,6 +121,8 @@ static fc_match_t  *match_list_head;
 static fc_target_t *target_list_head;
 static fc_chain_t  *chain_list_head;
 
+static _Bool fc_record_statistics = 0;
+
 /*
  * Private functions
  */
@@ -130,6 +173,7 @@ static void fc_free_rules (fc_rule_t *r) /* {{{ */
 
   fc_free_matches (r->matches);
   fc_free_targets (r->targets);
+  pthread_mutex_destroy (&r->stats_lock);
 
   if (r->next != NULL)
     fc_free_rules (r->next);
@@ -144,6 +188,7 @@ static void fc_free_chains (fc_chain_t *c) /* {{{ */
 
   fc_free_rules (c->rules);
   fc_free_targets (c->targets);
+  free (c->program);
 
   if (c->next != NULL)
     fc_free_chains (c->next);
@@ -169,6 +214,120 @@ static char *fc_strdup (const char *orig) /* {{{ */
   return (dest);
 } /* }}} char *fc_strdup */
 
+/*
+ * Compilation
+ *
+ * Each chain is translated into an array of `fc_op_t' once it has been
+ * configured, so processing a value does not have to follow the linked lists
+ * of rules, matches and targets.
+ */
+static int fc_bit_jump_invoke (const data_set_t *ds, value_list_t *vl,
+    notification_meta_t **meta, void **user_data);
+
+static void fc_compile_targets (fc_op_t *program, size_t *program_len, /* {{{ */
+    fc_target_t *targets)
+{
+  fc_target_t *target;
+
+  for (target = targets; target != NULL; target = target->next)
+  {
+    fc_op_t *op = program + *program_len;
+
+    op->type = FC_OP_TARGET;
+    op->target = target;
+    if (target->proc.invoke == fc_bit_jump_invoke)
+    {
+      op->type = FC_OP_JUMP;
+      /* The destination is resolved by `fc_resolve_jumps'. */
+      op->chain = NULL;
+    }
+    (*program_len)++;
+  }
+} /* }}} void fc_compile_targets */
+
+static int fc_compile_chain (fc_chain_t *chain) /* {{{ */
+{
+  fc_rule_t *rule;
+  fc_match_t *match;
+  fc_target_t *target;
+  fc_op_t *program;
+  size_t program_len;
+
+  /* Count the operations first. */
+  program_len = 1;
+  for (target = chain->targets; target != NULL; target = target->next)
+    program_len++;
+  for (rule = chain->rules; rule != NULL; rule = rule->next)
+  {
+    program_len++;
+    for (match = rule->matches; match != NULL; match = match->next)
+      program_len++;
+    for (target = rule->targets; target != NULL; target = target->next)
+      program_len++;
+  }
+
+  program = (fc_op_t *) calloc (program_len, sizeof (*program));
+  if (program == NULL)
+  {
+    ERROR ("fc_compile_chain: calloc failed.");
+    return (-1);
+  }
+
+  program_len = 0;
+  for (rule = chain->rules; rule != NULL; rule = rule->next)
+  {
+    fc_op_t *rule_op = program + program_len;
+
+    rule_op->type = FC_OP_RULE;
+    rule_op->rule = rule;
+    program_len++;
+
+    for (match = rule->matches; match != NULL; match = match->next)
+    {
+      program[program_len].type = FC_OP_MATCH;
+      program[program_len].match = match;
+      program_len++;
+    }
+
+    fc_compile_targets (program, &program_len, rule->targets);
+    rule_op->next = program_len;
+  }
+
+  program[program_len].type = FC_OP_DEFAULT;
+  program_len++;
+  fc_compile_targets (program, &program_len, chain->targets);
+
+  free (chain->program);
+  chain->program = program;
+  chain->program_len = program_len;
+
+  return (0);
+} /* }}} int fc_compile_chain */
+
+/* Resolves the destination of all `jump' targets. Chains may be defined after
+ * the chains jumping to them, so this is repeated whenever a chain is added.
+ * Jumps to chains that don't exist are left unresolved and are handled by
+ * the `jump' target itself, which reports the error. */
+static void fc_resolve_jumps (void) /* {{{ */
+{
+  fc_chain_t *chain;
+
+  for (chain = chain_list_head; chain != NULL; chain = chain->next)
+  {
+    size_t i;
+
+    for (i = 0; i < chain->program_len; i++)
+    {
+      fc_op_t *op = chain->program + i;
+
+      if ((op->type != FC_OP_JUMP) || (op->chain != NULL))
+        continue;
+
+      op->chain = fc_chain_get_by_name ((char *) op->target->user_data);
+    }
+  }
+} /* }}} void fc_resolve_jumps */
+
 /*
  * Configuration.
  *
@@ -367,6 +526,7 @@ static int fc_config_add_rule (fc_chain_t *chain, /* {{{ */
   }
   memset (rule, 0, sizeof (*rule));
   rule->next = NULL;
+  pthread_mutex_init (&rule->stats_lock, /* attr = */ NULL);
 
   if (ci->values_num == 1)
   {
@@ -479,6 +639,9 @@ static int fc_config_add_chain (const oconfig_item_t *ci) /* {{{ */
       break;
   } /* for (ci->children) */
 
+  if (status == 0)
+    status = fc_compile_chain (chain);
+
   if (status != 0)
   {
     fc_free_chains (chain);
@@ -500,6 +663,8 @@ static int fc_config_add_chain (const oconfig_item_t *ci) /* {{{ */
     chain_list_head = chain;
   }
 
+  fc_resolve_jumps ();
+
   return (0);
 } /* }}} int fc_config_add_chain */
 
@@ -858,11 +1023,66 @@ fc_chain_t *fc_chain_get_by_name (const char *chain_name) /* {{{ */
   return (NULL);
 } /* }}} int fc_chain_get_by_name */
 
+/* Executes `ops_num' target operations. Returns FC_TARGET_STOP or
+ * FC_TARGET_RETURN if one of the targets signaled that condition,
+ * FC_TARGET_CONTINUE otherwise. */
+static int fc_process_targets (const data_set_t *ds, /* {{{ */
+    value_list_t *vl, const fc_chain_t *chain,
+    const fc_op_t *ops, size_t ops_num)
+{
+  size_t i;
+  int status;
+
+  for (i = 0; i < ops_num; i++)
+  {
+    const fc_op_t *op = ops + i;
+    fc_target_t *target = op->target;
+
+    if ((op->type == FC_OP_JUMP) && (op->chain != NULL))
+    {
+      /* Same as `fc_bit_jump_invoke', without looking up the chain. */
+      status = fc_process_chain (ds, vl, op->chain);
+      if ((status >= 0) && (status != FC_TARGET_STOP))
+        status = FC_TARGET_CONTINUE;
+    }
+    else
+    {
+      /* FIXME: Pass the meta-data to match targets here (when implemented). */
+      status = (*target->proc.invoke) (ds, vl, /* meta = */ NULL,
+          &target->user_data);
+    }
+
+    if (status < 0)
+    {
+      WARNING ("fc_process_chain (%s): Target `%s' failed.",
+          chain->name, target->name);
+    }
+    else if (status == FC_TARGET_CONTINUE)
+      continue;
+    else if ((status == FC_TARGET_STOP)
+        || (status == FC_TARGET_RETURN))
+    {
+      DEBUG ("fc_process_chain (%s): Target `%s' signaled "
+          "the %s condition.",
+          chain->name, target->name,
+          (status == FC_TARGET_STOP) ? "stop" : "return");
+      return (status);
+    }
+    else
+    {
+      WARNING ("fc_process_chain (%s): Unknown return value "
+          "from target `%s': %i",
+          chain->name, target->name, status);
+    }
+  }
+
+  return (FC_TARGET_CONTINUE);
+} /* }}} int fc_process_targets */
+
 int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
     fc_chain_t *chain)
 {
-  fc_rule_t *rule;
-  fc_target_t *target;
+  size_t pc;
   int status;
 
   if (chain == NULL)
@@ -870,10 +1090,14 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
 
   DEBUG ("fc_process_chain (chain = %s);", chain->name);
 
-  status = FC_TARGET_CONTINUE;
-  for (rule = chain->rules; rule != NULL; rule = rule->next)
+  pc = 0;
+  while ((pc < chain->program_len)
+      && (chain->program[pc].type == FC_OP_RULE))
   {
-    fc_match_t *match;
+    const fc_op_t *rule_op = chain->program + pc;
+    fc_rule_t *rule = rule_op->rule;
+    cdtime_t start = 0;
+    _Bool matches = 1;
 
     if (rule->name[0] != 0)
     {
@@ -881,25 +1105,46 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
           chain->name, rule->name);
     }
 
-    /* N. B.: rule->matches may be NULL. */
-    for (match = rule->matches; match != NULL; match = match->next)
+    if (fc_record_statistics)
+      start = cdtime ();
+
+    /* N. B.: The rule may not have any matches. */
+    for (pc++; chain->program[pc].type == FC_OP_MATCH; pc++)
     {
+      fc_match_t *match = chain->program[pc].match;
+
       /* FIXME: Pass the meta-data to match targets here (when implemented). */
       status = (*match->proc.match) (ds, vl, /* meta = */ NULL,
           &match->user_data);
       if (status < 0)
       {
         WARNING ("fc_process_chain (%s): A match failed.", chain->name);
+        matches = 0;
         break;
       }
       else if (status != FC_MATCH_MATCHES)
+      {
+        matches = 0;
         break;
+      }
+    }
+
+    if (fc_record_statistics)
+    {
+      cdtime_t duration = cdtime () - start;
+
+      pthread_mutex_lock (&rule->stats_lock);
+      if (matches)
+        rule->stats_matched++;
+      else
+        rule->stats_not_matched++;
+      rule->stats_time += duration;
+      pthread_mutex_unlock (&rule->stats_lock);
     }
 
-    /* for-loop has been aborted: Either error or no match. */
-    if (match != NULL)
+    if (!matches)
     {
-      status = FC_TARGET_CONTINUE;
+      pc = rule_op->next;
       continue;
     }
 
@@ -909,102 +1154,29 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl, /* {{{ */
           chain->name, rule->name);
     }
 
-    for (target = rule->targets; target != NULL; target = target->next)
-    {
-      /* If we get here, all matches have matched the value. Execute the
-       * target. */
-      /* FIXME: Pass the meta-data to match targets here (when implemented). */
-      status = (*target->proc.invoke) (ds, vl, /* meta = */ NULL,
-          &target->user_data);
-      if (status < 0)
-      {
-        WARNING ("fc_process_chain (%s): A target failed.", chain->name);
-        continue;
-      }
-      else if (status == FC_TARGET_CONTINUE)
-        continue;
-      else if (status == FC_TARGET_STOP)
-        break;
-      else if (status == FC_TARGET_RETURN)
-        break;
-      else
-      {
-        WARNING ("fc_process_chain (%s): Unknown return value "
-            "from target `%s': %i",
-            chain->name, target->name, status);
-      }
-    }
-
-    if ((status == FC_TARGET_STOP)
-        || (status == FC_TARGET_RETURN))
-    {
-      if (rule->name[0] != 0)
-      {
-        DEBUG ("fc_process_chain (%s): Rule `%s' signaled "
-            "the %s condition.",
-            chain->name, rule->name,
-            (status == FC_TARGET_STOP) ? "stop" : "return");
-      }
-      break;
-    }
-    else
-    {
-      status = FC_TARGET_CONTINUE;
-    }
-  } /* for (rule) */
+    /* If we get here, all matches have matched the value. Execute the
+     * targets. */
+    status = fc_process_targets (ds, vl, chain,
+        chain->program + pc, rule_op->next - pc);
+    if (status == FC_TARGET_STOP)
+      return (FC_TARGET_STOP);
+    else if (status == FC_TARGET_RETURN)
+      return (FC_TARGET_CONTINUE);
 
-  if (status == FC_TARGET_STOP)
-    return (FC_TARGET_STOP);
-  else if (status == FC_TARGET_RETURN)
-    return (FC_TARGET_CONTINUE);
+    pc = rule_op->next;
+  } /* while (FC_OP_RULE) */
 
-  /* for-loop has been aborted: A target returned `FC_TARGET_STOP' */
-  if (rule != NULL)
-    return (FC_TARGET_CONTINUE);
+  assert ((pc < chain->program_len)
+      && (chain->program[pc].type == FC_OP_DEFAULT));
+  pc++;
 
   DEBUG ("fc_process_chain (%s): Executing the default targets.",
       chain->name);
 
-  status = FC_TARGET_CONTINUE;
-  for (target = chain->targets; target != NULL; target = target->next)
-  {
-    /* If we get here, all matches have matched the value. Execute the
-     * target. */
-    /* FIXME: Pass the meta-data to match targets here (when implemented). */
-    status = (*target->proc.invoke) (ds, vl, /* meta = */ NULL,
-        &target->user_data);
-    if (status < 0)
-    {
-      WARNING ("fc_process_chain (%s): The default target failed.",
-          chain->name);
-    }
-    else if (status == FC_TARGET_CONTINUE)
-      continue;
-    else if (status == FC_TARGET_STOP)
-      break;
-    else if (status == FC_TARGET_RETURN)
-      break;
-    else
-    {
-      WARNING ("fc_process_chain (%s): Unknown return value "
-          "from target `%s': %i",
-          chain->name, target->name, status);
-    }
-  }
-
-  if ((status == FC_TARGET_STOP)
-      || (status == FC_TARGET_RETURN))
-  {
-    assert (target != NULL);
-    DEBUG ("fc_process_chain (%s): Default target `%s' signaled "
-        "the %s condition.",
-        chain->name, target->name,
-        (status == FC_TARGET_STOP) ? "stop" : "return");
-    if (status == FC_TARGET_STOP)
-      return (FC_TARGET_STOP);
-    else
-      return (FC_TARGET_CONTINUE);
-  }
+  status = fc_process_targets (ds, vl, chain,
+      chain->program + pc, chain->program_len - pc);
+  if (status == FC_TARGET_STOP)
+    return (FC_TARGET_STOP);
 
   DEBUG ("fc_process_chain (%s): Signaling `continue' at end of chain.",
       chain->name);
@@ -1021,6 +1193,76 @@ int fc_default_action (const data_set_t *ds, value_list_t *vl) /* {{{ */
         /* meta = */ NULL, /* user_data = */ NULL));
 } /* }}} int fc_default_action */
 
+void fc_set_record_statistics (_Bool enable) /* {{{ */
+{
+  fc_record_statistics = enable;
+} /* }}} void fc_set_record_statistics */
+
+/* Dispatches the number of values each rule did and did not match and the
+ * time spent evaluating its matches. */
+int fc_dispatch_statistics (void) /* {{{ */
+{
+  value_list_t vl = VALUE_LIST_INIT;
+  value_t values[1];
+  fc_chain_t *chain;
+
+  if (!fc_record_statistics)
+    return (0);
+
+  vl.values = values;
+  vl.values_len = 1;
+  sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+  sstrncpy (vl.plugin, "collectd", sizeof (vl.plugin));
+
+  for (chain = chain_list_head; chain != NULL; chain = chain->next)
+  {
+    fc_rule_t *rule;
+    size_t rule_index = 0;
+
+    ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+        "filter_chain-%s", chain->name);
+
+    for (rule = chain->rules; rule != NULL; rule = rule->next)
+    {
+      char rule_name[DATA_MAX_NAME_LEN];
+      derive_t copy_matched;
+      derive_t copy_not_matched;
+      cdtime_t copy_time;
+
+      rule_index++;
+      if (rule->name[0] != 0)
+        sstrncpy (rule_name, rule->name, sizeof (rule_name));
+      else
+        ssnprintf (rule_name, sizeof (rule_name), "rule%zu", rule_index);
+
+      pthread_mutex_lock (&rule->stats_lock);
+      copy_matched = rule->stats_matched;
+      copy_not_matched = rule->stats_not_matched;
+      copy_time = rule->stats_time;
+      pthread_mutex_unlock (&rule->stats_lock);
+
+      sstrncpy (vl.type, "derive", sizeof (vl.type));
+
+      values[0].derive = copy_matched;
+      ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+          "%s-matched", rule_name);
+      plugin_dispatch_values (&vl);
+
+      values[0].derive = copy_not_matched;
+      ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+          "%s-not_matched", rule_name);
+      plugin_dispatch_values (&vl);
+
+      values[0].derive = (derive_t) CDTIME_T_TO_MS (copy_time);
+      sstrncpy (vl.type, "total_time_in_ms", sizeof (vl.type));
+      sstrncpy (vl.type_instance, rule_name, sizeof (vl.type_instance));
+      plugin_dispatch_values (&vl);
+    } /* for (rule) */
+  } /* for (chain) */
+
+  return (0);
+} /* }}} int fc_dispatch_statistics */
+
 int fc_configure (const oconfig_item_t *ci) /* {{{ */
 {
   fc_init_once ();
@@ -92,6 +92,12 @@ int fc_process_chain (const data_set_t *ds, value_list_t *vl,
 
 int fc_default_action (const data_set_t *ds, value_list_t *vl);
 
+/*
+ * Statistics
+ */
+void fc_set_record_statistics (_Bool enable);
+int fc_dispatch_statistics (void);
+
 /* 
  * Shortcut for global configuration
  */
@@ -27,14 +27,20 @@
  */
 
 #include "collectd.h"
+#include "common.h"
 #include "filter_chain.h"
 
 #include <sys/types.h>
 #include <regex.h>
+#include <pthread.h>
 
 #define log_err(...) ERROR ("`regex' match: " __VA_ARGS__)
 #define log_warn(...) WARNING ("`regex' match: " __VA_ARGS__)
 
+/* Number of match decisions remembered by each match. */
+#define MR_MEMO_SIZE 1024
+#define MR_MEMO_BUCKETS (2 * MR_MEMO_SIZE)
+
 /*
  * private data types
  */
@@ -46,9 +52,31 @@ struct mr_regex_s
 	regex_t re;
 	char *re_str;
 
+	/* Literal strings every matching string starts with or contains. Strings
+	 * lacking them are rejected without calling regexec(3). */
+	char *prefix;
+	size_t prefix_len;
+	char *substring;
+
 	mr_regex_t *next;
 };
 
+/* The key of a memo entry consists of the fields the match has regular
+ * expressions for, separated by null bytes. */
+struct mr_memo_entry_s;
+typedef struct mr_memo_entry_s mr_memo_entry_t;
+struct mr_memo_entry_s
+{
+	uint32_t hash;
+	size_t key_len;
+	char *key;
+	_Bool matches;
+
+	mr_memo_entry_t *next;     /* hash bucket */
+	mr_memo_entry_t *lru_prev; /* more recently used */
+	mr_memo_entry_t *lru_next; /* less recently used */
+};
+
 struct mr_match_s;
 typedef struct mr_match_s mr_match_t;
 struct mr_match_s
@@ -59,6 +87,12 @@ struct mr_match_s
 	mr_regex_t *type;
 	mr_regex_t *type_instance;
 	_Bool invert;
+
+	mr_memo_entry_t *memo[MR_MEMO_BUCKETS];
+	mr_memo_entry_t *memo_head;
+	mr_memo_entry_t *memo_tail;
+	size_t memo_size;
+	pthread_mutex_t memo_lock;
 };
 
 /*
@@ -72,9 +106,13 @@ static void mr_free_regex (mr_regex_t *r) /* {{{ */
 	regfree (&r->re);
 	memset (&r->re, 0, sizeof (r->re));
 	free (r->re_str);
+	free (r->prefix);
+	free (r->substring);
 
 	if (r->next != NULL)
 		mr_free_regex (r->next);
+
+	free (r);
 } /* }}} void mr_free_regex */
 
 static void mr_free_match (mr_match_t *m) /* {{{ */
@@ -88,9 +126,293 @@ static void mr_free_match (mr_match_t *m) /* {{{ */
 	mr_free_regex (m->type);
 	mr_free_regex (m->type_instance);
 
+	while (m->memo_head != NULL)
+	{
+		mr_memo_entry_t *next = m->memo_head->lru_next;
+		free (m->memo_head);
+		m->memo_head = next;
+	}
+	pthread_mutex_destroy (&m->memo_lock);
+
 	free (m);
 } /* }}} void mr_free_match */
 
+/*
+ * Literal prefilter
+ *
+ * Scans a regular expression for a run of literal characters every matching
+ * string must contain. Only runs outside of groups are considered, and
+ * expressions using alternation are skipped entirely, because in both cases
+ * a literal may be optional. If the expression is anchored and starts with a
+ * literal, that literal is used as a required prefix.
+ */
+static const char *mr_skip_bracket (const char *ptr) /* {{{ */
+{
+	/* `ptr' points to the opening bracket. */
+	ptr++;
+	if (*ptr == '^')
+		ptr++;
+	if (*ptr == ']')
+		ptr++;
+
+	while ((*ptr != 0) && (*ptr != ']'))
+	{
+		/* Character classes, equivalence classes and collating symbols, e.g.
+		 * "[:digit:]", may contain a closing bracket themselves. */
+		if ((ptr[0] == '[')
+				&& ((ptr[1] == ':') || (ptr[1] == '.') || (ptr[1] == '=')))
+		{
+			char delim = ptr[1];
+
+			ptr += 2;
+			while ((*ptr != 0) && !((ptr[0] == delim) && (ptr[1] == ']')))
+				ptr++;
+			if (*ptr == 0)
+				break;
+			ptr += 2;
+			continue;
+		}
+		ptr++;
+	}
+
+	return (ptr);
+} /* }}} const char *mr_skip_bracket */
+
+static int mr_extract_literals (mr_regex_t *re) /* {{{ */
+{
+	const char *ptr = re->re_str;
+	size_t buffer_size = strlen (re->re_str) + 1;
+	char run[buffer_size];
+	char best[buffer_size];
+	size_t run_len = 0;
+	size_t best_len = 0;
+	_Bool run_is_prefix = 0;
+	int depth = 0;
+
+	if (strchr (re->re_str, '|') != NULL)
+		return (0);
+
+	if (*ptr == '^')
+	{
+		run_is_prefix = 1;
+		ptr++;
+	}
+
+	while (42)
+	{
+		char c = *ptr;
+
+		if ((c == '\\') && (ptr[1] != 0)
+				&& (strchr (".[]()*+?{}|^$\\", ptr[1]) != NULL))
+		{
+			/* An escaped special character is a literal. Other escapes, such
+			 * as the word boundaries "\<" and "\>", are not. */
+			if (depth == 0)
+				run[run_len++] = ptr[1];
+			ptr += 2;
+			continue;
+		}
+		else if ((c != 0) && (strchr ("\\.[](){}*+?^$", c) == NULL))
+		{
+			if (depth == 0)
+				run[run_len++] = c;
+			ptr++;
+			continue;
+		}
+
+		/* A special character (or the end of the expression) ends the current
+		 * run. If it is a quantifier allowing zero repetitions, the preceding
+		 * character is optional and not part of the run. */
+		if (((c == '*') || (c == '?') || (c == '{')) && (run_len > 0))
+			run_len--;
+
+		if (run_len > 0)
+		{
+			if (run_is_prefix)
+			{
+				re->prefix = malloc (run_len + 1);
+				if (re->prefix == NULL)
+					return (-1);
+				memcpy (re->prefix, run, run_len);
+				re->prefix[run_len] = 0;
+				re->prefix_len = run_len;
+			}
+			else if (run_len > best_len)
+			{
+				memcpy (best, run, run_len);
+				best_len = run_len;
+			}
+		}
+		run_len = 0;
+		run_is_prefix = 0;
+
+		if (c == 0)
+			break;
+		else if (c == '[')
+			ptr = mr_skip_bracket (ptr);
+		else if (c == '{')
+		{
+			while ((*ptr != 0) && (*ptr != '}'))
+				ptr++;
+		}
+		else if (c == '(')
+			depth++;
+		else if ((c == ')') && (depth > 0))
+			depth--;
+		else if ((c == '\\') && (ptr[1] != 0))
+			ptr++; /* skip the escaped character */
+
+		if (*ptr != 0)
+			ptr++;
+	} /* while (42) */
+
+	if (best_len > 0)
+	{
+		re->substring = malloc (best_len + 1);
+		if (re->substring == NULL)
+			return (-1);
+		memcpy (re->substring, best, best_len);
+		re->substring[best_len] = 0;
+	}
+
+	return (0);
+} /* }}} int mr_extract_literals */
+
+/*
+ * Memoization
+ *
+ * Each match remembers its decision for the last MR_MEMO_SIZE keys in a hash
+ * table with a least recently used list. All functions expect `memo_lock' to
+ * be held.
+ */
+static size_t mr_memo_key (const mr_match_t *m, /* {{{ */
+		const value_list_t *vl, char *buffer, size_t buffer_size,
+		uint32_t *ret_hash)
+{
+	const mr_regex_t *regexen[] = { m->host, m->plugin, m->plugin_instance,
+		m->type, m->type_instance };
+	const char *fields[] = { vl->host, vl->plugin, vl->plugin_instance,
+		vl->type, vl->type_instance };
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < STATIC_ARRAY_LEN (fields); i++)
+	{
+		size_t field_len;
+
+		if (regexen[i] == NULL)
+			continue;
+
+		field_len = strlen (fields[i]);
+		assert ((len + field_len + 1) <= buffer_size);
+		memcpy (buffer + len, fields[i], field_len + 1);
+		len += field_len + 1;
+	}
+
+	*ret_hash = fnv1a_hash (buffer, len);
+	return (len);
+} /* }}} size_t mr_memo_key */
+
+static void mr_memo_lru_unlink (mr_match_t *m, mr_memo_entry_t *e) /* {{{ */
+{
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		m->memo_head = e->lru_next;
+
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		m->memo_tail = e->lru_prev;
+
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+} /* }}} void mr_memo_lru_unlink */
+
+static void mr_memo_lru_push (mr_match_t *m, mr_memo_entry_t *e) /* {{{ */
+{
+	e->lru_prev = NULL;
+	e->lru_next = m->memo_head;
+	if (m->memo_head != NULL)
+		m->memo_head->lru_prev = e;
+	m->memo_head = e;
+	if (m->memo_tail == NULL)
+		m->memo_tail = e;
+} /* }}} void mr_memo_lru_push */
+
+static mr_memo_entry_t *mr_memo_get (mr_match_t *m, /* {{{ */
+		const char *key, size_t key_len, uint32_t hash)
+{
+	mr_memo_entry_t *e;
+
+	for (e = m->memo[hash % MR_MEMO_BUCKETS]; e != NULL; e = e->next)
+	{
+		if ((e->hash == hash) && (e->key_len == key_len)
+				&& (memcmp (e->key, key, key_len) == 0))
+		{
+			mr_memo_lru_unlink (m, e);
+			mr_memo_lru_push (m, e);
+			return (e);
+		}
+	}
+
+	return (NULL);
+} /* }}} mr_memo_entry_t *mr_memo_get */
+
+static void mr_memo_remove (mr_match_t *m, mr_memo_entry_t *e) /* {{{ */
+{
+	mr_memo_entry_t **e_ptr;
+
+	for (e_ptr = m->memo + (e->hash % MR_MEMO_BUCKETS); *e_ptr != NULL;
+			e_ptr = &(*e_ptr)->next)
+	{
+		if (*e_ptr == e)
+		{
+			*e_ptr = e->next;
+			break;
+		}
+	}
+
+	mr_memo_lru_unlink (m, e);
+	m->memo_size--;
+	free (e);
+} /* }}} void mr_memo_remove */
+
+static void mr_memo_put (mr_match_t *m, /* {{{ */
+		const char *key, size_t key_len, uint32_t hash, _Bool matches)
+{
+	mr_memo_entry_t *e;
+	size_t index;
+
+	/* Another thread may have added the key in the meantime. */
+	e = mr_memo_get (m, key, key_len, hash);
+	if (e != NULL)
+	{
+		e->matches = matches;
+		return;
+	}
+
+	if (m->memo_size >= MR_MEMO_SIZE)
+		mr_memo_remove (m, m->memo_tail);
+
+	/* The entry and the key share one allocation. */
+	e = malloc (sizeof (*e) + key_len);
+	if (e == NULL)
+		return;
+	memset (e, 0, sizeof (*e));
+	e->hash = hash;
+	e->key_len = key_len;
+	e->key = (char *) (e + 1);
+	memcpy (e->key, key, key_len);
+	e->matches = matches;
+
+	index = hash % MR_MEMO_BUCKETS;
+	e->next = m->memo[index];
+	m->memo[index] = e;
+	mr_memo_lru_push (m, e);
+	m->memo_size++;
+} /* }}} void mr_memo_put */
+
 static int mr_match_regexen (mr_regex_t *re_head, /* {{{ */
 		const char *string)
 {
@@ -103,6 +425,16 @@ static int mr_match_regexen (mr_regex_t *re_head, /* {{{ */
 	{
 		int status;
 
+		if (((re->prefix != NULL)
+					&& (strncmp (re->prefix, string, re->prefix_len) != 0))
+				|| ((re->substring != NULL)
+					&& (strstr (string, re->substring) == NULL)))
+		{
+			DEBUG ("regex match: `%s' lacks a literal required by "
+					"regular expression `%s'.", string, re->re_str);
+			return (FC_MATCH_NO_MATCH);
+		}
+
 		status = regexec (&re->re, string,
 				/* nmatch = */ 0, /* pmatch = */ NULL,
 				/* eflags = */ 0);
@@ -165,6 +497,13 @@ static int mr_config_add_regex (mr_regex_t **re_head, /* {{{ */
 		return (-1);
 	}
 
+	if (mr_extract_literals (re) != 0)
+	{
+		log_err ("mr_config_add_regex: malloc failed.");
+		mr_free_regex (re);
+		return (-1);
+	}
+
 	if (*re_head == NULL)
 	{
 		*re_head = re;
@@ -198,6 +537,7 @@ static int mr_create (const oconfig_item_t *ci, void **user_data) /* {{{ */
 	memset (m, 0, sizeof (*m));
 	
 	m->invert = 0;
+	pthread_mutex_init (&m->memo_lock, /* attr = */ NULL);
 
 	status = 0;
 	for (i = 0; i < ci->children_num; i++)
@@ -262,6 +602,25 @@ static int mr_destroy (void **user_data) /* {{{ */
 	return (0);
 } /* }}} int mr_destroy */
 
+static _Bool mr_match_fields (mr_match_t *m, /* {{{ */
+		const value_list_t *vl)
+{
+	if (mr_match_regexen (m->host, vl->host) == FC_MATCH_NO_MATCH)
+		return (0);
+	if (mr_match_regexen (m->plugin, vl->plugin) == FC_MATCH_NO_MATCH)
+		return (0);
+	if (mr_match_regexen (m->plugin_instance,
+				vl->plugin_instance) == FC_MATCH_NO_MATCH)
+		return (0);
+	if (mr_match_regexen (m->type, vl->type) == FC_MATCH_NO_MATCH)
+		return (0);
+	if (mr_match_regexen (m->type_instance,
+				vl->type_instance) == FC_MATCH_NO_MATCH)
+		return (0);
+
+	return (1);
+} /* }}} _Bool mr_match_fields */
+
 static int mr_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
 		const value_list_t *vl,
 		notification_meta_t __attribute__((unused)) **meta,
@@ -270,6 +629,11 @@ static int mr_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
 	mr_match_t *m;
 	int match_value = FC_MATCH_MATCHES;
 	int nomatch_value = FC_MATCH_NO_MATCH;
+	char key[5 * DATA_MAX_NAME_LEN];
+	size_t key_len;
+	uint32_t hash;
+	mr_memo_entry_t *e;
+	_Bool matches;
 
 	if ((user_data == NULL) || (*user_data == NULL))
 		return (-1);
@@ -282,20 +646,26 @@ static int mr_match (const data_set_t __attribute__((unused)) *ds, /* {{{ */
 		nomatch_value = FC_MATCH_MATCHES;
 	}
 
-	if (mr_match_regexen (m->host, vl->host) == FC_MATCH_NO_MATCH)
-		return (nomatch_value);
-	if (mr_match_regexen (m->plugin, vl->plugin) == FC_MATCH_NO_MATCH)
-		return (nomatch_value);
-	if (mr_match_regexen (m->plugin_instance,
-				vl->plugin_instance) == FC_MATCH_NO_MATCH)
-		return (nomatch_value);
-	if (mr_match_regexen (m->type, vl->type) == FC_MATCH_NO_MATCH)
-		return (nomatch_value);
-	if (mr_match_regexen (m->type_instance,
-				vl->type_instance) == FC_MATCH_NO_MATCH)
-		return (nomatch_value);
+	key_len = mr_memo_key (m, vl, key, sizeof (key), &hash);
+
+	pthread_mutex_lock (&m->memo_lock);
+	e = mr_memo_get (m, key, key_len, hash);
+	if (e != NULL)
+	{
+		matches = e->matches;
+		pthread_mutex_unlock (&m->memo_lock);
+		return (matches ? match_value : nomatch_value);
+	}
+	pthread_mutex_unlock (&m->memo_lock);
+
+	/* Don't hold the lock while running the regular expressions. */
+	matches = mr_match_fields (m, vl);
+
+	pthread_mutex_lock (&m->memo_lock);
+	mr_memo_put (m, key, key_len, hash, matches);
+	pthread_mutex_unlock (&m->memo_lock);
 
-	return (match_value);
+	return (matches ? match_value : nomatch_value);
 } /* }}} int mr_match */
 
 void module_register (void)
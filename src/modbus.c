@@ -934,7 +934,7 @@ static int mb_config_add_host (oconfig_item_t *ci) /* {{{ */
 
     CDTIME_T_TO_TIMESPEC (host->interval, &interval);
 
-    plugin_register_complex_read (/* group = */ NULL, name,
+    plugin_register_complex_read (/* group = */ "modbus", name,
         /* callback = */ mb_read,
         /* interval = */ (host->interval > 0) ? &interval : NULL,
         &ud);
@@ -198,7 +198,7 @@ static int mysql_config_database (oconfig_item_t *ci) /* {{{ */
 		else
 			sstrncpy (cb_name, "mysql", sizeof (cb_name));
 
-		plugin_register_complex_read (/* group = */ NULL, cb_name,
+		plugin_register_complex_read (/* group = */ "mysql", cb_name,
 					      mysql_read,
 					      /* interval = */ NULL, &ud);
 	}
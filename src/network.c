@@ -23,6 +23,7 @@
  **/
 
 #define _BSD_SOURCE /* For struct ip_mreq */
+#define _GNU_SOURCE /* For recvmmsg(2) */
 
 #include "collectd.h"
 #include "plugin.h"
@@ -80,6 +81,15 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
  */
 #define BUFF_SIG_SIZE 106
 
+/* Number of datagrams read from a socket with one call to recvmmsg(2). */
+#define NETWORK_RECV_BATCH 16
+
+/* Number of packet buffers preallocated for each receive worker. */
+#define NETWORK_RECV_POOL_SIZE 1024
+
+/* Maximum number of packets waiting to be sent to one server. */
+#define NETWORK_SEND_QUEUE_LIMIT 1024
+
 /*
  * Private data types
  */
@@ -88,6 +98,14 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
 # define SECURITY_LEVEL_SIGN    1
 # define SECURITY_LEVEL_ENCRYPT 2
 #endif
+struct send_queue_entry_s
+{
+	char  *data;
+	size_t data_len;
+	struct send_queue_entry_s *next;
+};
+typedef struct send_queue_entry_s send_queue_entry_t;
+
 struct sockent_client
 {
 	int fd;
@@ -100,6 +118,16 @@ struct sockent_client
 	gcry_cipher_hd_t cypher;
 	unsigned char password_hash[32];
 #endif
+
+	/* Packets waiting to be signed or encrypted and sent by this server's
+	 * sender thread. */
+	send_queue_entry_t *queue_head;
+	send_queue_entry_t *queue_tail;
+	size_t              queue_length;
+	pthread_mutex_t     queue_lock;
+	pthread_cond_t      queue_cond;
+	int                 sender_thread_running;
+	pthread_t           sender_thread_id;
 };
 
 struct sockent_server
@@ -111,6 +139,8 @@ struct sockent_server
 	char *auth_file;
 	fbhash_t *userdb;
 	gcry_cipher_hd_t cypher;
+	/* Protects `cypher', which is shared by all receive workers. */
+	pthread_mutex_t cypher_lock;
 #endif
 };
 
@@ -250,11 +280,47 @@ struct receive_list_entry_s
 {
   char *data;
   int  data_len;
-  int  fd;
-  struct receive_list_entry_s *next;
+  sockent_t *se;
 };
 typedef struct receive_list_entry_s receive_list_entry_t;
 
+/* Each receive worker consists of a receive thread, which reads datagrams
+ * from the worker's own sockets, and a dispatch thread, which parses them.
+ * The two exchange packets using a ring of preallocated packet buffers private
+ * to the worker, so workers never contend for a lock and no memory is
+ * allocated per packet. With more than one worker, each unicast `Listen'
+ * address is opened once per worker using SO_REUSEPORT and the kernel
+ * distributes the datagrams among these sockets. */
+struct receive_worker_s
+{
+  struct pollfd *pollfd;
+  sockent_t    **sockent;
+  size_t         sockets_num;
+
+  /* The receive thread fills the buffers following the `ring_filled' buffers
+   * starting at `ring_read'. The dispatch thread parses the filled buffers and
+   * only then releases them by advancing `ring_read'. */
+  receive_list_entry_t *ring;
+  char                 *ring_data;
+  size_t                ring_read;
+  size_t                ring_filled;
+  derive_t              ring_exhausted;
+
+  /* Only updated by the dispatch thread and summed up by
+   * network_stats_read without a lock, like the global counters. */
+  derive_t              values_dispatched;
+  derive_t              values_not_dispatched;
+  pthread_mutex_t       list_lock;
+  pthread_cond_t        list_cond;
+  pthread_cond_t        ring_cond;
+
+  int            receive_thread_running;
+  pthread_t      receive_thread_id;
+  int            dispatch_thread_running;
+  pthread_t      dispatch_thread_id;
+};
+typedef struct receive_worker_s receive_worker_t;
+
 /*
  * Private variables
  */
@@ -263,26 +329,21 @@ static int network_config_ttl = 0;
 static size_t network_config_packet_size = 1452;
 static int network_config_forward = 0;
 static int network_config_stats = 0;
+static int network_config_receive_threads = 1;
 
 static sockent_t *sending_sockets = NULL;
 
-static receive_list_entry_t *receive_list_head = NULL;
-static receive_list_entry_t *receive_list_tail = NULL;
-static pthread_mutex_t       receive_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t        receive_list_cond = PTHREAD_COND_INITIALIZER;
-static uint64_t              receive_list_length = 0;
+static sockent_t *listen_sockets = NULL;
 
-static sockent_t     *listen_sockets = NULL;
-static struct pollfd *listen_sockets_pollfd = NULL;
-static size_t         listen_sockets_num = 0;
+static receive_worker_t *receive_workers = NULL;
+static size_t            receive_workers_num = 0;
 
 /* The receive and dispatch threads will run as long as `listen_loop' is set to
  * zero. */
 static int       listen_loop = 0;
-static int       receive_thread_running = 0;
-static pthread_t receive_thread_id;
-static int       dispatch_thread_running = 0;
-static pthread_t dispatch_thread_id;
+
+/* The sender threads will run as long as `send_loop' is set to zero. */
+static int       send_loop = 0;
 
 /* Buffer in which to-be-sent network packets are constructed. */
 static char            *send_buffer;
@@ -292,19 +353,20 @@ static value_list_t     send_buffer_vl = VALUE_LIST_STATIC;
 static pthread_mutex_t  send_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* XXX: These counters are incremented from one place only. The spot in which
- * the values are incremented is either only reachable by one thread (the
- * dispatch thread, for example) or locked by some lock (send_buffer_lock for
- * example). Only if neither is true, the stats_lock is acquired. The counters
+ * the values are incremented is either only reachable by one thread or locked
+ * by some lock (send_buffer_lock for example). Only if neither is true, the
+ * stats_lock is acquired. Since there may be several receive workers, the
+ * receive counters are protected by stats_lock. The number of dispatched
+ * values is counted per receive worker instead. The counters
  * are always read without holding a lock in the hope that writing 8 bytes to
  * memory is an atomic operation. */
 static derive_t stats_octets_rx  = 0;
 static derive_t stats_octets_tx  = 0;
 static derive_t stats_packets_rx = 0;
 static derive_t stats_packets_tx = 0;
-static derive_t stats_values_dispatched = 0;
-static derive_t stats_values_not_dispatched = 0;
 static derive_t stats_values_sent = 0;
 static derive_t stats_values_not_sent = 0;
+static derive_t stats_packets_send_dropped = 0;
 static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
@@ -389,8 +451,8 @@ static _Bool check_send_notify_okay (const notification_t *n) /* {{{ */
   return (!received);
 } /* }}} _Bool check_send_notify_okay */
 
-static int network_dispatch_values (value_list_t *vl, /* {{{ */
-    const char *username)
+static int network_dispatch_values (receive_worker_t *worker, /* {{{ */
+    value_list_t *vl, const char *username)
 {
   int status;
 
@@ -409,7 +471,7 @@ static int network_dispatch_values (value_list_t *vl, /* {{{ */
     DEBUG ("network plugin: network_dispatch_values: "
 	"NOT dispatching %s.", name);
 #endif
-    stats_values_not_dispatched++;
+    worker->values_not_dispatched++;
     return (0);
   }
 
@@ -444,7 +506,7 @@ static int network_dispatch_values (value_list_t *vl, /* {{{ */
   }
 
   plugin_dispatch_values_secure (vl);
-  stats_values_dispatched++;
+  worker->values_dispatched++;
 
   meta_data_destroy (vl->meta);
   vl->meta = NULL;
@@ -964,7 +1026,7 @@ static int parse_part_string (void **ret_buffer, size_t *ret_buffer_len,
  * parse_packet and vice versa. */
 #define PP_SIGNED    0x01
 #define PP_ENCRYPTED 0x02
-static int parse_packet (sockent_t *se,
+static int parse_packet (receive_worker_t *worker, sockent_t *se,
 		void *buffer, size_t buffer_size, int flags,
 		const char *username);
 
@@ -974,8 +1036,8 @@ static int parse_packet (sockent_t *se,
 } while (0)
 
 #if HAVE_LIBGCRYPT
-static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
-    void **ret_buffer, size_t *ret_buffer_len, int flags)
+static int parse_part_sign_sha256 (receive_worker_t *worker, /* {{{ */
+    sockent_t *se, void **ret_buffer, size_t *ret_buffer_len, int flags)
 {
   static c_complain_t complain_no_users = C_COMPLAIN_INIT_STATIC;
 
@@ -1094,8 +1156,8 @@ static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
   }
   else
   {
-    parse_packet (se, buffer + buffer_offset, buffer_len - buffer_offset,
-        flags | PP_SIGNED, pss.username);
+    parse_packet (worker, se, buffer + buffer_offset,
+        buffer_len - buffer_offset, flags | PP_SIGNED, pss.username);
   }
 
   sfree (secret);
@@ -1109,8 +1171,8 @@ static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
 /* #endif HAVE_LIBGCRYPT */
 
 #else /* if !HAVE_LIBGCRYPT */
-static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
-    void **ret_buffer, size_t *ret_buffer_size, int flags)
+static int parse_part_sign_sha256 (receive_worker_t *worker, /* {{{ */
+    sockent_t *se, void **ret_buffer, size_t *ret_buffer_size, int flags)
 {
   static int warning_has_been_printed = 0;
 
@@ -1144,7 +1206,7 @@ static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
     warning_has_been_printed = 1;
   }
 
-  parse_packet (se, buffer + part_len, buffer_size - part_len, flags,
+  parse_packet (worker, se, buffer + part_len, buffer_size - part_len, flags,
       /* username = */ NULL);
 
   *ret_buffer = buffer + buffer_size;
@@ -1155,8 +1217,8 @@ static int parse_part_sign_sha256 (sockent_t *se, /* {{{ */
 #endif /* !HAVE_LIBGCRYPT */
 
 #if HAVE_LIBGCRYPT
-static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
-		void **ret_buffer, size_t *ret_buffer_len,
+static int parse_part_encr_aes256 (receive_worker_t *worker, /* {{{ */
+		sockent_t *se, void **ret_buffer, size_t *ret_buffer_len,
 		int flags)
 {
   char  *buffer = *ret_buffer;
@@ -1221,10 +1283,13 @@ static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
   assert (buffer_offset == (username_len +
         PART_ENCRYPTION_AES256_SIZE - sizeof (pea.hash)));
 
+  pthread_mutex_lock (&se->data.server.cypher_lock);
+
   cypher = network_get_aes256_cypher (se, pea.iv, sizeof (pea.iv),
       pea.username);
   if (cypher == NULL)
   {
+    pthread_mutex_unlock (&se->data.server.cypher_lock);
     sfree (pea.username);
     return (-1);
   }
@@ -1237,6 +1302,7 @@ static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
       buffer    + buffer_offset,
       part_size - buffer_offset,
       /* in = */ NULL, /* in len = */ 0);
+  pthread_mutex_unlock (&se->data.server.cypher_lock);
   if (err != 0)
   {
     sfree (pea.username);
@@ -1263,7 +1329,7 @@ static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
     return (-1);
   }
 
-  parse_packet (se, buffer + buffer_offset, payload_len,
+  parse_packet (worker, se, buffer + buffer_offset, payload_len,
       flags | PP_ENCRYPTED, pea.username);
 
   /* XXX: Free pea.username?!? */
@@ -1279,8 +1345,8 @@ static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
 /* #endif HAVE_LIBGCRYPT */
 
 #else /* if !HAVE_LIBGCRYPT */
-static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
-    void **ret_buffer, size_t *ret_buffer_size, int flags)
+static int parse_part_encr_aes256 (receive_worker_t *worker, /* {{{ */
+    sockent_t *se, void **ret_buffer, size_t *ret_buffer_size, int flags)
 {
   static int warning_has_been_printed = 0;
 
@@ -1327,8 +1393,8 @@ static int parse_part_encr_aes256 (sockent_t *se, /* {{{ */
 
 #undef BUFFER_READ
 
-static int parse_packet (sockent_t *se, /* {{{ */
-		void *buffer, size_t buffer_size, int flags,
+static int parse_packet (receive_worker_t *worker, /* {{{ */
+		sockent_t *se, void *buffer, size_t buffer_size, int flags,
 		const char *username)
 {
 	int status;
@@ -1371,7 +1437,7 @@ static int parse_packet (sockent_t *se, /* {{{ */
 
 		if (pkg_type == TYPE_ENCR_AES256)
 		{
-			status = parse_part_encr_aes256 (se,
+			status = parse_part_encr_aes256 (worker, se,
 					&buffer, &buffer_size, flags);
 			if (status != 0)
 			{
@@ -1397,7 +1463,7 @@ static int parse_packet (sockent_t *se, /* {{{ */
 #endif /* HAVE_LIBGCRYPT */
 		else if (pkg_type == TYPE_SIGN_SHA256)
 		{
-			status = parse_part_sign_sha256 (se,
+			status = parse_part_sign_sha256 (worker, se,
                                         &buffer, &buffer_size, flags);
 			if (status != 0)
 			{
@@ -1429,7 +1495,7 @@ static int parse_packet (sockent_t *se, /* {{{ */
 			if (status != 0)
 				break;
 
-			network_dispatch_values (&vl, username);
+			network_dispatch_values (worker, &vl, username);
 
 			sfree (vl.values);
 		}
@@ -1572,6 +1638,17 @@ static int parse_packet (sockent_t *se, /* {{{ */
 
 static void free_sockent_client (struct sockent_client *sec) /* {{{ */
 {
+  while (sec->queue_head != NULL)
+  {
+    send_queue_entry_t *next = sec->queue_head->next;
+    sfree (sec->queue_head);
+    sec->queue_head = next;
+  }
+  sec->queue_tail = NULL;
+  sec->queue_length = 0;
+  pthread_mutex_destroy (&sec->queue_lock);
+  pthread_cond_destroy (&sec->queue_cond);
+
   if (sec->fd >= 0)
   {
     close (sec->fd);
@@ -1605,6 +1682,7 @@ static void free_sockent_server (struct sockent_server *ses) /* {{{ */
   fbh_destroy (ses->userdb);
   if (ses->cypher != NULL)
     gcry_cipher_close (ses->cypher);
+  pthread_mutex_destroy (&ses->cypher_lock);
 #endif
 } /* }}} void free_sockent_server */
 
@@ -1800,7 +1878,24 @@ static int network_set_interface (const sockent_t *se, const struct addrinfo *ai
 	return (0);
 } /* }}} network_set_interface */
 
-static int network_bind_socket (int fd, const struct addrinfo *ai, const int interface_idx)
+static _Bool network_addr_is_multicast (const struct addrinfo *ai) /* {{{ */
+{
+	if (ai->ai_family == AF_INET)
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *) ai->ai_addr;
+		return (IN_MULTICAST (ntohl (addr->sin_addr.s_addr)) ? 1 : 0);
+	}
+	else if (ai->ai_family == AF_INET6)
+	{
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) ai->ai_addr;
+		return (IN6_IS_ADDR_MULTICAST (&addr->sin6_addr) ? 1 : 0);
+	}
+
+	return (0);
+} /* }}} _Bool network_addr_is_multicast */
+
+static int network_bind_socket (int fd, const struct addrinfo *ai,
+		const int interface_idx, _Bool reuse_port)
 {
 	int loop = 0;
 	int yes  = 1;
@@ -1814,6 +1909,19 @@ static int network_bind_socket (int fd, const struct addrinfo *ai, const int int
 		return (-1);
 	}
 
+#ifdef SO_REUSEPORT
+	/* let the kernel distribute datagrams among the receive workers */
+	if (reuse_port
+			&& (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT,
+					&yes, sizeof (yes)) == -1))
+	{
+		char errbuf[1024];
+		ERROR ("setsockopt (SO_REUSEPORT): %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+#endif
+
 	DEBUG ("fd = %i; calling `bind'", fd);
 
 	if (bind (fd, ai->ai_addr, ai->ai_addrlen) == -1)
@@ -1948,6 +2056,41 @@ static int network_bind_socket (int fd, const struct addrinfo *ai, const int int
 	return (0);
 } /* int network_bind_socket */
 
+/* Registers a listening socket with a receive worker. */
+static int receive_worker_add_socket (receive_worker_t *worker, /* {{{ */
+		sockent_t *se, int fd)
+{
+	struct pollfd *tmp_pollfd;
+	sockent_t    **tmp_sockent;
+
+	tmp_pollfd = realloc (worker->pollfd,
+			sizeof (*tmp_pollfd) * (worker->sockets_num + 1));
+	if (tmp_pollfd == NULL)
+	{
+		ERROR ("network plugin: realloc failed.");
+		return (-1);
+	}
+	worker->pollfd = tmp_pollfd;
+
+	tmp_sockent = realloc (worker->sockent,
+			sizeof (*tmp_sockent) * (worker->sockets_num + 1));
+	if (tmp_sockent == NULL)
+	{
+		ERROR ("network plugin: realloc failed.");
+		return (-1);
+	}
+	worker->sockent = tmp_sockent;
+
+	memset (worker->pollfd + worker->sockets_num, 0, sizeof (*tmp_pollfd));
+	worker->pollfd[worker->sockets_num].fd = fd;
+	worker->pollfd[worker->sockets_num].events = POLLIN | POLLPRI;
+	worker->pollfd[worker->sockets_num].revents = 0;
+	worker->sockent[worker->sockets_num] = se;
+	worker->sockets_num++;
+
+	return (0);
+} /* }}} int receive_worker_add_socket */
+
 /* Initialize a sockent structure. `type' must be either `SOCKENT_TYPE_CLIENT'
  * or `SOCKENT_TYPE_SERVER' */
 static int sockent_init (sockent_t *se, int type) /* {{{ */
@@ -1972,12 +2115,22 @@ static int sockent_init (sockent_t *se, int type) /* {{{ */
 		se->data.server.auth_file = NULL;
 		se->data.server.userdb = NULL;
 		se->data.server.cypher = NULL;
+		pthread_mutex_init (&se->data.server.cypher_lock,
+				/* attr = */ NULL);
 #endif
 	}
 	else
 	{
 		se->data.client.fd = -1;
 		se->data.client.addr = NULL;
+		se->data.client.queue_head = NULL;
+		se->data.client.queue_tail = NULL;
+		se->data.client.queue_length = 0;
+		pthread_mutex_init (&se->data.client.queue_lock,
+				/* attr = */ NULL);
+		pthread_cond_init (&se->data.client.queue_cond,
+				/* attr = */ NULL);
+		se->data.client.sender_thread_running = 0;
 #if HAVE_LIBGCRYPT
 		se->data.client.security_level = SECURITY_LEVEL_NONE;
 		se->data.client.username = NULL;
@@ -2086,38 +2239,57 @@ static int sockent_open (sockent_t *se) /* {{{ */
 
 		if (se->type == SOCKENT_TYPE_SERVER) /* {{{ */
 		{
-			int *tmp;
+			size_t sockets_num;
+			size_t i;
 
-			tmp = realloc (se->data.server.fd,
-					sizeof (*tmp) * (se->data.server.fd_num + 1));
-			if (tmp == NULL)
-			{
-				ERROR ("network plugin: realloc failed.");
-				continue;
-			}
-			se->data.server.fd = tmp;
-			tmp = se->data.server.fd + se->data.server.fd_num;
+			assert (receive_workers_num > 0);
 
-			*tmp = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
-					ai_ptr->ai_protocol);
-			if (*tmp < 0)
-			{
-				char errbuf[1024];
-				ERROR ("network plugin: socket(2) failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				continue;
-			}
+			/* Multicast datagrams are delivered to every socket
+			 * bound to the group, so open those only once. */
+			sockets_num = receive_workers_num;
+			if (network_addr_is_multicast (ai_ptr))
+				sockets_num = 1;
 
-			status = network_bind_socket (*tmp, ai_ptr, se->interface);
-			if (status != 0)
+			for (i = 0; i < sockets_num; i++)
 			{
-				close (*tmp);
-				*tmp = -1;
-				continue;
+				int *tmp;
+
+				tmp = realloc (se->data.server.fd,
+						sizeof (*tmp) * (se->data.server.fd_num + 1));
+				if (tmp == NULL)
+				{
+					ERROR ("network plugin: realloc failed.");
+					break;
+				}
+				se->data.server.fd = tmp;
+				tmp = se->data.server.fd + se->data.server.fd_num;
+
+				*tmp = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+						ai_ptr->ai_protocol);
+				if (*tmp < 0)
+				{
+					char errbuf[1024];
+					ERROR ("network plugin: socket(2) failed: %s",
+							sstrerror (errno, errbuf,
+								sizeof (errbuf)));
+					break;
+				}
+
+				status = network_bind_socket (*tmp, ai_ptr,
+						se->interface,
+						/* reuse_port = */ (sockets_num > 1));
+				if (status == 0)
+					status = receive_worker_add_socket (
+							receive_workers + i, se, *tmp);
+				if (status != 0)
+				{
+					close (*tmp);
+					*tmp = -1;
+					break;
+				}
+
+				se->data.server.fd_num++;
 			}
-
-			se->data.server.fd_num++;
 			continue;
 		} /* }}} if (se->type == SOCKENT_TYPE_SERVER) */
 		else /* if (se->type == SOCKENT_TYPE_CLIENT) {{{ */
@@ -2184,30 +2356,6 @@ static int sockent_add (sockent_t *se) /* {{{ */
 
 	if (se->type == SOCKENT_TYPE_SERVER)
 	{
-		struct pollfd *tmp;
-		size_t i;
-
-		tmp = realloc (listen_sockets_pollfd,
-				sizeof (*tmp) * (listen_sockets_num
-					+ se->data.server.fd_num));
-		if (tmp == NULL)
-		{
-			ERROR ("network plugin: realloc failed.");
-			return (-1);
-		}
-		listen_sockets_pollfd = tmp;
-		tmp = listen_sockets_pollfd + listen_sockets_num;
-
-		for (i = 0; i < se->data.server.fd_num; i++)
-		{
-			memset (tmp + i, 0, sizeof (*tmp));
-			tmp[i].fd = se->data.server.fd[i];
-			tmp[i].events = POLLIN | POLLPRI;
-			tmp[i].revents = 0;
-		}
-
-		listen_sockets_num += se->data.server.fd_num;
-
 		if (listen_sockets == NULL)
 		{
 			listen_sockets = se;
@@ -2232,87 +2380,122 @@ static int sockent_add (sockent_t *se) /* {{{ */
 	return (0);
 } /* }}} int sockent_add */
 
-static void *dispatch_thread (void __attribute__((unused)) *arg) /* {{{ */
+static void *dispatch_thread (void *arg) /* {{{ */
 {
+  receive_worker_t *worker = arg;
+
   while (42)
   {
-    receive_list_entry_t *ent;
-    sockent_t *se;
+    size_t read;
+    size_t filled;
+    size_t i;
 
     /* Lock and wait for more data to come in */
-    pthread_mutex_lock (&receive_list_lock);
+    pthread_mutex_lock (&worker->list_lock);
     while ((listen_loop == 0)
-        && (receive_list_head == NULL))
-      pthread_cond_wait (&receive_list_cond, &receive_list_lock);
+        && (worker->ring_filled == 0))
+      pthread_cond_wait (&worker->list_cond, &worker->list_lock);
 
-    /* Remove the head entry and unlock */
-    ent = receive_list_head;
-    if (ent != NULL)
-      receive_list_head = ent->next;
-    receive_list_length--;
-    pthread_mutex_unlock (&receive_list_lock);
+    read = worker->ring_read;
+    filled = worker->ring_filled;
+    pthread_mutex_unlock (&worker->list_lock);
 
     /* Check whether we are supposed to exit. We do NOT check `listen_loop'
      * because we dispatch all missing packets before shutting down. */
-    if (ent == NULL)
+    if (filled == 0)
       break;
 
-    /* Look for the correct `sockent_t' */
-    se = listen_sockets;
-    while (se != NULL)
+    for (i = 0; i < filled; i++)
     {
-      size_t i;
-
-      for (i = 0; i < se->data.server.fd_num; i++)
-        if (se->data.server.fd[i] == ent->fd)
-          break;
+      receive_list_entry_t *ent;
 
-      if (i < se->data.server.fd_num)
-        break;
-
-      se = se->next;
+      ent = worker->ring + ((read + i) % NETWORK_RECV_POOL_SIZE);
+      parse_packet (worker, ent->se, ent->data, ent->data_len,
+          /* flags = */ 0, /* username = */ NULL);
     }
 
-    if (se == NULL)
-    {
-      ERROR ("network plugin: Got packet from FD %i, but can't "
-          "find an appropriate socket entry.",
-          ent->fd);
-      sfree (ent->data);
-      sfree (ent);
-      continue;
-    }
-
-    parse_packet (se, ent->data, ent->data_len, /* flags = */ 0,
-	/* username = */ NULL);
-    sfree (ent->data);
-    sfree (ent);
+    /* Hand the buffers back to the receive thread. */
+    pthread_mutex_lock (&worker->list_lock);
+    worker->ring_read = (read + filled) % NETWORK_RECV_POOL_SIZE;
+    worker->ring_filled -= filled;
+    pthread_cond_signal (&worker->ring_cond);
+    pthread_mutex_unlock (&worker->list_lock);
   } /* while (42) */
 
   return (NULL);
 } /* }}} void *dispatch_thread */
 
-static int network_receive (void) /* {{{ */
+/* Reads up to `num' datagrams from `fd' into the ring buffers starting at
+ * index `first'. Returns the number of datagrams read, zero if no data was
+ * available or less than zero on error. */
+static int network_receive_batch (receive_worker_t *worker, int fd, /* {{{ */
+		size_t first, size_t num)
 {
-	char buffer[network_config_packet_size];
-	int  buffer_len;
-
-	int i;
+	receive_list_entry_t *ent;
 	int status;
+#if HAVE_RECVMMSG
+	struct mmsghdr msgs[NETWORK_RECV_BATCH];
+	struct iovec   iovs[NETWORK_RECV_BATCH];
+	int i;
+
+	assert (num <= NETWORK_RECV_BATCH);
+
+	memset (msgs, 0, sizeof (msgs));
+	for (i = 0; i < (int) num; i++)
+	{
+		ent = worker->ring + ((first + i) % NETWORK_RECV_POOL_SIZE);
+		iovs[i].iov_base = ent->data;
+		iovs[i].iov_len = network_config_packet_size;
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	status = recvmmsg (fd, msgs, (unsigned int) num, MSG_DONTWAIT,
+			/* timeout = */ NULL);
+#else
+	ent = worker->ring + first;
+	status = (int) recv (fd, ent->data, network_config_packet_size,
+			MSG_DONTWAIT);
+	if (status >= 0)
+	{
+		ent->data_len = status;
+		status = 1;
+	}
+#endif
+	if (status < 0)
+	{
+		char errbuf[1024];
+
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+				|| (errno == EINTR))
+			return (0);
+
+		ERROR ("network plugin: recv failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+
+#if HAVE_RECVMMSG
+	for (i = 0; i < status; i++)
+	{
+		ent = worker->ring + ((first + i) % NETWORK_RECV_POOL_SIZE);
+		ent->data_len = (int) msgs[i].msg_len;
+	}
+#endif
 
-	receive_list_entry_t *private_list_head;
-	receive_list_entry_t *private_list_tail;
-	uint64_t              private_list_length;
+	return (status);
+} /* }}} int network_receive_batch */
 
-        assert (listen_sockets_num > 0);
+static int network_receive (receive_worker_t *worker) /* {{{ */
+{
+	int i;
+	int status;
 
-	private_list_head = NULL;
-	private_list_tail = NULL;
-	private_list_length = 0;
+	assert (worker->sockets_num > 0);
 
 	while (listen_loop == 0)
 	{
-		status = poll (listen_sockets_pollfd, listen_sockets_num, -1);
+		status = poll (worker->pollfd, worker->sockets_num, -1);
 
 		if (status <= 0)
 		{
@@ -2324,111 +2507,78 @@ static int network_receive (void) /* {{{ */
 			return (-1);
 		}
 
-		for (i = 0; (i < listen_sockets_num) && (status > 0); i++)
+		for (i = 0; (i < worker->sockets_num) && (status > 0); i++)
 		{
-			receive_list_entry_t *ent;
+			derive_t octets_rx = 0;
+			size_t first;
+			size_t num;
+			int received;
+			int j;
 
-			if ((listen_sockets_pollfd[i].revents
+			if ((worker->pollfd[i].revents
 						& (POLLIN | POLLPRI)) == 0)
 				continue;
 			status--;
 
-			buffer_len = recv (listen_sockets_pollfd[i].fd,
-					buffer, sizeof (buffer),
-					0 /* no flags */);
-			if (buffer_len < 0)
-			{
-				char errbuf[1024];
-				ERROR ("recv failed: %s",
-						sstrerror (errno, errbuf,
-							sizeof (errbuf)));
-				return (-1);
-			}
+			/* Reserve free buffers. If the dispatch thread is
+			 * lagging behind, wait for it and leave the datagrams
+			 * in the socket's receive buffer until then. */
+			pthread_mutex_lock (&worker->list_lock);
+			if (worker->ring_filled >= NETWORK_RECV_POOL_SIZE)
+				worker->ring_exhausted++;
+			while ((listen_loop == 0)
+					&& (worker->ring_filled >= NETWORK_RECV_POOL_SIZE))
+				pthread_cond_wait (&worker->ring_cond,
+						&worker->list_lock);
+			first = (worker->ring_read + worker->ring_filled)
+				% NETWORK_RECV_POOL_SIZE;
+			num = NETWORK_RECV_POOL_SIZE - worker->ring_filled;
+			pthread_mutex_unlock (&worker->list_lock);
+
+			if (listen_loop != 0)
+				break;
 
-			stats_octets_rx += ((uint64_t) buffer_len);
-			stats_packets_rx++;
+			if (num > NETWORK_RECV_BATCH)
+				num = NETWORK_RECV_BATCH;
+#if !HAVE_RECVMMSG
+			num = 1;
+#endif
 
-			/* TODO: Possible performance enhancement: Do not free
-			 * these entries in the dispatch thread but put them in
-			 * another list, so we don't have to allocate more and
-			 * more of these structures. */
-			ent = malloc (sizeof (receive_list_entry_t));
-			if (ent == NULL)
-			{
-				ERROR ("network plugin: malloc failed.");
-				return (-1);
-			}
-			memset (ent, 0, sizeof (receive_list_entry_t));
-			ent->data = malloc (network_config_packet_size);
-			if (ent->data == NULL)
-			{
-				sfree (ent);
-				ERROR ("network plugin: malloc failed.");
+			received = network_receive_batch (worker,
+					worker->pollfd[i].fd, first, num);
+			if (received < 0)
 				return (-1);
-			}
-			ent->fd = listen_sockets_pollfd[i].fd;
-			ent->next = NULL;
-
-			memcpy (ent->data, buffer, buffer_len);
-			ent->data_len = buffer_len;
-
-			if (private_list_head == NULL)
-				private_list_head = ent;
-			else
-				private_list_tail->next = ent;
-			private_list_tail = ent;
-			private_list_length++;
+			else if (received == 0)
+				continue;
 
-			/* Do not block here. Blocking here has led to
-			 * insufficient performance in the past. */
-			if (pthread_mutex_trylock (&receive_list_lock) == 0)
+			for (j = 0; j < received; j++)
 			{
-				assert (((receive_list_head == NULL) && (receive_list_length == 0))
-						|| ((receive_list_head != NULL) && (receive_list_length != 0)));
-
-				if (receive_list_head == NULL)
-					receive_list_head = private_list_head;
-				else
-					receive_list_tail->next = private_list_head;
-				receive_list_tail = private_list_tail;
-				receive_list_length += private_list_length;
-
-				pthread_cond_signal (&receive_list_cond);
-				pthread_mutex_unlock (&receive_list_lock);
-
-				private_list_head = NULL;
-				private_list_tail = NULL;
-				private_list_length = 0;
-			}
-		} /* for (listen_sockets_pollfd) */
-	} /* while (listen_loop == 0) */
+				receive_list_entry_t *ent;
 
-	/* Make sure everything is dispatched before exiting. */
-	if (private_list_head != NULL)
-	{
-		pthread_mutex_lock (&receive_list_lock);
-
-		if (receive_list_head == NULL)
-			receive_list_head = private_list_head;
-		else
-			receive_list_tail->next = private_list_head;
-		receive_list_tail = private_list_tail;
-		receive_list_length += private_list_length;
+				ent = worker->ring
+					+ ((first + j) % NETWORK_RECV_POOL_SIZE);
+				ent->se = worker->sockent[i];
+				octets_rx += (derive_t) ent->data_len;
+			}
 
-		private_list_head = NULL;
-		private_list_tail = NULL;
-		private_list_length = 0;
+			pthread_mutex_lock (&stats_lock);
+			stats_octets_rx += octets_rx;
+			stats_packets_rx += (derive_t) received;
+			pthread_mutex_unlock (&stats_lock);
 
-		pthread_cond_signal (&receive_list_cond);
-		pthread_mutex_unlock (&receive_list_lock);
-	}
+			pthread_mutex_lock (&worker->list_lock);
+			worker->ring_filled += (size_t) received;
+			pthread_cond_signal (&worker->list_cond);
+			pthread_mutex_unlock (&worker->list_lock);
+		} /* for (worker->pollfd) */
+	} /* while (listen_loop == 0) */
 
 	return (0);
 } /* }}} int network_receive */
 
-static void *receive_thread (void __attribute__((unused)) *arg)
+static void *receive_thread (void *arg)
 {
-	return (network_receive () ? (void *) 1 : (void *) 0);
+	return (network_receive (arg) ? (void *) 1 : (void *) 0);
 } /* void *receive_thread */
 
 static void network_init_buffer (void)
@@ -2631,6 +2781,59 @@ static void networt_send_buffer_encrypted (sockent_t *se, /* {{{ */
 #undef BUFFER_ADD
 #endif /* HAVE_LIBGCRYPT */
 
+static void network_send_buffer_sockent (sockent_t *se, /* {{{ */
+    const char *buffer, size_t buffer_len)
+{
+#if HAVE_LIBGCRYPT
+  if (se->data.client.security_level == SECURITY_LEVEL_ENCRYPT)
+    networt_send_buffer_encrypted (se, buffer, buffer_len);
+  else if (se->data.client.security_level == SECURITY_LEVEL_SIGN)
+    networt_send_buffer_signed (se, buffer, buffer_len);
+  else /* if (se->data.client.security_level == SECURITY_LEVEL_NONE) */
+#endif /* HAVE_LIBGCRYPT */
+    networt_send_buffer_plain (se, buffer, buffer_len);
+} /* }}} void network_send_buffer_sockent */
+
+static void *sender_thread (void *arg) /* {{{ */
+{
+  sockent_t *se = arg;
+
+  while (42)
+  {
+    send_queue_entry_t *head;
+
+    pthread_mutex_lock (&se->data.client.queue_lock);
+    while ((send_loop == 0)
+        && (se->data.client.queue_head == NULL))
+      pthread_cond_wait (&se->data.client.queue_cond,
+          &se->data.client.queue_lock);
+
+    /* Take all queued packets at once. */
+    head = se->data.client.queue_head;
+    se->data.client.queue_head = NULL;
+    se->data.client.queue_tail = NULL;
+    se->data.client.queue_length = 0;
+    pthread_mutex_unlock (&se->data.client.queue_lock);
+
+    /* Send all queued packets before shutting down. */
+    if (head == NULL)
+      break;
+
+    while (head != NULL)
+    {
+      send_queue_entry_t *next = head->next;
+
+      network_send_buffer_sockent (se, head->data, head->data_len);
+      sfree (head);
+      head = next;
+    }
+  } /* while (42) */
+
+  return (NULL);
+} /* }}} void *sender_thread */
+
+/* Hands a copy of `buffer' to the sender thread of every server. If a sender
+ * thread is not running, the packet is sent right away. */
 static void network_send_buffer (char *buffer, size_t buffer_len) /* {{{ */
 {
   sockent_t *se;
@@ -2639,14 +2842,47 @@ static void network_send_buffer (char *buffer, size_t buffer_len) /* {{{ */
 
   for (se = sending_sockets; se != NULL; se = se->next)
   {
-#if HAVE_LIBGCRYPT
-    if (se->data.client.security_level == SECURITY_LEVEL_ENCRYPT)
-      networt_send_buffer_encrypted (se, buffer, buffer_len);
-    else if (se->data.client.security_level == SECURITY_LEVEL_SIGN)
-      networt_send_buffer_signed (se, buffer, buffer_len);
-    else /* if (se->data.client.security_level == SECURITY_LEVEL_NONE) */
-#endif /* HAVE_LIBGCRYPT */
-      networt_send_buffer_plain (se, buffer, buffer_len);
+    send_queue_entry_t *ent;
+
+    if (!se->data.client.sender_thread_running)
+    {
+      network_send_buffer_sockent (se, buffer, buffer_len);
+      continue;
+    }
+
+    /* The entry and the packet data share one allocation. */
+    ent = malloc (sizeof (*ent) + buffer_len);
+    if (ent == NULL)
+    {
+      ERROR ("network plugin: malloc failed.");
+      continue;
+    }
+    ent->data = (char *) (ent + 1);
+    ent->data_len = buffer_len;
+    ent->next = NULL;
+    memcpy (ent->data, buffer, buffer_len);
+
+    pthread_mutex_lock (&se->data.client.queue_lock);
+    if (se->data.client.queue_length >= NETWORK_SEND_QUEUE_LIMIT)
+    {
+      pthread_mutex_unlock (&se->data.client.queue_lock);
+      sfree (ent);
+
+      pthread_mutex_lock (&stats_lock);
+      stats_packets_send_dropped++;
+      pthread_mutex_unlock (&stats_lock);
+      continue;
+    }
+
+    if (se->data.client.queue_tail == NULL)
+      se->data.client.queue_head = ent;
+    else
+      se->data.client.queue_tail->next = ent;
+    se->data.client.queue_tail = ent;
+    se->data.client.queue_length++;
+
+    pthread_cond_signal (&se->data.client.queue_cond);
+    pthread_mutex_unlock (&se->data.client.queue_lock);
   } /* for (sending_sockets) */
 } /* }}} void network_send_buffer */
 
@@ -2899,6 +3135,39 @@ static int network_config_set_buffer_size (const oconfig_item_t *ci) /* {{{ */
   return (0);
 } /* }}} int network_config_set_buffer_size */
 
+static int network_config_set_receive_threads (const oconfig_item_t *ci) /* {{{ */
+{
+  int tmp;
+  if ((ci->values_num != 1)
+      || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+  {
+    WARNING ("network plugin: The `ReceiveThreads' config option needs "
+        "exactly one numeric argument.");
+    return (-1);
+  }
+
+  tmp = (int) ci->values[0].value.number;
+  if (tmp < 1)
+  {
+    WARNING ("network plugin: The `ReceiveThreads' config option must be "
+        "at least one.");
+    return (-1);
+  }
+#ifndef SO_REUSEPORT
+  if (tmp > 1)
+  {
+    WARNING ("network plugin: This system does not support SO_REUSEPORT. "
+        "Ignoring `ReceiveThreads %i' and using a single receive thread.",
+        tmp);
+    tmp = 1;
+  }
+#endif
+
+  network_config_receive_threads = tmp;
+
+  return (0);
+} /* }}} int network_config_set_receive_threads */
+
 #if HAVE_LIBGCRYPT
 static int network_config_set_string (const oconfig_item_t *ci, /* {{{ */
     char **ret_string)
@@ -3014,14 +3283,8 @@ static int network_config_add_listen (const oconfig_item_t *ci) /* {{{ */
   }
 #endif /* HAVE_LIBGCRYPT */
 
-  status = sockent_open (se);
-  if (status != 0)
-  {
-    ERROR ("network plugin: network_config_add_listen: sockent_open failed.");
-    sockent_destroy (se);
-    return (-1);
-  }
-
+  /* The sockets are opened in `network_init', because the number of receive
+   * workers may not be known yet. */
   status = sockent_add (se);
   if (status != 0)
   {
@@ -3132,6 +3395,8 @@ static int network_config (oconfig_item_t *ci) /* {{{ */
       network_config_set_ttl (child);
     else if (strcasecmp ("MaxPacketSize", child->key) == 0)
       network_config_set_buffer_size (child);
+    else if (strcasecmp ("ReceiveThreads", child->key) == 0)
+      network_config_set_receive_threads (child);
     else if (strcasecmp ("Forward", child->key) == 0)
       network_config_set_boolean (child, &network_config_forward);
     else if (strcasecmp ("ReportStats", child->key) == 0)
@@ -3222,37 +3487,85 @@ static int network_notification (const notification_t *n,
 
 static int network_shutdown (void)
 {
+	sockent_t *se;
+	size_t i;
+
 	listen_loop++;
 
-	/* Kill the listening thread */
-	if (receive_thread_running != 0)
+	for (i = 0; i < receive_workers_num; i++)
 	{
-		INFO ("network plugin: Stopping receive thread.");
-		pthread_kill (receive_thread_id, SIGTERM);
-		pthread_join (receive_thread_id, NULL /* no return value */);
-		memset (&receive_thread_id, 0, sizeof (receive_thread_id));
-		receive_thread_running = 0;
-	}
+		receive_worker_t *worker = receive_workers + i;
 
-	/* Shutdown the dispatching thread */
-	if (dispatch_thread_running != 0)
-	{
-		INFO ("network plugin: Stopping dispatch thread.");
-		pthread_mutex_lock (&receive_list_lock);
-		pthread_cond_broadcast (&receive_list_cond);
-		pthread_mutex_unlock (&receive_list_lock);
-		pthread_join (dispatch_thread_id, /* ret = */ NULL);
-		dispatch_thread_running = 0;
+		/* Kill the listening thread */
+		if (worker->receive_thread_running != 0)
+		{
+			INFO ("network plugin: Stopping receive thread.");
+			/* The thread may be waiting for free buffers. */
+			pthread_mutex_lock (&worker->list_lock);
+			pthread_cond_broadcast (&worker->ring_cond);
+			pthread_mutex_unlock (&worker->list_lock);
+			pthread_kill (worker->receive_thread_id, SIGTERM);
+			pthread_join (worker->receive_thread_id,
+					NULL /* no return value */);
+			memset (&worker->receive_thread_id, 0,
+					sizeof (worker->receive_thread_id));
+			worker->receive_thread_running = 0;
+		}
+
+		/* Shutdown the dispatching thread */
+		if (worker->dispatch_thread_running != 0)
+		{
+			INFO ("network plugin: Stopping dispatch thread.");
+			pthread_mutex_lock (&worker->list_lock);
+			pthread_cond_broadcast (&worker->list_cond);
+			pthread_mutex_unlock (&worker->list_lock);
+			pthread_join (worker->dispatch_thread_id,
+					/* ret = */ NULL);
+			worker->dispatch_thread_running = 0;
+		}
 	}
 
 	sockent_destroy (listen_sockets);
 
+	for (i = 0; i < receive_workers_num; i++)
+	{
+		receive_worker_t *worker = receive_workers + i;
+
+		sfree (worker->pollfd);
+		sfree (worker->sockent);
+		sfree (worker->ring);
+		sfree (worker->ring_data);
+		pthread_mutex_destroy (&worker->list_lock);
+		pthread_cond_destroy (&worker->list_cond);
+		pthread_cond_destroy (&worker->ring_cond);
+	}
+	sfree (receive_workers);
+	receive_workers_num = 0;
+
+	pthread_mutex_lock (&send_buffer_lock);
 	if (send_buffer_fill > 0)
 		flush_buffer ();
+	pthread_mutex_unlock (&send_buffer_lock);
 
 	sfree (send_buffer);
 
-	/* TODO: Close `sending_sockets' */
+	/* Stop the sender threads after they have sent all queued packets. */
+	send_loop++;
+	for (se = sending_sockets; se != NULL; se = se->next)
+	{
+		if (se->data.client.sender_thread_running == 0)
+			continue;
+
+		pthread_mutex_lock (&se->data.client.queue_lock);
+		pthread_cond_broadcast (&se->data.client.queue_cond);
+		pthread_mutex_unlock (&se->data.client.queue_lock);
+		pthread_join (se->data.client.sender_thread_id,
+				/* ret = */ NULL);
+		se->data.client.sender_thread_running = 0;
+	}
+
+	sockent_destroy (sending_sockets);
+	sending_sockets = NULL;
 
 	plugin_unregister_config ("network");
 	plugin_unregister_init ("network");
@@ -3273,18 +3586,36 @@ static int network_stats_read (void) /* {{{ */
 	derive_t copy_values_sent;
 	derive_t copy_values_not_sent;
 	derive_t copy_receive_list_length;
+	derive_t copy_receive_pool_exhausted;
+	derive_t copy_packets_send_dropped;
+	derive_t copy_send_queue_length;
+	sockent_t *se;
 	value_list_t vl = VALUE_LIST_INIT;
 	value_t values[2];
+	size_t i;
 
 	copy_octets_rx = stats_octets_rx;
 	copy_octets_tx = stats_octets_tx;
 	copy_packets_rx = stats_packets_rx;
 	copy_packets_tx = stats_packets_tx;
-	copy_values_dispatched = stats_values_dispatched;
-	copy_values_not_dispatched = stats_values_not_dispatched;
+	copy_values_dispatched = 0;
+	copy_values_not_dispatched = 0;
 	copy_values_sent = stats_values_sent;
 	copy_values_not_sent = stats_values_not_sent;
-	copy_receive_list_length = receive_list_length;
+	copy_packets_send_dropped = stats_packets_send_dropped;
+	copy_receive_list_length = 0;
+	copy_receive_pool_exhausted = 0;
+	copy_send_queue_length = 0;
+	for (se = sending_sockets; se != NULL; se = se->next)
+		copy_send_queue_length += se->data.client.queue_length;
+	for (i = 0; i < receive_workers_num; i++)
+	{
+		copy_receive_list_length += receive_workers[i].ring_filled;
+		copy_receive_pool_exhausted += receive_workers[i].ring_exhausted;
+		copy_values_dispatched += receive_workers[i].values_dispatched;
+		copy_values_not_dispatched +=
+			receive_workers[i].values_not_dispatched;
+	}
 
 	/* Initialize `vl' */
 	vl.values = values;
@@ -3336,12 +3667,120 @@ static int network_stats_read (void) /* {{{ */
 	vl.type_instance[0] = 0;
 	plugin_dispatch_values_secure (&vl);
 
+	/* Number of times the receive buffers were exhausted */
+	vl.values[0].derive = copy_receive_pool_exhausted;
+	sstrncpy (vl.type, "derive", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "receive-pool-exhausted",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values_secure (&vl);
+
+	/* Packets dropped because a server's send queue was full */
+	vl.values[0].derive = copy_packets_send_dropped;
+	sstrncpy (vl.type_instance, "send-queue-dropped",
+			sizeof (vl.type_instance));
+	plugin_dispatch_values_secure (&vl);
+
+	/* Send queue length */
+	vl.values[0].gauge = (gauge_t) copy_send_queue_length;
+	sstrncpy (vl.type, "queue_length", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "send", sizeof (vl.type_instance));
+	plugin_dispatch_values_secure (&vl);
+
 	return (0);
 } /* }}} int network_stats_read */
 
+static int network_init_receive_workers (void) /* {{{ */
+{
+	sockent_t *se;
+	size_t i;
+
+	receive_workers = calloc ((size_t) network_config_receive_threads,
+			sizeof (*receive_workers));
+	if (receive_workers == NULL)
+	{
+		ERROR ("network plugin: calloc failed.");
+		return (-1);
+	}
+	receive_workers_num = (size_t) network_config_receive_threads;
+
+	for (i = 0; i < receive_workers_num; i++)
+	{
+		receive_worker_t *worker = receive_workers + i;
+
+		size_t j;
+
+		pthread_mutex_init (&worker->list_lock, /* attr = */ NULL);
+		pthread_cond_init (&worker->list_cond, /* attr = */ NULL);
+		pthread_cond_init (&worker->ring_cond, /* attr = */ NULL);
+
+		worker->ring = calloc (NETWORK_RECV_POOL_SIZE,
+				sizeof (*worker->ring));
+		worker->ring_data = malloc (NETWORK_RECV_POOL_SIZE
+				* network_config_packet_size);
+		if ((worker->ring == NULL) || (worker->ring_data == NULL))
+		{
+			ERROR ("network plugin: malloc failed.");
+			return (-1);
+		}
+
+		for (j = 0; j < NETWORK_RECV_POOL_SIZE; j++)
+			worker->ring[j].data = worker->ring_data
+				+ (j * network_config_packet_size);
+	}
+
+	for (se = listen_sockets; se != NULL; se = se->next)
+	{
+		if (sockent_open (se) != 0)
+			ERROR ("network plugin: Opening the listening socket "
+					"for \"%s\" failed.",
+					(se->node == NULL) ? "(null)" : se->node);
+	}
+
+	for (i = 0; i < receive_workers_num; i++)
+	{
+		receive_worker_t *worker = receive_workers + i;
+		int status;
+
+		/* No unicast socket was opened for this worker. */
+		if (worker->sockets_num == 0)
+			continue;
+
+		status = pthread_create (&worker->dispatch_thread_id,
+				NULL /* no attributes */,
+				dispatch_thread,
+				worker);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network: pthread_create failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			continue;
+		}
+		worker->dispatch_thread_running = 1;
+
+		status = pthread_create (&worker->receive_thread_id,
+				NULL /* no attributes */,
+				receive_thread,
+				worker);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("network: pthread_create failed: %s",
+					sstrerror (errno, errbuf,
+						sizeof (errbuf)));
+			continue;
+		}
+		worker->receive_thread_running = 1;
+	}
+
+	return (0);
+} /* }}} int network_init_receive_workers */
+
 static int network_init (void)
 {
 	static _Bool have_init = 0;
+	sockent_t *se;
 
 	/* Check if we were already initialized. If so, just return - there's
 	 * nothing more to do (for now, that is). */
@@ -3369,60 +3808,36 @@ static int network_init (void)
 	network_init_buffer ();
 
 	/* setup socket(s) and so on */
-	if (sending_sockets != NULL)
-	{
-		plugin_register_write ("network", network_write,
-				/* user_data = */ NULL);
-		plugin_register_notification ("network", network_notification,
-				/* user_data = */ NULL);
-	}
-
-	/* If no threads need to be started, return here. */
-	if ((listen_sockets_num == 0)
-			|| ((dispatch_thread_running != 0)
-				&& (receive_thread_running != 0)))
-		return (0);
-
-	if (dispatch_thread_running == 0)
+	for (se = sending_sockets; se != NULL; se = se->next)
 	{
 		int status;
-		status = pthread_create (&dispatch_thread_id,
+
+		status = pthread_create (&se->data.client.sender_thread_id,
 				NULL /* no attributes */,
-				dispatch_thread,
-				NULL /* no argument */);
+				sender_thread,
+				se);
 		if (status != 0)
 		{
 			char errbuf[1024];
 			ERROR ("network: pthread_create failed: %s",
 					sstrerror (errno, errbuf,
 						sizeof (errbuf)));
+			continue;
 		}
-		else
-		{
-			dispatch_thread_running = 1;
-		}
+		se->data.client.sender_thread_running = 1;
 	}
 
-	if (receive_thread_running == 0)
+	if (sending_sockets != NULL)
 	{
-		int status;
-		status = pthread_create (&receive_thread_id,
-				NULL /* no attributes */,
-				receive_thread,
-				NULL /* no argument */);
-		if (status != 0)
-		{
-			char errbuf[1024];
-			ERROR ("network: pthread_create failed: %s",
-					sstrerror (errno, errbuf,
-						sizeof (errbuf)));
-		}
-		else
-		{
-			receive_thread_running = 1;
-		}
+		plugin_register_write ("network", network_write,
+				/* user_data = */ NULL);
+		plugin_register_notification ("network", network_notification,
+				/* user_data = */ NULL);
 	}
 
+	if (listen_sockets != NULL)
+		return (network_init_receive_workers ());
+
 	return (0);
 } /* int network_init */
 
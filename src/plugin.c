@@ -41,10 +41,42 @@
 /*
  * Private structures
  */
+
+/* Upper bounds of the latency histogram buckets, in milliseconds. The last
+ * bucket counts all calls taking longer. */
+static const unsigned int stats_buckets_ms[] = { 1, 10, 100, 1000, 10000 };
+#define STATS_BUCKETS_NUM \
+	((sizeof (stats_buckets_ms) / sizeof (stats_buckets_ms[0])) + 1)
+
+/* Each callback has several sets of counters, each with its own lock. Every
+ * read and write thread uses "its" set, so threads don't contend for the
+ * locks. The sets are added up when dispatching the statistics. */
+#define STATS_SLOTS_NUM 8
+
+struct callback_stats_slot_s
+{
+	pthread_mutex_t lock;
+	derive_t calls;
+	derive_t failures;
+	cdtime_t time_total;
+	cdtime_t time_max; /* reset whenever the statistics are dispatched */
+	derive_t overruns;
+	derive_t buckets[STATS_BUCKETS_NUM];
+};
+typedef struct callback_stats_slot_s callback_stats_slot_t;
+
+struct callback_stats_s
+{
+	callback_stats_slot_t slots[STATS_SLOTS_NUM];
+};
+typedef struct callback_stats_s callback_stats_t;
+
 struct callback_func_s
 {
 	void *cf_callback;
 	user_data_t cf_udata;
+	/* Only allocated if `CollectInternalStats' is enabled. */
+	callback_stats_t *cf_stats;
 };
 typedef struct callback_func_s callback_func_t;
 
@@ -57,6 +89,7 @@ struct read_func_s
 	 * The `rf_super' member MUST be the first one in this structure! */
 #define rf_callback rf_super.cf_callback
 #define rf_udata rf_super.cf_udata
+#define rf_stats rf_super.cf_stats
 	callback_func_t rf_super;
 	char rf_group[DATA_MAX_NAME_LEN];
 	char rf_name[DATA_MAX_NAME_LEN];
@@ -64,9 +97,62 @@ struct read_func_s
 	struct timespec rf_interval;
 	struct timespec rf_effective_interval;
 	struct timespec rf_next_read;
+	/* Used to chain callbacks that are due but have to wait for another
+	 * callback of their group to finish. */
+	struct read_func_s *rf_next_deferred;
+	/* Protected by `read_lock'. */
+	c_complain_t rf_timeout_complaint;
 };
 typedef struct read_func_s read_func_t;
 
+struct read_pool_s;
+typedef struct read_pool_s read_pool_t;
+
+struct read_thread_s
+{
+	read_pool_t *pool;
+	pthread_t thread;
+	size_t index; /* selects the statistics slot */
+
+	/* The callback currently being executed, if any. Protected by
+	 * `read_lock'. */
+	read_func_t *rf;
+	cdtime_t start;
+	_Bool overrun;
+};
+typedef struct read_thread_s read_thread_t;
+
+/* Read callbacks are executed by thread pools. Callbacks of a group that has
+ * been configured with a "ReadGroup" block get a pool of their own, all other
+ * callbacks share the default pool. */
+struct read_pool_s
+{
+	char name[DATA_MAX_NAME_LEN]; /* empty for the default pool */
+	int threads_num_conf;
+	cdtime_t timeout; /* zero means "use ReadTimeout" */
+
+	c_heap_t *heap;
+	pthread_cond_t cond;
+
+	read_thread_t *threads;
+	int threads_num;
+	/* Maximum number of threads one group may occupy at the same time. */
+	int group_threads_max;
+
+	read_func_t *deferred;
+
+	read_pool_t *next;
+};
+
+struct write_queue_s;
+typedef struct write_queue_s write_queue_t;
+struct write_queue_s
+{
+	value_list_t *vl;
+	cdtime_t time;
+	write_queue_t *next;
+};
+
 /*
  * Private variables
  */
@@ -85,13 +171,37 @@ static c_avl_tree_t *data_sets;
 
 static char *plugindir = NULL;
 
-static c_heap_t       *read_heap = NULL;
+static read_pool_t    *read_pool_default = NULL;
+static read_pool_t    *read_pools = NULL;
+static _Bool           read_threads_running = 0;
 static llist_t        *read_list;
 static int             read_loop = 1;
 static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  read_cond = PTHREAD_COND_INITIALIZER;
-static pthread_t      *read_threads = NULL;
-static int             read_threads_num = 0;
+
+static write_queue_t  *write_queue_head;
+static write_queue_t  *write_queue_tail;
+static long            write_queue_length = 0;
+static _Bool           write_loop = 0;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  write_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t      *write_threads = NULL;
+static size_t          write_threads_num = 0;
+
+/* Dropping values is disabled if `write_limit_high' is set to zero. */
+static long            write_limit_high = 0;
+static long            write_limit_low = 0;
+
+/* Value lists that have been waiting for longer than this many of their own
+ * intervals are dropped by the write threads. */
+#define WRITE_QUEUE_MAX_AGE_INTERVALS 10
+
+static derive_t        stats_values_dropped = 0;
+static derive_t        stats_values_dropped_age = 0;
+static _Bool           record_statistics = 0;
+
+/* Index of the statistics slot used by the current thread, plus one. */
+static pthread_key_t   stats_slot_key;
+static pthread_once_t  stats_slot_key_once = PTHREAD_ONCE_INIT;
 
 /*
  * Static functions
@@ -104,6 +214,85 @@ static const char *plugin_get_dir (void)
 		return (plugindir);
 }
 
+static callback_stats_t *callback_stats_create (void) /* {{{ */
+{
+	callback_stats_t *stats;
+	size_t i;
+
+	stats = malloc (sizeof (*stats));
+	if (stats == NULL)
+	{
+		ERROR ("plugin: callback_stats_create: malloc failed.");
+		return (NULL);
+	}
+	memset (stats, 0, sizeof (*stats));
+
+	for (i = 0; i < STATS_SLOTS_NUM; i++)
+		pthread_mutex_init (&stats->slots[i].lock, /* attr = */ NULL);
+
+	return (stats);
+} /* }}} callback_stats_t *callback_stats_create */
+
+static void callback_stats_destroy (callback_stats_t *stats) /* {{{ */
+{
+	size_t i;
+
+	if (stats == NULL)
+		return;
+
+	for (i = 0; i < STATS_SLOTS_NUM; i++)
+		pthread_mutex_destroy (&stats->slots[i].lock);
+	sfree (stats);
+} /* }}} void callback_stats_destroy */
+
+static void stats_slot_key_create (void) /* {{{ */
+{
+	pthread_key_create (&stats_slot_key, /* destructor = */ NULL);
+} /* }}} void stats_slot_key_create */
+
+/* Assigns a statistics slot to the calling thread. */
+static void callback_stats_set_slot (size_t index) /* {{{ */
+{
+	pthread_once (&stats_slot_key_once, stats_slot_key_create);
+	pthread_setspecific (stats_slot_key,
+			(void *) (((index % STATS_SLOTS_NUM) + 1)));
+} /* }}} void callback_stats_set_slot */
+
+static void callback_stats_record (callback_stats_t *stats, /* {{{ */
+		cdtime_t duration, int status, _Bool overrun)
+{
+	callback_stats_slot_t *slot;
+	size_t slot_index = 0;
+	size_t bucket;
+	void *ptr;
+
+	if (stats == NULL)
+		return;
+
+	/* Threads other than the read and write threads share the first slot. */
+	pthread_once (&stats_slot_key_once, stats_slot_key_create);
+	ptr = pthread_getspecific (stats_slot_key);
+	if (ptr != NULL)
+		slot_index = ((size_t) ptr) - 1;
+	slot = stats->slots + slot_index;
+
+	for (bucket = 0; bucket < (STATS_BUCKETS_NUM - 1); bucket++)
+		if (duration < MS_TO_CDTIME_T (stats_buckets_ms[bucket]))
+			break;
+
+	pthread_mutex_lock (&slot->lock);
+	slot->calls++;
+	if (status != 0)
+		slot->failures++;
+	slot->time_total += duration;
+	if (slot->time_max < duration)
+		slot->time_max = duration;
+	if (overrun)
+		slot->overruns++;
+	slot->buckets[bucket]++;
+	pthread_mutex_unlock (&slot->lock);
+} /* }}} void callback_stats_record */
+
 static void destroy_callback (callback_func_t *cf) /* {{{ */
 {
 	if (cf == NULL)
@@ -115,6 +304,7 @@ static void destroy_callback (callback_func_t *cf) /* {{{ */
 		cf->cf_udata.data = NULL;
 		cf->cf_udata.free_func = NULL;
 	}
+	callback_stats_destroy (cf->cf_stats);
 	sfree (cf);
 } /* }}} void destroy_callback */
 
@@ -143,25 +333,207 @@ static void destroy_all_callbacks (llist_t **list) /* {{{ */
 	*list = NULL;
 } /* }}} void destroy_all_callbacks */
 
-static void destroy_read_heap (void) /* {{{ */
+static int plugin_compare_read_func (const void *arg0, const void *arg1)
+{
+	const read_func_t *rf0;
+	const read_func_t *rf1;
+
+	rf0 = arg0;
+	rf1 = arg1;
+
+	if (rf0->rf_next_read.tv_sec < rf1->rf_next_read.tv_sec)
+		return (-1);
+	else if (rf0->rf_next_read.tv_sec > rf1->rf_next_read.tv_sec)
+		return (1);
+	else if (rf0->rf_next_read.tv_nsec < rf1->rf_next_read.tv_nsec)
+		return (-1);
+	else if (rf0->rf_next_read.tv_nsec > rf1->rf_next_read.tv_nsec)
+		return (1);
+	else
+		return (0);
+} /* int plugin_compare_read_func */
+
+static read_pool_t *read_pool_create (const char *name) /* {{{ */
+{
+	read_pool_t *pool;
+
+	pool = malloc (sizeof (*pool));
+	if (pool == NULL)
+	{
+		ERROR ("plugin: read_pool_create: malloc failed.");
+		return (NULL);
+	}
+	memset (pool, 0, sizeof (*pool));
+
+	sstrncpy (pool->name, name, sizeof (pool->name));
+	pool->threads_num_conf = 1;
+
+	pool->heap = c_heap_create (plugin_compare_read_func);
+	if (pool->heap == NULL)
+	{
+		ERROR ("plugin: read_pool_create: c_heap_create failed.");
+		sfree (pool);
+		return (NULL);
+	}
+	pthread_cond_init (&pool->cond, /* attr = */ NULL);
+
+	return (pool);
+} /* }}} read_pool_t *read_pool_create */
+
+static void read_pool_destroy (read_pool_t *pool) /* {{{ */
 {
-	if (read_heap == NULL)
+	if (pool == NULL)
 		return;
 
+	while (pool->deferred != NULL)
+	{
+		read_func_t *rf = pool->deferred;
+
+		pool->deferred = rf->rf_next_deferred;
+		destroy_callback ((callback_func_t *) rf);
+	}
+
 	while (42)
 	{
 		callback_func_t *cf;
 
-		cf = c_heap_get_root (read_heap);
+		cf = c_heap_get_root (pool->heap);
 		if (cf == NULL)
 			break;
 
 		destroy_callback (cf);
 	}
 
-	c_heap_destroy (read_heap);
-	read_heap = NULL;
-} /* }}} void destroy_read_heap */
+	c_heap_destroy (pool->heap);
+	pthread_cond_destroy (&pool->cond);
+	sfree (pool->threads);
+	sfree (pool);
+} /* }}} void read_pool_destroy */
+
+static void destroy_read_pools (void) /* {{{ */
+{
+	while (read_pools != NULL)
+	{
+		read_pool_t *next = read_pools->next;
+
+		read_pool_destroy (read_pools);
+		read_pools = next;
+	}
+
+	read_pool_destroy (read_pool_default);
+	read_pool_default = NULL;
+} /* }}} void destroy_read_pools */
+
+/* Callbacks registered without a group are identified by their name. For
+ * plugins using `plugin_register_read' that's the name of the plugin. */
+static const char *read_func_group (const read_func_t *rf) /* {{{ */
+{
+	if (rf->rf_group[0] != 0)
+		return (rf->rf_group);
+	return (rf->rf_name);
+} /* }}} const char *read_func_group */
+
+/* Returns the pool responsible for `rf'. The caller must hold `read_lock'. */
+static read_pool_t *read_pool_get (const read_func_t *rf) /* {{{ */
+{
+	const char *group = read_func_group (rf);
+	read_pool_t *pool;
+
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		if (strcmp (pool->name, group) == 0)
+			return (pool);
+
+	if (read_pool_default == NULL)
+		read_pool_default = read_pool_create ("");
+
+	return (read_pool_default);
+} /* }}} read_pool_t *read_pool_get */
+
+struct read_func_due_s
+{
+	const char *group;
+	struct timespec now;
+};
+typedef struct read_func_due_s read_func_due_t;
+
+/* Callback for `c_heap_find': Returns non-zero if `ptr' is a callback that
+ * is due and belongs to another group than `user_data->group'. The caller
+ * must hold `read_lock'. */
+static int read_func_due_elsewhere (const void *ptr, /* {{{ */
+		void *user_data)
+{
+	const read_func_t *rf = ptr;
+	const read_func_due_t *due = user_data;
+
+	if (rf->rf_type == RF_REMOVE)
+		return (0);
+	if (strcmp (due->group, read_func_group (rf)) == 0)
+		return (0);
+
+	if (rf->rf_next_read.tv_sec != due->now.tv_sec)
+		return (rf->rf_next_read.tv_sec < due->now.tv_sec);
+	return (rf->rf_next_read.tv_nsec <= due->now.tv_nsec);
+} /* }}} int read_func_due_elsewhere */
+
+/* Returns true if another thread of `pool' may execute a callback of the
+ * group of `rf'. Without this limit, a group with several hanging callbacks
+ * could occupy all threads of the default pool. The limit only applies while
+ * callbacks of other groups are due, so a group may use all threads as long
+ * as nobody else is waiting for one. The caller must hold `read_lock'. */
+static _Bool read_pool_group_may_run (read_pool_t *pool, /* {{{ */
+		const read_func_t *rf)
+{
+	const char *group = read_func_group (rf);
+	read_func_due_t due;
+	read_func_t *other;
+	int busy = 0;
+	int i;
+
+	for (i = 0; i < pool->threads_num; i++)
+	{
+		read_func_t *running = pool->threads[i].rf;
+
+		if ((running != NULL)
+				&& (strcmp (group, read_func_group (running)) == 0))
+			busy++;
+	}
+
+	if (busy < pool->group_threads_max)
+		return (1);
+
+	/* Deferred callbacks are due already. */
+	for (other = pool->deferred; other != NULL;
+			other = other->rf_next_deferred)
+		if (strcmp (group, read_func_group (other)) != 0)
+			return (0);
+
+	due.group = group;
+	CDTIME_T_TO_TIMESPEC (cdtime (), &due.now);
+	return (c_heap_find (pool->heap, read_func_due_elsewhere, &due) == NULL);
+} /* }}} _Bool read_pool_group_may_run */
+
+/* Puts the deferred callbacks of `group' back into the heap. The caller must
+ * hold `read_lock'. */
+static void read_pool_release_deferred (read_pool_t *pool, /* {{{ */
+		const char *group)
+{
+	read_func_t **prev = &pool->deferred;
+
+	while (*prev != NULL)
+	{
+		read_func_t *rf = *prev;
+
+		if ((group != NULL) && (strcmp (group, read_func_group (rf)) != 0))
+		{
+			prev = &rf->rf_next_deferred;
+			continue;
+		}
+
+		*prev = rf->rf_next_deferred;
+		rf->rf_next_deferred = NULL;
+		c_heap_insert (pool->heap, rf);
+	}
+} /* }}} void read_pool_release_deferred */
 
 static int register_callback (llist_t **list, /* {{{ */
 		const char *name, callback_func_t *cf)
@@ -246,6 +618,9 @@ static int create_register_callback (llist_t **list, /* {{{ */
 		cf->cf_udata = *ud;
 	}
 
+	if (record_statistics && (list == &list_write))
+		cf->cf_stats = callback_stats_create ();
+
 	return (register_callback (list, name, cf));
 } /* }}} int create_register_callback */
 
@@ -341,18 +716,26 @@ static _Bool timeout_reached(struct timespec timeout)
 	return (now.tv_sec >= timeout.tv_sec && now.tv_usec >= (timeout.tv_nsec / 1000));
 }
 
-static void *plugin_read_thread (void __attribute__((unused)) *args)
+static void *plugin_read_thread (void *args)
 {
+	read_thread_t *rt = args;
+	read_pool_t *pool = rt->pool;
+
+	callback_stats_set_slot (rt->index);
+
 	while (read_loop != 0)
 	{
 		read_func_t *rf;
+		char group[DATA_MAX_NAME_LEN];
 		cdtime_t now;
+		cdtime_t timeout;
+		_Bool overrun;
 		int status;
 		int rf_type;
 		int rc;
 
 		/* Get the read function that needs to be read next. */
-		rf = c_heap_get_root (read_heap);
+		rf = c_heap_get_root (pool->heap);
 		if (rf == NULL)
 		{
 			struct timespec abstime;
@@ -362,7 +745,7 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 			CDTIME_T_TO_TIMESPEC (now + interval_g, &abstime);
 
 			pthread_mutex_lock (&read_lock);
-			pthread_cond_timedwait (&read_cond, &read_lock,
+			pthread_cond_timedwait (&pool->cond, &read_lock,
 					&abstime);
 			pthread_mutex_unlock (&read_lock);
 			continue;
@@ -391,7 +774,7 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 				&& !timeout_reached(rf->rf_next_read)
 				&& rc == 0)
 		{
-			rc = pthread_cond_timedwait (&read_cond, &read_lock,
+			rc = pthread_cond_timedwait (&pool->cond, &read_lock,
 				&rf->rf_next_read);
 		}
 
@@ -404,7 +787,7 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 		if (read_loop == 0)
 		{
 			/* Insert `rf' again, so it can be free'd correctly */
-			c_heap_insert (read_heap, rf);
+			c_heap_insert (pool->heap, rf);
 			break;
 		}
 
@@ -421,6 +804,25 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 			continue;
 		}
 
+		sstrncpy (group, read_func_group (rf), sizeof (group));
+
+		/* If too many threads are busy with this group already, park
+		 * the callback until one of them is done. */
+		pthread_mutex_lock (&read_lock);
+		if (!read_pool_group_may_run (pool, rf))
+		{
+			DEBUG ("plugin_read_thread: Deferring `%s'.",
+					rf->rf_name);
+			rf->rf_next_deferred = pool->deferred;
+			pool->deferred = rf;
+			pthread_mutex_unlock (&read_lock);
+			continue;
+		}
+		rt->rf = rf;
+		rt->start = cdtime ();
+		rt->overrun = 0;
+		pthread_mutex_unlock (&read_lock);
+
 		DEBUG ("plugin_read_thread: Handling `%s'.", rf->rf_name);
 
 		if (rf_type == RF_SIMPLE)
@@ -440,6 +842,38 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 			status = (*callback) (&rf->rf_udata);
 		}
 
+		/* update the ``next read due'' field */
+		now = cdtime ();
+
+		pthread_mutex_lock (&read_lock);
+		timeout = pool->timeout;
+		overrun = 0;
+		if ((timeout > 0) && ((now - rt->start) > timeout))
+		{
+			overrun = 1;
+			/* Don't complain twice about the same call. */
+			if (!rt->overrun)
+				c_complain (LOG_WARNING, &rf->rf_timeout_complaint,
+						"plugin: The read-function of plugin "
+						"`%s' took %.3f seconds, exceeding "
+						"the read timeout of %.3f seconds.",
+						rf->rf_name,
+						CDTIME_T_TO_DOUBLE (now - rt->start),
+						CDTIME_T_TO_DOUBLE (timeout));
+		}
+		else
+		{
+			c_release (LOG_INFO, &rf->rf_timeout_complaint,
+					"plugin: The read-function of plugin `%s' "
+					"returns within the read timeout again.",
+					rf->rf_name);
+		}
+		callback_stats_record (rf->rf_stats, now - rt->start, status,
+				overrun);
+		rt->rf = NULL;
+		read_pool_release_deferred (pool, group);
+		pthread_mutex_unlock (&read_lock);
+
 		/* If the function signals failure, we will increase the
 		 * intervals in which it will be called. */
 		if (status != 0)
@@ -465,101 +899,497 @@ static void *plugin_read_thread (void __attribute__((unused)) *args)
 			rf->rf_effective_interval = rf->rf_interval;
 		}
 
-		/* update the ``next read due'' field */
-		now = cdtime ();
+		DEBUG ("plugin_read_thread: Effective interval of the "
+				"%s plugin is %i.%09i.",
+				rf->rf_name,
+				(int) rf->rf_effective_interval.tv_sec,
+				(int) rf->rf_effective_interval.tv_nsec);
+
+		/* Calculate the next (absolute) time at which this function
+		 * should be called. */
+		rf->rf_next_read.tv_sec = rf->rf_next_read.tv_sec
+			+ rf->rf_effective_interval.tv_sec;
+		rf->rf_next_read.tv_nsec = rf->rf_next_read.tv_nsec
+			+ rf->rf_effective_interval.tv_nsec;
+		NORMALIZE_TIMESPEC (rf->rf_next_read);
+
+		/* Check, if `rf_next_read' is in the past. */
+		if (TIMESPEC_TO_CDTIME_T (&rf->rf_next_read) < now)
+		{
+			/* `rf_next_read' is in the past. Insert `now'
+			 * so this value doesn't trail off into the
+			 * past too much. */
+			CDTIME_T_TO_TIMESPEC (now, &rf->rf_next_read);
+		}
+
+		DEBUG ("plugin_read_thread: Next read of the %s plugin at %i.%09i.",
+				rf->rf_name,
+				(int) rf->rf_next_read.tv_sec,
+				(int) rf->rf_next_read.tv_nsec);
+
+		/* Re-insert this read function into the heap again. */
+		c_heap_insert (pool->heap, rf);
+	} /* while (read_loop) */
+
+	pthread_exit (NULL);
+	return ((void *) 0);
+} /* void *plugin_read_thread */
+
+static void start_read_pool (read_pool_t *pool, int num, /* {{{ */
+		size_t *thread_index)
+{
+	int i;
+
+	pool->threads = calloc (num, sizeof (*pool->threads));
+	if (pool->threads == NULL)
+	{
+		ERROR ("plugin: start_read_pool: calloc failed.");
+		return;
+	}
+
+	/* The new threads look at `threads_num' while holding `read_lock'. */
+	pthread_mutex_lock (&read_lock);
+
+	/* A group with a pool of its own may use all of its threads. In the
+	 * default pool one group may use at most half of the threads, but at
+	 * least one, while callbacks of other groups are due. */
+	if (pool == read_pool_default)
+		pool->group_threads_max = (num > 1) ? (num / 2) : 1;
+	else
+		pool->group_threads_max = num;
+
+	pool->threads_num = 0;
+	for (i = 0; i < num; i++)
+	{
+		read_thread_t *rt = pool->threads + pool->threads_num;
+
+		rt->pool = pool;
+		rt->index = *thread_index;
+		if (pthread_create (&rt->thread, NULL,
+					plugin_read_thread, rt) == 0)
+		{
+			pool->threads_num++;
+			(*thread_index)++;
+		}
+		else
+		{
+			ERROR ("plugin: start_read_pool: pthread_create failed.");
+			break;
+		}
+	} /* for (i) */
+
+	pthread_mutex_unlock (&read_lock);
+} /* }}} void start_read_pool */
+
+static void start_read_threads (int num)
+{
+	read_pool_t *pool;
+	read_func_t *moved = NULL;
+	cdtime_t timeout;
+	size_t thread_index = 0;
+
+	if (read_threads_running)
+		return;
+
+	timeout = DOUBLE_TO_CDTIME_T (atof (global_option_get ("ReadTimeout")));
+
+	pthread_mutex_lock (&read_lock);
+
+	if (read_pool_default == NULL)
+		read_pool_default = read_pool_create ("");
+	if (read_pool_default == NULL)
+	{
+		pthread_mutex_unlock (&read_lock);
+		return;
+	}
+	read_pool_default->timeout = timeout;
+
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		if (pool->timeout == 0)
+			pool->timeout = timeout;
+
+	/* Callbacks may have been registered before their "ReadGroup" block
+	 * was read. Move them to the pool they belong to. */
+	while (42)
+	{
+		read_func_t *rf = c_heap_get_root (read_pool_default->heap);
+
+		if (rf == NULL)
+			break;
+
+		rf->rf_next_deferred = moved;
+		moved = rf;
+	}
+	while (moved != NULL)
+	{
+		read_func_t *rf = moved;
+
+		moved = rf->rf_next_deferred;
+		rf->rf_next_deferred = NULL;
+		c_heap_insert (read_pool_get (rf)->heap, rf);
+	}
+
+	read_threads_running = 1;
+	pthread_mutex_unlock (&read_lock);
+
+	start_read_pool (read_pool_default, num, &thread_index);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		start_read_pool (pool, pool->threads_num_conf, &thread_index);
+} /* void start_read_threads */
+
+static void stop_read_pool (read_pool_t *pool) /* {{{ */
+{
+	int i;
+
+	for (i = 0; i < pool->threads_num; i++)
+	{
+		if (pthread_join (pool->threads[i].thread, NULL) != 0)
+		{
+			ERROR ("plugin: stop_read_threads: pthread_join failed.");
+		}
+	}
+
+	pthread_mutex_lock (&read_lock);
+	sfree (pool->threads);
+	pool->threads_num = 0;
+
+	/* Put deferred callbacks back, so they are free'd correctly. */
+	read_pool_release_deferred (pool, /* group = */ NULL);
+	pthread_mutex_unlock (&read_lock);
+} /* }}} void stop_read_pool */
+
+static void stop_read_threads (void)
+{
+	read_pool_t *pool;
+	int threads_num;
+
+	if (!read_threads_running)
+		return;
+
+	threads_num = read_pool_default->threads_num;
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		threads_num += pool->threads_num;
+
+	INFO ("collectd: Stopping %i read threads.", threads_num);
+
+	pthread_mutex_lock (&read_lock);
+	read_loop = 0;
+	DEBUG ("plugin: stop_read_threads: Signalling the read threads");
+	pthread_cond_broadcast (&read_pool_default->cond);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		pthread_cond_broadcast (&pool->cond);
+	pthread_mutex_unlock (&read_lock);
+
+	stop_read_pool (read_pool_default);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		stop_read_pool (pool);
+
+	read_threads_running = 0;
+} /* void stop_read_threads */
+
+/* Complains about read callbacks that are running longer than the timeout of
+ * their pool. Since threads can't be cancelled safely, the callback is left
+ * alone; it only uses up a thread of its own pool, though. */
+static void read_pool_check_timeouts (read_pool_t *pool, cdtime_t now) /* {{{ */
+{
+	int i;
+
+	if ((pool == NULL) || (pool->timeout == 0))
+		return;
+
+	for (i = 0; i < pool->threads_num; i++)
+	{
+		read_thread_t *rt = pool->threads + i;
+
+		if ((rt->rf == NULL) || rt->overrun
+				|| ((now - rt->start) <= pool->timeout))
+			continue;
+
+		rt->overrun = 1;
+		c_complain (LOG_WARNING, &rt->rf->rf_timeout_complaint,
+				"plugin: The read-function of plugin `%s' has "
+				"been running for %.3f seconds, exceeding the "
+				"read timeout of %.3f seconds.",
+				rt->rf->rf_name,
+				CDTIME_T_TO_DOUBLE (now - rt->start),
+				CDTIME_T_TO_DOUBLE (pool->timeout));
+	}
+} /* }}} void read_pool_check_timeouts */
+
+static void plugin_check_read_timeouts (void) /* {{{ */
+{
+	read_pool_t *pool;
+	cdtime_t now;
+
+	if (!read_threads_running)
+		return;
+
+	now = cdtime ();
+
+	pthread_mutex_lock (&read_lock);
+	read_pool_check_timeouts (read_pool_default, now);
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		read_pool_check_timeouts (pool, now);
+	pthread_mutex_unlock (&read_lock);
+} /* }}} void plugin_check_read_timeouts */
+
+static void plugin_value_list_free (value_list_t *vl) /* {{{ */
+{
+	if (vl == NULL)
+		return;
+
+	meta_data_destroy (vl->meta);
+	sfree (vl->values);
+	sfree (vl);
+} /* }}} void plugin_value_list_free */
+
+static value_list_t *plugin_value_list_clone (value_list_t const *vl_orig) /* {{{ */
+{
+	value_list_t *vl;
+
+	if (vl_orig == NULL)
+		return (NULL);
+
+	vl = malloc (sizeof (*vl));
+	if (vl == NULL)
+		return (NULL);
+	memcpy (vl, vl_orig, sizeof (*vl));
+
+	vl->values = calloc (vl_orig->values_len, sizeof (*vl->values));
+	if (vl->values == NULL)
+	{
+		sfree (vl);
+		return (NULL);
+	}
+	memcpy (vl->values, vl_orig->values,
+			vl_orig->values_len * sizeof (*vl->values));
+
+	if (vl_orig->meta != NULL)
+	{
+		vl->meta = meta_data_clone (vl_orig->meta);
+		if (vl->meta == NULL)
+		{
+			sfree (vl->values);
+			sfree (vl);
+			return (NULL);
+		}
+	}
+
+	/* Fill in the time here rather than in the write thread, so values
+	 * don't get the time they leave the queue. */
+	if (vl->time == 0)
+		vl->time = cdtime ();
+
+	return (vl);
+} /* }}} value_list_t *plugin_value_list_clone */
+
+static int plugin_dispatch_values_internal (value_list_t *vl);
+
+/* Appends a copy of `vl' to the write queue. Returns ENOTCONN, without
+ * queueing anything, if the write threads are not running (any more), in
+ * which case the caller has to dispatch the value list itself. */
+static int plugin_write_enqueue (value_list_t const *vl) /* {{{ */
+{
+	write_queue_t *q;
+
+	q = malloc (sizeof (*q));
+	if (q == NULL)
+		return (ENOMEM);
+	q->time = cdtime ();
+	q->next = NULL;
+
+	q->vl = plugin_value_list_clone (vl);
+	if (q->vl == NULL)
+	{
+		sfree (q);
+		return (ENOMEM);
+	}
+
+	pthread_mutex_lock (&write_lock);
+
+	if (!write_loop)
+	{
+		pthread_mutex_unlock (&write_lock);
+		plugin_value_list_free (q->vl);
+		sfree (q);
+		return (ENOTCONN);
+	}
+
+	if (write_queue_tail == NULL)
+	{
+		write_queue_head = q;
+		write_queue_tail = q;
+	}
+	else
+	{
+		write_queue_tail->next = q;
+		write_queue_tail = q;
+	}
+	write_queue_length++;
+
+	pthread_cond_signal (&write_cond);
+	pthread_mutex_unlock (&write_lock);
+
+	return (0);
+} /* }}} int plugin_write_enqueue */
+
+/* Returns true if `q' has been waiting in the queue for too long to still be
+ * worth writing. */
+static _Bool write_queue_entry_expired (write_queue_t const *q, /* {{{ */
+		cdtime_t now)
+{
+	cdtime_t interval = q->vl->interval;
+
+	if (interval == 0)
+		interval = interval_g;
 
-		DEBUG ("plugin_read_thread: Effective interval of the "
-				"%s plugin is %i.%09i.",
-				rf->rf_name,
-				(int) rf->rf_effective_interval.tv_sec,
-				(int) rf->rf_effective_interval.tv_nsec);
+	return ((now - q->time) > (WRITE_QUEUE_MAX_AGE_INTERVALS * interval));
+} /* }}} _Bool write_queue_entry_expired */
 
-		/* Calculate the next (absolute) time at which this function
-		 * should be called. */
-		rf->rf_next_read.tv_sec = rf->rf_next_read.tv_sec
-			+ rf->rf_effective_interval.tv_sec;
-		rf->rf_next_read.tv_nsec = rf->rf_next_read.tv_nsec
-			+ rf->rf_effective_interval.tv_nsec;
-		NORMALIZE_TIMESPEC (rf->rf_next_read);
+/* Blocks until a value list is available. Returns NULL once the write threads
+ * have been told to stop *and* the queue has been drained. Value lists that
+ * have been queued for too long are dropped on the way. */
+static value_list_t *plugin_write_dequeue (void) /* {{{ */
+{
+	write_queue_t *q;
+	write_queue_t *expired = NULL;
+	value_list_t *vl = NULL;
+	cdtime_t now;
 
-		/* Check, if `rf_next_read' is in the past. */
-		if (TIMESPEC_TO_CDTIME_T (&rf->rf_next_read) < now)
+	pthread_mutex_lock (&write_lock);
+
+	while (write_loop && (write_queue_head == NULL))
+		pthread_cond_wait (&write_cond, &write_lock);
+
+	now = cdtime ();
+	while (write_queue_head != NULL)
+	{
+		q = write_queue_head;
+		write_queue_head = q->next;
+		if (write_queue_head == NULL)
+			write_queue_tail = NULL;
+		write_queue_length--;
+
+		/* Don't drop anything while draining the queue on shutdown. */
+		if (!write_loop || !write_queue_entry_expired (q, now))
 		{
-			/* `rf_next_read' is in the past. Insert `now'
-			 * so this value doesn't trail off into the
-			 * past too much. */
-			CDTIME_T_TO_TIMESPEC (now, &rf->rf_next_read);
+			vl = q->vl;
+			sfree (q);
+			break;
 		}
 
-		DEBUG ("plugin_read_thread: Next read of the %s plugin at %i.%09i.",
-				rf->rf_name,
-				(int) rf->rf_next_read.tv_sec,
-				(int) rf->rf_next_read.tv_nsec);
+		stats_values_dropped_age++;
+		q->next = expired;
+		expired = q;
+	}
 
-		/* Re-insert this read function into the heap again. */
-		c_heap_insert (read_heap, rf);
-	} /* while (read_loop) */
+	pthread_mutex_unlock (&write_lock);
+
+	while (expired != NULL)
+	{
+		q = expired;
+		expired = q->next;
+		plugin_value_list_free (q->vl);
+		sfree (q);
+	}
+
+	return (vl);
+} /* }}} value_list_t *plugin_write_dequeue */
+
+static void *plugin_write_thread (void *args) /* {{{ */
+{
+	callback_stats_set_slot ((size_t) args);
+
+	while (42)
+	{
+		value_list_t *vl;
+
+		vl = plugin_write_dequeue ();
+		if (vl == NULL)
+			break;
+
+		plugin_dispatch_values_internal (vl);
+
+		plugin_value_list_free (vl);
+	}
 
 	pthread_exit (NULL);
 	return ((void *) 0);
-} /* void *plugin_read_thread */
+} /* }}} void *plugin_write_thread */
 
-static void start_read_threads (int num)
+static void start_write_threads (size_t num) /* {{{ */
 {
-	int i;
+	size_t i;
 
-	if (read_threads != NULL)
+	if (write_threads != NULL)
 		return;
 
-	read_threads = (pthread_t *) calloc (num, sizeof (pthread_t));
-	if (read_threads == NULL)
+	write_threads = (pthread_t *) calloc (num, sizeof (pthread_t));
+	if (write_threads == NULL)
 	{
-		ERROR ("plugin: start_read_threads: calloc failed.");
+		ERROR ("plugin: start_write_threads: calloc failed.");
 		return;
 	}
 
-	read_threads_num = 0;
+	pthread_mutex_lock (&write_lock);
+	write_loop = 1;
+	pthread_mutex_unlock (&write_lock);
+
+	write_threads_num = 0;
 	for (i = 0; i < num; i++)
 	{
-		if (pthread_create (read_threads + read_threads_num, NULL,
-					plugin_read_thread, NULL) == 0)
+		if (pthread_create (write_threads + write_threads_num, NULL,
+					plugin_write_thread,
+					(void *) write_threads_num) == 0)
 		{
-			read_threads_num++;
+			write_threads_num++;
 		}
 		else
 		{
-			ERROR ("plugin: start_read_threads: pthread_create failed.");
-			return;
+			ERROR ("plugin: start_write_threads: pthread_create failed.");
+			break;
 		}
 	} /* for (i) */
-} /* void start_read_threads */
 
-static void stop_read_threads (void)
+	/* Without a single write thread nobody would empty the queue. Fall
+	 * back to dispatching values synchronously in that case. */
+	if (write_threads_num == 0)
+	{
+		pthread_mutex_lock (&write_lock);
+		write_loop = 0;
+		pthread_mutex_unlock (&write_lock);
+		sfree (write_threads);
+	}
+} /* }}} void start_write_threads */
+
+/* Blocks until all write threads have drained the queue and shut down. Values
+ * dispatched afterwards are handled synchronously by the calling thread. */
+static void stop_write_threads (void) /* {{{ */
 {
-	int i;
+	size_t i;
 
-	if (read_threads == NULL)
+	if (write_threads == NULL)
 		return;
 
-	INFO ("collectd: Stopping %i read threads.", read_threads_num);
+	INFO ("collectd: Stopping %zu write threads.", write_threads_num);
 
-	pthread_mutex_lock (&read_lock);
-	read_loop = 0;
-	DEBUG ("plugin: stop_read_threads: Signalling `read_cond'");
-	pthread_cond_broadcast (&read_cond);
-	pthread_mutex_unlock (&read_lock);
+	pthread_mutex_lock (&write_lock);
+	write_loop = 0;
+	DEBUG ("plugin: stop_write_threads: Signalling `write_cond'");
+	pthread_cond_broadcast (&write_cond);
+	pthread_mutex_unlock (&write_lock);
 
-	for (i = 0; i < read_threads_num; i++)
+	for (i = 0; i < write_threads_num; i++)
 	{
-		if (pthread_join (read_threads[i], NULL) != 0)
+		if (pthread_join (write_threads[i], NULL) != 0)
 		{
-			ERROR ("plugin: stop_read_threads: pthread_join failed.");
+			ERROR ("plugin: stop_write_threads: pthread_join failed.");
 		}
-		read_threads[i] = (pthread_t) 0;
+		write_threads[i] = (pthread_t) 0;
 	}
-	sfree (read_threads);
-	read_threads_num = 0;
-} /* void stop_read_threads */
+	sfree (write_threads);
+	write_threads_num = 0;
+} /* }}} void stop_write_threads */
 
 /*
  * Public functions
@@ -686,31 +1516,12 @@ int plugin_register_init (const char *name,
 				/* user_data = */ NULL));
 } /* plugin_register_init */
 
-static int plugin_compare_read_func (const void *arg0, const void *arg1)
-{
-	const read_func_t *rf0;
-	const read_func_t *rf1;
-
-	rf0 = arg0;
-	rf1 = arg1;
-
-	if (rf0->rf_next_read.tv_sec < rf1->rf_next_read.tv_sec)
-		return (-1);
-	else if (rf0->rf_next_read.tv_sec > rf1->rf_next_read.tv_sec)
-		return (1);
-	else if (rf0->rf_next_read.tv_nsec < rf1->rf_next_read.tv_nsec)
-		return (-1);
-	else if (rf0->rf_next_read.tv_nsec > rf1->rf_next_read.tv_nsec)
-		return (1);
-	else
-		return (0);
-} /* int plugin_compare_read_func */
-
 /* Add a read function to both, the heap and a linked list. The linked list if
  * used to look-up read functions, especially for the remove function. The heap
  * is used to determine which plugin to read next. */
 static int plugin_insert_read (read_func_t *rf)
 {
+	read_pool_t *pool;
 	int status;
 	llentry_t *le;
 
@@ -727,15 +1538,12 @@ static int plugin_insert_read (read_func_t *rf)
 		}
 	}
 
-	if (read_heap == NULL)
+	pool = read_pool_get (rf);
+	if (pool == NULL)
 	{
-		read_heap = c_heap_create (plugin_compare_read_func);
-		if (read_heap == NULL)
-		{
-			pthread_mutex_unlock (&read_lock);
-			ERROR ("plugin_insert_read: c_heap_create failed.");
-			return (-1);
-		}
+		pthread_mutex_unlock (&read_lock);
+		ERROR ("plugin_insert_read: read_pool_get failed.");
+		return (-1);
 	}
 
 	le = llist_search (read_list, rf->rf_name);
@@ -757,7 +1565,7 @@ static int plugin_insert_read (read_func_t *rf)
 		return (-1);
 	}
 
-	status = c_heap_insert (read_heap, rf);
+	status = c_heap_insert (pool->heap, rf);
 	if (status != 0)
 	{
 		pthread_mutex_unlock (&read_lock);
@@ -796,10 +1604,15 @@ int plugin_register_read (const char *name,
 	rf->rf_interval.tv_sec = 0;
 	rf->rf_interval.tv_nsec = 0;
 	rf->rf_effective_interval = rf->rf_interval;
+	if (record_statistics)
+		rf->rf_stats = callback_stats_create ();
 
 	status = plugin_insert_read (rf);
 	if (status != 0)
+	{
+		callback_stats_destroy (rf->rf_stats);
 		sfree (rf);
+	}
 
 	return (status);
 } /* int plugin_register_read */
@@ -844,13 +1657,67 @@ int plugin_register_complex_read (const char *group, const char *name,
 		rf->rf_udata = *user_data;
 	}
 
+	if (record_statistics)
+		rf->rf_stats = callback_stats_create ();
+
 	status = plugin_insert_read (rf);
 	if (status != 0)
+	{
+		callback_stats_destroy (rf->rf_stats);
 		sfree (rf);
+	}
 
 	return (status);
 } /* int plugin_register_complex_read */
 
+int plugin_set_read_group (const char *group, int threads_num, /* {{{ */
+		cdtime_t timeout)
+{
+	read_pool_t *pool;
+	read_pool_t *last = NULL;
+
+	if ((group == NULL) || (group[0] == 0) || (threads_num < 1))
+		return (EINVAL);
+
+	pthread_mutex_lock (&read_lock);
+
+	if (read_threads_running)
+	{
+		pthread_mutex_unlock (&read_lock);
+		ERROR ("plugin_set_read_group: Read groups cannot be changed "
+				"after the read threads have been started.");
+		return (EBUSY);
+	}
+
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+	{
+		if (strcmp (pool->name, group) == 0)
+			break;
+		last = pool;
+	}
+
+	if (pool == NULL)
+	{
+		pool = read_pool_create (group);
+		if (pool == NULL)
+		{
+			pthread_mutex_unlock (&read_lock);
+			return (ENOMEM);
+		}
+
+		if (last == NULL)
+			read_pools = pool;
+		else
+			last->next = pool;
+	}
+
+	pool->threads_num_conf = threads_num;
+	pool->timeout = timeout;
+
+	pthread_mutex_unlock (&read_lock);
+	return (0);
+} /* }}} int plugin_set_read_group */
+
 int plugin_register_write (const char *name,
 		plugin_write_cb callback, user_data_t *ud)
 {
@@ -1109,8 +1976,65 @@ void plugin_init_all (void)
 	chain_name = global_option_get ("PostCacheChain");
 	post_cache_chain = fc_chain_get_by_name (chain_name);
 
+	write_limit_high = global_option_get_long ("WriteQueueLimitHigh",
+			/* default = */ 1000000);
+	if (write_limit_high < 0)
+	{
+		ERROR ("WriteQueueLimitHigh must be positive or zero.");
+		write_limit_high = 0;
+	}
+
+	write_limit_low = global_option_get_long ("WriteQueueLimitLow",
+			/* default = */ write_limit_high / 2);
+	if (write_limit_low < 0)
+	{
+		ERROR ("WriteQueueLimitLow must be positive or zero.");
+		write_limit_low = write_limit_high / 2;
+	}
+	else if (write_limit_low > write_limit_high)
+	{
+		ERROR ("WriteQueueLimitLow must not be larger than "
+				"WriteQueueLimitHigh.");
+		write_limit_low = write_limit_high;
+	}
+
+	record_statistics = IS_TRUE (global_option_get ("CollectInternalStats"));
+	fc_set_record_statistics (record_statistics);
 
-	if ((list_init == NULL) && (read_heap == NULL))
+	/* Callbacks registered while reading the configuration don't have
+	 * statistics yet. Later ones get them when they are registered. */
+	if (record_statistics)
+	{
+		pthread_mutex_lock (&read_lock);
+		for (le = llist_head (read_list); le != NULL; le = le->next)
+		{
+			read_func_t *rf = le->value;
+
+			if (rf->rf_stats == NULL)
+				rf->rf_stats = callback_stats_create ();
+		}
+		pthread_mutex_unlock (&read_lock);
+
+		for (le = llist_head (list_write); le != NULL; le = le->next)
+		{
+			callback_func_t *cf = le->value;
+
+			if (cf->cf_stats == NULL)
+				cf->cf_stats = callback_stats_create ();
+		}
+	}
+
+	/* Start write-threads. These are required even if no write callbacks
+	 * have been registered yet, because the queue is filled by
+	 * `plugin_dispatch_values' regardless. */
+	{
+		long num = global_option_get_long ("WriteThreads",
+				/* default = */ 5);
+		if (num > 0)
+			start_write_threads ((size_t) num);
+	}
+
+	if ((list_init == NULL) && (read_list == NULL))
 		return;
 
 	/* Calling all init callbacks before checking if read callbacks
@@ -1143,7 +2067,7 @@ void plugin_init_all (void)
 	}
 
 	/* Start read-threads */
-	if (read_heap != NULL)
+	if (read_list != NULL)
 	{
 		const char *rt;
 		int num;
@@ -1154,31 +2078,184 @@ void plugin_init_all (void)
 	}
 } /* void plugin_init_all */
 
+/* Dispatches the number of calls, failures, the time spent and the latency
+ * histogram of one callback. */
+static void plugin_dispatch_callback_statistics (const char *prefix, /* {{{ */
+		const char *name, callback_stats_t *stats)
+{
+	value_list_t vl = VALUE_LIST_INIT;
+	value_t values[1];
+	callback_stats_slot_t sum;
+	char *ptr;
+	size_t i;
+	size_t j;
+
+	if (stats == NULL)
+		return;
+
+	memset (&sum, 0, sizeof (sum));
+	for (i = 0; i < STATS_SLOTS_NUM; i++)
+	{
+		callback_stats_slot_t *slot = stats->slots + i;
+
+		pthread_mutex_lock (&slot->lock);
+		sum.calls += slot->calls;
+		sum.failures += slot->failures;
+		sum.time_total += slot->time_total;
+		if (sum.time_max < slot->time_max)
+			sum.time_max = slot->time_max;
+		slot->time_max = 0;
+		sum.overruns += slot->overruns;
+		for (j = 0; j < STATS_BUCKETS_NUM; j++)
+			sum.buckets[j] += slot->buckets[j];
+		pthread_mutex_unlock (&slot->lock);
+	}
+
+	vl.values = values;
+	vl.values_len = 1;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "collectd", sizeof (vl.plugin));
+	ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+			"%s-%s", prefix, name);
+	/* Callback names such as "write_graphite/host/port" contain slashes,
+	 * which are not allowed in identifiers. */
+	for (ptr = vl.plugin_instance; *ptr != 0; ptr++)
+		if (*ptr == '/')
+			*ptr = '_';
+
+	values[0].derive = sum.calls;
+	sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+	vl.type_instance[0] = 0;
+	plugin_dispatch_values (&vl);
+
+	values[0].derive = (derive_t) CDTIME_T_TO_MS (sum.time_total);
+	sstrncpy (vl.type, "total_time_in_ms", sizeof (vl.type));
+	plugin_dispatch_values (&vl);
+
+	/* Longest call since the last time the statistics were dispatched */
+	values[0].gauge = CDTIME_T_TO_DOUBLE (sum.time_max);
+	sstrncpy (vl.type, "response_time", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "max", sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	sstrncpy (vl.type, "derive", sizeof (vl.type));
+
+	values[0].derive = sum.failures;
+	sstrncpy (vl.type_instance, "failed", sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Only read callbacks have a timeout. */
+	if (strcmp ("read", prefix) == 0)
+	{
+		values[0].derive = sum.overruns;
+		sstrncpy (vl.type_instance, "overrun",
+				sizeof (vl.type_instance));
+		plugin_dispatch_values (&vl);
+	}
+
+	for (j = 0; j < STATS_BUCKETS_NUM; j++)
+	{
+		if (j < (STATS_BUCKETS_NUM - 1))
+			ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+					"latency-le_%ums", stats_buckets_ms[j]);
+		else
+			ssnprintf (vl.type_instance, sizeof (vl.type_instance),
+					"latency-gt_%ums", stats_buckets_ms[j - 1]);
+		values[0].derive = sum.buckets[j];
+		plugin_dispatch_values (&vl);
+	}
+} /* }}} void plugin_dispatch_callback_statistics */
+
+static void plugin_update_internal_statistics (void) /* {{{ */
+{
+	llentry_t *le;
+
+	value_list_t vl = VALUE_LIST_INIT;
+	value_t values[1];
+	gauge_t copy_write_queue_length;
+	derive_t copy_values_dropped;
+	derive_t copy_values_dropped_age;
+
+	pthread_mutex_lock (&write_lock);
+	copy_write_queue_length = (gauge_t) write_queue_length;
+	copy_values_dropped = stats_values_dropped;
+	copy_values_dropped_age = stats_values_dropped_age;
+	pthread_mutex_unlock (&write_lock);
+
+	vl.values = values;
+	vl.values_len = 1;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "collectd", sizeof (vl.plugin));
+	sstrncpy (vl.plugin_instance, "write_queue",
+			sizeof (vl.plugin_instance));
+
+	/* Number of value lists waiting for a write thread */
+	values[0].gauge = copy_write_queue_length;
+	sstrncpy (vl.type, "queue_length", sizeof (vl.type));
+	vl.type_instance[0] = 0;
+	plugin_dispatch_values (&vl);
+
+	/* Number of value lists dropped because the queue was too long */
+	values[0].derive = copy_values_dropped;
+	sstrncpy (vl.type, "derive", sizeof (vl.type));
+	sstrncpy (vl.type_instance, "dropped", sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Number of value lists dropped because they waited for too long */
+	values[0].derive = copy_values_dropped_age;
+	sstrncpy (vl.type_instance, "dropped-age", sizeof (vl.type_instance));
+	plugin_dispatch_values (&vl);
+
+	/* Holding `read_lock' keeps read threads from freeing callbacks that
+	 * have been unregistered while we look at them. */
+	pthread_mutex_lock (&read_lock);
+	for (le = llist_head (read_list); le != NULL; le = le->next)
+	{
+		read_func_t *rf = le->value;
+
+		plugin_dispatch_callback_statistics ("read", rf->rf_name,
+				rf->rf_stats);
+	}
+	pthread_mutex_unlock (&read_lock);
+
+	for (le = llist_head (list_write); le != NULL; le = le->next)
+	{
+		callback_func_t *cf = le->value;
+
+		plugin_dispatch_callback_statistics ("write", le->key,
+				cf->cf_stats);
+	}
+
+	fc_dispatch_statistics ();
+} /* }}} void plugin_update_internal_statistics */
+
 /* TODO: Rename this function. */
 void plugin_read_all (void)
 {
+	plugin_check_read_timeouts ();
+
+	if (record_statistics)
+		plugin_update_internal_statistics ();
+
 	uc_check_timeout ();
 
 	return;
 } /* void plugin_read_all */
 
 /* Read function called when the `-T' command line argument is given. */
-int plugin_read_all_once (void)
+static int read_pool_read_once (read_pool_t *pool) /* {{{ */
 {
 	int status;
 	int return_status = 0;
 
-	if (read_heap == NULL)
-	{
-		NOTICE ("No read-functions are registered.");
+	if (pool == NULL)
 		return (0);
-	}
 
 	while (42)
 	{
 		read_func_t *rf;
 
-		rf = c_heap_get_root (read_heap);
+		rf = c_heap_get_root (pool->heap);
 		if (rf == NULL)
 			break;
 
@@ -1207,6 +2284,26 @@ int plugin_read_all_once (void)
 		destroy_callback ((void *) rf);
 	}
 
+	return (return_status);
+} /* }}} int read_pool_read_once */
+
+int plugin_read_all_once (void)
+{
+	read_pool_t *pool;
+	int return_status = 0;
+
+	if (read_list == NULL)
+	{
+		NOTICE ("No read-functions are registered.");
+		return (0);
+	}
+
+	if (read_pool_read_once (read_pool_default) != 0)
+		return_status = -1;
+	for (pool = read_pools; pool != NULL; pool = pool->next)
+		if (read_pool_read_once (pool) != 0)
+			return_status = -1;
+
 	return (return_status);
 } /* int plugin_read_all_once */
 
@@ -1245,7 +2342,15 @@ int plugin_write (const char *plugin, /* {{{ */
 
       DEBUG ("plugin: plugin_write: Writing values via %s.", le->key);
       callback = cf->cf_callback;
-      status = (*callback) (ds, vl, &cf->cf_udata);
+      if (cf->cf_stats != NULL)
+      {
+        cdtime_t start = cdtime ();
+        status = (*callback) (ds, vl, &cf->cf_udata);
+        callback_stats_record (cf->cf_stats, cdtime () - start, status,
+          /* overrun = */ 0);
+      }
+      else
+        status = (*callback) (ds, vl, &cf->cf_udata);
       if (status != 0)
         failure++;
       else
@@ -1280,7 +2385,15 @@ int plugin_write (const char *plugin, /* {{{ */
 
     DEBUG ("plugin: plugin_write: Writing values via %s.", le->key);
     callback = cf->cf_callback;
-    status = (*callback) (ds, vl, &cf->cf_udata);
+    if (cf->cf_stats != NULL)
+    {
+      cdtime_t start = cdtime ();
+      status = (*callback) (ds, vl, &cf->cf_udata);
+      callback_stats_record (cf->cf_stats, cdtime () - start, status,
+          /* overrun = */ 0);
+    }
+    else
+      status = (*callback) (ds, vl, &cf->cf_udata);
   }
 
   return (status);
@@ -1322,6 +2435,9 @@ void plugin_shutdown_all (void)
 
 	stop_read_threads ();
 
+	/* Blocks until the write queue has been drained. */
+	stop_write_threads ();
+
 	destroy_all_callbacks (&list_init);
 
 	pthread_mutex_lock (&read_lock);
@@ -1329,7 +2445,7 @@ void plugin_shutdown_all (void)
 	read_list = NULL;
 	pthread_mutex_unlock (&read_lock);
 
-	destroy_read_heap ();
+	destroy_read_pools ();
 
 	plugin_flush (/* plugin = */ NULL,
 			/* timeout = */ 0,
@@ -1408,7 +2524,7 @@ int plugin_dispatch_missing (const value_list_t *vl) /* {{{ */
   return (0);
 } /* int }}} plugin_dispatch_missing */
 
-int plugin_dispatch_values (value_list_t *vl)
+static int plugin_dispatch_values_internal (value_list_t *vl)
 {
 	int status;
 	static c_complain_t no_write_complaint = C_COMPLAIN_INIT_STATIC;
@@ -1584,6 +2700,114 @@ int plugin_dispatch_values (value_list_t *vl)
 	}
 
 	return (0);
+} /* int plugin_dispatch_values_internal */
+
+static double get_drop_probability (void) /* {{{ */
+{
+	long pos;
+	long size;
+	long wql;
+
+	/* No locking: this is only a heuristic. */
+	wql = write_queue_length;
+
+	if (wql < write_limit_low)
+		return (0.0);
+	if (wql >= write_limit_high)
+		return (1.0);
+
+	pos = 1 + wql - write_limit_low;
+	size = 1 + write_limit_high - write_limit_low;
+
+	return (((double) pos) / ((double) size));
+} /* }}} double get_drop_probability */
+
+/* Returns true if the value list should be dropped because the write queue
+ * has grown beyond `WriteQueueLimitLow'. Between the low and the high limit
+ * values are dropped with a linearly increasing probability, beyond the high
+ * limit all values are dropped. */
+static _Bool check_drop_value (void) /* {{{ */
+{
+	static cdtime_t last_message_time = 0;
+	static pthread_mutex_t last_message_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	double p;
+	double q;
+
+	if (write_limit_high == 0)
+		return (0);
+
+	p = get_drop_probability ();
+	if (p == 0.0)
+		return (0);
+
+	if (pthread_mutex_trylock (&last_message_lock) == 0)
+	{
+		cdtime_t now;
+
+		now = cdtime ();
+		if ((now - last_message_time) > TIME_T_TO_CDTIME_T (1))
+		{
+			last_message_time = now;
+			ERROR ("plugin_dispatch_values: Low water mark "
+					"reached. Dropping %.0f%% of metrics.",
+					100.0 * p);
+		}
+		pthread_mutex_unlock (&last_message_lock);
+	}
+
+	if (p == 1.0)
+		return (1);
+
+	q = ((double) random ()) / (((double) RAND_MAX) + 1.0);
+	return (q < p);
+} /* }}} _Bool check_drop_value */
+
+/* Hands `vl' over to the write threads. Returns ENOTCONN if the write threads
+ * are not (yet / any more) running, in which case the caller has to handle
+ * the values synchronously. */
+static int plugin_dispatch_values_async (value_list_t const *vl) /* {{{ */
+{
+	int status;
+
+	if (!write_loop)
+		return (ENOTCONN);
+
+	if (check_drop_value ())
+	{
+		pthread_mutex_lock (&write_lock);
+		stats_values_dropped++;
+		pthread_mutex_unlock (&write_lock);
+		return (0);
+	}
+
+	status = plugin_write_enqueue (vl);
+	if ((status != 0) && (status != ENOTCONN))
+	{
+		char errbuf[1024];
+		ERROR ("plugin_dispatch_values: plugin_write_enqueue failed "
+				"with status %i (%s).", status,
+				sstrerror (status, errbuf, sizeof (errbuf)));
+	}
+
+	return (status);
+} /* }}} int plugin_dispatch_values_async */
+
+int plugin_dispatch_values (value_list_t *vl)
+{
+	int status;
+
+	if ((vl == NULL) || (vl->values == NULL) || (vl->values_len < 1))
+	{
+		ERROR ("plugin_dispatch_values: Invalid value list.");
+		return (-1);
+	}
+
+	status = plugin_dispatch_values_async (vl);
+	if (status == ENOTCONN)
+		return (plugin_dispatch_values_internal (vl));
+
+	return (status);
 } /* int plugin_dispatch_values */
 
 int plugin_dispatch_values_secure (const value_list_t *vl)
@@ -1594,12 +2818,23 @@ int plugin_dispatch_values_secure (const value_list_t *vl)
   if (vl == NULL)
     return EINVAL;
 
+  if ((vl->values == NULL) || (vl->values_len < 1))
+  {
+    ERROR ("plugin_dispatch_values_secure: Invalid value list.");
+    return (-1);
+  }
+
+  /* The write queue works on private copies anyway. */
+  status = plugin_dispatch_values_async (vl);
+  if (status != ENOTCONN)
+    return (status);
+
   memcpy (&vl_copy, vl, sizeof (vl_copy));
 
   /* Write callbacks must not change the values and meta pointers, so we can
    * savely skip copying those and make this more efficient. */
   if ((pre_cache_chain == NULL) && (post_cache_chain == NULL))
-    return (plugin_dispatch_values (&vl_copy));
+    return (plugin_dispatch_values_internal (&vl_copy));
 
   /* Set pointers to NULL, just to be on the save side. */
   vl_copy.values = NULL;
@@ -1624,7 +2859,7 @@ int plugin_dispatch_values_secure (const value_list_t *vl)
     }
   } /* if (vl->meta) */
 
-  status = plugin_dispatch_values (&vl_copy);
+  status = plugin_dispatch_values_internal (&vl_copy);
 
   meta_data_destroy (vl_copy.meta);
   free (vl_copy.values);
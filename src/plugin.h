@@ -255,6 +255,28 @@ int plugin_write (const char *plugin,
 
 int plugin_flush (const char *plugin, cdtime_t timeout, const char *identifier);
 
+/*
+ * NAME
+ *  plugin_set_read_group
+ *
+ * DESCRIPTION
+ *  Gives the read callbacks of a group a thread pool of their own, so a slow
+ *  or hanging plugin cannot delay other plugins. Callbacks registered without
+ *  a group are matched by their name.
+ *
+ * ARGUMENTS
+ *  group       Name of the group, as passed to `plugin_register_complex_read'.
+ *  threads_num Number of threads to start for this group.
+ *  timeout     Time after which a running callback is reported as overdue.
+ *              If zero, the global `ReadTimeout' is used.
+ *
+ * RETURN VALUE
+ *  Returns zero upon success or an errno value if an error occurred. Read
+ *  groups can only be configured before the read threads are started.
+ */
+int plugin_set_read_group (const char *group, int threads_num,
+		cdtime_t timeout);
+
 /*
  * The `plugin_register_*' functions are used to make `config', `init',
  * `read', `write' and `shutdown' functions known to the plugin
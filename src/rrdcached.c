@@ -22,12 +22,45 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "utils_avltree.h"
+#include "utils_complain.h"
 #include "utils_rrdcreate.h"
 
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
 #undef HAVE_CONFIG_H
 #include <rrd.h>
 #include <rrd_client.h>
 
+#define RC_DEFAULT_PORT "42217"
+#define RC_SOCKET_TIMEOUT 10 /* seconds */
+/* Reconnect backoff, doubled after each failed attempt. */
+#define RC_RECONNECT_MIN TIME_T_TO_CDTIME_T(1)
+#define RC_RECONNECT_MAX TIME_T_TO_CDTIME_T(64)
+/* Reject values when this many batches are waiting to be sent. */
+#define RC_BACKLOG_BATCHES 64
+
+/*
+ * Private types
+ */
+
+/* Values waiting to be sent for one file, as space separated
+ * "time:value[:value...]" strings. */
+struct rc_file_s;
+typedef struct rc_file_s rc_file_t;
+struct rc_file_s {
+	char *filename;
+	char *values;
+	size_t values_len;
+	size_t values_size;
+	int values_num;
+
+	rc_file_t *next;
+};
+
 /*
  * Private variables
  */
@@ -41,6 +74,8 @@ static const char *config_keys[] ={
 	"RRARows",
 	"RRATimespan",
 	"XFF",
+	"BatchSize",
+	"BatchTimeout",
 };
 static int config_keys_num = STATIC_ARRAY_SIZE(config_keys);
 
@@ -48,6 +83,27 @@ static char *datadir = NULL;
 static char *daemon_address = NULL;
 static int config_create_files = 1;
 static int config_collect_stats = 1;
+static int config_batch_size = 1000;
+static cdtime_t config_batch_timeout = 0;
+/* Values are collected per file in `batch_files' and sent to the daemon in
+ * BATCH mode by `batch_thread'. The connection is kept open between
+ * batches. */
+static c_avl_tree_t *batch_files = NULL;
+static int batch_values_num = 0;
+static cdtime_t batch_first_value = 0;
+static _Bool batch_flush_requested = 0;
+static _Bool batch_shutdown = 0;
+static pthread_t batch_thread;
+static _Bool batch_thread_running = 0;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static c_complain_t batch_backlog_complaint = C_COMPLAIN_INIT_STATIC;
+
+/* Only used by `batch_thread' */
+static int batch_fd = -1;
+static char batch_rbuf[4096];
+static size_t batch_rbuf_len = 0;
+
 static rrdcreate_config_t rrdcreate_config ={
 	/* stepsize = */ 0,
 	/* heartbeat = */ 0,
@@ -58,7 +114,10 @@ static rrdcreate_config_t rrdcreate_config ={
 	/* timespans_num = */ 0,
 
 	/* consolidation_functions = */ NULL,
-	/* consolidation_functions_num = */ 0
+	/* consolidation_functions_num = */ 0,
+
+	/* async = */ 0,
+	/* creates_per_second = */ 0.0
 };
 
 static int value_list_to_string(char *buffer, int buffer_len,
@@ -268,12 +327,549 @@ static int rc_config(const char *key, const char *value)
 			return (1);
 		}
 		rrdcreate_config.xff = tmp;
+	} else if (strcasecmp("BatchSize", key) == 0) {
+		int tmp = atoi(value);
+		if (tmp < 1) {
+			ERROR("rrdcached plugin: `BatchSize' must "
+			      "be at least 1.");
+			return (1);
+		}
+		config_batch_size = tmp;
+	} else if (strcasecmp("BatchTimeout", key) == 0) {
+		double tmp = atof(value);
+		if (tmp < 0.0) {
+			ERROR("rrdcached plugin: `BatchTimeout' must "
+			      "be greater than or equal to zero.");
+			return (1);
+		}
+		config_batch_timeout = DOUBLE_TO_CDTIME_T(tmp);
 	} else {
 		return (-1);
 	}
 	return (0);
 } /* int rc_config */
 
+static void rc_file_free(rc_file_t *f)
+{
+	if (f == NULL)
+		return;
+
+	sfree(f->filename);
+	sfree(f->values);
+	sfree(f);
+} /* void rc_file_free */
+
+/* Appends `value' to the values of `f', separated by a space. */
+static int rc_file_append(rc_file_t *f, const char *value, size_t value_len)
+{
+	size_t required = f->values_len + value_len + 2;
+
+	if (required > f->values_size) {
+		size_t new_size = (f->values_size > 0) ? f->values_size : 64;
+		char *tmp;
+
+		while (new_size < required)
+			new_size *= 2;
+
+		tmp = realloc(f->values, new_size);
+		if (tmp == NULL)
+			return (-1);
+		f->values = tmp;
+		f->values_size = new_size;
+	}
+
+	if (f->values_len > 0)
+		f->values[f->values_len++] = ' ';
+	memcpy(f->values + f->values_len, value, value_len);
+	f->values_len += value_len;
+	f->values[f->values_len] = 0;
+
+	return (0);
+} /* int rc_file_append */
+
+/* Must hold batch_lock */
+static int rc_batch_add(const char *filename, const char *value)
+{
+	rc_file_t *f = NULL;
+
+	if (c_avl_get(batch_files, filename, (void *) &f) != 0) {
+		f = malloc(sizeof (*f));
+		if (f == NULL)
+			return (-1);
+		memset(f, 0, sizeof (*f));
+
+		f->filename = strdup(filename);
+		if ((f->filename == NULL)
+		    || (c_avl_insert(batch_files, f->filename, f) != 0)) {
+			rc_file_free(f);
+			return (-1);
+		}
+	}
+
+	if (rc_file_append(f, value, strlen(value)) != 0)
+		return (-1);
+	f->values_num++;
+
+	if (batch_values_num == 0)
+		batch_first_value = cdtime();
+	batch_values_num++;
+
+	return (0);
+} /* int rc_batch_add */
+
+/* Puts the values of a batch that could not be sent back in front of the
+ * values that have been added in the meantime. Must hold batch_lock. */
+static void rc_batch_requeue(rc_file_t *files, cdtime_t first_value)
+{
+	while (files != NULL) {
+		rc_file_t *f = files;
+		rc_file_t *newer = NULL;
+
+		files = f->next;
+		f->next = NULL;
+
+		if (c_avl_get(batch_files, f->filename, (void *) &newer) == 0) {
+			if (rc_file_append(f, newer->values,
+					   newer->values_len) != 0) {
+				ERROR("rrdcached plugin: Dropping %i value(s) "
+				      "for %s.", f->values_num, f->filename);
+				rc_file_free(f);
+				continue;
+			}
+			f->values_num += newer->values_num;
+			batch_values_num -= newer->values_num;
+
+			c_avl_remove(batch_files, f->filename, NULL, NULL);
+			rc_file_free(newer);
+		}
+
+		if (c_avl_insert(batch_files, f->filename, f) != 0) {
+			ERROR("rrdcached plugin: Dropping %i value(s) for %s.",
+			      f->values_num, f->filename);
+			rc_file_free(f);
+			continue;
+		}
+		batch_values_num += f->values_num;
+	}
+
+	if ((batch_first_value == 0) || (first_value < batch_first_value))
+		batch_first_value = first_value;
+} /* void rc_batch_requeue */
+
+static void rc_batch_disconnect(void)
+{
+	if (batch_fd >= 0)
+		close(batch_fd);
+	batch_fd = -1;
+	batch_rbuf_len = 0;
+} /* void rc_batch_disconnect */
+
+static int rc_batch_connect_unix(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof (sa));
+	sa.sun_family = AF_UNIX;
+	sstrncpy(sa.sun_path, path, sizeof (sa.sun_path));
+
+	fd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return (-1);
+
+	if (connect(fd, (struct sockaddr *) &sa, sizeof (sa)) != 0) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+} /* int rc_batch_connect_unix */
+
+static int rc_batch_connect_network(const char *address)
+{
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = NULL;
+	struct addrinfo *ai_ptr;
+	char host[NI_MAXHOST];
+	const char *port = RC_DEFAULT_PORT;
+	char *ptr;
+	int fd = -1;
+	int status;
+
+	/* Possible formats: "host", "host:port", "[address]" and
+	 * "[address]:port" */
+	if (address[0] == '[') {
+		sstrncpy(host, address + 1, sizeof (host));
+		ptr = strchr(host, ']');
+		if (ptr == NULL)
+			return (-1);
+		*ptr = 0;
+		ptr = strchr(address, ']') + 1;
+		if (*ptr == ':')
+			port = ptr + 1;
+	} else {
+		sstrncpy(host, address, sizeof (host));
+		ptr = strchr(host, ':');
+		/* More than one colon: an IPv6 address without port */
+		if ((ptr != NULL) && (strchr(ptr + 1, ':') == NULL)) {
+			*ptr = 0;
+			port = strchr(address, ':') + 1;
+		}
+	}
+
+	memset(&ai_hints, 0, sizeof (ai_hints));
+	ai_hints.ai_flags = AI_ADDRCONFIG;
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+
+	status = getaddrinfo(host, port, &ai_hints, &ai_list);
+	if (status != 0) {
+		ERROR("rrdcached plugin: getaddrinfo (%s, %s) failed: %s",
+		      host, port, gai_strerror(status));
+		return (-1);
+	}
+
+	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) {
+		fd = socket(ai_ptr->ai_family, ai_ptr->ai_socktype,
+			    ai_ptr->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (connect(fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai_list);
+	return (fd);
+} /* int rc_batch_connect_network */
+
+static int rc_batch_connect(void)
+{
+	struct timeval tv;
+
+	if (batch_fd >= 0)
+		return (0);
+
+	if (strncmp("unix:", daemon_address, strlen("unix:")) == 0)
+		batch_fd = rc_batch_connect_unix(daemon_address + strlen("unix:"));
+	else if (daemon_address[0] == '/')
+		batch_fd = rc_batch_connect_unix(daemon_address);
+	else
+		batch_fd = rc_batch_connect_network(daemon_address);
+
+	if (batch_fd < 0)
+		return (-1);
+
+	/* Don't hang forever if the daemon stops responding. */
+	memset(&tv, 0, sizeof (tv));
+	tv.tv_sec = RC_SOCKET_TIMEOUT;
+	setsockopt(batch_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	setsockopt(batch_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+	batch_rbuf_len = 0;
+	return (0);
+} /* int rc_batch_connect */
+
+static int rc_batch_read_line(char *buffer, size_t buffer_size)
+{
+	while (42) {
+		char *eol;
+		ssize_t status;
+
+		eol = memchr(batch_rbuf, '\n', batch_rbuf_len);
+		if (eol != NULL) {
+			size_t line_len = eol - batch_rbuf;
+
+			if (line_len >= buffer_size)
+				line_len = buffer_size - 1;
+			memcpy(buffer, batch_rbuf, line_len);
+			buffer[line_len] = 0;
+
+			batch_rbuf_len -= (eol - batch_rbuf) + 1;
+			memmove(batch_rbuf, eol + 1, batch_rbuf_len);
+			return (0);
+		}
+
+		/* Discard overlong lines */
+		if (batch_rbuf_len >= sizeof (batch_rbuf))
+			batch_rbuf_len = 0;
+
+		status = read(batch_fd, batch_rbuf + batch_rbuf_len,
+			      sizeof (batch_rbuf) - batch_rbuf_len);
+		if (status <= 0) {
+			if ((status < 0) && (errno == EINTR))
+				continue;
+			return (-1);
+		}
+		batch_rbuf_len += (size_t) status;
+	}
+} /* int rc_batch_read_line */
+
+/* Escapes spaces and backslashes the way the daemon expects them. */
+static int rc_batch_buffer_add_filename(char **buffer, size_t *buffer_len,
+					size_t *buffer_size,
+					const char *filename)
+{
+	size_t filename_len = strlen(filename);
+	size_t i;
+
+	if ((*buffer_len + 2 * filename_len) > *buffer_size) {
+		size_t new_size = *buffer_size;
+		char *tmp;
+
+		while ((*buffer_len + 2 * filename_len) > new_size)
+			new_size *= 2;
+
+		tmp = realloc(*buffer, new_size);
+		if (tmp == NULL)
+			return (-1);
+		*buffer = tmp;
+		*buffer_size = new_size;
+	}
+
+	for (i = 0; i < filename_len; i++) {
+		if ((filename[i] == ' ') || (filename[i] == '\\'))
+			(*buffer)[(*buffer_len)++] = '\\';
+		(*buffer)[(*buffer_len)++] = filename[i];
+	}
+
+	return (0);
+} /* int rc_batch_buffer_add_filename */
+
+static int rc_batch_buffer_add(char **buffer, size_t *buffer_len,
+			       size_t *buffer_size,
+			       const char *data, size_t data_len)
+{
+	if ((*buffer_len + data_len) > *buffer_size) {
+		size_t new_size = *buffer_size;
+		char *tmp;
+
+		while ((*buffer_len + data_len) > new_size)
+			new_size *= 2;
+
+		tmp = realloc(*buffer, new_size);
+		if (tmp == NULL)
+			return (-1);
+		*buffer = tmp;
+		*buffer_size = new_size;
+	}
+
+	memcpy(*buffer + *buffer_len, data, data_len);
+	*buffer_len += data_len;
+
+	return (0);
+} /* int rc_batch_buffer_add */
+
+/* Sends the values of `files' using a single BATCH command. Returns zero if
+ * the daemon received the batch, even if some updates failed. */
+static int rc_batch_send(rc_file_t *files)
+{
+	rc_file_t *f;
+	char *buffer;
+	size_t buffer_len = 0;
+	size_t buffer_size = 4096;
+	size_t offset;
+	char line[1024];
+	int errors_num;
+	int status = 0;
+	int i;
+
+	buffer = malloc(buffer_size);
+	if (buffer == NULL)
+		return (-1);
+
+	status |= rc_batch_buffer_add(&buffer, &buffer_len, &buffer_size,
+				      "BATCH\n", strlen("BATCH\n"));
+	for (f = files; f != NULL; f = f->next) {
+		status |= rc_batch_buffer_add(&buffer, &buffer_len,
+					      &buffer_size, "UPDATE ",
+					      strlen("UPDATE "));
+		status |= rc_batch_buffer_add_filename(&buffer, &buffer_len,
+						       &buffer_size,
+						       f->filename);
+		status |= rc_batch_buffer_add(&buffer, &buffer_len,
+					      &buffer_size, " ", 1);
+		status |= rc_batch_buffer_add(&buffer, &buffer_len,
+					      &buffer_size, f->values,
+					      f->values_len);
+		status |= rc_batch_buffer_add(&buffer, &buffer_len,
+					      &buffer_size, "\n", 1);
+	}
+	status |= rc_batch_buffer_add(&buffer, &buffer_len, &buffer_size,
+				      ".\n", strlen(".\n"));
+	if (status != 0) {
+		ERROR("rrdcached plugin: realloc failed.");
+		sfree(buffer);
+		return (-1);
+	}
+
+	offset = 0;
+	while (offset < buffer_len) {
+		ssize_t sent = send(batch_fd, buffer + offset,
+				    buffer_len - offset, MSG_NOSIGNAL);
+		if (sent < 0) {
+			char errbuf[1024];
+
+			if (errno == EINTR)
+				continue;
+			ERROR("rrdcached plugin: send failed: %s",
+			      sstrerror(errno, errbuf, sizeof (errbuf)));
+			sfree(buffer);
+			return (-1);
+		}
+		offset += (size_t) sent;
+	}
+	sfree(buffer);
+
+	/* "0 Go ahead.  End with dot '.' on its own line." */
+	if (rc_batch_read_line(line, sizeof (line)) != 0) {
+		ERROR("rrdcached plugin: Reading the response to BATCH "
+		      "failed.");
+		return (-1);
+	}
+	if (atoi(line) < 0) {
+		ERROR("rrdcached plugin: BATCH failed: %s", line);
+		return (-1);
+	}
+
+	/* "<num> errors", followed by one line per error. */
+	if (rc_batch_read_line(line, sizeof (line)) != 0) {
+		ERROR("rrdcached plugin: Reading the result of BATCH failed.");
+		return (-1);
+	}
+	errors_num = atoi(line);
+	if (errors_num < 0) {
+		ERROR("rrdcached plugin: BATCH failed: %s", line);
+		return (-1);
+	}
+
+	for (i = 0; i < errors_num; i++) {
+		if (rc_batch_read_line(line, sizeof (line)) != 0) {
+			ERROR("rrdcached plugin: Reading the result of "
+			      "BATCH failed.");
+			return (-1);
+		}
+		/* "<command number> <message>" */
+		WARNING("rrdcached plugin: Update failed: %s", line);
+	}
+
+	return (0);
+} /* int rc_batch_send */
+
+static void *rc_batch_thread(void __attribute__((unused)) *arg)
+{
+	cdtime_t reconnect_interval = RC_RECONNECT_MIN;
+	cdtime_t reconnect_next = 0;
+
+	pthread_mutex_lock(&batch_lock);
+	while (42) {
+		rc_file_t *files = NULL;
+		cdtime_t first_value;
+		void *key;
+		void *value;
+		int values_num;
+		int status;
+
+		/* Wait until a batch is complete, old enough or flushed and,
+		 * after a failure, until the reconnect backoff has passed.
+		 * rc_write signals when it adds the first value, so the batch
+		 * timeout is picked up right away. */
+		while (!batch_shutdown) {
+			struct timespec ts_wait;
+			cdtime_t deadline;
+
+			if (batch_values_num == 0) {
+				pthread_cond_wait(&batch_cond, &batch_lock);
+				continue;
+			}
+
+			if (batch_flush_requested
+			    || (batch_values_num >= config_batch_size))
+				deadline = 0;
+			else
+				deadline = batch_first_value
+					+ config_batch_timeout;
+
+			if ((batch_fd < 0) && (deadline < reconnect_next))
+				deadline = reconnect_next;
+
+			if (cdtime() >= deadline)
+				break;
+
+			CDTIME_T_TO_TIMESPEC(deadline, &ts_wait);
+			pthread_cond_timedwait(&batch_cond, &batch_lock,
+					       &ts_wait);
+		}
+		batch_flush_requested = 0;
+
+		/* Only happens when shutting down */
+		if (batch_values_num == 0)
+			break;
+
+		values_num = batch_values_num;
+		first_value = batch_first_value;
+		while (c_avl_pick(batch_files, &key, &value) == 0) {
+			rc_file_t *f = value;
+			f->next = files;
+			files = f;
+		}
+		batch_values_num = 0;
+		batch_first_value = 0;
+		pthread_mutex_unlock(&batch_lock);
+
+		status = rc_batch_connect();
+		if (status != 0) {
+			ERROR("rrdcached plugin: Connecting to %s failed. "
+			      "Will retry in %.0f seconds.", daemon_address,
+			      CDTIME_T_TO_DOUBLE(reconnect_interval));
+		} else {
+			status = rc_batch_send(files);
+			if (status != 0)
+				rc_batch_disconnect();
+		}
+
+		if (status == 0) {
+			reconnect_interval = RC_RECONNECT_MIN;
+			reconnect_next = 0;
+
+			while (files != NULL) {
+				rc_file_t *next = files->next;
+				rc_file_free(files);
+				files = next;
+			}
+			DEBUG("rrdcached plugin: Sent %i value(s).",
+			      values_num);
+		} else {
+			reconnect_next = cdtime() + reconnect_interval;
+			reconnect_interval *= 2;
+			if (reconnect_interval > RC_RECONNECT_MAX)
+				reconnect_interval = RC_RECONNECT_MAX;
+		}
+
+		pthread_mutex_lock(&batch_lock);
+		if (status != 0) {
+			if (batch_shutdown) {
+				ERROR("rrdcached plugin: Shutting down, "
+				      "dropping %i value(s).", values_num);
+				while (files != NULL) {
+					rc_file_t *next = files->next;
+					rc_file_free(files);
+					files = next;
+				}
+			} else {
+				rc_batch_requeue(files, first_value);
+			}
+		}
+	} /* while (42) */
+	pthread_mutex_unlock(&batch_lock);
+
+	rc_batch_disconnect();
+	return ((void *) 0);
+} /* void *rc_batch_thread */
+
 static int rc_read(void)
 {
 	int status;
@@ -299,6 +895,13 @@ static int rc_read(void)
 		sstrncpy(vl.host, daemon_address, sizeof (vl.host));
 	sstrncpy(vl.plugin, "rrdcached", sizeof (vl.plugin));
 
+	status = rrdc_connect(daemon_address);
+	if (status != 0) {
+		ERROR("rrdcached plugin: rrdc_connect (%s) failed with status %i.",
+		      daemon_address, status);
+		return (-1);
+	}
+
 	head = NULL;
 	status = rrdc_stats_get(&head);
 	if (status != 0) {
@@ -357,9 +960,36 @@ static int rc_read(void)
 
 static int rc_init(void)
 {
+	int status;
+
 	if (config_collect_stats != 0)
 		plugin_register_read("rrdcached", rc_read);
 
+	if (config_batch_timeout == 0)
+		config_batch_timeout = interval_g;
+
+	pthread_mutex_lock(&batch_lock);
+	if (batch_files == NULL)
+		batch_files = c_avl_create((void *) strcmp);
+	if (batch_files == NULL) {
+		pthread_mutex_unlock(&batch_lock);
+		ERROR("rrdcached plugin: c_avl_create failed.");
+		return (-1);
+	}
+	pthread_mutex_unlock(&batch_lock);
+
+	if ((daemon_address != NULL) && !batch_thread_running) {
+		status = pthread_create(&batch_thread, /* attr = */ NULL,
+					rc_batch_thread, /* arg = */ NULL);
+		if (status != 0) {
+			char errbuf[1024];
+			ERROR("rrdcached plugin: pthread_create failed: %s",
+			      sstrerror(status, errbuf, sizeof (errbuf)));
+			return (-1);
+		}
+		batch_thread_running = 1;
+	}
+
 	return (0);
 } /* int rc_init */
 
@@ -368,7 +998,6 @@ static int rc_write(const data_set_t *ds, const value_list_t *vl,
 {
 	char filename[512];
 	char values[512];
-	char *values_array[2];
 	int status;
 
 	if (daemon_address == NULL) {
@@ -392,9 +1021,6 @@ static int rc_write(const data_set_t *ds, const value_list_t *vl,
 		return (-1);
 	}
 
-	values_array[0] = values;
-	values_array[1] = NULL;
-
 	if (config_create_files != 0) {
 		struct stat statbuf;
 
@@ -416,26 +1042,76 @@ static int rc_write(const data_set_t *ds, const value_list_t *vl,
 		}
 	}
 
-	status = rrdc_connect(daemon_address);
-	if (status != 0) {
-		ERROR("rrdcached plugin: rrdc_connect (%s) failed with status %i.",
-		      daemon_address, status);
+	pthread_mutex_lock(&batch_lock);
+
+	if ((batch_files == NULL) || batch_shutdown) {
+		pthread_mutex_unlock(&batch_lock);
+		return (-1);
+	}
+
+	if (batch_values_num >= (RC_BACKLOG_BATCHES * config_batch_size)) {
+		pthread_mutex_unlock(&batch_lock);
+		c_complain(LOG_ERR, &batch_backlog_complaint,
+			   "rrdcached plugin: Too many values are waiting to "
+			   "be sent to %s. Dropping values.", daemon_address);
 		return (-1);
 	}
+	c_release(LOG_INFO, &batch_backlog_complaint,
+		  "rrdcached plugin: Accepting values again.");
 
-	status = rrdc_update(filename, /* values_num = */ 1, (void *) values_array);
+	status = rc_batch_add(filename, values);
 	if (status != 0) {
-		ERROR("rrdcached plugin: rrdc_update (%s, [%s], 1) failed with "
-		      "status %i.",
-		      filename, values_array[0], status);
+		pthread_mutex_unlock(&batch_lock);
+		ERROR("rrdcached plugin: rc_batch_add (%s) failed.", filename);
 		return (-1);
 	}
 
+	if ((batch_values_num == 1)
+	    || (batch_values_num >= config_batch_size))
+		pthread_cond_signal(&batch_cond);
+
+	pthread_mutex_unlock(&batch_lock);
+
 	return (0);
 } /* int rc_write */
 
+static int rc_flush(cdtime_t __attribute__((unused)) timeout,
+		    const char __attribute__((unused)) *identifier,
+		    user_data_t __attribute__((unused)) *user_data)
+{
+	pthread_mutex_lock(&batch_lock);
+	batch_flush_requested = 1;
+	pthread_cond_signal(&batch_cond);
+	pthread_mutex_unlock(&batch_lock);
+
+	return (0);
+} /* int rc_flush */
+
 static int rc_shutdown(void)
 {
+	void *key;
+	void *value;
+
+	/* Send the remaining values, then stop the thread. */
+	pthread_mutex_lock(&batch_lock);
+	batch_shutdown = 1;
+	pthread_cond_signal(&batch_cond);
+	pthread_mutex_unlock(&batch_lock);
+
+	if (batch_thread_running) {
+		pthread_join(batch_thread, NULL);
+		batch_thread_running = 0;
+	}
+
+	pthread_mutex_lock(&batch_lock);
+	if (batch_files != NULL) {
+		while (c_avl_pick(batch_files, &key, &value) == 0)
+			rc_file_free(value);
+		c_avl_destroy(batch_files);
+		batch_files = NULL;
+	}
+	pthread_mutex_unlock(&batch_lock);
+
 	rrdc_disconnect();
 	return (0);
 } /* int rc_shutdown */
@@ -446,6 +1122,7 @@ void module_register(void)
 			       config_keys, config_keys_num);
 	plugin_register_init("rrdcached", rc_init);
 	plugin_register_write("rrdcached", rc_write, /* user_data = */ NULL);
+	plugin_register_flush("rrdcached", rc_flush, /* user_data = */ NULL);
 	plugin_register_shutdown("rrdcached", rc_shutdown);
 } /* void module_register */
 
@@ -27,6 +27,7 @@
 #include "plugin.h"
 #include "common.h"
 #include "utils_avltree.h"
+#include "utils_complain.h"
 #include "utils_rrdcreate.h"
 
 #include <rrd.h>
@@ -35,16 +36,38 @@
 # include <pthread.h>
 #endif
 
+#define RRD_CHUNK_SIZE 32
+
+/* Maximum number of values held back per file while it is being created. */
+#define RRD_PENDING_VALUES_MAX (16 * RRD_CHUNK_SIZE)
+
 /*
  * Private types
  */
+
+/* Pending updates are staged in their binary form, in chunks of
+ * RRD_CHUNK_SIZE updates, and only formatted when they're written. */
+struct rrd_chunk_s;
+typedef struct rrd_chunk_s rrd_chunk_t;
+struct rrd_chunk_s
+{
+	rrd_chunk_t *next;
+	int          values_num;
+	int          ds_num;
+	int         *ds_types; /* points into the same allocation */
+	cdtime_t     times[RRD_CHUNK_SIZE];
+	value_t      values[]; /* RRD_CHUNK_SIZE * ds_num */
+};
+
 struct rrd_cache_s
 {
-	int      values_num;
-	char   **values;
+	int          values_num;
+	rrd_chunk_t *chunks_head;
+	rrd_chunk_t *chunks_tail;
 	cdtime_t first_value;
 	cdtime_t last_value;
 	int64_t  random_variation;
+	_Bool    file_pending; /* file is being created asynchronously */
 	enum
 	{
 		FLAG_NONE   = 0x00,
@@ -68,6 +91,28 @@ struct rrd_queue_s
 };
 typedef struct rrd_queue_s rrd_queue_t;
 
+/* Files are assigned to update workers by a hash of their name, so that all
+ * updates of one file are done by the same thread and in order. */
+struct rrd_worker_s
+{
+	rrd_queue_t *queue_head;
+	rrd_queue_t *queue_tail;
+	rrd_queue_t *flushq_head;
+	rrd_queue_t *flushq_tail;
+	int          queue_length;
+
+	pthread_t       thread;
+	int             thread_running;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+
+	/* Statistics, protected by `lock' */
+	derive_t updates_num;
+	derive_t updates_failed;
+	cdtime_t updates_time;
+};
+typedef struct rrd_worker_s rrd_worker_t;
+
 /*
  * Private variables
  */
@@ -82,7 +127,11 @@ static const char *config_keys[] =
 	"RRATimespan",
 	"XFF",
 	"WritesPerSecond",
-	"RandomTimeout"
+	"RandomTimeout",
+	"UpdateThreads",
+	"ReportStats",
+	"CreateFilesAsync",
+	"CreatesPerSecond"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -102,11 +151,14 @@ static rrdcreate_config_t rrdcreate_config =
 	/* timespans_num = */ 0,
 
 	/* consolidation_functions = */ NULL,
-	/* consolidation_functions_num = */ 0
+	/* consolidation_functions_num = */ 0,
+
+	/* async = */ 0,
+	/* creates_per_second = */ 0.0
 };
 
-/* XXX: If you need to lock both, cache_lock and queue_lock, at the same time,
- * ALWAYS lock `cache_lock' first! */
+/* XXX: If you need to lock both, cache_lock and a worker's lock, at the same
+ * time, ALWAYS lock `cache_lock' first! */
 static cdtime_t    cache_timeout = 0;
 static cdtime_t    cache_flush_timeout = 0;
 static cdtime_t    random_timeout = TIME_T_TO_CDTIME_T (1);
@@ -114,14 +166,15 @@ static cdtime_t    cache_flush_last;
 static c_avl_tree_t *cache = NULL;
 static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static rrd_queue_t    *queue_head = NULL;
-static rrd_queue_t    *queue_tail = NULL;
-static rrd_queue_t    *flushq_head = NULL;
-static rrd_queue_t    *flushq_tail = NULL;
-static pthread_t       queue_thread;
-static int             queue_thread_running = 1;
-static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+/* Names of files known to exist, so they don't have to be stat(2)ed for
+ * every value. */
+static c_avl_tree_t   *known_files = NULL;
+static pthread_mutex_t known_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static rrd_worker_t *workers = NULL;
+static size_t        workers_num = 0;
+static int           update_threads = 1;
+static _Bool         report_stats = 0;
 
 #if !HAVE_THREADSAFE_LIBRRD
 static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -194,8 +247,9 @@ static int srrd_update (char *filename, char *template,
 } /* int srrd_update */
 #endif /* !HAVE_THREADSAFE_LIBRRD */
 
-static int value_list_to_string (char *buffer, int buffer_len,
-		const data_set_t *ds, const value_list_t *vl)
+static int value_to_string (char *buffer, int buffer_len,
+		const int *ds_types, int ds_num,
+		cdtime_t t, const value_t *values)
 {
 	int offset;
 	int status;
@@ -204,41 +258,161 @@ static int value_list_to_string (char *buffer, int buffer_len,
 
 	memset (buffer, '\0', buffer_len);
 
-	tt = CDTIME_T_TO_TIME_T (vl->time);
+	tt = CDTIME_T_TO_TIME_T (t);
 	status = ssnprintf (buffer, buffer_len, "%u", (unsigned int) tt);
 	if ((status < 1) || (status >= buffer_len))
 		return (-1);
 	offset = status;
 
-	for (i = 0; i < ds->ds_num; i++)
+	for (i = 0; i < ds_num; i++)
 	{
-		if ((ds->ds[i].type != DS_TYPE_COUNTER)
-				&& (ds->ds[i].type != DS_TYPE_GAUGE)
-				&& (ds->ds[i].type != DS_TYPE_DERIVE)
-				&& (ds->ds[i].type != DS_TYPE_ABSOLUTE))
-			return (-1);
-
-		if (ds->ds[i].type == DS_TYPE_COUNTER)
+		if (ds_types[i] == DS_TYPE_COUNTER)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%llu", vl->values[i].counter);
-		else if (ds->ds[i].type == DS_TYPE_GAUGE)
+					":%llu", values[i].counter);
+		else if (ds_types[i] == DS_TYPE_GAUGE)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%lf", vl->values[i].gauge);
-		else if (ds->ds[i].type == DS_TYPE_DERIVE)
+					":%lf", values[i].gauge);
+		else if (ds_types[i] == DS_TYPE_DERIVE)
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%"PRIi64, vl->values[i].derive);
-		else /*if (ds->ds[i].type == DS_TYPE_ABSOLUTE) */
+					":%"PRIi64, values[i].derive);
+		else /*if (ds_types[i] == DS_TYPE_ABSOLUTE) */
 			status = ssnprintf (buffer + offset, buffer_len - offset,
-					":%"PRIu64, vl->values[i].absolute);
+					":%"PRIu64, values[i].absolute);
 
 		if ((status < 1) || (status >= (buffer_len - offset)))
 			return (-1);
 
 		offset += status;
-	} /* for ds->ds_num */
+	} /* for ds_num */
+
+	return (0);
+} /* int value_to_string */
+
+static rrd_chunk_t *rrd_chunk_create (const data_set_t *ds) /* {{{ */
+{
+	rrd_chunk_t *chunk;
+	size_t values_size;
+	int i;
+
+	values_size = RRD_CHUNK_SIZE * ds->ds_num * sizeof (value_t);
+
+	chunk = malloc (sizeof (*chunk) + values_size
+			+ ds->ds_num * sizeof (int));
+	if (chunk == NULL)
+		return (NULL);
+
+	chunk->next = NULL;
+	chunk->values_num = 0;
+	chunk->ds_num = ds->ds_num;
+	chunk->ds_types = (int *) (((char *) chunk->values) + values_size);
+	for (i = 0; i < ds->ds_num; i++)
+		chunk->ds_types[i] = ds->ds[i].type;
+
+	return (chunk);
+} /* }}} rrd_chunk_t *rrd_chunk_create */
+
+static void rrd_chunk_free_all (rrd_chunk_t *chunk) /* {{{ */
+{
+	while (chunk != NULL)
+	{
+		rrd_chunk_t *next = chunk->next;
+		sfree (chunk);
+		chunk = next;
+	}
+} /* }}} void rrd_chunk_free_all */
+
+/* Formats the staged updates as "time:value[:value...]" strings suitable for
+ * srrd_update. All strings are stored in `*ret_buffer'; both, it and
+ * `*ret_argv', must be freed by the caller. */
+static int rrd_chunk_format (const rrd_chunk_t *chunks, /* {{{ */
+		int *ret_argc, char ***ret_argv, char **ret_buffer)
+{
+	const rrd_chunk_t *chunk;
+	char   *buffer = NULL;
+	size_t  buffer_size = 0;
+	size_t  buffer_fill = 0;
+	size_t *offsets = NULL;
+	char  **argv;
+	int     argc = 0;
+	int     values_num = 0;
+	int     i;
+
+	for (chunk = chunks; chunk != NULL; chunk = chunk->next)
+		values_num += chunk->values_num;
+
+	if (values_num == 0)
+		return (-1);
+
+	offsets = malloc (values_num * sizeof (*offsets));
+	if (offsets == NULL)
+		return (-1);
+
+	for (chunk = chunks; chunk != NULL; chunk = chunk->next)
+	{
+		for (i = 0; i < chunk->values_num; i++)
+		{
+			char value[512];
+			size_t value_len;
+
+			if (value_to_string (value, sizeof (value),
+						chunk->ds_types, chunk->ds_num,
+						chunk->times[i],
+						chunk->values + (i * chunk->ds_num)) != 0)
+				continue;
+			value_len = strlen (value) + 1;
+
+			if ((buffer_fill + value_len) > buffer_size)
+			{
+				size_t new_size;
+				char *tmp;
+
+				new_size = (buffer_size > 0) ? (2 * buffer_size)
+					: (values_num * 32);
+				while (new_size < (buffer_fill + value_len))
+					new_size *= 2;
+
+				tmp = realloc (buffer, new_size);
+				if (tmp == NULL)
+				{
+					sfree (buffer);
+					sfree (offsets);
+					return (-1);
+				}
+				buffer = tmp;
+				buffer_size = new_size;
+			}
 
+			memcpy (buffer + buffer_fill, value, value_len);
+			offsets[argc] = buffer_fill;
+			buffer_fill += value_len;
+			argc++;
+		}
+	}
+
+	if (argc == 0)
+	{
+		sfree (buffer);
+		sfree (offsets);
+		return (-1);
+	}
+
+	argv = malloc (argc * sizeof (*argv));
+	if (argv == NULL)
+	{
+		sfree (buffer);
+		sfree (offsets);
+		return (-1);
+	}
+
+	for (i = 0; i < argc; i++)
+		argv[i] = buffer + offsets[i];
+	sfree (offsets);
+
+	*ret_argc = argc;
+	*ret_argv = argv;
+	*ret_buffer = buffer;
 	return (0);
-} /* int value_list_to_string */
+} /* }}} int rrd_chunk_format */
 
 static int value_list_to_filename (char *buffer, int buffer_len,
 		const data_set_t __attribute__((unused)) *ds, const value_list_t *vl)
@@ -284,40 +458,116 @@ static int value_list_to_filename (char *buffer, int buffer_len,
 	return (0);
 } /* int value_list_to_filename */
 
-static void *rrd_queue_thread (void __attribute__((unused)) *data)
+static _Bool rrd_known_file_exists (const char *filename) /* {{{ */
 {
+	_Bool exists = 0;
+
+	pthread_mutex_lock (&known_files_lock);
+	if ((known_files != NULL)
+			&& (c_avl_get (known_files, filename, NULL) == 0))
+		exists = 1;
+	pthread_mutex_unlock (&known_files_lock);
+
+	return (exists);
+} /* }}} _Bool rrd_known_file_exists */
+
+static void rrd_known_file_add (const char *filename) /* {{{ */
+{
+	char *key;
+
+	pthread_mutex_lock (&known_files_lock);
+
+	if ((known_files == NULL)
+			|| (c_avl_get (known_files, filename, NULL) == 0))
+	{
+		pthread_mutex_unlock (&known_files_lock);
+		return;
+	}
+
+	key = strdup (filename);
+	if (key == NULL)
+	{
+		pthread_mutex_unlock (&known_files_lock);
+		return;
+	}
+
+	if (c_avl_insert (known_files, key, NULL) != 0)
+		sfree (key);
+
+	pthread_mutex_unlock (&known_files_lock);
+} /* }}} void rrd_known_file_add */
+
+/* Forget about a file, e.g. because updating it failed. Its existence will be
+ * checked again with the next value. */
+static void rrd_known_file_remove (const char *filename) /* {{{ */
+{
+	char *key = NULL;
+
+	pthread_mutex_lock (&known_files_lock);
+	if (known_files != NULL)
+		c_avl_remove (known_files, filename, (void *) &key, NULL);
+	pthread_mutex_unlock (&known_files_lock);
+
+	sfree (key);
+} /* }}} void rrd_known_file_remove */
+
+static rrd_worker_t *rrd_worker_get (const char *filename) /* {{{ */
+{
+	uint32_t hash;
+
+	if (workers_num == 0)
+		return (NULL);
+
+	hash = fnv1a_hash (filename, strlen (filename));
+	return (workers + (hash % workers_num));
+} /* }}} rrd_worker_t *rrd_worker_get */
+
+static void *rrd_queue_thread (void *data)
+{
+	rrd_worker_t *worker = data;
         struct timeval tv_next_update;
         struct timeval tv_now;
+	double worker_write_rate;
 
         gettimeofday (&tv_next_update, /* timezone = */ NULL);
 
+	/* `WritesPerSecond' is the limit for all workers together. */
+	worker_write_rate = write_rate * ((double) workers_num);
+
 	while (42)
 	{
 		rrd_queue_t *queue_entry;
 		rrd_cache_t *cache_entry;
+		rrd_chunk_t *chunks;
 		char **values;
+		char  *values_buffer;
 		int    values_num;
 		int    status;
-		int    i;
+		cdtime_t update_start;
+		cdtime_t update_time;
 
+		chunks = NULL;
 		values = NULL;
+		values_buffer = NULL;
 		values_num = 0;
 
-                pthread_mutex_lock (&queue_lock);
+                pthread_mutex_lock (&worker->lock);
                 /* Wait for values to arrive */
                 while (42)
                 {
                   struct timespec ts_wait;
 
-                  while ((flushq_head == NULL) && (queue_head == NULL)
+                  while ((worker->flushq_head == NULL)
+                      && (worker->queue_head == NULL)
                       && (do_shutdown == 0))
-                    pthread_cond_wait (&queue_cond, &queue_lock);
+                    pthread_cond_wait (&worker->cond, &worker->lock);
 
-                  if ((flushq_head == NULL) && (queue_head == NULL))
+                  if ((worker->flushq_head == NULL)
+                      && (worker->queue_head == NULL))
                     break;
 
                   /* Don't delay if there's something to flush */
-                  if (flushq_head != NULL)
+                  if (worker->flushq_head != NULL)
                     break;
 
                   /* Don't delay if we're shutting down */
@@ -325,7 +575,7 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                     break;
 
                   /* Don't delay if no delay was configured. */
-                  if (write_rate <= 0.0)
+                  if (worker_write_rate <= 0.0)
                     break;
 
                   gettimeofday (&tv_now, /* timezone = */ NULL);
@@ -340,43 +590,45 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                   ts_wait.tv_sec = tv_next_update.tv_sec;
                   ts_wait.tv_nsec = 1000 * tv_next_update.tv_usec;
 
-                  status = pthread_cond_timedwait (&queue_cond, &queue_lock,
-                      &ts_wait);
+                  status = pthread_cond_timedwait (&worker->cond,
+                      &worker->lock, &ts_wait);
                   if (status == ETIMEDOUT)
                     break;
                 } /* while (42) */
 
-                /* XXX: If you need to lock both, cache_lock and queue_lock, at
-                 * the same time, ALWAYS lock `cache_lock' first! */
+                /* XXX: If you need to lock both, cache_lock and a worker's
+                 * lock, at the same time, ALWAYS lock `cache_lock' first! */
 
                 /* We're in the shutdown phase */
-                if ((flushq_head == NULL) && (queue_head == NULL))
+                if ((worker->flushq_head == NULL)
+                    && (worker->queue_head == NULL))
                 {
-                  pthread_mutex_unlock (&queue_lock);
+                  pthread_mutex_unlock (&worker->lock);
                   break;
                 }
 
-                if (flushq_head != NULL)
+                if (worker->flushq_head != NULL)
                 {
                   /* Dequeue the first flush entry */
-                  queue_entry = flushq_head;
-                  if (flushq_head == flushq_tail)
-                    flushq_head = flushq_tail = NULL;
+                  queue_entry = worker->flushq_head;
+                  if (worker->flushq_head == worker->flushq_tail)
+                    worker->flushq_head = worker->flushq_tail = NULL;
                   else
-                    flushq_head = flushq_head->next;
+                    worker->flushq_head = worker->flushq_head->next;
                 }
-                else /* if (queue_head != NULL) */
+                else /* if (worker->queue_head != NULL) */
                 {
                   /* Dequeue the first regular entry */
-                  queue_entry = queue_head;
-                  if (queue_head == queue_tail)
-                    queue_head = queue_tail = NULL;
+                  queue_entry = worker->queue_head;
+                  if (worker->queue_head == worker->queue_tail)
+                    worker->queue_head = worker->queue_tail = NULL;
                   else
-                    queue_head = queue_head->next;
+                    worker->queue_head = worker->queue_head->next;
                 }
+                worker->queue_length--;
 
 		/* Unlock the queue again */
-		pthread_mutex_unlock (&queue_lock);
+		pthread_mutex_unlock (&worker->lock);
 
 		/* We now need the cache lock so the entry isn't updated while
 		 * we make a copy of it's values */
@@ -387,16 +639,23 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
 
 		if (status == 0)
 		{
-			values = cache_entry->values;
-			values_num = cache_entry->values_num;
+			chunks = cache_entry->chunks_head;
 
-			cache_entry->values = NULL;
+			cache_entry->chunks_head = NULL;
+			cache_entry->chunks_tail = NULL;
 			cache_entry->values_num = 0;
 			cache_entry->flags = FLAG_NONE;
 		}
 
 		pthread_mutex_unlock (&cache_lock);
 
+		/* Format the values now that the cache lock has been
+		 * released. */
+		if (status == 0)
+			status = rrd_chunk_format (chunks, &values_num,
+					&values, &values_buffer);
+		rrd_chunk_free_all (chunks);
+
 		if (status != 0)
 		{
 			sfree (queue_entry->filename);
@@ -405,12 +664,12 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
 		}
 
 		/* Update `tv_next_update' */
-		if (write_rate > 0.0) 
+		if (worker_write_rate > 0.0) 
                 {
                   gettimeofday (&tv_now, /* timezone = */ NULL);
                   tv_next_update.tv_sec = tv_now.tv_sec;
                   tv_next_update.tv_usec = tv_now.tv_usec
-                    + ((suseconds_t) (1000000 * write_rate));
+                    + ((suseconds_t) (1000000 * worker_write_rate));
                   while (tv_next_update.tv_usec > 1000000)
                   {
                     tv_next_update.tv_sec++;
@@ -419,16 +678,25 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
                 }
 
 		/* Write the values to the RRD-file */
-		srrd_update (queue_entry->filename, NULL,
+		update_start = cdtime ();
+		status = srrd_update (queue_entry->filename, NULL,
 				values_num, (const char **)values);
+		update_time = cdtime () - update_start;
 		DEBUG ("rrdtool plugin: queue thread: Wrote %i value%s to %s",
 				values_num, (values_num == 1) ? "" : "s",
 				queue_entry->filename);
 
-		for (i = 0; i < values_num; i++)
-		{
-			sfree (values[i]);
-		}
+		if (status != 0)
+			rrd_known_file_remove (queue_entry->filename);
+
+		pthread_mutex_lock (&worker->lock);
+		worker->updates_num++;
+		if (status != 0)
+			worker->updates_failed++;
+		worker->updates_time += update_time;
+		pthread_mutex_unlock (&worker->lock);
+
+		sfree (values_buffer);
 		sfree (values);
 		sfree (queue_entry->filename);
 		sfree (queue_entry);
@@ -438,11 +706,15 @@ static void *rrd_queue_thread (void __attribute__((unused)) *data)
 	return ((void *) 0);
 } /* void *rrd_queue_thread */
 
-static int rrd_queue_enqueue (const char *filename,
-    rrd_queue_t **head, rrd_queue_t **tail)
+static int rrd_queue_enqueue (const char *filename, _Bool flush)
 {
+  rrd_worker_t *worker;
   rrd_queue_t *queue_entry;
 
+  worker = rrd_worker_get (filename);
+  if (worker == NULL)
+    return (-1);
+
   queue_entry = (rrd_queue_t *) malloc (sizeof (rrd_queue_t));
   if (queue_entry == NULL)
     return (-1);
@@ -456,30 +728,47 @@ static int rrd_queue_enqueue (const char *filename,
 
   queue_entry->next = NULL;
 
-  pthread_mutex_lock (&queue_lock);
+  pthread_mutex_lock (&worker->lock);
 
-  if (*tail == NULL)
-    *head = queue_entry;
+  if (flush)
+  {
+    if (worker->flushq_tail == NULL)
+      worker->flushq_head = queue_entry;
+    else
+      worker->flushq_tail->next = queue_entry;
+    worker->flushq_tail = queue_entry;
+  }
   else
-    (*tail)->next = queue_entry;
-  *tail = queue_entry;
+  {
+    if (worker->queue_tail == NULL)
+      worker->queue_head = queue_entry;
+    else
+      worker->queue_tail->next = queue_entry;
+    worker->queue_tail = queue_entry;
+  }
+  worker->queue_length++;
 
-  pthread_cond_signal (&queue_cond);
-  pthread_mutex_unlock (&queue_lock);
+  pthread_cond_signal (&worker->cond);
+  pthread_mutex_unlock (&worker->lock);
 
   return (0);
 } /* int rrd_queue_enqueue */
 
-static int rrd_queue_dequeue (const char *filename,
-    rrd_queue_t **head, rrd_queue_t **tail)
+/* Removes `filename' from the regular (i.e. non-flush) queue. */
+static int rrd_queue_dequeue (const char *filename)
 {
+  rrd_worker_t *worker;
   rrd_queue_t *this;
   rrd_queue_t *prev;
 
-  pthread_mutex_lock (&queue_lock);
+  worker = rrd_worker_get (filename);
+  if (worker == NULL)
+    return (-1);
+
+  pthread_mutex_lock (&worker->lock);
 
   prev = NULL;
-  this = *head;
+  this = worker->queue_head;
 
   while (this != NULL)
   {
@@ -492,19 +781,20 @@ static int rrd_queue_dequeue (const char *filename,
 
   if (this == NULL)
   {
-    pthread_mutex_unlock (&queue_lock);
+    pthread_mutex_unlock (&worker->lock);
     return (-1);
   }
 
   if (prev == NULL)
-    *head = this->next;
+    worker->queue_head = this->next;
   else
     prev->next = this->next;
 
   if (this->next == NULL)
-    *tail = prev;
+    worker->queue_tail = prev;
+  worker->queue_length--;
 
-  pthread_mutex_unlock (&queue_lock);
+  pthread_mutex_unlock (&worker->lock);
 
   sfree (this->filename);
   sfree (this);
@@ -512,6 +802,45 @@ static int rrd_queue_dequeue (const char *filename,
   return (0);
 } /* int rrd_queue_dequeue */
 
+/* XXX: You must hold "cache_lock" when calling this function! Drops the
+ * values held back while the file was being created, after creating it
+ * failed. */
+static void rrd_cache_drop_pending (const char *filename, /* {{{ */
+		rrd_cache_t *rc)
+{
+	WARNING ("rrdtool plugin: Creating `%s' failed. Dropping %i value%s.",
+			filename, rc->values_num, (rc->values_num == 1) ? "" : "s");
+
+	rrd_chunk_free_all (rc->chunks_head);
+	rc->chunks_head = NULL;
+	rc->chunks_tail = NULL;
+	rc->values_num = 0;
+	rc->file_pending = 0;
+} /* }}} void rrd_cache_drop_pending */
+
+/* XXX: You must hold "cache_lock" when calling this function! Checks whether
+ * the asynchronous creation of the file has finished. Returns true while the
+ * file is still being created. */
+static _Bool rrd_cache_file_pending (const char *filename, /* {{{ */
+		rrd_cache_t *rc)
+{
+	if (!rc->file_pending)
+		return (0);
+
+	if (cu_rrd_create_pending (filename))
+		return (1);
+
+	if (cu_rrd_create_failed (filename))
+	{
+		rrd_cache_drop_pending (filename, rc);
+		return (0);
+	}
+
+	rc->file_pending = 0;
+	rrd_known_file_add (filename);
+	return (0);
+} /* }}} _Bool rrd_cache_file_pending */
+
 /* XXX: You must hold "cache_lock" when calling this function! */
 static void rrd_cache_flush (cdtime_t timeout)
 {
@@ -537,6 +866,9 @@ static void rrd_cache_flush (cdtime_t timeout)
 	{
 		if (rc->flags != FLAG_NONE)
 			continue;
+		/* The file doesn't exist yet. */
+		else if (rrd_cache_file_pending (key, rc))
+			continue;
 		/* timeout == 0  =>  flush everything */
 		else if ((timeout != 0)
 				&& ((now - rc->first_value) < timeout))
@@ -545,7 +877,7 @@ static void rrd_cache_flush (cdtime_t timeout)
 		{
 			int status;
 
-			status = rrd_queue_enqueue (key, &queue_head,  &queue_tail);
+			status = rrd_queue_enqueue (key, /* flush = */ 0);
 			if (status == 0)
 				rc->flags = FLAG_QUEUED;
 		}
@@ -579,7 +911,7 @@ static void rrd_cache_flush (cdtime_t timeout)
 			continue;
 		}
 
-		assert (rc->values == NULL);
+		assert (rc->chunks_head == NULL);
 		assert (rc->values_num == 0);
 
 		sfree (rc);
@@ -629,10 +961,16 @@ static int rrd_cache_flush_identifier (cdtime_t timeout,
   {
     status = 0;
   }
+  else if (rrd_cache_file_pending (key, rc))
+  {
+    DEBUG ("rrdtool plugin: rrd_cache_flush_identifier: "
+        "`%s' is still being created.", key);
+    status = EAGAIN;
+  }
   else if (rc->flags == FLAG_QUEUED)
   {
-    rrd_queue_dequeue (key, &queue_head, &queue_tail);
-    status = rrd_queue_enqueue (key, &flushq_head, &flushq_tail);
+    rrd_queue_dequeue (key);
+    status = rrd_queue_enqueue (key, /* flush = */ 1);
     if (status == 0)
       rc->flags = FLAG_FLUSHQ;
   }
@@ -642,7 +980,7 @@ static int rrd_cache_flush_identifier (cdtime_t timeout,
   }
   else if (rc->values_num > 0)
   {
-    status = rrd_queue_enqueue (key, &flushq_head, &flushq_tail);
+    status = rrd_queue_enqueue (key, /* flush = */ 1);
     if (status == 0)
       rc->flags = FLAG_FLUSHQ;
   }
@@ -685,12 +1023,17 @@ static int64_t rrd_get_random_variation (void)
   return (ret);
 } /* int64_t rrd_get_random_variation */
 
+/* If `file_pending' is true, the file is still being created. The values are
+ * kept in the cache until a value arrives after the file has been created. */
 static int rrd_cache_insert (const char *filename,
-		const char *value, cdtime_t value_time)
+		const data_set_t *ds, const value_list_t *vl,
+		_Bool file_pending)
 {
+	static c_complain_t pending_complaint = C_COMPLAIN_INIT_STATIC;
+
 	rrd_cache_t *rc = NULL;
 	int new_rc = 0;
-	char **values_new;
+	rrd_chunk_t *chunk;
 
 	pthread_mutex_lock (&cache_lock);
 
@@ -709,53 +1052,87 @@ static int rrd_cache_insert (const char *filename,
 	{
 		rc = malloc (sizeof (*rc));
 		if (rc == NULL)
+		{
+			pthread_mutex_unlock (&cache_lock);
 			return (-1);
+		}
 		rc->values_num = 0;
-		rc->values = NULL;
+		rc->chunks_head = NULL;
+		rc->chunks_tail = NULL;
 		rc->first_value = 0;
 		rc->last_value = 0;
 		rc->random_variation = rrd_get_random_variation ();
 		rc->flags = FLAG_NONE;
+		rc->file_pending = file_pending;
 		new_rc = 1;
 	}
 
-	if (rc->last_value >= value_time)
+	if (rc->last_value >= vl->time)
 	{
 		pthread_mutex_unlock (&cache_lock);
 		DEBUG ("rrdtool plugin: (rc->last_value = %"PRIu64") "
 				">= (value_time = %"PRIu64")",
-				rc->last_value, value_time);
+				rc->last_value, vl->time);
 		return (-1);
 	}
 
-	values_new = (char **) realloc ((void *) rc->values,
-			(rc->values_num + 1) * sizeof (char *));
-	if (values_new == NULL)
+	if (file_pending && (rc->values_num >= RRD_PENDING_VALUES_MAX))
 	{
-		char errbuf[1024];
-		void *cache_key = NULL;
-
-		sstrerror (errno, errbuf, sizeof (errbuf));
+		pthread_mutex_unlock (&cache_lock);
+		c_complain (LOG_WARNING, &pending_complaint,
+				"rrdtool plugin: `%s' has not been created yet "
+				"and %i values are held back already. "
+				"Dropping new values.",
+				filename, RRD_PENDING_VALUES_MAX);
+		return (-1);
+	}
 
-		c_avl_remove (cache, filename, &cache_key, NULL);
+	chunk = rc->chunks_tail;
+	if ((chunk != NULL) && (chunk->ds_num != ds->ds_num))
+	{
 		pthread_mutex_unlock (&cache_lock);
+		ERROR ("rrdtool plugin: Number of data sources of `%s' "
+				"changed from %i to %i.", filename,
+				chunk->ds_num, ds->ds_num);
+		return (-1);
+	}
 
-		ERROR ("rrdtool plugin: realloc failed: %s", errbuf);
+	if ((chunk == NULL) || (chunk->values_num >= RRD_CHUNK_SIZE))
+	{
+		chunk = rrd_chunk_create (ds);
+		if (chunk == NULL)
+		{
+			void *cache_key = NULL;
 
-		sfree (cache_key);
-		sfree (rc->values);
-		sfree (rc);
-		return (-1);
+			if (new_rc == 0)
+				c_avl_remove (cache, filename, &cache_key, NULL);
+			pthread_mutex_unlock (&cache_lock);
+
+			ERROR ("rrdtool plugin: malloc failed.");
+
+			sfree (cache_key);
+			rrd_chunk_free_all (rc->chunks_head);
+			sfree (rc);
+			return (-1);
+		}
+
+		if (rc->chunks_tail == NULL)
+			rc->chunks_head = chunk;
+		else
+			rc->chunks_tail->next = chunk;
+		rc->chunks_tail = chunk;
 	}
-	rc->values = values_new;
 
-	rc->values[rc->values_num] = strdup (value);
-	if (rc->values[rc->values_num] != NULL)
-		rc->values_num++;
+	chunk->times[chunk->values_num] = vl->time;
+	memcpy (chunk->values + (chunk->values_num * chunk->ds_num),
+			vl->values, chunk->ds_num * sizeof (value_t));
+	chunk->values_num++;
+	rc->values_num++;
 
 	if (rc->values_num == 1)
-		rc->first_value = value_time;
-	rc->last_value = value_time;
+		rc->first_value = vl->time;
+	rc->last_value = vl->time;
+	rc->file_pending = file_pending;
 
 	/* Insert if this is the first value */
 	if (new_rc == 1)
@@ -771,8 +1148,7 @@ static int rrd_cache_insert (const char *filename,
 
 			ERROR ("rrdtool plugin: strdup failed: %s", errbuf);
 
-			sfree (rc->values[0]);
-			sfree (rc->values);
+			rrd_chunk_free_all (rc->chunks_head);
 			sfree (rc);
 			return (-1);
 		}
@@ -785,15 +1161,21 @@ static int rrd_cache_insert (const char *filename,
 			filename, rc->values_num,
 			CDTIME_T_TO_DOUBLE (rc->last_value - rc->first_value));
 
-	if ((rc->last_value - rc->first_value) >= (cache_timeout + rc->random_variation))
+	if (rc->file_pending)
+	{
+		DEBUG ("rrdtool plugin: `%s' is being created, "
+				"holding back %i value%s.", filename,
+				rc->values_num, (rc->values_num == 1) ? "" : "s");
+	}
+	else if ((rc->last_value - rc->first_value) >= (cache_timeout + rc->random_variation))
 	{
-		/* XXX: If you need to lock both, cache_lock and queue_lock, at
-		 * the same time, ALWAYS lock `cache_lock' first! */
+		/* XXX: If you need to lock both, cache_lock and a worker's
+		 * lock, at the same time, ALWAYS lock `cache_lock' first! */
 		if (rc->flags == FLAG_NONE)
 		{
 			int status;
 
-			status = rrd_queue_enqueue (filename, &queue_head, &queue_tail);
+			status = rrd_queue_enqueue (filename, /* flush = */ 0);
 			if (status == 0)
 				rc->flags = FLAG_QUEUED;
 
@@ -832,7 +1214,6 @@ static int rrd_cache_destroy (void) /* {{{ */
   while (c_avl_pick (cache, &key, &value) == 0)
   {
     rrd_cache_t *rc;
-    int i;
 
     sfree (key);
     key = NULL;
@@ -843,9 +1224,7 @@ static int rrd_cache_destroy (void) /* {{{ */
     if (rc->values_num > 0)
       non_empty++;
 
-    for (i = 0; i < rc->values_num; i++)
-      sfree (rc->values[i]);
-    sfree (rc->values);
+    rrd_chunk_free_all (rc->chunks_head);
     sfree (rc);
   }
 
@@ -885,8 +1264,9 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 {
 	struct stat  statbuf;
 	char         filename[512];
-	char         values[512];
+	_Bool        file_pending = 0;
 	int          status;
+	int          i;
 
 	if (do_shutdown)
 		return (0);
@@ -899,10 +1279,39 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 	if (value_list_to_filename (filename, sizeof (filename), ds, vl) != 0)
 		return (-1);
 
-	if (value_list_to_string (values, sizeof (values), ds, vl) != 0)
-		return (-1);
+	for (i = 0; i < ds->ds_num; i++)
+	{
+		if ((ds->ds[i].type != DS_TYPE_COUNTER)
+				&& (ds->ds[i].type != DS_TYPE_GAUGE)
+				&& (ds->ds[i].type != DS_TYPE_DERIVE)
+				&& (ds->ds[i].type != DS_TYPE_ABSOLUTE))
+			return (-1);
+	}
 
-	if (stat (filename, &statbuf) == -1)
+	if (rrd_known_file_exists (filename))
+	{
+		/* nothing to do */
+	}
+	else if (rrdcreate_config.async && cu_rrd_create_pending (filename))
+	{
+		file_pending = 1;
+	}
+	else if (rrdcreate_config.async && cu_rrd_create_failed (filename))
+	{
+		rrd_cache_t *rc = NULL;
+
+		/* Drop the values held back for the file. Creating it is tried
+		 * again with the next value. */
+		pthread_mutex_lock (&cache_lock);
+		if ((cache != NULL)
+				&& (c_avl_get (cache, filename, (void *) &rc) == 0)
+				&& rc->file_pending)
+			rrd_cache_drop_pending (filename, rc);
+		pthread_mutex_unlock (&cache_lock);
+
+		return (-1);
+	}
+	else if (stat (filename, &statbuf) == -1)
 	{
 		if (errno == ENOENT)
 		{
@@ -910,6 +1319,11 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 					ds, vl, &rrdcreate_config);
 			if (status != 0)
 				return (-1);
+
+			if (rrdcreate_config.async)
+				file_pending = 1;
+			else
+				rrd_known_file_add (filename);
 		}
 		else
 		{
@@ -926,8 +1340,12 @@ static int rrd_write (const data_set_t *ds, const value_list_t *vl,
 				filename);
 		return (-1);
 	}
+	else
+	{
+		rrd_known_file_add (filename);
+	}
 
-	status = rrd_cache_insert (filename, values, vl->time);
+	status = rrd_cache_insert (filename, ds, vl, file_pending);
 
 	return (status);
 } /* int rrd_write */
@@ -1109,6 +1527,46 @@ static int rrd_config (const char *key, const char *value)
 			random_timeout = DOUBLE_TO_CDTIME_T (tmp);
 		}
 	}
+	else if (strcasecmp ("UpdateThreads", key) == 0)
+	{
+		int tmp = atoi (value);
+		if (tmp < 1)
+		{
+			fprintf (stderr, "rrdtool: `UpdateThreads' must "
+					"be at least 1.\n");
+			ERROR ("rrdtool: `UpdateThreads' must "
+					"be at least 1.");
+			return (1);
+		}
+		update_threads = tmp;
+	}
+	else if (strcasecmp ("ReportStats", key) == 0)
+	{
+		if (IS_TRUE (value))
+			report_stats = 1;
+		else
+			report_stats = 0;
+	}
+	else if (strcasecmp ("CreateFilesAsync", key) == 0)
+	{
+		if (IS_TRUE (value))
+			rrdcreate_config.async = 1;
+		else
+			rrdcreate_config.async = 0;
+	}
+	else if (strcasecmp ("CreatesPerSecond", key) == 0)
+	{
+		double tmp = atof (value);
+		if (tmp < 0.0)
+		{
+			fprintf (stderr, "rrdtool: `CreatesPerSecond' must "
+					"be greater than or equal to zero.\n");
+			ERROR ("rrdtool: `CreatesPerSecond' must "
+					"be greater than or equal to zero.");
+			return (1);
+		}
+		rrdcreate_config.creates_per_second = tmp;
+	}
 	else
 	{
 		return (-1);
@@ -1116,39 +1574,135 @@ static int rrd_config (const char *key, const char *value)
 	return (0);
 } /* int rrd_config */
 
+static int rrd_stats_read (void) /* {{{ */
+{
+	value_list_t vl = VALUE_LIST_INIT;
+	value_t values[1];
+	size_t i;
+
+	vl.values = values;
+	vl.values_len = 1;
+	vl.time = 0;
+	vl.interval = interval_g;
+	sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+	sstrncpy (vl.plugin, "rrdtool", sizeof (vl.plugin));
+
+	for (i = 0; i < workers_num; i++)
+	{
+		rrd_worker_t *worker = workers + i;
+		int      copy_queue_length;
+		derive_t copy_updates_num;
+		derive_t copy_updates_failed;
+		cdtime_t copy_updates_time;
+
+		pthread_mutex_lock (&worker->lock);
+		copy_queue_length = worker->queue_length;
+		copy_updates_num = worker->updates_num;
+		copy_updates_failed = worker->updates_failed;
+		copy_updates_time = worker->updates_time;
+		pthread_mutex_unlock (&worker->lock);
+
+		ssnprintf (vl.plugin_instance, sizeof (vl.plugin_instance),
+				"worker%zu", i);
+
+		/* Files waiting to be written */
+		vl.values[0].gauge = (gauge_t) copy_queue_length;
+		sstrncpy (vl.type, "queue_length", sizeof (vl.type));
+		vl.type_instance[0] = 0;
+		plugin_dispatch_values (&vl);
+
+		/* Number of updates and the time spent in them */
+		vl.values[0].derive = copy_updates_num;
+		sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+		sstrncpy (vl.type_instance, "update",
+				sizeof (vl.type_instance));
+		plugin_dispatch_values (&vl);
+
+		vl.values[0].derive = (derive_t) CDTIME_T_TO_MS (copy_updates_time);
+		sstrncpy (vl.type, "total_time_in_ms", sizeof (vl.type));
+		plugin_dispatch_values (&vl);
+
+		vl.values[0].derive = copy_updates_failed;
+		sstrncpy (vl.type, "derive", sizeof (vl.type));
+		sstrncpy (vl.type_instance, "update-failed",
+				sizeof (vl.type_instance));
+		plugin_dispatch_values (&vl);
+	}
+
+	return (0);
+} /* }}} int rrd_stats_read */
+
 static int rrd_shutdown (void)
 {
+	int queue_length = 0;
+	size_t i;
+
+	/* Files still waiting to be created are reported as failed from now on,
+	 * so their values are dropped by the flush below. */
+	if (rrdcreate_config.async)
+		cu_rrd_create_shutdown ();
+
 	pthread_mutex_lock (&cache_lock);
 	rrd_cache_flush (0);
 	pthread_mutex_unlock (&cache_lock);
 
-	pthread_mutex_lock (&queue_lock);
 	do_shutdown = 1;
-	pthread_cond_signal (&queue_cond);
-	pthread_mutex_unlock (&queue_lock);
+	for (i = 0; i < workers_num; i++)
+	{
+		pthread_mutex_lock (&workers[i].lock);
+		queue_length += workers[i].queue_length;
+		pthread_cond_signal (&workers[i].cond);
+		pthread_mutex_unlock (&workers[i].lock);
+	}
 
-	if ((queue_thread_running != 0)
-			&& ((queue_head != NULL) || (flushq_head != NULL)))
+	if ((workers_num > 0) && (queue_length > 0))
 	{
-		INFO ("rrdtool plugin: Shutting down the queue thread. "
+		INFO ("rrdtool plugin: Shutting down the queue threads. "
 				"This may take a while.");
 	}
-	else if (queue_thread_running != 0)
+	else if (workers_num > 0)
 	{
-		INFO ("rrdtool plugin: Shutting down the queue thread.");
+		INFO ("rrdtool plugin: Shutting down the queue threads.");
 	}
 
 	/* Wait for all the values to be written to disk before returning. */
-	if (queue_thread_running != 0)
+	for (i = 0; i < workers_num; i++)
 	{
-		pthread_join (queue_thread, NULL);
-		memset (&queue_thread, 0, sizeof (queue_thread));
-		queue_thread_running = 0;
-		DEBUG ("rrdtool plugin: queue_thread exited.");
+		if (workers[i].thread_running == 0)
+			continue;
+
+		pthread_join (workers[i].thread, NULL);
+		memset (&workers[i].thread, 0, sizeof (workers[i].thread));
+		workers[i].thread_running = 0;
+		DEBUG ("rrdtool plugin: queue thread %zu exited.", i);
 	}
 
 	rrd_cache_destroy ();
 
+	pthread_mutex_lock (&known_files_lock);
+	if (known_files != NULL)
+	{
+		void *key = NULL;
+		void *value = NULL;
+
+		while (c_avl_pick (known_files, &key, &value) == 0)
+			sfree (key);
+		c_avl_destroy (known_files);
+		known_files = NULL;
+	}
+	pthread_mutex_unlock (&known_files_lock);
+
+	/* No more entries can be queued now that the cache is gone. */
+	pthread_mutex_lock (&cache_lock);
+	for (i = 0; i < workers_num; i++)
+	{
+		pthread_mutex_destroy (&workers[i].lock);
+		pthread_cond_destroy (&workers[i].cond);
+	}
+	sfree (workers);
+	workers_num = 0;
+	pthread_mutex_unlock (&cache_lock);
+
 	return (0);
 } /* int rrd_shutdown */
 
@@ -1156,6 +1710,7 @@ static int rrd_init (void)
 {
 	static int init_once = 0;
 	int status;
+	size_t i;
 
 	if (init_once != 0)
 		return (0);
@@ -1175,12 +1730,49 @@ static int rrd_init (void)
 				"smaller than your `interval'. This will "
 				"create needlessly big RRD-files.");
 
-	/* Set the cache up */
+#if !HAVE_THREADSAFE_LIBRRD
+	if (update_threads > 1)
+	{
+		WARNING ("rrdtool plugin: This version of librrd is not "
+				"thread-safe, so updates would be serialized "
+				"anyway. Ignoring \"UpdateThreads %i\".",
+				update_threads);
+		update_threads = 1;
+	}
+#endif
+
+	/* Set the update workers and the cache up */
 	pthread_mutex_lock (&cache_lock);
 
+	workers = calloc ((size_t) update_threads, sizeof (*workers));
+	if (workers == NULL)
+	{
+		pthread_mutex_unlock (&cache_lock);
+		ERROR ("rrdtool plugin: calloc failed.");
+		return (-1);
+	}
+	workers_num = (size_t) update_threads;
+
+	for (i = 0; i < workers_num; i++)
+	{
+		pthread_mutex_init (&workers[i].lock, /* attr = */ NULL);
+		pthread_cond_init (&workers[i].cond, /* attr = */ NULL);
+	}
+
 	cache = c_avl_create ((int (*) (const void *, const void *)) strcmp);
 	if (cache == NULL)
 	{
+		pthread_mutex_unlock (&cache_lock);
+		ERROR ("rrdtool plugin: c_avl_create failed.");
+		return (-1);
+	}
+
+	pthread_mutex_lock (&known_files_lock);
+	known_files = c_avl_create ((int (*) (const void *, const void *)) strcmp);
+	pthread_mutex_unlock (&known_files_lock);
+	if (known_files == NULL)
+	{
+		pthread_mutex_unlock (&cache_lock);
 		ERROR ("rrdtool plugin: c_avl_create failed.");
 		return (-1);
 	}
@@ -1195,14 +1787,20 @@ static int rrd_init (void)
 
 	pthread_mutex_unlock (&cache_lock);
 
-	status = pthread_create (&queue_thread, /* attr = */ NULL,
-			rrd_queue_thread, /* args = */ NULL);
-	if (status != 0)
+	for (i = 0; i < workers_num; i++)
 	{
-		ERROR ("rrdtool plugin: Cannot create queue-thread.");
-		return (-1);
+		status = pthread_create (&workers[i].thread, /* attr = */ NULL,
+				rrd_queue_thread, /* args = */ workers + i);
+		if (status != 0)
+		{
+			ERROR ("rrdtool plugin: Cannot create queue-thread.");
+			return (-1);
+		}
+		workers[i].thread_running = 1;
 	}
-	queue_thread_running = 1;
+
+	if (report_stats)
+		plugin_register_read ("rrdtool", rrd_stats_read);
 
 	DEBUG ("rrdtool plugin: rrd_init: datadir = %s; stepsize = %lu;"
 			" heartbeat = %i; rrarows = %i; xff = %lf;",
@@ -636,7 +636,7 @@ static int csnmp_config_add_host (oconfig_item_t *ci)
 
   CDTIME_T_TO_TIMESPEC (hd->interval, &cb_interval);
 
-  status = plugin_register_complex_read (/* group = */ NULL, cb_name,
+  status = plugin_register_complex_read (/* group = */ "snmp", cb_name,
       csnmp_read_host, /* interval = */ &cb_interval,
       /* user_data = */ &cb_data);
   if (status != 0)
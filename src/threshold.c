@@ -59,116 +59,362 @@ typedef struct threshold_s
 } threshold_t;
 /* }}} */
 
+/* Configured thresholds are stored in a tree with one level per identifier
+ * field: host, plugin, plugin instance, type and type instance. Thresholds
+ * that do not restrict a field are stored below the `any' child of that
+ * level. The list of thresholds is attached to the type instance level. */
+#define UT_LEVELS_NUM 5
+typedef struct ut_node_s
+{
+  c_avl_tree_t *children;
+  struct ut_node_s *any;
+  threshold_t *th;
+} ut_node_t;
+
+/* The results of threshold_search, including misses, are remembered per
+ * identifier. Entries are removed when the value goes missing. */
+#define UT_CACHE_BUCKETS_INIT 256
+typedef struct ut_cache_entry_s
+{
+  uint32_t hash;
+  threshold_t *th;
+  size_t key_len;
+  char *key;
+  struct ut_cache_entry_s *next;
+} ut_cache_entry_t;
+/* }}} */
+
 /*
  * Private (static) variables
  * {{{ */
-static c_avl_tree_t   *threshold_tree = NULL;
+static ut_node_t      *threshold_root = NULL;
+static size_t          threshold_num = 0;
 static pthread_mutex_t threshold_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ut_cache_entry_t **threshold_cache = NULL;
+static size_t             threshold_cache_buckets = 0;
+static size_t             threshold_cache_size = 0;
 /* }}} */
 
 /*
  * Threshold management
  * ====================
  * The following functions add, delete, search, etc. configured thresholds to
- * the underlying AVL trees.
+ * the underlying tree.
  */
+static ut_node_t *ut_node_create (void)
+{ /* {{{ */
+  ut_node_t *node;
+
+  node = calloc (1, sizeof (*node));
+  if (node == NULL)
+    ERROR ("ut_node_create: calloc failed.");
+
+  return (node);
+} /* }}} ut_node_t *ut_node_create */
+
 /*
- * threshold_t *threshold_get
+ * ut_node_t *ut_node_child
  *
- * Retrieve one specific threshold configuration. For looking up a threshold
- * matching a value_list_t, see "threshold_search" below. Returns NULL if the
- * specified threshold doesn't exist.
+ * Returns the child of `node' for `name', creating it if `create' is true.
+ * An empty name refers to the `any' child.
  */
-static threshold_t *threshold_get (const char *hostname,
-    const char *plugin, const char *plugin_instance,
-    const char *type, const char *type_instance)
+static ut_node_t *ut_node_child (ut_node_t *node, const char *name,
+    _Bool create)
 { /* {{{ */
-  char name[6 * DATA_MAX_NAME_LEN];
-  threshold_t *th = NULL;
+  ut_node_t *child = NULL;
+  char *name_copy;
 
-  format_name (name, sizeof (name),
-      (hostname == NULL) ? "" : hostname,
-      (plugin == NULL) ? "" : plugin, plugin_instance,
-      (type == NULL) ? "" : type, type_instance);
-  name[sizeof (name) - 1] = '\0';
+  if (name[0] == 0)
+  {
+    if ((node->any == NULL) && create)
+      node->any = ut_node_create ();
+    return (node->any);
+  }
 
-  if (c_avl_get (threshold_tree, name, (void *) &th) == 0)
-    return (th);
-  else
+  if ((node->children != NULL)
+      && (c_avl_get (node->children, name, (void *) &child) == 0))
+    return (child);
+
+  if (!create)
     return (NULL);
-} /* }}} threshold_t *threshold_get */
+
+  if (node->children == NULL)
+  {
+    node->children = c_avl_create ((void *) strcmp);
+    if (node->children == NULL)
+    {
+      ERROR ("ut_node_child: c_avl_create failed.");
+      return (NULL);
+    }
+  }
+
+  name_copy = strdup (name);
+  child = ut_node_create ();
+  if ((name_copy == NULL) || (child == NULL))
+  {
+    sfree (name_copy);
+    sfree (child);
+    return (NULL);
+  }
+
+  if (c_avl_insert (node->children, name_copy, child) != 0)
+  {
+    ERROR ("ut_node_child: c_avl_insert (%s) failed.", name);
+    sfree (name_copy);
+    sfree (child);
+    return (NULL);
+  }
+
+  return (child);
+} /* }}} ut_node_t *ut_node_child */
 
 /*
- * int ut_threshold_add
+ * threshold_t *ut_node_search
  *
- * Adds a threshold configuration to the list of thresholds. The threshold_t
- * structure is copied and may be destroyed after this call. Returns zero on
- * success, non-zero otherwise.
+ * Walks the tree depth first, preferring exact matches over `any' children.
+ * This results in the same precedence as checking the most specific
+ * configuration first: host before plugin before plugin instance before type
+ * instance.
  */
-static int ut_threshold_add (const threshold_t *th)
+static threshold_t *ut_node_search (const ut_node_t *node,
+    const char * const *names, int level)
 { /* {{{ */
-  char name[6 * DATA_MAX_NAME_LEN];
-  char *name_copy;
-  threshold_t *th_copy;
-  threshold_t *th_ptr;
-  int status = 0;
+  ut_node_t *child = NULL;
+  threshold_t *th;
 
-  if (format_name (name, sizeof (name), th->host,
-	th->plugin, th->plugin_instance,
-	th->type, th->type_instance) != 0)
+  if (level >= UT_LEVELS_NUM)
+    return (node->th);
+
+  if ((node->children != NULL) && (names[level][0] != 0)
+      && (c_avl_get (node->children, names[level], (void *) &child) == 0))
   {
-    ERROR ("ut_threshold_add: format_name failed.");
-    return (-1);
+    th = ut_node_search (child, names, level + 1);
+    if (th != NULL)
+      return (th);
   }
 
-  name_copy = strdup (name);
-  if (name_copy == NULL)
+  if (node->any != NULL)
+    return (ut_node_search (node->any, names, level + 1));
+
+  return (NULL);
+} /* }}} threshold_t *ut_node_search */
+
+/*
+ * Search cache
+ * ============
+ * Maps the identifier of a value list to the result of ut_node_search. The
+ * key consists of the identifier's fields separated by null bytes. All
+ * functions expect `threshold_lock' to be held.
+ */
+static size_t ut_cache_key (char *buffer, size_t buffer_size,
+    const value_list_t *vl, uint32_t *ret_hash)
+{ /* {{{ */
+  const char *fields[UT_LEVELS_NUM] = { vl->host, vl->plugin,
+    vl->plugin_instance, vl->type, vl->type_instance };
+  size_t len = 0;
+  size_t i;
+
+  for (i = 0; i < UT_LEVELS_NUM; i++)
+  {
+    size_t field_len = strlen (fields[i]);
+
+    assert ((len + field_len + 1) <= buffer_size);
+    memcpy (buffer + len, fields[i], field_len);
+    len += field_len;
+    buffer[len] = 0;
+    len++;
+  }
+
+  *ret_hash = fnv1a_hash (buffer, len);
+  return (len);
+} /* }}} size_t ut_cache_key */
+
+static ut_cache_entry_t **ut_cache_find (const char *key, size_t key_len,
+    uint32_t hash)
+{ /* {{{ */
+  ut_cache_entry_t **ce_ptr;
+
+  if (threshold_cache == NULL)
+    return (NULL);
+
+  ce_ptr = threshold_cache + (hash & (threshold_cache_buckets - 1));
+  while (*ce_ptr != NULL)
+  {
+    ut_cache_entry_t *ce = *ce_ptr;
+
+    if ((ce->hash == hash) && (ce->key_len == key_len)
+        && (memcmp (ce->key, key, key_len) == 0))
+      return (ce_ptr);
+
+    ce_ptr = &ce->next;
+  }
+
+  return (NULL);
+} /* }}} ut_cache_entry_t **ut_cache_find */
+
+static int ut_cache_grow (void)
+{ /* {{{ */
+  ut_cache_entry_t **buckets;
+  size_t buckets_num;
+  size_t i;
+
+  buckets_num = (threshold_cache_buckets == 0)
+    ? UT_CACHE_BUCKETS_INIT : 2 * threshold_cache_buckets;
+  buckets = calloc (buckets_num, sizeof (*buckets));
+  if (buckets == NULL)
   {
-    ERROR ("ut_threshold_add: strdup failed.");
+    ERROR ("ut_cache_grow: calloc failed.");
     return (-1);
   }
 
+  for (i = 0; i < threshold_cache_buckets; i++)
+  {
+    while (threshold_cache[i] != NULL)
+    {
+      ut_cache_entry_t *ce = threshold_cache[i];
+      size_t index = ce->hash & (buckets_num - 1);
+
+      threshold_cache[i] = ce->next;
+      ce->next = buckets[index];
+      buckets[index] = ce;
+    }
+  }
+
+  sfree (threshold_cache);
+  threshold_cache = buckets;
+  threshold_cache_buckets = buckets_num;
+
+  return (0);
+} /* }}} int ut_cache_grow */
+
+static void ut_cache_insert (const char *key, size_t key_len, uint32_t hash,
+    threshold_t *th)
+{ /* {{{ */
+  ut_cache_entry_t *ce;
+  size_t index;
+
+  if ((threshold_cache_size >= threshold_cache_buckets)
+      && (ut_cache_grow () != 0)
+      && (threshold_cache == NULL))
+    return;
+
+  /* The entry and the key share one allocation. */
+  ce = malloc (sizeof (*ce) + key_len);
+  if (ce == NULL)
+  {
+    ERROR ("ut_cache_insert: malloc failed.");
+    return;
+  }
+  ce->hash = hash;
+  ce->th = th;
+  ce->key_len = key_len;
+  ce->key = (char *) (ce + 1);
+  memcpy (ce->key, key, key_len);
+
+  index = hash & (threshold_cache_buckets - 1);
+  ce->next = threshold_cache[index];
+  threshold_cache[index] = ce;
+  threshold_cache_size++;
+} /* }}} void ut_cache_insert */
+
+static void ut_cache_remove (const value_list_t *vl)
+{ /* {{{ */
+  char key[UT_LEVELS_NUM * DATA_MAX_NAME_LEN];
+  size_t key_len;
+  uint32_t hash;
+  ut_cache_entry_t **ce_ptr;
+  ut_cache_entry_t *ce;
+
+  key_len = ut_cache_key (key, sizeof (key), vl, &hash);
+  ce_ptr = ut_cache_find (key, key_len, hash);
+  if (ce_ptr == NULL)
+    return;
+
+  ce = *ce_ptr;
+  *ce_ptr = ce->next;
+  sfree (ce);
+  threshold_cache_size--;
+} /* }}} void ut_cache_remove */
+
+static void ut_cache_clear (void)
+{ /* {{{ */
+  size_t i;
+
+  for (i = 0; i < threshold_cache_buckets; i++)
+  {
+    while (threshold_cache[i] != NULL)
+    {
+      ut_cache_entry_t *ce = threshold_cache[i];
+      threshold_cache[i] = ce->next;
+      sfree (ce);
+    }
+  }
+
+  threshold_cache_size = 0;
+} /* }}} void ut_cache_clear */
+
+/*
+ * int ut_threshold_add
+ *
+ * Adds a threshold configuration to the list of thresholds. The threshold_t
+ * structure is copied and may be destroyed after this call. Returns zero on
+ * success, non-zero otherwise.
+ */
+static int ut_threshold_add (const threshold_t *th)
+{ /* {{{ */
+  const char *names[UT_LEVELS_NUM] = { th->host, th->plugin,
+    th->plugin_instance, th->type, th->type_instance };
+  threshold_t *th_copy;
+  threshold_t *th_ptr;
+  ut_node_t *node;
+  int i;
+
   th_copy = (threshold_t *) malloc (sizeof (threshold_t));
   if (th_copy == NULL)
   {
-    sfree (name_copy);
     ERROR ("ut_threshold_add: malloc failed.");
     return (-1);
   }
   memcpy (th_copy, th, sizeof (threshold_t));
-  th_ptr = NULL;
+  th_copy->next = NULL;
 
-  DEBUG ("ut_threshold_add: Adding entry `%s'", name);
+  DEBUG ("ut_threshold_add: Adding entry `%s/%s-%s/%s-%s'", th->host,
+      th->plugin, th->plugin_instance, th->type, th->type_instance);
 
   pthread_mutex_lock (&threshold_lock);
 
-  th_ptr = threshold_get (th->host, th->plugin, th->plugin_instance,
-      th->type, th->type_instance);
+  if (threshold_root == NULL)
+    threshold_root = ut_node_create ();
+
+  node = threshold_root;
+  for (i = 0; (i < UT_LEVELS_NUM) && (node != NULL); i++)
+    node = ut_node_child (node, names[i], /* create = */ 1);
+
+  if (node == NULL)
+  {
+    pthread_mutex_unlock (&threshold_lock);
+    ERROR ("ut_threshold_add: Adding the threshold to the tree failed.");
+    sfree (th_copy);
+    return (-1);
+  }
 
+  th_ptr = node->th;
   while ((th_ptr != NULL) && (th_ptr->next != NULL))
     th_ptr = th_ptr->next;
 
   if (th_ptr == NULL) /* no such threshold yet */
-  {
-    status = c_avl_insert (threshold_tree, name_copy, th_copy);
-  }
+    node->th = th_copy;
   else /* th_ptr points to the last threshold in the list */
-  {
     th_ptr->next = th_copy;
-    /* name_copy isn't needed */
-    sfree (name_copy);
-  }
+  threshold_num++;
 
-  pthread_mutex_unlock (&threshold_lock);
+  /* Cached results may be outdated now. */
+  ut_cache_clear ();
 
-  if (status != 0)
-  {
-    ERROR ("ut_threshold_add: c_avl_insert (%s) failed.", name);
-    sfree (name_copy);
-    sfree (th_copy);
-  }
+  pthread_mutex_unlock (&threshold_lock);
 
-  return (status);
+  return (0);
 } /* }}} int ut_threshold_add */
 
 /* 
@@ -176,51 +422,32 @@ static int ut_threshold_add (const threshold_t *th)
  *
  * Searches for a threshold configuration using all the possible variations of
  * "Host", "Plugin" and "Type" blocks. Returns NULL if no threshold could be
- * found.
- * XXX: This is likely the least efficient function in collectd.
+ * found. The result is cached, so that subsequent searches for the same
+ * identifier, whether successful or not, need one hash lookup only. The
+ * caller must hold `threshold_lock'.
  */
 static threshold_t *threshold_search (const value_list_t *vl)
 { /* {{{ */
+  const char *names[UT_LEVELS_NUM] = { vl->host, vl->plugin,
+    vl->plugin_instance, vl->type, vl->type_instance };
+  char key[UT_LEVELS_NUM * DATA_MAX_NAME_LEN];
+  size_t key_len;
+  uint32_t hash;
+  ut_cache_entry_t **ce_ptr;
   threshold_t *th;
 
-  if ((th = threshold_get (vl->host, vl->plugin, vl->plugin_instance,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, vl->plugin, vl->plugin_instance,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, vl->plugin, NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, vl->plugin, NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, "", NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get (vl->host, "", NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, vl->plugin_instance,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, vl->plugin_instance,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", vl->plugin, NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", "", NULL,
-	  vl->type, vl->type_instance)) != NULL)
-    return (th);
-  else if ((th = threshold_get ("", "", NULL,
-	  vl->type, NULL)) != NULL)
-    return (th);
+  if (threshold_root == NULL)
+    return (NULL);
 
-  return (NULL);
+  key_len = ut_cache_key (key, sizeof (key), vl, &hash);
+  ce_ptr = ut_cache_find (key, key_len, hash);
+  if (ce_ptr != NULL)
+    return ((*ce_ptr)->th);
+
+  th = ut_node_search (threshold_root, names, /* level = */ 0);
+  ut_cache_insert (key, key_len, hash, th);
+
+  return (th);
 } /* }}} threshold_t *threshold_search */
 
 /*
@@ -877,11 +1104,11 @@ static int ut_check_threshold (const data_set_t *ds, const value_list_t *vl,
   threshold_t *worst_th = NULL;
   int worst_ds_index = -1;
 
-  if (threshold_tree == NULL)
+  if (threshold_num == 0)
     return (0);
 
-  /* Is this lock really necessary? So far, thresholds are only inserted at
-   * startup. -octo */
+  /* Thresholds are only inserted at startup, but the search cache is updated
+   * by every search. */
   pthread_mutex_lock (&threshold_lock);
   th = threshold_search (vl);
   pthread_mutex_unlock (&threshold_lock);
@@ -944,10 +1171,15 @@ static int ut_missing (const value_list_t *vl,
   notification_t n;
 
   /* dispatch notifications for "interesting" values only */
-  if (threshold_tree == NULL)
+  if (threshold_num == 0)
     return (0);
 
+  /* The value is about to be removed from the cache, so don't keep the search
+   * result around either. */
+  pthread_mutex_lock (&threshold_lock);
   th = threshold_search (vl);
+  ut_cache_remove (vl);
+  pthread_mutex_unlock (&threshold_lock);
   if (th == NULL)
     return (0);
 
@@ -971,16 +1203,6 @@ int ut_config (oconfig_item_t *ci)
 
   threshold_t th;
 
-  if (threshold_tree == NULL)
-  {
-    threshold_tree = c_avl_create ((void *) strcmp);
-    if (threshold_tree == NULL)
-    {
-      ERROR ("ut_config: c_avl_create failed.");
-      return (-1);
-    }
-  }
-
   memset (&th, '\0', sizeof (th));
   th.warning_min = NAN;
   th.warning_max = NAN;
@@ -1012,7 +1234,7 @@ int ut_config (oconfig_item_t *ci)
       break;
   }
 
-  if (c_avl_size (threshold_tree) > 0) {
+  if (threshold_num > 0) {
     plugin_register_missing ("threshold", ut_missing,
         /* user data = */ NULL);
     plugin_register_write ("threshold", ut_check_threshold,
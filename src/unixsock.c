@@ -37,6 +37,10 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 
+#if HAVE_POLL_H
+# include <poll.h>
+#endif
+
 #include <grp.h>
 
 #ifndef UNIX_PATH_MAX
@@ -45,6 +49,31 @@
 
 #define US_DEFAULT_PATH LOCALSTATEDIR"/run/"PACKAGE_NAME"-unixsock"
 
+/* Longest accepted command line. The input buffer of a connection starts
+ * small and only grows while a single line does not fit. */
+#define US_LINE_MAX    (NOTIF_MAX_MSG_LEN + 1024)
+#define US_BUFFER_INIT 4096
+
+/* Seconds a worker waits for a client to accept its replies. */
+#define US_WRITE_TIMEOUT 10
+
+#define US_STATE_IDLE   0 /* polled by the server thread */
+#define US_STATE_QUEUED 1 /* waiting for or handled by a worker */
+#define US_STATE_CLOSED 2 /* closed by a worker, to be freed */
+
+struct us_client_s
+{
+	int   fd;
+	FILE *fhout;
+	char  *buffer;
+	size_t buffer_size;
+	size_t buffer_fill;
+	_Bool  eof;
+	int    state;
+	struct us_client_s *next;
+};
+typedef struct us_client_s us_client_t;
+
 /*
  * Private variables
  */
@@ -54,7 +83,8 @@ static const char *config_keys[] =
 	"SocketFile",
 	"SocketGroup",
 	"SocketPerms",
-	"DeleteSocket"
+	"DeleteSocket",
+	"WorkerThreads"
 };
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
 
@@ -69,6 +99,22 @@ static _Bool delete_socket = 0;
 
 static pthread_t listen_thread = (pthread_t) 0;
 
+/* The server thread polls the listening socket and all idle connections and
+ * hands connections with complete lines to a small pool of workers. */
+static int        worker_threads_num = 5;
+static pthread_t *worker_threads     = NULL;
+static int        worker_threads_running = 0;
+
+static us_client_t **clients     = NULL; /* owned by the server thread */
+static size_t        clients_num = 0;
+static us_client_t  *client_queue_head = NULL;
+static us_client_t  *client_queue_tail = NULL;
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  client_cond = PTHREAD_COND_INITIALIZER;
+
+/* Workers and us_shutdown wake up the server thread through this pipe. */
+static int wakeup_pipe[2] = { -1, -1 };
+
 /*
  * Functions
  */
@@ -135,6 +181,19 @@ static int us_open_socket (void)
 		return (-1);
 	}
 
+	/* The server thread accepts all pending connections after poll(2)
+	 * returned, so accept(2) must not block. */
+	status = fcntl (sock_fd, F_GETFL);
+	if ((status == -1) || (fcntl (sock_fd, F_SETFL, status | O_NONBLOCK) != 0))
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: fcntl failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (sock_fd);
+		sock_fd = -1;
+		return (-1);
+	}
+
 	do
 	{
 		char *grpname;
@@ -174,157 +233,436 @@ static int us_open_socket (void)
 	return (0);
 } /* int us_open_socket */
 
-static void *us_handle_client (void *arg)
+/* Writes the reply to a single command to "fhout". Returns non-zero if the
+ * connection should be closed. */
+static int us_handle_command (FILE *fhout, char *buffer)
 {
-	int fdin;
-	int fdout;
-	FILE *fhin, *fhout;
+	char buffer_copy[US_LINE_MAX];
+	char *fields[128];
+	int   fields_num;
 
-	fdin = *((int *) arg);
-	free (arg);
-	arg = NULL;
+	sstrncpy (buffer_copy, buffer, sizeof (buffer_copy));
 
-	DEBUG ("unixsock plugin: us_handle_client: Reading from fd #%i", fdin);
+	fields_num = strsplit (buffer_copy, fields,
+			sizeof (fields) / sizeof (fields[0]));
+	if (fields_num < 1)
+	{
+		fprintf (fhout, "-1 Internal error\n");
+		return (-1);
+	}
 
-	fdout = dup (fdin);
-	if (fdout < 0)
+	if (strcasecmp (fields[0], "getval") == 0)
 	{
-		char errbuf[1024];
-		ERROR ("unixsock plugin: dup failed: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		close (fdin);
-		pthread_exit ((void *) 1);
+		handle_getval (fhout, buffer);
+	}
+	else if (strcasecmp (fields[0], "putval") == 0)
+	{
+		handle_putval (fhout, buffer);
+	}
+	else if (strcasecmp (fields[0], "listval") == 0)
+	{
+		handle_listval (fhout, buffer);
 	}
+	else if (strcasecmp (fields[0], "putnotif") == 0)
+	{
+		handle_putnotif (fhout, buffer);
+	}
+	else if (strcasecmp (fields[0], "flush") == 0)
+	{
+		handle_flush (fhout, buffer);
+	}
+	else
+	{
+		if (fprintf (fhout, "-1 Unknown command: %s\n", fields[0]) < 0)
+		{
+			char errbuf[1024];
+			WARNING ("unixsock plugin: failed to write to socket #%i: %s",
+					fileno (fhout),
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+			return (-1);
+		}
+	}
+
+	return (0);
+} /* int us_handle_command */
+
+static void us_client_close (us_client_t *client)
+{
+	DEBUG ("unixsock plugin: Closing connection on fd #%i", client->fd);
 
-	fhin  = fdopen (fdin, "r");
-	if (fhin == NULL)
+	if (client->fhout != NULL)
 	{
-		char errbuf[1024];
-		ERROR ("unixsock plugin: fdopen failed: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		close (fdin);
-		close (fdout);
-		pthread_exit ((void *) 1);
+		fclose (client->fhout); /* this closes the dup'ed fd */
+		client->fhout = NULL;
+	}
+	if (client->fd >= 0)
+	{
+		close (client->fd);
+		client->fd = -1;
+	}
+} /* void us_client_close */
+
+static void us_client_free (us_client_t *client)
+{
+	if (client == NULL)
+		return;
+
+	sfree (client->buffer);
+	sfree (client);
+} /* void us_client_free */
+
+/* Executes all complete lines in the client's buffer, i.e. all commands a
+ * client has pipelined so far, and sends the replies with a single flush.
+ * Returns non-zero if the connection should be closed. */
+static int us_client_process (us_client_t *client)
+{
+	char *line;
+	size_t offset;
+	int status = 0;
+
+	offset = 0;
+	while (offset < client->buffer_fill)
+	{
+		char *end;
+		size_t len;
+
+		line = client->buffer + offset;
+		end = memchr (line, '\n', client->buffer_fill - offset);
+		if (end == NULL)
+		{
+			/* Treat the remainder as the last command once the client
+			 * closed its end, like fgets did. */
+			if (!client->eof)
+				break;
+			end = client->buffer + client->buffer_fill;
+		}
+
+		len = (size_t) (end - line);
+		offset += len + 1;
+		if (offset > client->buffer_fill)
+			offset = client->buffer_fill;
+
+		if (len >= US_LINE_MAX)
+		{
+			fprintf (client->fhout, "-1 Line too long\n");
+			status = -1;
+			break;
+		}
+
+		*end = 0;
+		while ((len > 0) && (line[len - 1] == '\r'))
+			line[--len] = 0;
+
+		if (len == 0)
+			continue;
+
+		status = us_handle_command (client->fhout, line);
+		if (status != 0)
+			break;
 	}
 
-	fhout = fdopen (fdout, "w");
-	if (fhout == NULL)
+	if (fflush (client->fhout) != 0)
 	{
 		char errbuf[1024];
-		ERROR ("unixsock plugin: fdopen failed: %s",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (fhin); /* this closes fdin as well */
-		close (fdout);
-		pthread_exit ((void *) 1);
+		WARNING ("unixsock plugin: failed to write to socket #%i: %s",
+				client->fd, sstrerror (errno, errbuf, sizeof (errbuf)));
+		status = -1;
+	}
+
+	if (status != 0)
+		return (status);
+
+	/* Keep an incomplete line for the next read. */
+	memmove (client->buffer, client->buffer + offset,
+			client->buffer_fill - offset);
+	client->buffer_fill -= offset;
+
+	if (client->buffer_fill >= US_LINE_MAX)
+	{
+		fprintf (client->fhout, "-1 Line too long\n");
+		fflush (client->fhout);
+		return (-1);
 	}
 
-	/* change output buffer to line buffered mode */
-	if (setvbuf (fhout, NULL, _IOLBF, 0) != 0)
+	if (client->eof)
+		return (-1);
+
+	return (0);
+} /* int us_client_process */
+
+static void us_wakeup_server (void)
+{
+	char c = 0;
+
+	/* The pipe is non-blocking; if it is full, the server is awake anyway. */
+	if ((write (wakeup_pipe[1], &c, 1) < 0) && (errno != EAGAIN))
 	{
 		char errbuf[1024];
-		ERROR ("unixsock plugin: setvbuf failed: %s",
+		WARNING ("unixsock plugin: write to the wakeup pipe failed: %s",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
-		fclose (fhin);
-		fclose (fhout);
-		pthread_exit ((void *) 1);
 	}
+} /* void us_wakeup_server */
 
+static void *us_worker_thread (void __attribute__((unused)) *arg)
+{
+	pthread_mutex_lock (&client_lock);
 	while (42)
 	{
-		char buffer[NOTIF_MAX_MSG_LEN + 1024];
-		char buffer_copy[NOTIF_MAX_MSG_LEN + 1024];
-		char *fields[128];
-		int   fields_num;
-		int   len;
+		us_client_t *client;
+		int status;
 
-		errno = 0;
-		if (fgets (buffer, sizeof (buffer), fhin) == NULL)
-		{
-			if (errno != 0)
-			{
-				char errbuf[1024];
-				WARNING ("unixsock plugin: failed to read from socket #%i: %s",
-						fileno (fhin),
-						sstrerror (errno, errbuf, sizeof (errbuf)));
-			}
+		while ((loop != 0) && (client_queue_head == NULL))
+			pthread_cond_wait (&client_cond, &client_lock);
+
+		if (client_queue_head == NULL)
 			break;
-		}
 
-		len = strlen (buffer);
-		while ((len > 0)
-				&& ((buffer[len - 1] == '\n') || (buffer[len - 1] == '\r')))
-			buffer[--len] = '\0';
+		client = client_queue_head;
+		client_queue_head = client->next;
+		if (client_queue_head == NULL)
+			client_queue_tail = NULL;
+		client->next = NULL;
+		pthread_mutex_unlock (&client_lock);
 
-		if (len == 0)
-			continue;
+		status = us_client_process (client);
+		if (status != 0)
+			us_client_close (client);
 
-		sstrncpy (buffer_copy, buffer, sizeof (buffer_copy));
+		pthread_mutex_lock (&client_lock);
+		client->state = (status != 0) ? US_STATE_CLOSED : US_STATE_IDLE;
+		us_wakeup_server ();
+	} /* while (42) */
+	pthread_mutex_unlock (&client_lock);
 
-		fields_num = strsplit (buffer_copy, fields,
-				sizeof (fields) / sizeof (fields[0]));
-		if (fields_num < 1)
-		{
-			fprintf (fhout, "-1 Internal error\n");
-			fclose (fhin);
-			fclose (fhout);
-			pthread_exit ((void *) 1);
-		}
+	return ((void *) 0);
+} /* void *us_worker_thread */
 
-		if (strcasecmp (fields[0], "getval") == 0)
-		{
-			handle_getval (fhout, buffer);
-		}
-		else if (strcasecmp (fields[0], "putval") == 0)
-		{
-			handle_putval (fhout, buffer);
-		}
-		else if (strcasecmp (fields[0], "listval") == 0)
-		{
-			handle_listval (fhout, buffer);
-		}
-		else if (strcasecmp (fields[0], "putnotif") == 0)
-		{
-			handle_putnotif (fhout, buffer);
-		}
-		else if (strcasecmp (fields[0], "flush") == 0)
-		{
-			handle_flush (fhout, buffer);
-		}
-		else
+/* XXX: You must hold "client_lock" when calling this function! */
+static void us_client_enqueue (us_client_t *client)
+{
+	client->state = US_STATE_QUEUED;
+	client->next = NULL;
+
+	if (client_queue_tail == NULL)
+		client_queue_head = client;
+	else
+		client_queue_tail->next = client;
+	client_queue_tail = client;
+
+	pthread_cond_signal (&client_cond);
+} /* void us_client_enqueue */
+
+/* Reads whatever is available without blocking. Returns non-zero if the
+ * client has complete lines to process or closed the connection. */
+static int us_client_read (us_client_t *client)
+{
+	ssize_t status;
+
+	/* Keep one byte for the terminating null byte. */
+	if ((client->buffer_fill + 1) >= client->buffer_size)
+	{
+		size_t new_size = 2 * client->buffer_size;
+		char *tmp;
+
+		if (client->buffer_size > US_LINE_MAX)
+			return (1);
+		if (new_size > (US_LINE_MAX + 2))
+			new_size = US_LINE_MAX + 2;
+
+		tmp = realloc (client->buffer, new_size);
+		if (tmp == NULL)
 		{
-			if (fprintf (fhout, "-1 Unknown command: %s\n", fields[0]) < 0)
-			{
-				char errbuf[1024];
-				WARNING ("unixsock plugin: failed to write to socket #%i: %s",
-						fileno (fhout),
-						sstrerror (errno, errbuf, sizeof (errbuf)));
-				break;
-			}
+			ERROR ("unixsock plugin: realloc failed.");
+			client->eof = 1;
+			return (1);
 		}
-	} /* while (fgets) */
+		client->buffer = tmp;
+		client->buffer_size = new_size;
+	}
 
-	DEBUG ("unixsock plugin: us_handle_client: Exiting..");
-	fclose (fhin);
-	fclose (fhout);
+	status = recv (client->fd, client->buffer + client->buffer_fill,
+			client->buffer_size - client->buffer_fill - 1, MSG_DONTWAIT);
+	if (status < 0)
+	{
+		char errbuf[1024];
 
-	pthread_exit ((void *) 0);
-	return ((void *) 0);
-} /* void *us_handle_client */
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return (0);
+
+		WARNING ("unixsock plugin: failed to read from socket #%i: %s",
+				client->fd, sstrerror (errno, errbuf, sizeof (errbuf)));
+		client->eof = 1;
+		return (1);
+	}
+	else if (status == 0)
+	{
+		client->eof = 1;
+		return (1);
+	}
+
+	client->buffer_fill += (size_t) status;
+
+	if (memchr (client->buffer + client->buffer_fill - status, '\n',
+				(size_t) status) != NULL)
+		return (1);
+
+	/* A line longer than the buffer is handled by the worker, too. */
+	if (client->buffer_fill >= US_LINE_MAX)
+		return (1);
+
+	return (0);
+} /* int us_client_read */
+
+static int us_client_add (int fd)
+{
+	us_client_t *client;
+	us_client_t **tmp;
+	struct timeval tv;
+	int flags;
+	int fdout;
+
+	/* Accepted sockets inherit O_NONBLOCK on some systems. Replies are
+	 * written with blocking stdio calls, reads use MSG_DONTWAIT. */
+	flags = fcntl (fd, F_GETFL);
+	if ((flags != -1) && ((flags & O_NONBLOCK) != 0))
+		fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
+
+	/* Don't let a client that doesn't read its replies block a worker
+	 * forever. */
+	tv.tv_sec = US_WRITE_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+	client = malloc (sizeof (*client));
+	if (client == NULL)
+	{
+		ERROR ("unixsock plugin: malloc failed.");
+		close (fd);
+		return (-1);
+	}
+	memset (client, 0, sizeof (*client));
+	client->fd = fd;
+	client->state = US_STATE_IDLE;
+
+	client->buffer = malloc (US_BUFFER_INIT);
+	if (client->buffer == NULL)
+	{
+		ERROR ("unixsock plugin: malloc failed.");
+		close (fd);
+		us_client_free (client);
+		return (-1);
+	}
+	client->buffer_size = US_BUFFER_INIT;
+
+	fdout = dup (fd);
+	if (fdout < 0)
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: dup failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (fd);
+		us_client_free (client);
+		return (-1);
+	}
+
+	client->fhout = fdopen (fdout, "w");
+	if (client->fhout == NULL)
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: fdopen failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		close (fdout);
+		close (fd);
+		us_client_free (client);
+		return (-1);
+	}
+
+	tmp = realloc (clients, sizeof (*clients) * (clients_num + 1));
+	if (tmp == NULL)
+	{
+		ERROR ("unixsock plugin: realloc failed.");
+		us_client_close (client);
+		us_client_free (client);
+		return (-1);
+	}
+	clients = tmp;
+	clients[clients_num] = client;
+	clients_num++;
+
+	DEBUG ("unixsock plugin: Accepted connection on fd #%i", fd);
+
+	return (0);
+} /* int us_client_add */
 
 static void *us_server_thread (void __attribute__((unused)) *arg)
 {
-	int  status;
-	int *remote_fd;
-	pthread_t th;
-	pthread_attr_t th_attr;
+	struct pollfd *pollfds = NULL;
+	us_client_t  **polled = NULL;
+	size_t pollfds_size = 0;
+	int status;
+	size_t i;
 
 	if (us_open_socket () != 0)
 		pthread_exit ((void *) 1);
 
 	while (loop != 0)
 	{
-		DEBUG ("unixsock plugin: Calling accept..");
-		status = accept (sock_fd, NULL, NULL);
+		size_t pollfds_num;
+
+		/* Build the poll set from idle clients and forget about clients
+		 * the workers have closed. */
+		pthread_mutex_lock (&client_lock);
+		if (pollfds_size < (clients_num + 2))
+		{
+			struct pollfd *tmp_fds;
+			us_client_t **tmp_polled;
+
+			pollfds_size = clients_num + 16;
+			tmp_fds = realloc (pollfds, sizeof (*pollfds) * pollfds_size);
+			if (tmp_fds != NULL)
+				pollfds = tmp_fds;
+			tmp_polled = realloc (polled, sizeof (*polled) * pollfds_size);
+			if (tmp_polled != NULL)
+				polled = tmp_polled;
+			if ((tmp_fds == NULL) || (tmp_polled == NULL))
+			{
+				pthread_mutex_unlock (&client_lock);
+				ERROR ("unixsock plugin: realloc failed.");
+				break;
+			}
+		}
+
+		memset (pollfds, 0, sizeof (*pollfds) * pollfds_size);
+		pollfds[0].fd = wakeup_pipe[0];
+		pollfds[0].events = POLLIN;
+		pollfds[1].fd = sock_fd;
+		pollfds[1].events = POLLIN;
+		pollfds_num = 2;
+
+		for (i = 0; i < clients_num; )
+		{
+			us_client_t *client = clients[i];
+
+			if (client->state == US_STATE_CLOSED)
+			{
+				us_client_free (client);
+				clients[i] = clients[clients_num - 1];
+				clients_num--;
+				continue;
+			}
+
+			if (client->state == US_STATE_IDLE)
+			{
+				pollfds[pollfds_num].fd = client->fd;
+				pollfds[pollfds_num].events = POLLIN;
+				polled[pollfds_num] = client;
+				pollfds_num++;
+			}
+			i++;
+		}
+		pthread_mutex_unlock (&client_lock);
+
+		status = poll (pollfds, (nfds_t) pollfds_num, /* timeout = */ -1);
 		if (status < 0)
 		{
 			char errbuf[1024];
@@ -332,41 +670,59 @@ static void *us_server_thread (void __attribute__((unused)) *arg)
 			if (errno == EINTR)
 				continue;
 
-			ERROR ("unixsock plugin: accept failed: %s",
+			ERROR ("unixsock plugin: poll failed: %s",
 					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (sock_fd);
-			sock_fd = -1;
-			pthread_exit ((void *) 1);
+			break;
 		}
 
-		remote_fd = (int *) malloc (sizeof (int));
-		if (remote_fd == NULL)
+		if (pollfds[0].revents != 0)
 		{
-			char errbuf[1024];
-			WARNING ("unixsock plugin: malloc failed: %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (status);
-			continue;
+			char buffer[64];
+			while (read (wakeup_pipe[0], buffer, sizeof (buffer)) > 0)
+				/* drain */;
 		}
-		*remote_fd = status;
 
-		DEBUG ("Spawning child to handle connection on fd #%i", *remote_fd);
+		if (pollfds[1].revents != 0)
+		{
+			while (42)
+			{
+				status = accept (sock_fd, NULL, NULL);
+				if (status < 0)
+				{
+					char errbuf[1024];
+
+					if ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+							|| (errno == EINTR) || (errno == ECONNABORTED))
+						break;
 
-		pthread_attr_init (&th_attr);
-		pthread_attr_setdetachstate (&th_attr, PTHREAD_CREATE_DETACHED);
+					ERROR ("unixsock plugin: accept failed: %s",
+							sstrerror (errno, errbuf, sizeof (errbuf)));
+					break;
+				}
 
-		status = pthread_create (&th, &th_attr, us_handle_client, (void *) remote_fd);
-		if (status != 0)
+				us_client_add (status);
+			}
+		}
+
+		/* Idle clients belong to this thread, only queueing them needs the
+		 * lock. */
+		for (i = 2; i < pollfds_num; i++)
 		{
-			char errbuf[1024];
-			WARNING ("unixsock plugin: pthread_create failed: %s",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-			close (*remote_fd);
-			free (remote_fd);
-			continue;
+			if (pollfds[i].revents == 0)
+				continue;
+
+			if (us_client_read (polled[i]) == 0)
+				continue;
+
+			pthread_mutex_lock (&client_lock);
+			us_client_enqueue (polled[i]);
+			pthread_mutex_unlock (&client_lock);
 		}
 	} /* while (loop) */
 
+	sfree (pollfds);
+	sfree (polled);
+
 	close (sock_fd);
 	sock_fd = -1;
 
@@ -413,6 +769,16 @@ static int us_config (const char *key, const char *val)
 		else
 			delete_socket = 0;
 	}
+	else if (strcasecmp (key, "WorkerThreads") == 0)
+	{
+		int tmp = atoi (val);
+		if (tmp < 1)
+		{
+			WARNING ("unixsock plugin: WorkerThreads must be at least 1.");
+			return (1);
+		}
+		worker_threads_num = tmp;
+	}
 	else
 	{
 		return (-1);
@@ -426,6 +792,7 @@ static int us_init (void)
 	static int have_init = 0;
 
 	int status;
+	int i;
 
 	/* Initialize only once. */
 	if (have_init != 0)
@@ -434,6 +801,45 @@ static int us_init (void)
 
 	loop = 1;
 
+	if (pipe (wakeup_pipe) != 0)
+	{
+		char errbuf[1024];
+		ERROR ("unixsock plugin: pipe failed: %s",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+		return (-1);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		int flags = fcntl (wakeup_pipe[i], F_GETFL);
+		if (flags != -1)
+			fcntl (wakeup_pipe[i], F_SETFL, flags | O_NONBLOCK);
+	}
+
+	worker_threads = calloc ((size_t) worker_threads_num,
+			sizeof (*worker_threads));
+	if (worker_threads == NULL)
+	{
+		ERROR ("unixsock plugin: calloc failed.");
+		return (-1);
+	}
+
+	for (i = 0; i < worker_threads_num; i++)
+	{
+		status = pthread_create (&worker_threads[worker_threads_running],
+				NULL, us_worker_thread, NULL);
+		if (status != 0)
+		{
+			char errbuf[1024];
+			ERROR ("unixsock plugin: pthread_create failed: %s",
+					sstrerror (status, errbuf, sizeof (errbuf)));
+			continue;
+		}
+		worker_threads_running++;
+	}
+
+	if (worker_threads_running == 0)
+		return (-1);
+
 	status = pthread_create (&listen_thread, NULL, us_server_thread, NULL);
 	if (status != 0)
 	{
@@ -449,16 +855,44 @@ static int us_init (void)
 static int us_shutdown (void)
 {
 	void *ret;
+	size_t i;
 
+	pthread_mutex_lock (&client_lock);
 	loop = 0;
+	pthread_cond_broadcast (&client_cond);
+	pthread_mutex_unlock (&client_lock);
 
 	if (listen_thread != (pthread_t) 0)
 	{
-		pthread_kill (listen_thread, SIGTERM);
+		us_wakeup_server ();
 		pthread_join (listen_thread, &ret);
 		listen_thread = (pthread_t) 0;
 	}
 
+	/* Workers handle the connections still queued before they exit. */
+	for (i = 0; i < (size_t) worker_threads_running; i++)
+		pthread_join (worker_threads[i], &ret);
+	worker_threads_running = 0;
+	sfree (worker_threads);
+
+	for (i = 0; i < clients_num; i++)
+	{
+		if (clients[i]->state != US_STATE_CLOSED)
+			us_client_close (clients[i]);
+		us_client_free (clients[i]);
+	}
+	clients_num = 0;
+	sfree (clients);
+	client_queue_head = NULL;
+	client_queue_tail = NULL;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (wakeup_pipe[i] >= 0)
+			close (wakeup_pipe[i]);
+		wakeup_pipe[i] = -1;
+	}
+
 	plugin_unregister_init ("unixsock");
 	plugin_unregister_shutdown ("unixsock");
 
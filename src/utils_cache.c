@@ -22,16 +22,37 @@
 #include "collectd.h"
 #include "common.h"
 #include "plugin.h"
-#include "utils_avltree.h"
 #include "utils_cache.h"
 #include "meta_data.h"
 
 #include <assert.h>
 #include <pthread.h>
 
-typedef struct cache_entry_s
+/* Number of independently locked parts of the cache. Entries are assigned to
+ * a shard by the hash of their identifier, so threads updating different
+ * identifiers rarely contend for the same lock. Must be a power of two. */
+#define CACHE_SHARDS_BITS 6
+#define CACHE_SHARDS_NUM (1 << CACHE_SHARDS_BITS)
+
+/* Initial number of hash buckets per shard. Must be a power of two. */
+#define CACHE_BUCKETS_INIT 64
+
+/* Number of one-second slots in each shard's timer wheel. Entries are kept in
+ * the slot of the second in which they time out, so `uc_check_timeout' only
+ * needs to look at the slots of the seconds that passed since the last call.
+ * Entries timing out further in the future than this share slots with
+ * earlier ones and are simply skipped until their time has come. */
+#define CACHE_TIMER_SLOTS 512
+
+struct cache_entry_s;
+typedef struct cache_entry_s cache_entry_t;
+struct cache_entry_s
 {
+	/* `hash' and `name' form the key of the entry. */
+	uint32_t hash;
 	char name[6 * DATA_MAX_NAME_LEN];
+	/* Next entry in the same hash bucket */
+	cache_entry_t *next;
 	int        values_num;
 	gauge_t   *values_gauge;
 	value_t   *values_raw;
@@ -44,6 +65,18 @@ typedef struct cache_entry_s
 	/* Interval in which the data is collected
 	 * (for purding old entries) */
 	cdtime_t interval;
+	/* Time at which the entry is considered missing, and the neighbors in
+	 * the timer wheel slot for that time. */
+	cdtime_t timeout;
+	cache_entry_t *timer_prev;
+	cache_entry_t *timer_next;
+	/* Length of the identifier parts in `name', so the value list can be
+	 * restored without parsing the name. */
+	uint8_t host_len;
+	uint8_t plugin_len;
+	uint8_t plugin_instance_len;
+	uint8_t type_len;
+	uint8_t type_instance_len;
 	int state;
 	int hits;
 
@@ -61,16 +94,244 @@ typedef struct cache_entry_s
 	size_t   history_length;
 
 	meta_data_t *meta;
-} cache_entry_t;
+};
 
-static c_avl_tree_t   *cache_tree = NULL;
-static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Each shard is a chained hash table with its own lock, plus a timer wheel
+ * for finding entries that timed out. */
+typedef struct cache_shard_s
+{
+  cache_entry_t **buckets;
+  size_t          buckets_num;
+  size_t          entries_num;
+  cache_entry_t  *timer_slots[CACHE_TIMER_SLOTS];
+  /* The second up to which the timer wheel has been checked */
+  time_t          timer_checked;
+  pthread_mutex_t lock;
+} cache_shard_t;
+
+static cache_shard_t cache_shards[CACHE_SHARDS_NUM];
+static _Bool         cache_initialized = 0;
+
+static cache_shard_t *cache_get_shard (uint32_t hash) /* {{{ */
+{
+  return (cache_shards + (hash & (CACHE_SHARDS_NUM - 1)));
+} /* }}} cache_shard_t *cache_get_shard */
+
+/* The lower bits of the hash select the shard, so use the remaining bits to
+ * select the bucket. */
+static size_t cache_bucket_index (const cache_shard_t *shard, /* {{{ */
+    uint32_t hash)
+{
+  return ((size_t) (hash >> CACHE_SHARDS_BITS) & (shard->buckets_num - 1));
+} /* }}} size_t cache_bucket_index */
+
+/* The following functions require the shard's lock to be held. */
+static cache_entry_t **cache_timer_slot (cache_shard_t *shard, /* {{{ */
+    cdtime_t timeout)
+{
+  return (shard->timer_slots
+      + (CDTIME_T_TO_TIME_T (timeout) % CACHE_TIMER_SLOTS));
+} /* }}} cache_entry_t **cache_timer_slot */
+
+static void cache_timer_unlink (cache_shard_t *shard, /* {{{ */
+    cache_entry_t *ce)
+{
+  if (ce->timer_prev != NULL)
+    ce->timer_prev->timer_next = ce->timer_next;
+  else
+    *cache_timer_slot (shard, ce->timeout) = ce->timer_next;
+
+  if (ce->timer_next != NULL)
+    ce->timer_next->timer_prev = ce->timer_prev;
+
+  ce->timer_prev = NULL;
+  ce->timer_next = NULL;
+} /* }}} void cache_timer_unlink */
+
+static void cache_timer_link (cache_shard_t *shard, /* {{{ */
+    cache_entry_t *ce)
+{
+  cache_entry_t **slot = cache_timer_slot (shard, ce->timeout);
+
+  ce->timer_prev = NULL;
+  ce->timer_next = *slot;
+  if (*slot != NULL)
+    (*slot)->timer_prev = ce;
+  *slot = ce;
+} /* }}} void cache_timer_link */
+
+/* Moves the entry to the timer wheel slot matching its `last_update' and
+ * `interval' members. */
+static void cache_timer_update (cache_shard_t *shard, /* {{{ */
+    cache_entry_t *ce)
+{
+  cdtime_t timeout = ce->last_update + (ce->interval * timeout_g);
+
+  if (cache_timer_slot (shard, timeout)
+      != cache_timer_slot (shard, ce->timeout))
+  {
+    cache_timer_unlink (shard, ce);
+    ce->timeout = timeout;
+    cache_timer_link (shard, ce);
+  }
+  else
+  {
+    ce->timeout = timeout;
+  }
+} /* }}} void cache_timer_update */
+
+static cache_entry_t *cache_shard_get (cache_shard_t *shard, /* {{{ */
+    const cache_entry_t *key)
+{
+  cache_entry_t *ce;
+
+  for (ce = shard->buckets[cache_bucket_index (shard, key->hash)];
+      ce != NULL;
+      ce = ce->next)
+  {
+    /* Comparing the hash first spares us most of the (long and similar)
+     * string comparisons. */
+    if ((ce->hash == key->hash) && (strcmp (ce->name, key->name) == 0))
+      return (ce);
+  }
+
+  return (NULL);
+} /* }}} cache_entry_t *cache_shard_get */
+
+static void cache_shard_grow (cache_shard_t *shard) /* {{{ */
+{
+  cache_entry_t **old_buckets = shard->buckets;
+  size_t old_buckets_num = shard->buckets_num;
+  cache_entry_t **new_buckets;
+  size_t i;
+
+  new_buckets = calloc (2 * old_buckets_num, sizeof (*new_buckets));
+  if (new_buckets == NULL)
+  {
+    /* Not fatal: chains just get longer. */
+    WARNING ("utils_cache: cache_shard_grow: calloc failed.");
+    return;
+  }
+
+  shard->buckets = new_buckets;
+  shard->buckets_num = 2 * old_buckets_num;
+
+  for (i = 0; i < old_buckets_num; i++)
+  {
+    cache_entry_t *ce = old_buckets[i];
+
+    while (ce != NULL)
+    {
+      cache_entry_t *next = ce->next;
+      size_t index = cache_bucket_index (shard, ce->hash);
+
+      ce->next = shard->buckets[index];
+      shard->buckets[index] = ce;
+
+      ce = next;
+    }
+  }
+
+  sfree (old_buckets);
+} /* }}} void cache_shard_grow */
+
+static void cache_shard_insert (cache_shard_t *shard, /* {{{ */
+    cache_entry_t *ce)
+{
+  size_t index;
+
+  if (shard->entries_num >= (2 * shard->buckets_num))
+    cache_shard_grow (shard);
 
-static int cache_compare (const cache_entry_t *a, const cache_entry_t *b)
+  index = cache_bucket_index (shard, ce->hash);
+  ce->next = shard->buckets[index];
+  shard->buckets[index] = ce;
+  shard->entries_num++;
+
+  ce->timeout = ce->last_update + (ce->interval * timeout_g);
+  cache_timer_link (shard, ce);
+} /* }}} void cache_shard_insert */
+
+static cache_entry_t *cache_shard_remove (cache_shard_t *shard, /* {{{ */
+    const cache_entry_t *key)
+{
+  cache_entry_t **ptr;
+
+  for (ptr = shard->buckets + cache_bucket_index (shard, key->hash);
+      *ptr != NULL;
+      ptr = &(*ptr)->next)
+  {
+    cache_entry_t *ce = *ptr;
+
+    if ((ce->hash != key->hash) || (strcmp (ce->name, key->name) != 0))
+      continue;
+
+    *ptr = ce->next;
+    ce->next = NULL;
+    shard->entries_num--;
+
+    cache_timer_unlink (shard, ce);
+    return (ce);
+  }
+
+  return (NULL);
+} /* }}} cache_entry_t *cache_shard_remove */
+
+/* Initializes the lookup key `key' from an identifier string. Only the `hash'
+ * and `name' members are set. */
+static void cache_key_from_name (cache_entry_t *key, const char *name) /* {{{ */
 {
-  assert ((a != NULL) && (b != NULL));
-  return (strcmp (a->name, b->name));
-} /* int cache_compare */
+  sstrncpy (key->name, name, sizeof (key->name));
+  key->hash = fnv1a_hash (key->name, strlen (key->name));
+} /* }}} void cache_key_from_name */
+
+/* Initializes the lookup key `key' from a value list. */
+static int cache_key_from_vl (cache_entry_t *key, /* {{{ */
+    const value_list_t *vl)
+{
+  if (FORMAT_VL (key->name, sizeof (key->name), vl) != 0)
+    return (-1);
+
+  key->hash = fnv1a_hash (key->name, strlen (key->name));
+  return (0);
+} /* }}} int cache_key_from_vl */
+
+/* Restores the identifier of a value list from the entry's name, using the
+ * lengths of the parts recorded by `uc_insert'. */
+static void cache_entry_to_vl (const cache_entry_t *ce, /* {{{ */
+    value_list_t *vl)
+{
+  const char *ptr = ce->name;
+
+#define COPY_PART(field, len) do { \
+  memcpy (vl->field, ptr, len); \
+  vl->field[len] = 0; \
+  ptr += len; \
+} while (0)
+
+  COPY_PART (host, ce->host_len);
+  ptr++; /* "/" */
+  COPY_PART (plugin, ce->plugin_len);
+  vl->plugin_instance[0] = 0;
+  if (ce->plugin_instance_len > 0)
+  {
+    ptr++; /* "-" */
+    COPY_PART (plugin_instance, ce->plugin_instance_len);
+  }
+  ptr++; /* "/" */
+  COPY_PART (type, ce->type_len);
+  vl->type_instance[0] = 0;
+  if (ce->type_instance_len > 0)
+  {
+    ptr++; /* "-" */
+    COPY_PART (type_instance, ce->type_instance_len);
+  }
+
+#undef COPY_PART
+
+  vl->time = ce->last_time;
+  vl->interval = ce->interval;
+} /* }}} void cache_entry_to_vl */
 
 static cache_entry_t *cache_alloc (int values_num)
 {
@@ -134,31 +395,29 @@ static void uc_check_range (const data_set_t *ds, cache_entry_t *ce)
   }
 } /* void uc_check_range */
 
-static int uc_insert (const data_set_t *ds, const value_list_t *vl,
-    const char *key)
+static int uc_insert (cache_shard_t *shard,
+    const data_set_t *ds, const value_list_t *vl,
+    const cache_entry_t *key)
 {
   int i;
-  char *key_copy;
   cache_entry_t *ce;
 
-  /* `cache_lock' has been locked by `uc_update' */
-
-  key_copy = strdup (key);
-  if (key_copy == NULL)
-  {
-    ERROR ("uc_insert: strdup failed.");
-    return (-1);
-  }
+  /* `shard->lock' has been locked by `uc_update' */
 
   ce = cache_alloc (ds->ds_num);
   if (ce == NULL)
   {
-    sfree (key_copy);
     ERROR ("uc_insert: cache_alloc (%i) failed.", ds->ds_num);
     return (-1);
   }
 
-  sstrncpy (ce->name, key, sizeof (ce->name));
+  sstrncpy (ce->name, key->name, sizeof (ce->name));
+  ce->hash = key->hash;
+  ce->host_len = (uint8_t) strlen (vl->host);
+  ce->plugin_len = (uint8_t) strlen (vl->plugin);
+  ce->plugin_instance_len = (uint8_t) strlen (vl->plugin_instance);
+  ce->type_len = (uint8_t) strlen (vl->type);
+  ce->type_instance_len = (uint8_t) strlen (vl->type_instance);
 
   for (i = 0; i < ds->ds_num; i++)
   {
@@ -191,6 +450,7 @@ static int uc_insert (const data_set_t *ds, const value_list_t *vl,
 	/* This shouldn't happen. */
 	ERROR ("uc_insert: Don't know how to handle data source type %i.",
 	    ds->ds[i].type);
+	cache_free (ce);
 	return (-1);
     } /* switch (ds->ds[i].type) */
   } /* for (i) */
@@ -203,99 +463,126 @@ static int uc_insert (const data_set_t *ds, const value_list_t *vl,
   ce->interval = vl->interval;
   ce->state = STATE_OKAY;
 
-  if (c_avl_insert (cache_tree, key_copy, ce) != 0)
-  {
-    sfree (key_copy);
-    ERROR ("uc_insert: c_avl_insert failed.");
-    return (-1);
-  }
+  cache_shard_insert (shard, ce);
 
-  DEBUG ("uc_insert: Added %s to the cache.", key);
+  DEBUG ("uc_insert: Added %s to the cache.", ce->name);
   return (0);
 } /* int uc_insert */
 
 int uc_init (void)
 {
-  if (cache_tree == NULL)
-    cache_tree = c_avl_create ((int (*) (const void *, const void *))
-	cache_compare);
+  int i;
 
+  if (cache_initialized)
+    return (0);
+
+  for (i = 0; i < CACHE_SHARDS_NUM; i++)
+  {
+    cache_shard_t *shard = cache_shards + i;
+
+    shard->buckets = calloc (CACHE_BUCKETS_INIT, sizeof (*shard->buckets));
+    if (shard->buckets == NULL)
+    {
+      ERROR ("uc_init: calloc failed.");
+      return (-1);
+    }
+    shard->buckets_num = CACHE_BUCKETS_INIT;
+    shard->entries_num = 0;
+    memset (shard->timer_slots, 0, sizeof (shard->timer_slots));
+    shard->timer_checked = time (NULL);
+    pthread_mutex_init (&shard->lock, /* attr = */ NULL);
+  }
+
+  cache_initialized = 1;
   return (0);
 } /* int uc_init */
 
-int uc_check_timeout (void)
+/* Appends the identifiers of all entries in `shard' that timed out before
+ * `now' to `*expired'. Only the timer wheel slots of the seconds since the
+ * last call are looked at. */
+static int uc_collect_expired (cache_shard_t *shard, cdtime_t now, /* {{{ */
+    value_list_t **expired, size_t *expired_num, size_t *expired_size)
 {
-  cdtime_t now;
-  cache_entry_t *ce;
+  time_t now_sec = CDTIME_T_TO_TIME_T (now);
+  time_t sec;
 
-  char **keys = NULL;
-  cdtime_t *keys_time = NULL;
-  cdtime_t *keys_interval = NULL;
-  int keys_len = 0;
+  /* No need to visit a slot more than once. */
+  sec = shard->timer_checked;
+  if ((now_sec - sec) >= CACHE_TIMER_SLOTS)
+    sec = now_sec - (CACHE_TIMER_SLOTS - 1);
 
-  char *key;
-  c_avl_iterator_t *iter;
+  for (; sec <= now_sec; sec++)
+  {
+    cache_entry_t *ce;
 
-  int status;
-  int i;
-  
-  pthread_mutex_lock (&cache_lock);
+    for (ce = shard->timer_slots[sec % CACHE_TIMER_SLOTS];
+	ce != NULL;
+	ce = ce->timer_next)
+    {
+      value_list_t *vl;
 
-  now = cdtime ();
+      /* Either not yet due or sharing the slot with an entry from another
+       * round of the wheel. */
+      if (ce->timeout > now)
+	continue;
 
-  /* Build a list of entries to be flushed */
-  iter = c_avl_get_iterator (cache_tree);
-  while (c_avl_iterator_next (iter, (void *) &key, (void *) &ce) == 0)
-  {
-    char **tmp;
-    cdtime_t *tmp_time;
+      if (*expired_num >= *expired_size)
+      {
+	value_list_t *tmp;
+	size_t new_size = (*expired_size == 0) ? 16 : (2 * *expired_size);
 
-    /* If the entry is fresh enough, continue. */
-    if ((now - ce->last_update) < (ce->interval * timeout_g))
-      continue;
+	tmp = realloc (*expired, new_size * sizeof (**expired));
+	if (tmp == NULL)
+	{
+	  ERROR ("uc_check_timeout: realloc failed.");
+	  return (-1);
+	}
+	*expired = tmp;
+	*expired_size = new_size;
+      }
 
-    /* If entry has not been updated, add to `keys' array */
-    tmp = (char **) realloc ((void *) keys,
-	(keys_len + 1) * sizeof (char *));
-    if (tmp == NULL)
-    {
-      ERROR ("uc_check_timeout: realloc failed.");
-      continue;
-    }
-    keys = tmp;
+      vl = *expired + *expired_num;
+      memset (vl, 0, sizeof (*vl));
+      vl->values = NULL;
+      vl->values_len = 0;
+      vl->meta = NULL;
+      cache_entry_to_vl (ce, vl);
+      (*expired_num)++;
+    } /* for (ce) */
+  } /* for (sec) */
 
-    tmp_time = realloc (keys_time, (keys_len + 1) * sizeof (*keys_time));
-    if (tmp_time == NULL)
-    {
-      ERROR ("uc_check_timeout: realloc failed.");
-      continue;
-    }
-    keys_time = tmp_time;
+  /* The slot of the current second may receive more due entries before the
+   * second is over, so it is checked again next time. */
+  shard->timer_checked = now_sec;
 
-    tmp_time = realloc (keys_interval, (keys_len + 1) * sizeof (*keys_interval));
-    if (tmp_time == NULL)
-    {
-      ERROR ("uc_check_timeout: realloc failed.");
-      continue;
-    }
-    keys_interval = tmp_time;
+  return (0);
+} /* }}} int uc_collect_expired */
 
-    keys[keys_len] = strdup (key);
-    if (keys[keys_len] == NULL)
-    {
-      ERROR ("uc_check_timeout: strdup failed.");
-      continue;
-    }
-    keys_time[keys_len] = ce->last_time;
-    keys_interval[keys_len] = ce->interval;
+int uc_check_timeout (void)
+{
+  cdtime_t now;
+
+  value_list_t *expired = NULL;
+  size_t expired_num = 0;
+  size_t expired_size = 0;
+
+  size_t i;
+  int j;
+
+  now = cdtime ();
 
-    keys_len++;
-  } /* while (c_avl_iterator_next) */
+  /* Build a list of entries to be flushed. Only one shard is locked at a
+   * time, so updates to the other shards can go on in the meantime. */
+  for (j = 0; j < CACHE_SHARDS_NUM; j++)
+  {
+    cache_shard_t *shard = cache_shards + j;
 
-  c_avl_iterator_destroy (iter);
-  pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_lock (&shard->lock);
+    uc_collect_expired (shard, now, &expired, &expired_num, &expired_size);
+    pthread_mutex_unlock (&shard->lock);
+  } /* for (j = 0; j < CACHE_SHARDS_NUM; j++) */
 
-  if (keys_len == 0)
+  if (expired_num == 0)
     return (0);
 
   /* Call the "missing" callback for each value. Do this before removing the
@@ -303,79 +590,62 @@ int uc_check_timeout (void)
    * including plugin specific meta data, rates, history, …. This must be done
    * without holding the lock, otherwise we will run into a deadlock if a
    * plugin calls the cache interface. */
-  for (i = 0; i < keys_len; i++)
-  {
-    value_list_t vl = VALUE_LIST_INIT;
-
-    vl.values = NULL;
-    vl.values_len = 0;
-    vl.meta = NULL;
+  for (i = 0; i < expired_num; i++)
+    plugin_dispatch_missing (expired + i);
 
-    status = parse_identifier_vl (keys[i], &vl);
-    if (status != 0)
-    {
-      ERROR ("uc_check_timeout: parse_identifier_vl (\"%s\") failed.", keys[i]);
-      cache_free (ce);
-      continue;
-    }
-
-    vl.time = keys_time[i];
-    vl.interval = keys_interval[i];
-
-    plugin_dispatch_missing (&vl);
-  } /* for (i = 0; i < keys_len; i++) */
-
-  /* Now actually remove all the values from the cache. We don't re-evaluate
-   * the timestamp again, so in theory it is possible we remove a value after
-   * it is updated here. */
-  pthread_mutex_lock (&cache_lock);
-  for (i = 0; i < keys_len; i++)
+  /* Now actually remove all the values from the cache, unless they have been
+   * updated in the meantime. */
+  for (i = 0; i < expired_num; i++)
   {
-    key = NULL;
-    ce = NULL;
+    cache_entry_t key;
+    cache_shard_t *shard;
+    cache_entry_t *ce;
 
-    status = c_avl_remove (cache_tree, keys[i],
-	(void *) &key, (void *) &ce);
-    if (status != 0)
+    if (cache_key_from_vl (&key, expired + i) != 0)
     {
-      ERROR ("uc_check_timeout: c_avl_remove (\"%s\") failed.", keys[i]);
-      sfree (keys[i]);
+      ERROR ("uc_check_timeout: FORMAT_VL failed.");
       continue;
     }
+    shard = cache_get_shard (key.hash);
+
+    pthread_mutex_lock (&shard->lock);
+    ce = cache_shard_get (shard, &key);
+    if ((ce != NULL) && (ce->timeout <= now))
+      ce = cache_shard_remove (shard, &key);
+    else
+      ce = NULL;
+    pthread_mutex_unlock (&shard->lock);
 
-    sfree (keys[i]);
-    sfree (key);
     cache_free (ce);
-  } /* for (i = 0; i < keys_len; i++) */
-  pthread_mutex_unlock (&cache_lock);
+  } /* for (i = 0; i < expired_num; i++) */
 
-  sfree (keys);
-  sfree (keys_time);
-  sfree (keys_interval);
+  sfree (expired);
 
   return (0);
 } /* int uc_check_timeout */
 
 int uc_update (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int status;
   int i;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (cache_key_from_vl (&key, vl) != 0)
   {
     ERROR ("uc_update: FORMAT_VL failed.");
     return (-1);
   }
+  shard = cache_get_shard (key.hash);
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0) /* entry does not yet exist */
+  ce = cache_shard_get (shard, &key);
+  if (ce == NULL) /* entry does not yet exist */
   {
-    status = uc_insert (ds, vl, name);
-    pthread_mutex_unlock (&cache_lock);
+    status = uc_insert (shard, ds, vl, &key);
+    pthread_mutex_unlock (&shard->lock);
     return (status);
   }
 
@@ -384,10 +654,10 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
 
   if (ce->last_time >= vl->time)
   {
-    pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&shard->lock);
     NOTICE ("uc_update: Value too old: name = %s; value time = %.3f; "
 	"last cache update = %.3f;",
-	name,
+	key.name,
 	CDTIME_T_TO_DOUBLE (vl->time),
 	CDTIME_T_TO_DOUBLE (ce->last_time));
     return (-1);
@@ -447,13 +717,13 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
 
       default:
 	/* This shouldn't happen. */
-	pthread_mutex_unlock (&cache_lock);
+	pthread_mutex_unlock (&shard->lock);
 	ERROR ("uc_update: Don't know how to handle data source type %i.",
 	    ds->ds[i].type);
 	return (-1);
     } /* switch (ds->ds[i].type) */
 
-    DEBUG ("uc_update: %s: ds[%i] = %lf", name, i, ce->values_gauge[i]);
+    DEBUG ("uc_update: %s: ds[%i] = %lf", key.name, i, ce->values_gauge[i]);
   } /* for (i) */
 
   /* Update the history if it exists. */
@@ -476,22 +746,28 @@ int uc_update (const data_set_t *ds, const value_list_t *vl)
   ce->last_time = vl->time;
   ce->last_update = cdtime ();
   ce->interval = vl->interval;
+  cache_timer_update (shard, ce);
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (0);
 } /* int uc_update */
 
 int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_values_num)
 {
+  cache_entry_t key;
+  cache_shard_t *shard;
   gauge_t *ret = NULL;
   size_t ret_num = 0;
   cache_entry_t *ce = NULL;
   int status = 0;
 
-  pthread_mutex_lock (&cache_lock);
+  cache_key_from_name (&key, name);
+  shard = cache_get_shard (key.hash);
+
+  pthread_mutex_lock (&shard->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  if ((ce = cache_shard_get (shard, &key)) != NULL)
   {
     assert (ce != NULL);
 
@@ -521,7 +797,7 @@ int uc_get_rate_by_name (const char *name, gauge_t **ret_values, size_t *ret_val
     status = -1;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   if (status == 0)
   {
@@ -563,78 +839,114 @@ gauge_t *uc_get_rate (const data_set_t *ds, const value_list_t *vl)
   return (ret);
 } /* gauge_t *uc_get_rate */
 
+struct uc_name_time_s
+{
+  char *name;
+  cdtime_t time;
+};
+
+static int uc_name_time_compare (const void *a, const void *b) /* {{{ */
+{
+  const struct uc_name_time_s *nt_a = a;
+  const struct uc_name_time_s *nt_b = b;
+
+  return (strcmp (nt_a->name, nt_b->name));
+} /* }}} int uc_name_time_compare */
+
 int uc_get_names (char ***ret_names, cdtime_t **ret_times, size_t *ret_number)
 {
-  c_avl_iterator_t *iter;
-  char *key;
   cache_entry_t *value;
 
+  struct uc_name_time_s *entries = NULL;
+  size_t entries_size = 0;
+
   char **names = NULL;
   cdtime_t *times = NULL;
   size_t number = 0;
+  size_t i;
+  int j;
 
   int status = 0;
 
   if ((ret_names == NULL) || (ret_number == NULL))
     return (-1);
 
-  pthread_mutex_lock (&cache_lock);
-
-  iter = c_avl_get_iterator (cache_tree);
-  while (c_avl_iterator_next (iter, (void *) &key, (void *) &value) == 0)
+  for (j = 0; (j < CACHE_SHARDS_NUM) && (status == 0); j++)
   {
-    char **temp;
+    cache_shard_t *shard = cache_shards + j;
+    size_t b;
 
-    /* remove missing values when list values */
-    if (value->state == STATE_MISSING)
-      continue;
+    pthread_mutex_lock (&shard->lock);
 
-    if (ret_times != NULL)
+    for (b = 0; (b < shard->buckets_num) && (status == 0); b++)
+    for (value = shard->buckets[b]; value != NULL; value = value->next)
     {
-      cdtime_t *tmp_times;
+      /* remove missing values when list values */
+      if (value->state == STATE_MISSING)
+	continue;
 
-      tmp_times = (cdtime_t *) realloc (times, sizeof (cdtime_t) * (number + 1));
-      if (tmp_times == NULL)
+      if (number >= entries_size)
+      {
+	struct uc_name_time_s *tmp;
+	size_t new_size = (entries_size == 0) ? 64 : (2 * entries_size);
+
+	tmp = realloc (entries, new_size * sizeof (*entries));
+	if (tmp == NULL)
+	{
+	  status = -1;
+	  break;
+	}
+	entries = tmp;
+	entries_size = new_size;
+      }
+
+      entries[number].name = strdup (value->name);
+      if (entries[number].name == NULL)
       {
 	status = -1;
 	break;
       }
-      times = tmp_times;
-      times[number] = value->last_time;
-    }
+      entries[number].time = value->last_time;
+      number++;
+    } /* for (value) */
 
-    temp = (char **) realloc (names, sizeof (char *) * (number + 1));
-    if (temp == NULL)
-    {
-      status = -1;
-      break;
-    }
-    names = temp;
-    names[number] = strdup (key);
-    if (names[number] == NULL)
-    {
-      status = -1;
-      break;
-    }
-    number++;
-  } /* while (c_avl_iterator_next) */
+    pthread_mutex_unlock (&shard->lock);
+  } /* for (j = 0; j < CACHE_SHARDS_NUM; j++) */
 
-  c_avl_iterator_destroy (iter);
-  pthread_mutex_unlock (&cache_lock);
+  /* Entries are spread over the shards by hash. Sort them so users get the
+   * same alphabetical list they used to. */
+  if ((status == 0) && (number > 0))
+  {
+    qsort (entries, number, sizeof (*entries), uc_name_time_compare);
+
+    names = calloc (number, sizeof (*names));
+    if (ret_times != NULL)
+      times = calloc (number, sizeof (*times));
+    if ((names == NULL) || ((ret_times != NULL) && (times == NULL)))
+      status = -1;
+  }
 
   if (status != 0)
   {
-    size_t i;
-    
     for (i = 0; i < number; i++)
     {
-      sfree (names[i]);
+      sfree (entries[i].name);
     }
+    sfree (entries);
     sfree (names);
+    sfree (times);
 
     return (-1);
   }
 
+  for (i = 0; i < number; i++)
+  {
+    names[i] = entries[i].name;
+    if (times != NULL)
+      times[i] = entries[i].time;
+  }
+  sfree (entries);
+
   *ret_names = names;
   if (ret_times != NULL)
     *ret_times = times;
@@ -645,51 +957,55 @@ int uc_get_names (char ***ret_names, cdtime_t **ret_times, size_t *ret_number)
 
 int uc_get_state (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int ret = STATE_ERROR;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (cache_key_from_vl (&key, vl) != 0)
   {
     ERROR ("uc_get_state: FORMAT_VL failed.");
     return (STATE_ERROR);
   }
+  shard = cache_get_shard (key.hash);
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  if ((ce = cache_shard_get (shard, &key)) != NULL)
   {
     assert (ce != NULL);
     ret = ce->state;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_get_state */
 
 int uc_set_state (const data_set_t *ds, const value_list_t *vl, int state)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int ret = -1;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (cache_key_from_vl (&key, vl) != 0)
   {
     ERROR ("uc_get_state: FORMAT_VL failed.");
     return (STATE_ERROR);
   }
+  shard = cache_get_shard (key.hash);
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  if ((ce = cache_shard_get (shard, &key)) != NULL)
   {
     assert (ce != NULL);
     ret = ce->state;
     ce->state = state;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_set_state */
@@ -697,22 +1013,26 @@ int uc_set_state (const data_set_t *ds, const value_list_t *vl, int state)
 int uc_get_history_by_name (const char *name,
     gauge_t *ret_history, size_t num_steps, size_t num_ds)
 {
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   size_t i;
-  int status = 0;
 
-  pthread_mutex_lock (&cache_lock);
+  cache_key_from_name (&key, name);
+  shard = cache_get_shard (key.hash);
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0)
+  pthread_mutex_lock (&shard->lock);
+
+  ce = cache_shard_get (shard, &key);
+  if (ce == NULL)
   {
-    pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&shard->lock);
     return (-ENOENT);
   }
 
   if (((size_t) ce->values_num) != num_ds)
   {
-    pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&shard->lock);
     return (-EINVAL);
   }
 
@@ -727,7 +1047,7 @@ int uc_get_history_by_name (const char *name,
 	* num_steps * ce->values_num);
     if (tmp == NULL)
     {
-      pthread_mutex_unlock (&cache_lock);
+      pthread_mutex_unlock (&shard->lock);
       return (-ENOMEM);
     }
 
@@ -758,7 +1078,7 @@ int uc_get_history_by_name (const char *name,
 	sizeof (*ret_history) * num_ds);
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (0);
 } /* int uc_get_history_by_name */
@@ -779,77 +1099,83 @@ int uc_get_history (const data_set_t *ds, const value_list_t *vl,
 
 int uc_get_hits (const data_set_t *ds, const value_list_t *vl)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int ret = STATE_ERROR;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (cache_key_from_vl (&key, vl) != 0)
   {
     ERROR ("uc_get_state: FORMAT_VL failed.");
     return (STATE_ERROR);
   }
+  shard = cache_get_shard (key.hash);
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  if ((ce = cache_shard_get (shard, &key)) != NULL)
   {
     assert (ce != NULL);
     ret = ce->hits;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_get_hits */
 
 int uc_set_hits (const data_set_t *ds, const value_list_t *vl, int hits)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int ret = -1;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (cache_key_from_vl (&key, vl) != 0)
   {
     ERROR ("uc_get_state: FORMAT_VL failed.");
     return (STATE_ERROR);
   }
+  shard = cache_get_shard (key.hash);
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  if ((ce = cache_shard_get (shard, &key)) != NULL)
   {
     assert (ce != NULL);
     ret = ce->hits;
     ce->hits = hits;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_set_hits */
 
 int uc_inc_hits (const data_set_t *ds, const value_list_t *vl, int step)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int ret = -1;
 
-  if (FORMAT_VL (name, sizeof (name), vl) != 0)
+  if (cache_key_from_vl (&key, vl) != 0)
   {
     ERROR ("uc_get_state: FORMAT_VL failed.");
     return (STATE_ERROR);
   }
+  shard = cache_get_shard (key.hash);
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  if (c_avl_get (cache_tree, name, (void *) &ce) == 0)
+  if ((ce = cache_shard_get (shard, &key)) != NULL)
   {
     assert (ce != NULL);
     ret = ce->hits;
     ce->hits = ret + step;
   }
 
-  pthread_mutex_unlock (&cache_lock);
+  pthread_mutex_unlock (&shard->lock);
 
   return (ret);
 } /* int uc_inc_hits */
@@ -857,26 +1183,31 @@ int uc_inc_hits (const data_set_t *ds, const value_list_t *vl, int step)
 /*
  * Meta data interface
  */
-/* XXX: This function will acquire `cache_lock' but will not free it! */
-static meta_data_t *uc_get_meta (const value_list_t *vl) /* {{{ */
+/* XXX: This function will acquire the lock of the shard returned in
+ * `ret_shard' but will not free it! */
+static meta_data_t *uc_get_meta (const value_list_t *vl, /* {{{ */
+    cache_shard_t **ret_shard)
 {
-  char name[6 * DATA_MAX_NAME_LEN];
+  cache_entry_t key;
+  cache_shard_t *shard;
   cache_entry_t *ce = NULL;
   int status;
 
-  status = FORMAT_VL (name, sizeof (name), vl);
+  status = cache_key_from_vl (&key, vl);
   if (status != 0)
   {
     ERROR ("utils_cache: uc_get_meta: FORMAT_VL failed.");
     return (NULL);
   }
+  shard = cache_get_shard (key.hash);
+  *ret_shard = shard;
 
-  pthread_mutex_lock (&cache_lock);
+  pthread_mutex_lock (&shard->lock);
 
-  status = c_avl_get (cache_tree, name, (void *) &ce);
-  if (status != 0)
+  ce = cache_shard_get (shard, &key);
+  if (ce == NULL)
   {
-    pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&shard->lock);
     return (NULL);
   }
   assert (ce != NULL);
@@ -885,7 +1216,7 @@ static meta_data_t *uc_get_meta (const value_list_t *vl) /* {{{ */
     ce->meta = meta_data_create ();
 
   if (ce->meta == NULL)
-    pthread_mutex_unlock (&cache_lock);
+    pthread_mutex_unlock (&shard->lock);
 
   return (ce->meta);
 } /* }}} meta_data_t *uc_get_meta */
@@ -893,12 +1224,13 @@ static meta_data_t *uc_get_meta (const value_list_t *vl) /* {{{ */
 /* Sorry about this preprocessor magic, but it really makes this file much
  * shorter.. */
 #define UC_WRAP(wrap_function) { \
+  cache_shard_t *shard; \
   meta_data_t *meta; \
   int status; \
-  meta = uc_get_meta (vl); \
+  meta = uc_get_meta (vl, &shard); \
   if (meta == NULL) return (-1); \
   status = wrap_function (meta, key); \
-  pthread_mutex_unlock (&cache_lock); \
+  pthread_mutex_unlock (&shard->lock); \
   return (status); \
 }
 int uc_meta_data_exists (const value_list_t *vl, const char *key)
@@ -911,12 +1243,13 @@ int uc_meta_data_delete (const value_list_t *vl, const char *key)
 /* We need a new version of this macro because the following functions take
  * two argumetns. */
 #define UC_WRAP(wrap_function) { \
+  cache_shard_t *shard; \
   meta_data_t *meta; \
   int status; \
-  meta = uc_get_meta (vl); \
+  meta = uc_get_meta (vl, &shard); \
   if (meta == NULL) return (-1); \
   status = wrap_function (meta, key, value); \
-  pthread_mutex_unlock (&cache_lock); \
+  pthread_mutex_unlock (&shard->lock); \
   return (status); \
 }
 int uc_meta_data_add_string (const value_list_t *vl,
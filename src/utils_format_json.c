@@ -23,95 +23,181 @@
 #include "plugin.h"
 #include "common.h"
 
+#include "utils_avltree.h"
 #include "utils_cache.h"
 #include "utils_format_json.h"
 
-static int escape_string (char *buffer, size_t buffer_size, /* {{{ */
-    const char *string)
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* The parts of the JSON object which only depend on the data set, i.e.
+ * `,"dstypes":[...],"dsnames":[...]', are built once per type and cached. */
+struct json_ds_fragment_s
+{
+  int    ds_num;
+  char  *fragment;
+  size_t fragment_len;
+};
+typedef struct json_ds_fragment_s json_ds_fragment_t;
+
+static c_avl_tree_t   *ds_fragments = NULL;
+static pthread_mutex_t ds_fragments_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writes JSON directly into the caller's buffer in a single pass. When the
+ * buffer is too small, `overflow' is set and nothing else is written. */
+struct json_writer_s
 {
-  size_t src_pos;
-  size_t dst_pos;
+  char  *buffer;
+  size_t size;
+  size_t pos;
+  _Bool  overflow;
+};
+typedef struct json_writer_s json_writer_t;
 
-  if ((buffer == NULL) || (string == NULL))
-    return (-EINVAL);
+static void jw_add (json_writer_t *jw, const char *data, size_t len) /* {{{ */
+{
+  if (jw->overflow || (len > (jw->size - jw->pos)))
+  {
+    jw->overflow = 1;
+    return;
+  }
 
-  if (buffer_size < 3)
-    return (-ENOMEM);
+  memcpy (jw->buffer + jw->pos, data, len);
+  jw->pos += len;
+} /* }}} void jw_add */
 
-  dst_pos = 0;
+#define JW_ADD_LITERAL(jw, str) jw_add ((jw), (str), sizeof (str) - 1)
 
-#define BUFFER_ADD(c) do { \
-  if (dst_pos >= (buffer_size - 1)) { \
-    buffer[buffer_size - 1] = 0; \
-    return (-ENOMEM); \
-  } \
-  buffer[dst_pos] = (c); \
-  dst_pos++; \
-} while (0)
+static void jw_add_uint64 (json_writer_t *jw, uint64_t value, /* {{{ */
+    _Bool negative)
+{
+  char buffer[24];
+  char *ptr = buffer + sizeof (buffer);
+
+  do
+  {
+    *(--ptr) = '0' + (char) (value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  if (negative)
+    *(--ptr) = '-';
+
+  jw_add (jw, ptr, (size_t) ((buffer + sizeof (buffer)) - ptr));
+} /* }}} void jw_add_uint64 */
+
+static void jw_add_gauge (json_writer_t *jw, gauge_t value) /* {{{ */
+{
+  char buffer[64];
+  int status;
+
+  if (!isfinite (value))
+  {
+    JW_ADD_LITERAL (jw, "null");
+    return;
+  }
+
+  status = ssnprintf (buffer, sizeof (buffer), "%g", value);
+  if ((status < 1) || ((size_t) status >= sizeof (buffer)))
+  {
+    jw->overflow = 1;
+    return;
+  }
+  jw_add (jw, buffer, (size_t) status);
+} /* }}} void jw_add_gauge */
+
+/* Same as "%.3f" with CDTIME_T_TO_DOUBLE, but without floating point
+ * arithmetic. To print the same digits, the time is first rounded to the 53
+ * significant bits of a double, and the milliseconds are then rounded half to
+ * even, as printf(3) does. */
+static void jw_add_time (json_writer_t *jw, cdtime_t t) /* {{{ */
+{
+  uint64_t seconds;
+  uint64_t fraction;
+  uint64_t rest;
+  uint64_t ms;
+  int shift = 0;
+  char buffer[5];
+
+  while ((t >> shift) >= (((uint64_t) 1) << 53))
+    shift++;
+  if (shift > 0)
+  {
+    uint64_t mask = (((uint64_t) 1) << shift) - 1;
+    uint64_t half = ((uint64_t) 1) << (shift - 1);
+    uint64_t low = t & mask;
+
+    t -= low;
+    if ((low > half) || ((low == half) && (((t >> shift) & 1) != 0)))
+      t += mask + 1;
+  }
+
+  seconds = (uint64_t) (t >> 30);
+  fraction = ((uint64_t) (t & 0x3fffffff)) * 1000;
+  ms = fraction >> 30;
+  rest = fraction & 0x3fffffff;
+  if ((rest > 0x20000000) || ((rest == 0x20000000) && ((ms & 1) != 0)))
+    ms++;
+
+  if (ms >= 1000)
+  {
+    seconds++;
+    ms -= 1000;
+  }
+
+  jw_add_uint64 (jw, seconds, /* negative = */ 0);
 
-  /* Escape special characters */
-  BUFFER_ADD ('"');
-  for (src_pos = 0; string[src_pos] != 0; src_pos++)
+  buffer[0] = '.';
+  buffer[1] = '0' + (char) (ms / 100);
+  buffer[2] = '0' + (char) ((ms / 10) % 10);
+  buffer[3] = '0' + (char) (ms % 10);
+  jw_add (jw, buffer, 4);
+} /* }}} void jw_add_time */
+
+/* Adds `string' as a quoted JSON string. */
+static void jw_add_string (json_writer_t *jw, const char *string) /* {{{ */
+{
+  const char *start = string;
+  const char *ptr;
+
+  JW_ADD_LITERAL (jw, "\"");
+
+  /* Copy runs of characters which don't need escaping in one go. */
+  for (ptr = string; *ptr != 0; ptr++)
   {
-    if ((string[src_pos] == '"')
-        || (string[src_pos] == '\\'))
+    if ((*ptr == '"') || (*ptr == '\\'))
     {
-      BUFFER_ADD ('\\');
-      BUFFER_ADD (string[src_pos]);
+      jw_add (jw, start, (size_t) (ptr - start));
+      JW_ADD_LITERAL (jw, "\\");
+      start = ptr;
+    }
+    else if (*ptr <= 0x001F)
+    {
+      jw_add (jw, start, (size_t) (ptr - start));
+      JW_ADD_LITERAL (jw, "?");
+      start = ptr + 1;
     }
-    else if (string[src_pos] <= 0x001F)
-      BUFFER_ADD ('?');
-    else
-      BUFFER_ADD (string[src_pos]);
   } /* for */
-  BUFFER_ADD ('"');
-  buffer[dst_pos] = 0;
-
-#undef BUFFER_ADD
+  jw_add (jw, start, (size_t) (ptr - start));
 
-  return (0);
-} /* }}} int buffer_add_string */
+  JW_ADD_LITERAL (jw, "\"");
+} /* }}} void jw_add_string */
 
-static int values_to_json (char *buffer, size_t buffer_size, /* {{{ */
+static int values_to_json (json_writer_t *jw, /* {{{ */
                 const data_set_t *ds, const value_list_t *vl, int store_rates)
 {
-  size_t offset = 0;
   int i;
   gauge_t *rates = NULL;
 
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  int status; \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-  { \
-    sfree(rates); \
-    return (-1); \
-  } \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-  { \
-    sfree(rates); \
-    return (-ENOMEM); \
-  } \
-  else \
-    offset += ((size_t) status); \
-} while (0)
-
-  BUFFER_ADD ("[");
+  JW_ADD_LITERAL (jw, "[");
   for (i = 0; i < ds->ds_num; i++)
   {
     if (i > 0)
-      BUFFER_ADD (",");
+      JW_ADD_LITERAL (jw, ",");
 
     if (ds->ds[i].type == DS_TYPE_GAUGE)
-    {
-      if(isfinite (vl->values[i].gauge))
-        BUFFER_ADD ("%g", vl->values[i].gauge);
-      else
-        BUFFER_ADD ("null");
-    }
+      jw_add_gauge (jw, vl->values[i].gauge);
     else if (store_rates)
     {
       if (rates == NULL)
@@ -119,21 +205,26 @@ static int values_to_json (char *buffer, size_t buffer_size, /* {{{ */
       if (rates == NULL)
       {
         WARNING ("utils_format_json: uc_get_rate failed.");
-        sfree(rates);
         return (-1);
       }
 
-      if(isfinite (rates[i]))
-        BUFFER_ADD ("%g", rates[i]);
-      else
-        BUFFER_ADD ("null");
+      jw_add_gauge (jw, rates[i]);
     }
     else if (ds->ds[i].type == DS_TYPE_COUNTER)
-      BUFFER_ADD ("%llu", vl->values[i].counter);
+      jw_add_uint64 (jw, (uint64_t) vl->values[i].counter,
+          /* negative = */ 0);
     else if (ds->ds[i].type == DS_TYPE_DERIVE)
-      BUFFER_ADD ("%"PRIi64, vl->values[i].derive);
+    {
+      if (vl->values[i].derive < 0)
+        jw_add_uint64 (jw, (uint64_t) 0 - (uint64_t) vl->values[i].derive,
+            /* negative = */ 1);
+      else
+        jw_add_uint64 (jw, (uint64_t) vl->values[i].derive,
+            /* negative = */ 0);
+    }
     else if (ds->ds[i].type == DS_TYPE_ABSOLUTE)
-      BUFFER_ADD ("%"PRIu64, vl->values[i].absolute);
+      jw_add_uint64 (jw, (uint64_t) vl->values[i].absolute,
+          /* negative = */ 0);
     else
     {
       ERROR ("format_json: Unknown data source type: %i",
@@ -142,174 +233,161 @@ static int values_to_json (char *buffer, size_t buffer_size, /* {{{ */
       return (-1);
     }
   } /* for ds->ds_num */
-  BUFFER_ADD ("]");
+  JW_ADD_LITERAL (jw, "]");
 
-#undef BUFFER_ADD
-
-  DEBUG ("format_json: values_to_json: buffer = %s;", buffer);
   sfree(rates);
   return (0);
 } /* }}} int values_to_json */
 
-static int dstypes_to_json (char *buffer, size_t buffer_size, /* {{{ */
-                const data_set_t *ds, const value_list_t *vl)
+static json_ds_fragment_t *ds_fragment_create (const data_set_t *ds) /* {{{ */
 {
-  size_t offset = 0;
+  json_ds_fragment_t *f;
+  json_writer_t jw;
+  char buffer[4096];
   int i;
 
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  int status; \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
+  memset (&jw, 0, sizeof (jw));
+  jw.buffer = buffer;
+  jw.size = sizeof (buffer);
 
-  BUFFER_ADD ("[");
+  JW_ADD_LITERAL (&jw, ",\"dstypes\":[");
   for (i = 0; i < ds->ds_num; i++)
   {
     if (i > 0)
-      BUFFER_ADD (",");
-
-    BUFFER_ADD ("\"%s\"", DS_TYPE_TO_STRING (ds->ds[i].type));
-  } /* for ds->ds_num */
-  BUFFER_ADD ("]");
-
-#undef BUFFER_ADD
+      JW_ADD_LITERAL (&jw, ",");
+    jw_add_string (&jw, DS_TYPE_TO_STRING (ds->ds[i].type));
+  }
+  JW_ADD_LITERAL (&jw, "],\"dsnames\":[");
+  for (i = 0; i < ds->ds_num; i++)
+  {
+    if (i > 0)
+      JW_ADD_LITERAL (&jw, ",");
+    jw_add_string (&jw, ds->ds[i].name);
+  }
+  JW_ADD_LITERAL (&jw, "]");
 
-  DEBUG ("format_json: dstypes_to_json: buffer = %s;", buffer);
+  if (jw.overflow)
+  {
+    ERROR ("format_json: The data source names of type \"%s\" are too "
+        "long.", ds->type);
+    return (NULL);
+  }
+
+  f = malloc (sizeof (*f));
+  if (f == NULL)
+    return (NULL);
+
+  f->ds_num = ds->ds_num;
+  f->fragment_len = jw.pos;
+  f->fragment = malloc (jw.pos);
+  if (f->fragment == NULL)
+  {
+    sfree (f);
+    return (NULL);
+  }
+  memcpy (f->fragment, buffer, jw.pos);
 
-  return (0);
-} /* }}} int dstypes_to_json */
+  return (f);
+} /* }}} json_ds_fragment_t *ds_fragment_create */
 
-static int dsnames_to_json (char *buffer, size_t buffer_size, /* {{{ */
-                const data_set_t *ds, const value_list_t *vl)
+/* Adds the cached `dstypes' and `dsnames' fragment of `ds'. */
+static int ds_fragment_add (json_writer_t *jw, const data_set_t *ds) /* {{{ */
 {
-  size_t offset = 0;
-  int i;
+  json_ds_fragment_t *f = NULL;
+  int status;
 
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  int status; \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
+  pthread_mutex_lock (&ds_fragments_lock);
 
-  BUFFER_ADD ("[");
-  for (i = 0; i < ds->ds_num; i++)
+  if (ds_fragments == NULL)
   {
-    if (i > 0)
-      BUFFER_ADD (",");
+    ds_fragments = c_avl_create ((void *) strcmp);
+    if (ds_fragments == NULL)
+    {
+      pthread_mutex_unlock (&ds_fragments_lock);
+      return (-1);
+    }
+  }
 
-    BUFFER_ADD ("\"%s\"", ds->ds[i].name);
-  } /* for ds->ds_num */
-  BUFFER_ADD ("]");
+  status = c_avl_get (ds_fragments, ds->type, (void *) &f);
+  /* The data set has been replaced since the fragment was built. */
+  if ((status == 0) && (f->ds_num != ds->ds_num))
+  {
+    char *key = NULL;
+
+    c_avl_remove (ds_fragments, ds->type, (void *) &key, NULL);
+    sfree (key);
+    sfree (f->fragment);
+    sfree (f);
+    status = -1;
+  }
+
+  if (status != 0)
+  {
+    char *key;
 
-#undef BUFFER_ADD
+    f = ds_fragment_create (ds);
+    key = strdup (ds->type);
+    if ((f == NULL) || (key == NULL)
+        || (c_avl_insert (ds_fragments, key, f) != 0))
+    {
+      pthread_mutex_unlock (&ds_fragments_lock);
+      sfree (key);
+      if (f != NULL)
+        sfree (f->fragment);
+      sfree (f);
+      return (-1);
+    }
+  }
 
-  DEBUG ("format_json: dsnames_to_json: buffer = %s;", buffer);
+  jw_add (jw, f->fragment, f->fragment_len);
 
+  pthread_mutex_unlock (&ds_fragments_lock);
   return (0);
-} /* }}} int dsnames_to_json */
+} /* }}} int ds_fragment_add */
 
-static int value_list_to_json (char *buffer, size_t buffer_size, /* {{{ */
+static int value_list_to_json (json_writer_t *jw, /* {{{ */
                 const data_set_t *ds, const value_list_t *vl, int store_rates)
 {
-  char temp[512];
-  size_t offset = 0;
   int status;
 
-  memset (buffer, 0, buffer_size);
-
-#define BUFFER_ADD(...) do { \
-  status = ssnprintf (buffer + offset, buffer_size - offset, \
-      __VA_ARGS__); \
-  if (status < 1) \
-    return (-1); \
-  else if (((size_t) status) >= (buffer_size - offset)) \
-    return (-ENOMEM); \
-  else \
-    offset += ((size_t) status); \
-} while (0)
-
   /* All value lists have a leading comma. The first one will be replaced with
    * a square bracket in `format_json_finalize'. */
-  BUFFER_ADD (",{");
+  JW_ADD_LITERAL (jw, ",{\"values\":");
 
-  status = values_to_json (temp, sizeof (temp), ds, vl, store_rates);
+  status = values_to_json (jw, ds, vl, store_rates);
   if (status != 0)
     return (status);
-  BUFFER_ADD ("\"values\":%s", temp);
 
-  status = dstypes_to_json (temp, sizeof (temp), ds, vl);
+  status = ds_fragment_add (jw, ds);
   if (status != 0)
     return (status);
-  BUFFER_ADD (",\"dstypes\":%s", temp);
 
-  status = dsnames_to_json (temp, sizeof (temp), ds, vl);
-  if (status != 0)
-    return (status);
-  BUFFER_ADD (",\"dsnames\":%s", temp);
-
-  BUFFER_ADD (",\"time\":%.3f", CDTIME_T_TO_DOUBLE (vl->time));
-  BUFFER_ADD (",\"interval\":%.3f", CDTIME_T_TO_DOUBLE (vl->interval));
+  JW_ADD_LITERAL (jw, ",\"time\":");
+  jw_add_time (jw, vl->time);
+  JW_ADD_LITERAL (jw, ",\"interval\":");
+  jw_add_time (jw, vl->interval);
 
-#define BUFFER_ADD_KEYVAL(key, value) do { \
-  status = escape_string (temp, sizeof (temp), (value)); \
-  if (status != 0) \
-    return (status); \
-  BUFFER_ADD (",\"%s\":%s", (key), temp); \
+#define JW_ADD_KEYVAL(key, value) do { \
+  JW_ADD_LITERAL (jw, ",\"" key "\":"); \
+  jw_add_string (jw, (value)); \
 } while (0)
 
-  BUFFER_ADD_KEYVAL ("host", vl->host);
-  BUFFER_ADD_KEYVAL ("plugin", vl->plugin);
-  BUFFER_ADD_KEYVAL ("plugin_instance", vl->plugin_instance);
-  BUFFER_ADD_KEYVAL ("type", vl->type);
-  BUFFER_ADD_KEYVAL ("type_instance", vl->type_instance);
+  JW_ADD_KEYVAL ("host", vl->host);
+  JW_ADD_KEYVAL ("plugin", vl->plugin);
+  JW_ADD_KEYVAL ("plugin_instance", vl->plugin_instance);
+  JW_ADD_KEYVAL ("type", vl->type);
+  JW_ADD_KEYVAL ("type_instance", vl->type_instance);
 
-  BUFFER_ADD ("}");
+  JW_ADD_LITERAL (jw, "}");
 
-#undef BUFFER_ADD_KEYVAL
-#undef BUFFER_ADD
+#undef JW_ADD_KEYVAL
 
-  DEBUG ("format_json: value_list_to_json: buffer = %s;", buffer);
+  if (jw->overflow)
+    return (-ENOMEM);
 
   return (0);
 } /* }}} int value_list_to_json */
 
-static int format_json_value_list_nocheck (char *buffer, /* {{{ */
-    size_t *ret_buffer_fill, size_t *ret_buffer_free,
-    const data_set_t *ds, const value_list_t *vl,
-    int store_rates, size_t temp_size)
-{
-  char temp[temp_size];
-  int status;
-
-  status = value_list_to_json (temp, sizeof (temp), ds, vl, store_rates);
-  if (status != 0)
-    return (status);
-  temp_size = strlen (temp);
-
-  memcpy (buffer + (*ret_buffer_fill), temp, temp_size + 1);
-  (*ret_buffer_fill) += temp_size;
-  (*ret_buffer_free) -= temp_size;
-
-  return (0);
-} /* }}} int format_json_value_list_nocheck */
-
 int format_json_initialize (char *buffer, /* {{{ */
     size_t *ret_buffer_fill, size_t *ret_buffer_free)
 {
@@ -328,7 +406,7 @@ int format_json_initialize (char *buffer, /* {{{ */
   if (buffer_free < 3)
     return (-ENOMEM);
 
-  memset (buffer, 0, buffer_free);
+  buffer[0] = 0;
   *ret_buffer_fill = buffer_fill;
   *ret_buffer_free = buffer_free;
 
@@ -366,6 +444,9 @@ int format_json_value_list (char *buffer, /* {{{ */
     size_t *ret_buffer_fill, size_t *ret_buffer_free,
     const data_set_t *ds, const value_list_t *vl, int store_rates)
 {
+  json_writer_t jw;
+  int status;
+
   if ((buffer == NULL)
       || (ret_buffer_fill == NULL) || (ret_buffer_free == NULL)
       || (ds == NULL) || (vl == NULL))
@@ -374,9 +455,24 @@ int format_json_value_list (char *buffer, /* {{{ */
   if (*ret_buffer_free < 3)
     return (-ENOMEM);
 
-  return (format_json_value_list_nocheck (buffer,
-        ret_buffer_fill, ret_buffer_free, ds, vl,
-        store_rates, (*ret_buffer_free) - 2));
+  /* Leave room for the closing bracket and the null byte. */
+  memset (&jw, 0, sizeof (jw));
+  jw.buffer = buffer + (*ret_buffer_fill);
+  jw.size = (*ret_buffer_free) - 2;
+
+  status = value_list_to_json (&jw, ds, vl, store_rates);
+  if (status != 0)
+  {
+    /* Discard anything written so far. */
+    buffer[*ret_buffer_fill] = 0;
+    return (status);
+  }
+
+  buffer[(*ret_buffer_fill) + jw.pos] = 0;
+  (*ret_buffer_fill) += jw.pos;
+  (*ret_buffer_free) -= jw.pos;
+
+  return (0);
 } /* }}} int format_json_value_list */
 
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -223,4 +223,27 @@ void *c_heap_get_root (c_heap_t *h)
   return (ret);
 } /* void *c_heap_get_root */
 
+void *c_heap_find (c_heap_t *h,
+    int (*match) (const void *ptr, void *user_data), void *user_data)
+{
+  void *ret = NULL;
+  size_t i;
+
+  if ((h == NULL) || (match == NULL))
+    return (NULL);
+
+  pthread_mutex_lock (&h->lock);
+  for (i = 0; i < h->list_len; i++)
+  {
+    if ((*match) (h->list[i], user_data) != 0)
+    {
+      ret = h->list[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock (&h->lock);
+
+  return (ret);
+} /* void *c_heap_find */
+
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -92,5 +92,23 @@ int c_heap_insert (c_heap_t *h, void *ptr);
  */
 void *c_heap_get_root (c_heap_t *h);
 
+/*
+ * NAME
+ *   c_heap_find
+ * DESCRIPTION
+ *   Looks for a value for which the function `match' returns non-zero. The
+ *   values are visited in no particular order. The heap is locked while
+ *   `match' is called, so `match' must not access the heap itself.
+ * PARAMETERS
+ *   `h'           Heap to search.
+ *   `match'       Function called with each value and `user_data'.
+ *   `user_data'   Passed to `match' unchanged.
+ * RETURN VALUE
+ *   The first value for which `match' returned non-zero, or NULL if there is
+ *   no such value.
+ */
+void *c_heap_find (c_heap_t *h,
+    int (*match) (const void *ptr, void *user_data), void *user_data);
+
 #endif /* UTILS_HEAP_H */
 /* vim: set sw=2 sts=2 et : */
@@ -22,10 +22,30 @@
 #include "collectd.h"
 #include "common.h"
 #include "utils_rrdcreate.h"
+#include "utils_avltree.h"
 
 #include <pthread.h>
 #include <rrd.h>
 
+/*
+ * Private types
+ */
+struct async_create_file_s;
+typedef struct async_create_file_s async_create_file_t;
+struct async_create_file_s
+{
+  char *filename;
+  unsigned long pdp_step;
+  time_t last_up;
+
+  char **ds_def;
+  int ds_num;
+  char **rra_def;
+  int rra_num;
+
+  async_create_file_t *next;
+};
+
 /*
  * Private variables
  */
@@ -51,6 +71,22 @@ static int rra_types_num = STATIC_ARRAY_SIZE (rra_types);
 static pthread_mutex_t librrd_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/* Files queued for or in the process of being created, indexed by file name.
+ * The queue is worked on by a thread which exits when it is empty. It is
+ * joined when the next thread is started or by `cu_rrd_create_shutdown'.
+ * Names of files which could not be created are kept in `async_failed' until
+ * `cu_rrd_create_failed' is called for them. */
+static c_avl_tree_t        *async_pending = NULL;
+static c_avl_tree_t        *async_failed = NULL;
+static async_create_file_t *async_head = NULL;
+static async_create_file_t *async_tail = NULL;
+static pthread_t            async_thread;
+static _Bool                async_thread_running = 0;
+static _Bool                async_thread_joinable = 0;
+static _Bool                async_shutdown = 0;
+static double               async_creates_per_second = 0.0;
+static pthread_mutex_t      async_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Private functions
  */
@@ -359,6 +395,250 @@ static int srrd_create (const char *filename, /* {{{ */
 } /* }}} int srrd_create */
 #endif /* !HAVE_THREADSAFE_LIBRRD */
 
+static int srrd_create_args (const char *filename, /* {{{ */
+    unsigned long pdp_step, time_t last_up,
+    char **ds_def, int ds_num, char **rra_def, int rra_num)
+{
+  char **argv;
+  int argc;
+  int status;
+
+  argc = ds_num + rra_num;
+
+  if ((argv = (char **) malloc (sizeof (char *) * (argc + 1))) == NULL)
+  {
+    char errbuf[1024];
+    ERROR ("cu_rrd_create_file failed: %s",
+        sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  memcpy (argv, ds_def, ds_num * sizeof (char *));
+  memcpy (argv + ds_num, rra_def, rra_num * sizeof (char *));
+  argv[ds_num + rra_num] = NULL;
+
+  status = srrd_create (filename, pdp_step, last_up,
+      argc, (const char **) argv);
+
+  free (argv);
+
+  if (status != 0)
+  {
+    WARNING ("cu_rrd_create_file: srrd_create (%s) returned status %i.",
+        filename, status);
+  }
+  else
+  {
+    DEBUG ("cu_rrd_create_file: Successfully created RRD file \"%s\".",
+        filename);
+  }
+
+  return (status);
+} /* }}} int srrd_create_args */
+
+static void async_create_file_free (async_create_file_t *cf) /* {{{ */
+{
+  if (cf == NULL)
+    return;
+
+  ds_free (cf->ds_num, cf->ds_def);
+  rra_free (cf->rra_num, cf->rra_def);
+  sfree (cf->filename);
+  sfree (cf);
+} /* }}} void async_create_file_free */
+
+/* Must hold async_lock */
+static void async_failed_add (const char *filename) /* {{{ */
+{
+  char *key;
+
+  if (async_failed == NULL)
+  {
+    async_failed = c_avl_create ((void *) strcmp);
+    if (async_failed == NULL)
+    {
+      ERROR ("cu_rrd_create_file: c_avl_create failed.");
+      return;
+    }
+  }
+
+  if (c_avl_get (async_failed, filename, NULL) == 0)
+    return;
+
+  key = strdup (filename);
+  if (key == NULL)
+  {
+    ERROR ("cu_rrd_create_file: strdup failed.");
+    return;
+  }
+
+  if (c_avl_insert (async_failed, key, NULL) != 0)
+  {
+    ERROR ("cu_rrd_create_file: c_avl_insert (%s) failed.", filename);
+    sfree (key);
+  }
+} /* }}} void async_failed_add */
+
+static void *srrd_create_thread (void __attribute__((unused)) *data) /* {{{ */
+{
+  cdtime_t next_create = 0;
+
+  while (42)
+  {
+    async_create_file_t *cf;
+    struct stat statbuf;
+    double creates_per_second;
+    int status = 0;
+
+    pthread_mutex_lock (&async_lock);
+    cf = async_head;
+    if (cf == NULL)
+    {
+      async_thread_running = 0;
+      pthread_mutex_unlock (&async_lock);
+      break;
+    }
+    async_head = cf->next;
+    if (async_head == NULL)
+      async_tail = NULL;
+    creates_per_second = async_creates_per_second;
+    pthread_mutex_unlock (&async_lock);
+
+    if (creates_per_second > 0.0)
+    {
+      cdtime_t now = cdtime ();
+
+      if (now < next_create)
+      {
+        struct timespec ts_wait;
+
+        CDTIME_T_TO_TIMESPEC (next_create - now, &ts_wait);
+        while (nanosleep (&ts_wait, &ts_wait) != 0)
+          /* continue */;
+      }
+      else
+        next_create = now;
+
+      next_create += DOUBLE_TO_CDTIME_T (1.0 / creates_per_second);
+    }
+
+    /* The file may have been created by someone else in the meantime. Since
+     * librrd happily overwrites existing files, check again. */
+    if (stat (cf->filename, &statbuf) == 0)
+    {
+      DEBUG ("cu_rrd_create_file: \"%s\" exists already.", cf->filename);
+    }
+    else if (check_create_dir (cf->filename) != 0)
+    {
+      status = -1;
+    }
+    else
+    {
+      status = srrd_create_args (cf->filename, cf->pdp_step, cf->last_up,
+          cf->ds_def, cf->ds_num, cf->rra_def, cf->rra_num);
+      if (status != 0)
+        ERROR ("cu_rrd_create_file: Creating \"%s\" failed.", cf->filename);
+    }
+
+    pthread_mutex_lock (&async_lock);
+    c_avl_remove (async_pending, cf->filename, NULL, NULL);
+    if (status != 0)
+      async_failed_add (cf->filename);
+    pthread_mutex_unlock (&async_lock);
+
+    async_create_file_free (cf);
+  } /* while (42) */
+
+  return ((void *) 0);
+} /* }}} void *srrd_create_thread */
+
+/* Takes ownership of `cf'. */
+static int srrd_create_async (async_create_file_t *cf, /* {{{ */
+    const rrdcreate_config_t *cfg)
+{
+  int status;
+
+  pthread_mutex_lock (&async_lock);
+
+  if (async_shutdown)
+  {
+    pthread_mutex_unlock (&async_lock);
+    async_create_file_free (cf);
+    return (-1);
+  }
+
+  if (async_pending == NULL)
+  {
+    async_pending = c_avl_create ((void *) strcmp);
+    if (async_pending == NULL)
+    {
+      pthread_mutex_unlock (&async_lock);
+      ERROR ("cu_rrd_create_file: c_avl_create failed.");
+      async_create_file_free (cf);
+      return (-1);
+    }
+  }
+
+  /* Already queued */
+  if (c_avl_get (async_pending, cf->filename, NULL) == 0)
+  {
+    pthread_mutex_unlock (&async_lock);
+    async_create_file_free (cf);
+    return (0);
+  }
+
+  status = c_avl_insert (async_pending, cf->filename, cf);
+  if (status != 0)
+  {
+    pthread_mutex_unlock (&async_lock);
+    ERROR ("cu_rrd_create_file: c_avl_insert (%s) failed.", cf->filename);
+    async_create_file_free (cf);
+    return (-1);
+  }
+
+  cf->next = NULL;
+  if (async_tail == NULL)
+    async_head = cf;
+  else
+    async_tail->next = cf;
+  async_tail = cf;
+
+  async_creates_per_second = cfg->creates_per_second;
+
+  if (!async_thread_running)
+  {
+    /* The previous thread has left its loop already. */
+    if (async_thread_joinable)
+    {
+      pthread_join (async_thread, NULL);
+      async_thread_joinable = 0;
+    }
+
+    status = pthread_create (&async_thread, /* attr = */ NULL,
+        srrd_create_thread, /* args = */ NULL);
+    if (status != 0)
+    {
+      char errbuf[1024];
+
+      /* Dequeue again, it's the only entry. */
+      c_avl_remove (async_pending, cf->filename, NULL, NULL);
+      async_head = async_tail = NULL;
+      pthread_mutex_unlock (&async_lock);
+
+      ERROR ("cu_rrd_create_file: pthread_create failed: %s",
+          sstrerror (status, errbuf, sizeof (errbuf)));
+      async_create_file_free (cf);
+      return (-1);
+    }
+    async_thread_running = 1;
+    async_thread_joinable = 1;
+  }
+
+  pthread_mutex_unlock (&async_lock);
+
+  return (0);
+} /* }}} int srrd_create_async */
+
 /*
  * Public functions
  */
@@ -366,8 +646,6 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
     const data_set_t *ds, const value_list_t *vl,
     const rrdcreate_config_t *cfg)
 {
-  char **argv;
-  int argc;
   char **rra_def;
   int rra_num;
   char **ds_def;
@@ -376,7 +654,7 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   time_t last_up;
   unsigned long stepsize;
 
-  if (check_create_dir (filename))
+  if (!cfg->async && check_create_dir (filename))
     return (-1);
 
   if ((rra_num = rra_get (&rra_def, vl, cfg)) < 1)
@@ -388,23 +666,10 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   if ((ds_num = ds_get (&ds_def, ds, vl, cfg)) < 1)
   {
     ERROR ("cu_rrd_create_file failed: Could not calculate DSes");
+    rra_free (rra_num, rra_def);
     return (-1);
   }
 
-  argc = ds_num + rra_num;
-
-  if ((argv = (char **) malloc (sizeof (char *) * (argc + 1))) == NULL)
-  {
-    char errbuf[1024];
-    ERROR ("cu_rrd_create_file failed: %s",
-        sstrerror (errno, errbuf, sizeof (errbuf)));
-    return (-1);
-  }
-
-  memcpy (argv, ds_def, ds_num * sizeof (char *));
-  memcpy (argv + ds_num, rra_def, rra_num * sizeof (char *));
-  argv[ds_num + rra_num] = NULL;
-
   last_up = CDTIME_T_TO_TIME_T (vl->time);
   if (last_up <= 10)
     last_up = time (NULL);
@@ -415,25 +680,113 @@ int cu_rrd_create_file (const char *filename, /* {{{ */
   else
     stepsize = (unsigned long) CDTIME_T_TO_TIME_T (vl->interval);
 
-  status = srrd_create (filename, stepsize, last_up,
-      argc, (const char **) argv);
+  if (cfg->async)
+  {
+    async_create_file_t *cf;
+
+    cf = malloc (sizeof (*cf));
+    if (cf == NULL)
+    {
+      ERROR ("cu_rrd_create_file: malloc failed.");
+      ds_free (ds_num, ds_def);
+      rra_free (rra_num, rra_def);
+      return (-1);
+    }
+    memset (cf, 0, sizeof (*cf));
+
+    cf->filename = strdup (filename);
+    if (cf->filename == NULL)
+    {
+      ERROR ("cu_rrd_create_file: strdup failed.");
+      sfree (cf);
+      ds_free (ds_num, ds_def);
+      rra_free (rra_num, rra_def);
+      return (-1);
+    }
+
+    cf->pdp_step = stepsize;
+    cf->last_up = last_up;
+    cf->ds_def = ds_def;
+    cf->ds_num = ds_num;
+    cf->rra_def = rra_def;
+    cf->rra_num = rra_num;
+
+    return (srrd_create_async (cf, cfg));
+  }
+
+  status = srrd_create_args (filename, stepsize, last_up,
+      ds_def, ds_num, rra_def, rra_num);
 
-  free (argv);
   ds_free (ds_num, ds_def);
   rra_free (rra_num, rra_def);
 
-  if (status != 0)
+  return (status);
+} /* }}} int cu_rrd_create_file */
+
+_Bool cu_rrd_create_pending (const char *filename) /* {{{ */
+{
+  _Bool pending = 0;
+
+  pthread_mutex_lock (&async_lock);
+  if ((async_pending != NULL)
+      && (c_avl_get (async_pending, filename, NULL) == 0))
+    pending = 1;
+  pthread_mutex_unlock (&async_lock);
+
+  return (pending);
+} /* }}} _Bool cu_rrd_create_pending */
+
+_Bool cu_rrd_create_failed (const char *filename) /* {{{ */
+{
+  char *key = NULL;
+
+  pthread_mutex_lock (&async_lock);
+  if (async_failed != NULL)
+    c_avl_remove (async_failed, filename, (void *) &key, NULL);
+  pthread_mutex_unlock (&async_lock);
+
+  if (key == NULL)
+    return (0);
+
+  sfree (key);
+  return (1);
+} /* }}} _Bool cu_rrd_create_failed */
+
+void cu_rrd_create_shutdown (void) /* {{{ */
+{
+  async_create_file_t *cf;
+  int dropped = 0;
+
+  pthread_mutex_lock (&async_lock);
+
+  async_shutdown = 1;
+
+  /* Files that have not been created yet are treated as failed, so their
+   * values are dropped by the caller. */
+  while (async_head != NULL)
   {
-    WARNING ("cu_rrd_create_file: srrd_create (%s) returned status %i.",
-        filename, status);
+    cf = async_head;
+    async_head = cf->next;
+
+    c_avl_remove (async_pending, cf->filename, NULL, NULL);
+    async_failed_add (cf->filename);
+    async_create_file_free (cf);
+    dropped++;
   }
-  else
+  async_tail = NULL;
+
+  pthread_mutex_unlock (&async_lock);
+
+  if (dropped > 0)
+    INFO ("cu_rrd_create_file: Not creating %i queued RRD file%s "
+        "because of shutdown.", dropped, (dropped == 1) ? "" : "s");
+
+  /* Wait for the file currently being created, if any. */
+  if (async_thread_joinable)
   {
-    DEBUG ("cu_rrd_create_file: Successfully created RRD file \"%s\".",
-        filename);
+    pthread_join (async_thread, NULL);
+    async_thread_joinable = 0;
   }
-
-  return (status);
-} /* }}} int cu_rrd_create_file */
+} /* }}} void cu_rrd_create_shutdown */
 
 /* vim: set sw=2 sts=2 et fdm=marker : */
@@ -38,13 +38,33 @@ struct rrdcreate_config_s
 
   char **consolidation_functions;
   size_t consolidation_functions_num;
+
+  /* Create files in a background thread, at most `creates_per_second' files
+   * per second (zero means no limit). */
+  _Bool async;
+  double creates_per_second;
 };
 typedef struct rrdcreate_config_s rrdcreate_config_t;
 
+/* If `cfg->async' is set, the file is only queued for creation and zero is
+ * returned. Use `cu_rrd_create_pending' to find out when it has been
+ * created. */
 int cu_rrd_create_file (const char *filename,
     const data_set_t *ds, const value_list_t *vl,
     const rrdcreate_config_t *cfg);
 
+/* Returns true while `filename' is queued for or in the process of being
+ * created asynchronously. */
+_Bool cu_rrd_create_pending (const char *filename);
+
+/* Returns true if creating `filename' asynchronously has failed. The failure
+ * is reported only once; the next call of `cu_rrd_create_file' retries. */
+_Bool cu_rrd_create_failed (const char *filename);
+
+/* Stops the asynchronous creation of files. Queued files are not created and
+ * reported as failed, the file currently being created is waited for. */
+void cu_rrd_create_shutdown (void);
+
 #endif /* UTILS_RRDCREATE_H */
 
 /* vim: set sw=2 sts=2 et : */
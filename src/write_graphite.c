@@ -45,7 +45,9 @@
 #include "plugin.h"
 #include "configfile.h"
 
+#include "utils_avltree.h"
 #include "utils_cache.h"
+#include "utils_complain.h"
 #include "utils_parse_option.h"
 
 /* Folks without pthread will need to disable this plugin. */
@@ -66,20 +68,87 @@
 # define WG_DEFAULT_ESCAPE '_'
 #endif
 
+#ifndef WG_DEFAULT_PROTOCOL
+# define WG_DEFAULT_PROTOCOL "tcp"
+#endif
+
 /* Ethernet - (IPv6 + TCP) = 1500 - (40 + 32) = 1428 */
 #ifndef WG_SEND_BUF_SIZE
 # define WG_SEND_BUF_SIZE 1428
 #endif
 
+/* Size of the buffer of each connection, holding lines not yet sent. */
+#ifndef WG_DEFAULT_BUFFER_SIZE
+# define WG_DEFAULT_BUFFER_SIZE 1048576
+#endif
+
+/* Maximum number of bytes passed to a single send(2) call over TCP. */
+#ifndef WG_SEND_CHUNK_SIZE
+# define WG_SEND_CHUNK_SIZE 65536
+#endif
+
+/* Data is sent once WG_SEND_BUF_SIZE bytes are available or, at the latest,
+ * after this delay. */
+#define WG_SEND_DELAY TIME_T_TO_CDTIME_T (1)
+
+/* A send(2) over TCP that makes no progress for this long fails, and the
+ * connection is closed, so an unresponsive server can't block the sender
+ * thread forever. */
+#define WG_SEND_TIMEOUT 10
+
+/* Reconnect backoff, doubled after each failed attempt. */
+#define WG_RECONNECT_MIN TIME_T_TO_CDTIME_T (1)
+#define WG_RECONNECT_MAX TIME_T_TO_CDTIME_T (64)
+
+/* Cached metric names are removed after not being used for this many
+ * intervals. */
+#define WG_NAMES_TIMEOUT_INTERVALS 10
+
+/* Largest absolute value formatted by wg_dtoa(). Up to this value the six
+ * decimal places can be represented exactly by a 64 bit integer. */
+#define WG_DTOA_MAX 9007199254.0
+
 /*
  * Private variables
  */
-struct wg_callback
+struct wg_callback;
+
+/* Each connection has its own buffer and a thread sending its contents, so
+ * that a slow or unreachable Carbon server never blocks the write callback.
+ * Lines are appended to the ring buffer by the write callback and removed by
+ * the sender thread once they have been sent. */
+struct wg_connection
 {
+    struct wg_callback *cb;
     int      sock_fd;
 
+    char    *ring;
+    size_t   ring_size;
+    size_t   ring_head; /* position of the first unsent byte */
+    size_t   ring_fill;
+    cdtime_t ring_init_time; /* time the oldest unsent byte was added */
+    _Bool    line_partial; /* the last line was sent only partially */
+    _Bool    skip_line; /* drop the rest of a partially sent line */
+
+    cdtime_t reconnect_next;
+    cdtime_t reconnect_interval;
+
+    _Bool    flush_requested;
+    _Bool    shutdown;
+
+    pthread_t       thread;
+    _Bool           thread_running;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    c_complain_t    drop_complaint;
+};
+
+struct wg_callback
+{
     char    *node;
     char    *service;
+    char    *protocol;
     char    *prefix;
     char    *postfix;
     char     escape_char;
@@ -88,81 +157,37 @@ struct wg_callback
     _Bool    separate_instances;
     _Bool    always_append_ds;
 
-    char     send_buf[WG_SEND_BUF_SIZE];
-    size_t   send_buf_free;
-    size_t   send_buf_fill;
-    cdtime_t send_buf_init_time;
+    struct wg_connection *connections;
+    int      connections_num;
+    size_t   buffer_size;
 
-    pthread_mutex_t send_lock;
+    /* Escaped metric names, one per data source, keyed by the identifier. */
+    c_avl_tree_t   *names;
+    cdtime_t        names_last_purge;
+    pthread_mutex_t names_lock;
+};
+
+struct wg_names_entry
+{
+    char   **keys;
+    int      keys_num;
+    cdtime_t last_used;
 };
 
 
 /*
  * Functions
  */
-static void wg_reset_buffer (struct wg_callback *cb)
-{
-    memset (cb->send_buf, 0, sizeof (cb->send_buf));
-    cb->send_buf_free = sizeof (cb->send_buf);
-    cb->send_buf_fill = 0;
-    cb->send_buf_init_time = cdtime ();
-}
-
-static int wg_send_buffer (struct wg_callback *cb)
+static void wg_connection_close (struct wg_connection *conn)
 {
-    ssize_t status = 0;
-
-    status = swrite (cb->sock_fd, cb->send_buf, strlen (cb->send_buf));
-    if (status < 0)
-    {
-        char errbuf[1024];
-        ERROR ("write_graphite plugin: send failed with status %zi (%s)",
-                status, sstrerror (errno, errbuf, sizeof (errbuf)));
-
-
-        close (cb->sock_fd);
-        cb->sock_fd = -1;
-
-        return (-1);
-    }
-
-    return (0);
-}
-
-/* NOTE: You must hold cb->send_lock when calling this function! */
-static int wg_flush_nolock (cdtime_t timeout, struct wg_callback *cb)
-{
-    int status;
-
-    DEBUG ("write_graphite plugin: wg_flush_nolock: timeout = %.3f; "
-            "send_buf_fill = %zu;",
-            (double)timeout,
-            cb->send_buf_fill);
-
-    /* timeout == 0  => flush unconditionally */
-    if (timeout > 0)
-    {
-        cdtime_t now;
-
-        now = cdtime ();
-        if ((cb->send_buf_init_time + timeout) > now)
-            return (0);
-    }
-
-    if (cb->send_buf_fill <= 0)
-    {
-        cb->send_buf_init_time = cdtime ();
-        return (0);
-    }
-
-    status = wg_send_buffer (cb);
-    wg_reset_buffer (cb);
-
-    return (status);
+    if (conn->sock_fd >= 0)
+        close (conn->sock_fd);
+    conn->sock_fd = -1;
 }
 
-static int wg_callback_init (struct wg_callback *cb)
+static int wg_connection_connect (struct wg_connection *conn)
 {
+    struct wg_callback *cb = conn->cb;
     struct addrinfo ai_hints;
     struct addrinfo *ai_list;
     struct addrinfo *ai_ptr;
@@ -170,8 +195,9 @@ static int wg_callback_init (struct wg_callback *cb)
 
     const char *node = cb->node ? cb->node : WG_DEFAULT_NODE;
     const char *service = cb->service ? cb->service : WG_DEFAULT_SERVICE;
+    const char *protocol = cb->protocol ? cb->protocol : WG_DEFAULT_PROTOCOL;
 
-    if (cb->sock_fd > 0)
+    if (conn->sock_fd >= 0)
         return (0);
 
     memset (&ai_hints, 0, sizeof (ai_hints));
@@ -179,172 +205,545 @@ static int wg_callback_init (struct wg_callback *cb)
     ai_hints.ai_flags |= AI_ADDRCONFIG;
 #endif
     ai_hints.ai_family = AF_UNSPEC;
-    ai_hints.ai_socktype = SOCK_STREAM;
+
+    if (strcasecmp ("udp", protocol) == 0)
+        ai_hints.ai_socktype = SOCK_DGRAM;
+    else
+        ai_hints.ai_socktype = SOCK_STREAM;
 
     ai_list = NULL;
 
     status = getaddrinfo (node, service, &ai_hints, &ai_list);
     if (status != 0)
     {
-        ERROR ("write_graphite plugin: getaddrinfo (%s, %s) failed: %s",
-                node, service, gai_strerror (status));
+        ERROR ("write_graphite plugin: getaddrinfo (%s, %s, %s) failed: %s",
+                node, service, protocol, gai_strerror (status));
         return (-1);
     }
 
     assert (ai_list != NULL);
     for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
     {
-        cb->sock_fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+        conn->sock_fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
                 ai_ptr->ai_protocol);
-        if (cb->sock_fd < 0)
+        if (conn->sock_fd < 0)
             continue;
 
-        status = connect (cb->sock_fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+        /* For UDP this only sets the default destination. */
+        status = connect (conn->sock_fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
         if (status != 0)
         {
-            close (cb->sock_fd);
-            cb->sock_fd = -1;
+            close (conn->sock_fd);
+            conn->sock_fd = -1;
             continue;
         }
 
+        if (ai_ptr->ai_socktype == SOCK_STREAM)
+        {
+            struct timeval tv;
+
+            tv.tv_sec = WG_SEND_TIMEOUT;
+            tv.tv_usec = 0;
+            if (setsockopt (conn->sock_fd, SOL_SOCKET, SO_SNDTIMEO,
+                        &tv, sizeof (tv)) != 0)
+            {
+                char errbuf[1024];
+                WARNING ("write_graphite plugin: setsockopt (SO_SNDTIMEO) "
+                        "failed: %s",
+                        sstrerror (errno, errbuf, sizeof (errbuf)));
+            }
+        }
+
         break;
     }
 
     freeaddrinfo (ai_list);
 
-    if (cb->sock_fd < 0)
+    if (conn->sock_fd < 0)
     {
         char errbuf[1024];
-        ERROR ("write_graphite plugin: Connecting to %s:%s failed. "
-                "The last error was: %s", node, service,
+        ERROR ("write_graphite plugin: Connecting to %s:%s via %s failed. "
+                "The last error was: %s", node, service, protocol,
                 sstrerror (errno, errbuf, sizeof (errbuf)));
-        close (cb->sock_fd);
         return (-1);
     }
 
-    wg_reset_buffer (cb);
+    return (0);
+}
+
+/* Copies up to `buffer_size' unsent bytes to `buffer'. Unless `whole_lines'
+ * is false, only complete lines are copied.
+ * NOTE: You must hold conn->lock when calling this function! */
+static size_t wg_ring_peek (struct wg_connection *conn,
+        char *buffer, size_t buffer_size, _Bool whole_lines)
+{
+    size_t len;
+    size_t first;
+
+    len = conn->ring_fill;
+    if (len > buffer_size)
+        len = buffer_size;
+
+    first = conn->ring_size - conn->ring_head;
+    if (first > len)
+        first = len;
+
+    memcpy (buffer, conn->ring + conn->ring_head, first);
+    memcpy (buffer + first, conn->ring, len - first);
+
+    if (whole_lines)
+    {
+        while ((len > 0) && (buffer[len - 1] != '\n'))
+            len--;
+    }
+
+    return (len);
+}
+
+/* NOTE: You must hold conn->lock when calling this function! */
+static void wg_ring_consume (struct wg_connection *conn, size_t len)
+{
+    assert (len <= conn->ring_fill);
+
+    conn->ring_head = (conn->ring_head + len) % conn->ring_size;
+    conn->ring_fill -= len;
+    conn->ring_init_time = cdtime ();
+}
+
+/* NOTE: You must hold conn->lock when calling this function! */
+static int wg_ring_append (struct wg_connection *conn,
+        const char *message, size_t message_len)
+{
+    size_t tail;
+    size_t first;
+
+    if ((conn->ring_size - conn->ring_fill) < message_len)
+        return (-1);
+
+    if (conn->ring_fill == 0)
+        conn->ring_init_time = cdtime ();
+
+    tail = (conn->ring_head + conn->ring_fill) % conn->ring_size;
+    first = conn->ring_size - tail;
+    if (first > message_len)
+        first = message_len;
+
+    memcpy (conn->ring + tail, message, first);
+    memcpy (conn->ring, message + first, message_len - first);
+    conn->ring_fill += message_len;
 
     return (0);
 }
 
+/* After a connection broke in the middle of a line, skip the remainder of
+ * that line so the server doesn't receive garbage.
+ * NOTE: You must hold conn->lock when calling this function! */
+static void wg_ring_skip_line (struct wg_connection *conn)
+{
+    while (conn->skip_line && (conn->ring_fill > 0))
+    {
+        if (conn->ring[conn->ring_head] == '\n')
+            conn->skip_line = 0;
+        wg_ring_consume (conn, 1);
+    }
+}
+
+static void *wg_sender_thread (void *arg)
+{
+    struct wg_connection *conn = arg;
+    _Bool is_udp;
+    char *buffer;
+    size_t buffer_size;
+
+    is_udp = ((conn->cb->protocol != NULL)
+            && (strcasecmp ("udp", conn->cb->protocol) == 0));
+
+    /* Datagrams contain whole lines and must fit into a single packet. */
+    buffer_size = is_udp ? WG_SEND_BUF_SIZE : WG_SEND_CHUNK_SIZE;
+    buffer = malloc (buffer_size);
+    if (buffer == NULL)
+    {
+        ERROR ("write_graphite plugin: malloc failed.");
+        return ((void *) 0);
+    }
+
+    pthread_mutex_lock (&conn->lock);
+    while (42)
+    {
+        struct timespec ts_wait;
+        cdtime_t deadline;
+        ssize_t status;
+        size_t len;
+
+        wg_ring_skip_line (conn);
+
+        if (conn->ring_fill == 0)
+        {
+            conn->flush_requested = 0;
+            if (conn->shutdown)
+                break;
+
+            pthread_cond_wait (&conn->cond, &conn->lock);
+            continue;
+        }
+
+        if (conn->shutdown || conn->flush_requested
+                || (conn->ring_fill >= WG_SEND_BUF_SIZE))
+            deadline = 0;
+        else
+            deadline = conn->ring_init_time + WG_SEND_DELAY;
+
+        /* Wait for the reconnect backoff, except when shutting down. */
+        if ((conn->sock_fd < 0) && !conn->shutdown
+                && (deadline < conn->reconnect_next))
+            deadline = conn->reconnect_next;
+
+        if (cdtime () < deadline)
+        {
+            CDTIME_T_TO_TIMESPEC (deadline, &ts_wait);
+            pthread_cond_timedwait (&conn->cond, &conn->lock, &ts_wait);
+            continue;
+        }
+
+        len = wg_ring_peek (conn, buffer, buffer_size, is_udp);
+        pthread_mutex_unlock (&conn->lock);
+
+        /* Send without holding the lock, so writers can append. Only this
+         * thread removes data from the buffer. */
+        status = -1;
+        if (wg_connection_connect (conn) == 0)
+        {
+            status = send (conn->sock_fd, buffer, len, MSG_NOSIGNAL);
+            if (status < 0)
+            {
+                char errbuf[1024];
+                ERROR ("write_graphite plugin: send failed: %s",
+                        sstrerror (errno, errbuf, sizeof (errbuf)));
+                wg_connection_close (conn);
+            }
+        }
+
+        pthread_mutex_lock (&conn->lock);
+        if (status >= 0)
+        {
+            wg_ring_consume (conn, (size_t) status);
+            conn->reconnect_interval = WG_RECONNECT_MIN;
+            conn->reconnect_next = 0;
+
+            /* A partial send(2) is continued by the next call. */
+            if (status > 0)
+                conn->line_partial = (buffer[status - 1] != '\n');
+            continue;
+        }
+
+        /* The beginning of the current line went out over the broken
+         * connection, so the rest of it is useless. */
+        if (conn->line_partial)
+            conn->skip_line = 1;
+        conn->line_partial = 0;
+
+        if (conn->shutdown)
+        {
+            WARNING ("write_graphite plugin: Shutting down, dropping %zu "
+                    "bytes of unsent data.", conn->ring_fill);
+            wg_ring_consume (conn, conn->ring_fill);
+            conn->skip_line = 0;
+            continue;
+        }
+
+        conn->reconnect_next = cdtime () + conn->reconnect_interval;
+        conn->reconnect_interval *= 2;
+        if (conn->reconnect_interval > WG_RECONNECT_MAX)
+            conn->reconnect_interval = WG_RECONNECT_MAX;
+    } /* while (42) */
+    pthread_mutex_unlock (&conn->lock);
+
+    sfree (buffer);
+    return ((void *) 0);
+}
+
+/* NOTE: You must hold conn->lock when calling this function! */
+static int wg_connection_start (struct wg_connection *conn)
+{
+    int status;
+
+    if (conn->thread_running)
+        return (0);
+
+    status = pthread_create (&conn->thread, /* attr = */ NULL,
+            wg_sender_thread, conn);
+    if (status != 0)
+    {
+        char errbuf[1024];
+        ERROR ("write_graphite plugin: pthread_create failed: %s",
+                sstrerror (status, errbuf, sizeof (errbuf)));
+        return (-1);
+    }
+    conn->thread_running = 1;
+
+    return (0);
+}
+
+static void wg_names_entry_free (struct wg_names_entry *entry)
+{
+    int i;
+
+    if (entry == NULL)
+        return;
+
+    for (i = 0; i < entry->keys_num; i++)
+        sfree (entry->keys[i]);
+    sfree (entry->keys);
+    sfree (entry);
+}
+
 static void wg_callback_free (void *data)
 {
     struct wg_callback *cb;
+    int i;
 
     if (data == NULL)
         return;
 
     cb = data;
 
-    pthread_mutex_lock (&cb->send_lock);
+    /* The sender threads send what's left in the buffers before exiting. */
+    for (i = 0; i < cb->connections_num; i++)
+    {
+        struct wg_connection *conn = cb->connections + i;
+
+        pthread_mutex_lock (&conn->lock);
+        conn->shutdown = 1;
+        pthread_cond_signal (&conn->cond);
+        pthread_mutex_unlock (&conn->lock);
+    }
+
+    for (i = 0; i < cb->connections_num; i++)
+    {
+        struct wg_connection *conn = cb->connections + i;
 
-    wg_flush_nolock (/* timeout = */ 0, cb);
+        if (conn->thread_running)
+            pthread_join (conn->thread, NULL);
+        conn->thread_running = 0;
 
-    close(cb->sock_fd);
-    cb->sock_fd = -1;
+        wg_connection_close (conn);
+        sfree (conn->ring);
+        pthread_mutex_destroy (&conn->lock);
+        pthread_cond_destroy (&conn->cond);
+    }
+    sfree (cb->connections);
 
     sfree(cb->node);
     sfree(cb->service);
+    sfree(cb->protocol);
     sfree(cb->prefix);
     sfree(cb->postfix);
 
-    pthread_mutex_destroy (&cb->send_lock);
+    if (cb->names != NULL)
+    {
+        char *identifier;
+        struct wg_names_entry *entry;
+
+        while (c_avl_pick (cb->names, (void *) &identifier,
+                    (void *) &entry) == 0)
+        {
+            sfree (identifier);
+            wg_names_entry_free (entry);
+        }
+        c_avl_destroy (cb->names);
+    }
+
+    pthread_mutex_destroy (&cb->names_lock);
 
     sfree(cb);
 }
 
-static int wg_flush (cdtime_t timeout,
+static int wg_flush (cdtime_t timeout __attribute__((unused)),
         const char *identifier __attribute__((unused)),
         user_data_t *user_data)
 {
     struct wg_callback *cb;
-    int status;
+    int i;
 
     if (user_data == NULL)
         return (-EINVAL);
 
     cb = user_data->data;
 
-    pthread_mutex_lock (&cb->send_lock);
+    /* Ask the sender threads to send all buffered data now. */
+    for (i = 0; i < cb->connections_num; i++)
+    {
+        struct wg_connection *conn = cb->connections + i;
 
-    if (cb->sock_fd < 0)
+        pthread_mutex_lock (&conn->lock);
+        conn->flush_requested = 1;
+        pthread_cond_signal (&conn->cond);
+        pthread_mutex_unlock (&conn->lock);
+    }
+
+    return (0);
+}
+
+/* Writes the decimal representation of `value' to `ret', with a minus sign
+ * if `negative' is true. This is a lot faster than snprintf(3). */
+static int wg_utoa (char *ret, size_t ret_len, uint64_t value,
+        _Bool negative)
+{
+    char buffer[24];
+    char *ptr = buffer + sizeof (buffer);
+    size_t len;
+
+    do
     {
-        status = wg_callback_init (cb);
-        if (status != 0)
+        *(--ptr) = '0' + (char) (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    if (negative)
+        *(--ptr) = '-';
+
+    len = (size_t) ((buffer + sizeof (buffer)) - ptr);
+    if (len >= ret_len)
+        return (-1);
+
+    memcpy (ret, ptr, len);
+    ret[len] = 0;
+    return (0);
+}
+
+/* Writes `value' with up to six decimal places, omitting trailing zeros, to
+ * `ret'. Returns an error if the value is not finite or too large, in which
+ * case the caller should fall back to snprintf(3). */
+static int wg_dtoa (char *ret, size_t ret_len, double value)
+{
+    char buffer[32];
+    char *ptr = buffer + sizeof (buffer);
+    uint64_t scaled;
+    uint64_t int_part;
+    uint64_t frac_part;
+    _Bool negative;
+    int digits;
+    size_t len;
+
+    if (!isfinite (value) || (fabs (value) >= WG_DTOA_MAX))
+        return (-1);
+
+    negative = (value < 0.0);
+    if (negative)
+        value = -value;
+
+    scaled = (uint64_t) ((value * 1000000.0) + 0.5);
+    int_part = scaled / 1000000;
+    frac_part = scaled % 1000000;
+
+    digits = 6;
+    while ((digits > 0) && ((frac_part % 10) == 0))
+    {
+        frac_part /= 10;
+        digits--;
+    }
+
+    if (digits > 0)
+    {
+        while (digits > 0)
         {
-            ERROR ("write_graphite plugin: wg_callback_init failed.");
-            pthread_mutex_unlock (&cb->send_lock);
-            return (-1);
+            *(--ptr) = '0' + (char) (frac_part % 10);
+            frac_part /= 10;
+            digits--;
         }
+        *(--ptr) = '.';
     }
 
-    status = wg_flush_nolock (timeout, cb);
-    pthread_mutex_unlock (&cb->send_lock);
+    do
+    {
+        *(--ptr) = '0' + (char) (int_part % 10);
+        int_part /= 10;
+    } while (int_part != 0);
 
-    return (status);
+    if (negative && (scaled != 0))
+        *(--ptr) = '-';
+
+    len = (size_t) ((buffer + sizeof (buffer)) - ptr);
+    if (len >= ret_len)
+        return (-1);
+
+    memcpy (ret, ptr, len);
+    ret[len] = 0;
+    return (0);
 }
 
 static int wg_format_values (char *ret, size_t ret_len,
         int ds_num, const data_set_t *ds, const value_list_t *vl,
         _Bool store_rates)
 {
-    size_t offset = 0;
     int status;
     gauge_t *rates = NULL;
 
     assert (0 == strcmp (ds->type, vl->type));
 
-    memset (ret, 0, ret_len);
-
-#define BUFFER_ADD(...) do { \
-    status = ssnprintf (ret + offset, ret_len - offset, \
-            __VA_ARGS__); \
-    if (status < 1) \
-    { \
-        sfree (rates); \
-        return (-1); \
-    } \
-    else if (((size_t) status) >= (ret_len - offset)) \
-    { \
-        sfree (rates); \
-        return (-1); \
-    } \
-    else \
-    offset += ((size_t) status); \
-} while (0)
-
     if (ds->ds[ds_num].type == DS_TYPE_GAUGE)
-        BUFFER_ADD ("%f", vl->values[ds_num].gauge);
+    {
+        gauge_t value = vl->values[ds_num].gauge;
+
+        status = wg_dtoa (ret, ret_len, value);
+        if (status != 0)
+        {
+            status = ssnprintf (ret, ret_len, "%f", value);
+            status = ((status < 1) || ((size_t) status >= ret_len)) ? -1 : 0;
+        }
+    }
     else if (store_rates)
     {
-        if (rates == NULL)
-            rates = uc_get_rate (ds, vl);
+        gauge_t value;
+
+        rates = uc_get_rate (ds, vl);
         if (rates == NULL)
         {
             WARNING ("format_values: "
                     "uc_get_rate failed.");
             return (-1);
         }
-        BUFFER_ADD ("%g", rates[ds_num]);
+        value = rates[ds_num];
+        sfree (rates);
+
+        /* Six decimal places don't give six significant digits, as "%g"
+         * does, for small rates. */
+        if ((value != 0.0) && (fabs (value) < 0.1))
+            status = -1;
+        else
+            status = wg_dtoa (ret, ret_len, value);
+
+        if (status != 0)
+        {
+            status = ssnprintf (ret, ret_len, "%g", value);
+            status = ((status < 1) || ((size_t) status >= ret_len)) ? -1 : 0;
+        }
     }
     else if (ds->ds[ds_num].type == DS_TYPE_COUNTER)
-        BUFFER_ADD ("%llu", vl->values[ds_num].counter);
+        status = wg_utoa (ret, ret_len,
+                (uint64_t) vl->values[ds_num].counter, /* negative = */ 0);
     else if (ds->ds[ds_num].type == DS_TYPE_DERIVE)
-        BUFFER_ADD ("%"PRIi64, vl->values[ds_num].derive);
+    {
+        derive_t value = vl->values[ds_num].derive;
+
+        if (value < 0)
+            status = wg_utoa (ret, ret_len,
+                    (uint64_t) 0 - (uint64_t) value, /* negative = */ 1);
+        else
+            status = wg_utoa (ret, ret_len,
+                    (uint64_t) value, /* negative = */ 0);
+    }
     else if (ds->ds[ds_num].type == DS_TYPE_ABSOLUTE)
-        BUFFER_ADD ("%"PRIu64, vl->values[ds_num].absolute);
+        status = wg_utoa (ret, ret_len,
+                (uint64_t) vl->values[ds_num].absolute, /* negative = */ 0);
     else
     {
         ERROR ("format_values plugin: Unknown data source type: %i",
                 ds->ds[ds_num].type);
-        sfree (rates);
         return (-1);
     }
 
-#undef BUFFER_ADD
-
-    sfree (rates);
-    return (0);
+    return (status);
 }
 
 static void wg_copy_escape_part (char *dst, const char *src, size_t dst_len,
@@ -436,65 +835,234 @@ static int wg_format_name (char *ret, int ret_len,
     return (0);
 }
 
+static struct wg_names_entry *wg_names_entry_create (const data_set_t *ds,
+        const value_list_t *vl, const struct wg_callback *cb)
+{
+    struct wg_names_entry *entry;
+    char key[10*DATA_MAX_NAME_LEN];
+    int status, i;
+
+    entry = malloc (sizeof (*entry));
+    if (entry == NULL)
+        return (NULL);
+    memset (entry, 0, sizeof (*entry));
+
+    entry->keys = calloc ((size_t) ds->ds_num, sizeof (*entry->keys));
+    if (entry->keys == NULL)
+    {
+        sfree (entry);
+        return (NULL);
+    }
+
+    for (i = 0; i < ds->ds_num; i++)
+    {
+        const char *ds_name = NULL;
+
+        if (cb->always_append_ds || (ds->ds_num > 1))
+            ds_name = ds->ds[i].name;
+
+        /* Copy the identifier to `key' and escape it. */
+        status = wg_format_name (key, sizeof (key), vl, cb, ds_name);
+        if (status != 0)
+        {
+            ERROR ("write_graphite plugin: error with format_name");
+            wg_names_entry_free (entry);
+            return (NULL);
+        }
+
+        escape_string (key, sizeof (key));
+
+        entry->keys[i] = strdup (key);
+        if (entry->keys[i] == NULL)
+        {
+            wg_names_entry_free (entry);
+            return (NULL);
+        }
+        entry->keys_num++;
+    }
+
+    return (entry);
+}
+
+/* Removes names which haven't been used for a while.
+ * NOTE: You must hold cb->names_lock when calling this function! */
+static void wg_names_purge (struct wg_callback *cb, cdtime_t now)
+{
+    c_avl_iterator_t *iter;
+    char *identifier;
+    struct wg_names_entry *entry;
+    char **stale = NULL;
+    int stale_num = 0;
+    int i;
+
+    iter = c_avl_get_iterator (cb->names);
+    while (c_avl_iterator_next (iter, (void *) &identifier,
+                (void *) &entry) == 0)
+    {
+        char **tmp;
+
+        if ((now - entry->last_used)
+                < (WG_NAMES_TIMEOUT_INTERVALS * interval_g))
+            continue;
+
+        tmp = realloc (stale, (stale_num + 1) * sizeof (*stale));
+        if (tmp == NULL)
+            break;
+        stale = tmp;
+        stale[stale_num] = identifier;
+        stale_num++;
+    }
+    c_avl_iterator_destroy (iter);
+
+    for (i = 0; i < stale_num; i++)
+    {
+        if (c_avl_remove (cb->names, stale[i], (void *) &identifier,
+                    (void *) &entry) != 0)
+            continue;
+
+        sfree (identifier);
+        wg_names_entry_free (entry);
+    }
+    sfree (stale);
+
+    cb->names_last_purge = now;
+}
+
+/* Copies the escaped metric name of data source `ds_index' of `vl' to `ret'.
+ * The names are built once per identifier and then taken from the cache. */
+static int wg_get_key (char *ret, size_t ret_len, const char *identifier,
+        int ds_index, const data_set_t *ds, const value_list_t *vl,
+        struct wg_callback *cb)
+{
+    struct wg_names_entry *entry = NULL;
+    cdtime_t now;
+
+    now = cdtime ();
+
+    pthread_mutex_lock (&cb->names_lock);
+
+    if (c_avl_get (cb->names, identifier, (void *) &entry) != 0)
+    {
+        char *identifier_copy;
+
+        entry = wg_names_entry_create (ds, vl, cb);
+        identifier_copy = strdup (identifier);
+        if ((entry == NULL) || (identifier_copy == NULL)
+                || (c_avl_insert (cb->names, identifier_copy, entry) != 0))
+        {
+            pthread_mutex_unlock (&cb->names_lock);
+            ERROR ("write_graphite plugin: Caching the metric name of "
+                    "\"%s\" failed.", identifier);
+            sfree (identifier_copy);
+            wg_names_entry_free (entry);
+            return (-1);
+        }
+    }
+
+    if (ds_index >= entry->keys_num)
+    {
+        pthread_mutex_unlock (&cb->names_lock);
+        ERROR ("write_graphite plugin: Data source %i of \"%s\" is not "
+                "cached.", ds_index, identifier);
+        return (-1);
+    }
+
+    sstrncpy (ret, entry->keys[ds_index], ret_len);
+    entry->last_used = now;
+
+    if ((now - cb->names_last_purge) >= interval_g)
+        wg_names_purge (cb, now);
+
+    pthread_mutex_unlock (&cb->names_lock);
+
+    return (0);
+}
+
 static int wg_send_message (const char* key, const char* value,
         cdtime_t time, struct wg_callback *cb)
 {
+    struct wg_connection *conn;
     int status;
+    size_t key_len;
+    size_t value_len;
     size_t message_len;
     char message[1024];
+    char time_str[24];
 
-    message_len = (size_t) ssnprintf (message, sizeof (message),
-            "%s %s %u\r\n",
-            key,
-            value,
-            (unsigned int) CDTIME_T_TO_TIME_T (time));
+    wg_utoa (time_str, sizeof (time_str),
+            (uint64_t) CDTIME_T_TO_TIME_T (time), /* negative = */ 0);
+
+    /* Assemble "<key> <value> <time>\r\n" without going through
+     * snprintf(3). */
+    key_len = strlen (key);
+    value_len = strlen (value);
+    message_len = key_len + value_len + strlen (time_str) + 4;
     if (message_len >= sizeof (message)) {
         ERROR ("write_graphite plugin: message buffer too small: "
                 "Need %zu bytes.", message_len + 1);
         return (-1);
     }
 
-    pthread_mutex_lock (&cb->send_lock);
-
-    if (cb->sock_fd < 0)
+    memcpy (message, key, key_len);
+    message[key_len] = ' ';
+    memcpy (message + key_len + 1, value, value_len);
+    message[key_len + 1 + value_len] = ' ';
+    sstrncpy (message + key_len + value_len + 2, time_str,
+            sizeof (message) - (key_len + value_len + 2));
+    memcpy (message + message_len - 2, "\r\n", 3);
+
+    /* Lines are distributed over the connections by the metric name, so
+     * that all values of one metric use the same connection. */
+    conn = cb->connections;
+    if (cb->connections_num > 1)
     {
-        status = wg_callback_init (cb);
-        if (status != 0)
-        {
-            ERROR ("write_graphite plugin: wg_callback_init failed.");
-            pthread_mutex_unlock (&cb->send_lock);
-            return (-1);
-        }
+        uint32_t hash = fnv1a_hash (key, key_len);
+
+        conn = cb->connections + (hash % ((uint32_t) cb->connections_num));
     }
 
-    if (message_len >= cb->send_buf_free)
+    pthread_mutex_lock (&conn->lock);
+
+    /* Start the sender thread on first use rather than during
+     * configuration, which happens before the daemon forks. */
+    if (wg_connection_start (conn) != 0)
     {
-        status = wg_flush_nolock (/* timeout = */ 0, cb);
-        if (status != 0)
-        {
-            pthread_mutex_unlock (&cb->send_lock);
-            return (status);
-        }
+        pthread_mutex_unlock (&conn->lock);
+        return (-1);
     }
 
-    /* Assert that we have enough space for this message. */
-    assert (message_len < cb->send_buf_free);
+    status = wg_ring_append (conn, message, message_len);
+    if (status != 0)
+    {
+        pthread_mutex_unlock (&conn->lock);
+        c_complain (LOG_ERR, &conn->drop_complaint,
+                "write_graphite plugin: The send buffer for %s:%s is "
+                "full. Dropping values.",
+                cb->node != NULL ? cb->node : WG_DEFAULT_NODE,
+                cb->service != NULL ? cb->service : WG_DEFAULT_SERVICE);
+        return (-1);
+    }
 
-    /* `message_len + 1' because `message_len' does not include the
-     * trailing null byte. Neither does `send_buffer_fill'. */
-    memcpy (cb->send_buf + cb->send_buf_fill,
-            message, message_len + 1);
-    cb->send_buf_fill += message_len;
-    cb->send_buf_free -= message_len;
+    /* Wake up the sender once a packet's worth of data is available. */
+    if ((conn->ring_fill >= WG_SEND_BUF_SIZE)
+            && ((conn->ring_fill - message_len) < WG_SEND_BUF_SIZE))
+        pthread_cond_signal (&conn->cond);
+    else if (conn->ring_fill == message_len)
+        pthread_cond_signal (&conn->cond);
 
     DEBUG ("write_graphite plugin: [%s]:%s buf %zu/%zu (%.1f %%) \"%s\"",
             cb->node,
             cb->service,
-            cb->send_buf_fill, sizeof (cb->send_buf),
-            100.0 * ((double) cb->send_buf_fill) / ((double) sizeof (cb->send_buf)),
+            conn->ring_fill, conn->ring_size,
+            100.0 * ((double) conn->ring_fill) / ((double) conn->ring_size),
             message);
 
-    pthread_mutex_unlock (&cb->send_lock);
+    pthread_mutex_unlock (&conn->lock);
+
+    c_release (LOG_INFO, &conn->drop_complaint,
+            "write_graphite plugin: Accepting values for %s:%s again.",
+            cb->node != NULL ? cb->node : WG_DEFAULT_NODE,
+            cb->service != NULL ? cb->service : WG_DEFAULT_SERVICE);
 
     return (0);
 }
@@ -502,6 +1070,7 @@ static int wg_send_message (const char* key, const char* value,
 static int wg_write_messages (const data_set_t *ds, const value_list_t *vl,
         struct wg_callback *cb)
 {
+    char identifier[6 * DATA_MAX_NAME_LEN];
     char key[10*DATA_MAX_NAME_LEN];
     char values[512];
 
@@ -514,22 +1083,19 @@ static int wg_write_messages (const data_set_t *ds, const value_list_t *vl,
         return -1;
     }
 
-    for (i = 0; i < ds->ds_num; i++)
+    status = FORMAT_VL (identifier, sizeof (identifier), vl);
+    if (status != 0)
     {
-        const char *ds_name = NULL;
-
-        if (cb->always_append_ds || (ds->ds_num > 1))
-            ds_name = ds->ds[i].name;
+        ERROR ("write_graphite plugin: FORMAT_VL failed.");
+        return (status);
+    }
 
-        /* Copy the identifier to `key' and escape it. */
-        status = wg_format_name (key, sizeof (key), vl, cb, ds_name);
+    for (i = 0; i < ds->ds_num; i++)
+    {
+        /* Look up the escaped name of this metric. */
+        status = wg_get_key (key, sizeof (key), identifier, i, ds, vl, cb);
         if (status != 0)
-        {
-            ERROR ("write_graphite plugin: error with format_name");
             return (status);
-        }
-
-        escape_string (key, sizeof (key));
         /* Convert the values to an ASCII representation and put that into
          * `values'. */
         status = wg_format_values (values, sizeof (values), i, ds, vl,
@@ -615,15 +1181,25 @@ static int wg_config_carbon (oconfig_item_t *ci)
         return (-1);
     }
     memset (cb, 0, sizeof (*cb));
-    cb->sock_fd = -1;
     cb->node = NULL;
     cb->service = NULL;
+    cb->protocol = NULL;
     cb->prefix = NULL;
     cb->postfix = NULL;
     cb->escape_char = WG_DEFAULT_ESCAPE;
     cb->store_rates = 1;
+    cb->connections_num = 1;
+    cb->buffer_size = WG_DEFAULT_BUFFER_SIZE;
+
+    pthread_mutex_init (&cb->names_lock, /* attr = */ NULL);
 
-    pthread_mutex_init (&cb->send_lock, /* attr = */ NULL);
+    cb->names = c_avl_create ((void *) strcmp);
+    if (cb->names == NULL)
+    {
+        ERROR ("write_graphite plugin: c_avl_create failed.");
+        wg_callback_free (cb);
+        return (-1);
+    }
 
     for (i = 0; i < ci->children_num; i++)
     {
@@ -633,6 +1209,40 @@ static int wg_config_carbon (oconfig_item_t *ci)
             cf_util_get_string (child, &cb->node);
         else if (strcasecmp ("Port", child->key) == 0)
             cf_util_get_service (child, &cb->service);
+        else if (strcasecmp ("Protocol", child->key) == 0)
+        {
+            cf_util_get_string (child, &cb->protocol);
+
+            if ((cb->protocol != NULL)
+                    && (strcasecmp ("udp", cb->protocol) != 0)
+                    && (strcasecmp ("tcp", cb->protocol) != 0))
+            {
+                ERROR ("write_graphite plugin: Unknown protocol (%s). "
+                        "Using \"%s\" instead.",
+                        cb->protocol, WG_DEFAULT_PROTOCOL);
+                sfree (cb->protocol);
+            }
+        }
+        else if (strcasecmp ("Connections", child->key) == 0)
+        {
+            int tmp = cb->connections_num;
+            cf_util_get_int (child, &tmp);
+            if (tmp < 1)
+                ERROR ("write_graphite plugin: \"Connections\" must be "
+                        "at least 1.");
+            else
+                cb->connections_num = tmp;
+        }
+        else if (strcasecmp ("BufferSize", child->key) == 0)
+        {
+            int tmp = (int) cb->buffer_size;
+            cf_util_get_int (child, &tmp);
+            if (tmp < (2 * WG_SEND_BUF_SIZE))
+                ERROR ("write_graphite plugin: \"BufferSize\" must be "
+                        "at least %i.", 2 * WG_SEND_BUF_SIZE);
+            else
+                cb->buffer_size = (size_t) tmp;
+        }
         else if (strcasecmp ("Prefix", child->key) == 0)
             cf_util_get_string (child, &cb->prefix);
         else if (strcasecmp ("Postfix", child->key) == 0)
@@ -652,6 +1262,37 @@ static int wg_config_carbon (oconfig_item_t *ci)
         }
     }
 
+    cb->connections = calloc ((size_t) cb->connections_num,
+            sizeof (*cb->connections));
+    if (cb->connections == NULL)
+    {
+        ERROR ("write_graphite plugin: calloc failed.");
+        cb->connections_num = 0;
+        wg_callback_free (cb);
+        return (-1);
+    }
+
+    for (i = 0; i < cb->connections_num; i++)
+    {
+        struct wg_connection *conn = cb->connections + i;
+
+        conn->cb = cb;
+        conn->sock_fd = -1;
+        conn->reconnect_interval = WG_RECONNECT_MIN;
+        C_COMPLAIN_INIT (&conn->drop_complaint);
+        pthread_mutex_init (&conn->lock, /* attr = */ NULL);
+        pthread_cond_init (&conn->cond, /* attr = */ NULL);
+
+        conn->ring_size = cb->buffer_size;
+        conn->ring = malloc (conn->ring_size);
+        if (conn->ring == NULL)
+        {
+            ERROR ("write_graphite plugin: malloc failed.");
+            wg_callback_free (cb);
+            return (-1);
+        }
+    }
+
     ssnprintf (callback_name, sizeof (callback_name), "write_graphite/%s/%s",
             cb->node != NULL ? cb->node : WG_DEFAULT_NODE,
             cb->service != NULL ? cb->service : WG_DEFAULT_SERVICE);
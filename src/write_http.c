@@ -26,7 +26,9 @@
 #include "collectd.h"
 #include "plugin.h"
 #include "common.h"
+#include "configfile.h"
 #include "utils_cache.h"
+#include "utils_complain.h"
 #include "utils_parse_option.h"
 #include "utils_format_json.h"
 
@@ -36,9 +38,48 @@
 
 #include <curl/curl.h>
 
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+#ifndef WH_DEFAULT_BUFFER_SIZE
+# define WH_DEFAULT_BUFFER_SIZE 65536
+#endif
+
+/* Buffers waiting to be sent. When this many are queued, further buffers are
+ * dropped. */
+#ifndef WH_QUEUE_MAX_LENGTH
+# define WH_QUEUE_MAX_LENGTH 64
+#endif
+
+/* How long the sender thread tries to send queued data when shutting down. */
+#define WH_SHUTDOWN_TIMEOUT TIME_T_TO_CDTIME_T (10)
+
 /*
  * Private variables
  */
+struct wh_buffer_s;
+typedef struct wh_buffer_s wh_buffer_t;
+struct wh_buffer_s
+{
+        char   *data;
+        size_t  data_len;
+        wh_buffer_t *next;
+};
+
+/* One request in flight. Each request has its own easy handle, which is
+ * reused so that connections are kept alive between requests. */
+struct wh_request_s
+{
+        CURL *curl;
+        char curl_errbuf[CURL_ERROR_SIZE];
+
+        wh_buffer_t *buffer;
+        char   *body; /* compressed body, if enabled */
+        cdtime_t start_time;
+};
+typedef struct wh_request_s wh_request_t;
+
 struct wh_callback_s
 {
         char *location;
@@ -50,27 +91,51 @@ struct wh_callback_s
         int   verify_host;
         char *cacert;
         int   store_rates;
+        int   compress;
+        int   report_stats;
 
 #define WH_FORMAT_COMMAND 0
 #define WH_FORMAT_JSON    1
         int format;
 
-        CURL *curl;
-        char curl_errbuf[CURL_ERROR_SIZE];
+        struct curl_slist *headers;
 
-        char   send_buffer[4096];
+        /* Data is formatted into `send_buffer'. Full buffers are moved to
+         * the queue, from where the sender thread takes them. */
+        char  *send_buffer;
+        size_t send_buffer_size;
         size_t send_buffer_free;
         size_t send_buffer_fill;
         cdtime_t send_buffer_init_time;
 
+        wh_buffer_t *queue_head;
+        wh_buffer_t *queue_tail;
+        int          queue_length;
+        c_complain_t queue_complaint;
+
+        int           requests_num;
+        pthread_t     thread;
+        int           thread_running;
+        int           shutdown;
+        pthread_cond_t send_cond;
+
+        /* Statistics, protected by `send_lock'. */
+        char     stats_instance[DATA_MAX_NAME_LEN];
+        derive_t stats_requests;
+        derive_t stats_failed;
+        derive_t stats_dropped;
+        cdtime_t stats_time;
+
         pthread_mutex_t send_lock;
 };
 typedef struct wh_callback_s wh_callback_t;
 
+static int wh_instances_num = 0;
+
 static void wh_reset_buffer (wh_callback_t *cb)  /* {{{ */
 {
-        memset (cb->send_buffer, 0, sizeof (cb->send_buffer));
-        cb->send_buffer_free = sizeof (cb->send_buffer);
+        cb->send_buffer[0] = 0;
+        cb->send_buffer_free = cb->send_buffer_size;
         cb->send_buffer_fill = 0;
         cb->send_buffer_init_time = cdtime ();
 
@@ -82,78 +147,455 @@ static void wh_reset_buffer (wh_callback_t *cb)  /* {{{ */
         }
 } /* }}} wh_reset_buffer */
 
-static int wh_send_buffer (wh_callback_t *cb) /* {{{ */
+static void wh_buffer_free (wh_buffer_t *buffer) /* {{{ */
 {
-        int status = 0;
+        if (buffer == NULL)
+                return;
 
-        curl_easy_setopt (cb->curl, CURLOPT_POSTFIELDS, cb->send_buffer);
-        status = curl_easy_perform (cb->curl);
-        if (status != 0)
+        sfree (buffer->data);
+        sfree (buffer);
+} /* }}} void wh_buffer_free */
+
+/* Discards the response body. */
+static size_t wh_curl_write_callback (char *ptr __attribute__((unused)), /* {{{ */
+                size_t size, size_t nmemb,
+                void *user_data __attribute__((unused)))
+{
+        return (size * nmemb);
+} /* }}} size_t wh_curl_write_callback */
+
+static int wh_request_init (wh_callback_t *cb, wh_request_t *req) /* {{{ */
+{
+        req->curl = curl_easy_init ();
+        if (req->curl == NULL)
         {
-                ERROR ("write_http plugin: curl_easy_perform failed with "
-                                "status %i: %s",
-                                status, cb->curl_errbuf);
+                ERROR ("write_http plugin: curl_easy_init failed.");
+                return (-1);
         }
-        return (status);
-} /* }}} wh_send_buffer */
 
-static int wh_callback_init (wh_callback_t *cb) /* {{{ */
+        curl_easy_setopt (req->curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt (req->curl, CURLOPT_USERAGENT, PACKAGE_NAME"/"PACKAGE_VERSION);
+        curl_easy_setopt (req->curl, CURLOPT_HTTPHEADER, cb->headers);
+        curl_easy_setopt (req->curl, CURLOPT_WRITEFUNCTION, wh_curl_write_callback);
+#if LIBCURL_VERSION_NUM >= 0x071900
+        curl_easy_setopt (req->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+
+        curl_easy_setopt (req->curl, CURLOPT_ERRORBUFFER, req->curl_errbuf);
+        curl_easy_setopt (req->curl, CURLOPT_URL, cb->location);
+        curl_easy_setopt (req->curl, CURLOPT_PRIVATE, (char *) req);
+
+        if (cb->credentials != NULL)
+        {
+                curl_easy_setopt (req->curl, CURLOPT_USERPWD, cb->credentials);
+                curl_easy_setopt (req->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+        }
+
+        curl_easy_setopt (req->curl, CURLOPT_SSL_VERIFYPEER, (long) cb->verify_peer);
+        curl_easy_setopt (req->curl, CURLOPT_SSL_VERIFYHOST,
+                        cb->verify_host ? 2L : 0L);
+        if (cb->cacert != NULL)
+                curl_easy_setopt (req->curl, CURLOPT_CAINFO, cb->cacert);
+
+        return (0);
+} /* }}} int wh_request_init */
+
+#if HAVE_LIBZ
+/* Compresses the request's buffer using gzip. The result is stored in
+ * `req->body'. */
+static int wh_compress (wh_request_t *req, size_t *ret_len) /* {{{ */
 {
-        struct curl_slist *headers;
+        z_stream zs;
+        size_t body_size;
+        int status;
 
-        if (cb->curl != NULL)
-                return (0);
+        memset (&zs, 0, sizeof (zs));
+        /* 15 + 16: default window size, gzip header */
+        status = deflateInit2 (&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        15 + 16, 8, Z_DEFAULT_STRATEGY);
+        if (status != Z_OK)
+        {
+                ERROR ("write_http plugin: deflateInit2 failed with status %i.",
+                                status);
+                return (-1);
+        }
+
+        body_size = (size_t) deflateBound (&zs, (uLong) req->buffer->data_len);
+        req->body = malloc (body_size);
+        if (req->body == NULL)
+        {
+                ERROR ("write_http plugin: malloc failed.");
+                deflateEnd (&zs);
+                return (-1);
+        }
 
-        cb->curl = curl_easy_init ();
-        if (cb->curl == NULL)
+        zs.next_in = (Bytef *) req->buffer->data;
+        zs.avail_in = (uInt) req->buffer->data_len;
+        zs.next_out = (Bytef *) req->body;
+        zs.avail_out = (uInt) body_size;
+
+        status = deflate (&zs, Z_FINISH);
+        if (status != Z_STREAM_END)
         {
-                ERROR ("curl plugin: curl_easy_init failed.");
+                ERROR ("write_http plugin: deflate failed with status %i.",
+                                status);
+                deflateEnd (&zs);
+                sfree (req->body);
                 return (-1);
         }
 
-        curl_easy_setopt (cb->curl, CURLOPT_NOSIGNAL, 1);
-        curl_easy_setopt (cb->curl, CURLOPT_USERAGENT, PACKAGE_NAME"/"PACKAGE_VERSION);
+        *ret_len = (size_t) zs.total_out;
+        deflateEnd (&zs);
+        return (0);
+} /* }}} int wh_compress */
+#endif /* HAVE_LIBZ */
 
-        headers = NULL;
-        headers = curl_slist_append (headers, "Accept:  */*");
-        if (cb->format == WH_FORMAT_JSON)
-                headers = curl_slist_append (headers, "Content-Type: application/json");
+static int wh_request_start (wh_callback_t *cb, CURLM *multi, /* {{{ */
+                wh_request_t *req, wh_buffer_t *buffer)
+{
+        const char *body = buffer->data;
+        size_t body_len = buffer->data_len;
+        CURLMcode status;
+
+        req->buffer = buffer;
+        req->start_time = cdtime ();
+
+#if HAVE_LIBZ
+        if (cb->compress)
+        {
+                if (wh_compress (req, &body_len) != 0)
+                {
+                        req->buffer = NULL;
+                        return (-1);
+                }
+                body = req->body;
+        }
+#endif
+
+        curl_easy_setopt (req->curl, CURLOPT_POSTFIELDSIZE, (long) body_len);
+        curl_easy_setopt (req->curl, CURLOPT_POSTFIELDS, body);
+
+        status = curl_multi_add_handle (multi, req->curl);
+        if (status != CURLM_OK)
+        {
+                ERROR ("write_http plugin: curl_multi_add_handle failed: %s",
+                                curl_multi_strerror (status));
+                sfree (req->body);
+                req->buffer = NULL;
+                return (-1);
+        }
+
+        return (0);
+} /* }}} int wh_request_start */
+
+static void wh_request_finish (wh_callback_t *cb, CURLM *multi, /* {{{ */
+                wh_request_t *req, CURLcode result)
+{
+        long response_code = 0;
+        _Bool failed = 0;
+
+        curl_multi_remove_handle (multi, req->curl);
+
+        if (result != CURLE_OK)
+        {
+                ERROR ("write_http plugin: Posting data to <%s> failed "
+                                "with status %i: %s",
+                                cb->location, (int) result, req->curl_errbuf);
+                failed = 1;
+        }
         else
-                headers = curl_slist_append (headers, "Content-Type: text/plain");
-        headers = curl_slist_append (headers, "Expect:");
-        curl_easy_setopt (cb->curl, CURLOPT_HTTPHEADER, headers);
+        {
+                curl_easy_getinfo (req->curl, CURLINFO_RESPONSE_CODE,
+                                &response_code);
+                if (response_code >= 400)
+                {
+                        ERROR ("write_http plugin: Posting data to <%s> "
+                                        "failed: HTTP status %li.",
+                                        cb->location, response_code);
+                        failed = 1;
+                }
+        }
 
-        curl_easy_setopt (cb->curl, CURLOPT_ERRORBUFFER, cb->curl_errbuf);
-        curl_easy_setopt (cb->curl, CURLOPT_URL, cb->location);
+        pthread_mutex_lock (&cb->send_lock);
+        cb->stats_requests++;
+        cb->stats_time += cdtime () - req->start_time;
+        if (failed)
+                cb->stats_failed++;
+        pthread_mutex_unlock (&cb->send_lock);
 
-        if (cb->user != NULL)
+        wh_buffer_free (req->buffer);
+        req->buffer = NULL;
+        sfree (req->body);
+} /* }}} void wh_request_finish */
+
+/* Waits up to `timeout_ms' milliseconds for activity on any of the
+ * transfers. */
+static void wh_multi_wait (CURLM *multi, int timeout_ms) /* {{{ */
+{
+#if LIBCURL_VERSION_NUM >= 0x071c00
+        curl_multi_wait (multi, NULL, 0, timeout_ms, NULL);
+#else
+        fd_set fd_read;
+        fd_set fd_write;
+        fd_set fd_except;
+        int fd_max = -1;
+        struct timeval tv;
+
+        FD_ZERO (&fd_read);
+        FD_ZERO (&fd_write);
+        FD_ZERO (&fd_except);
+
+        curl_multi_fdset (multi, &fd_read, &fd_write, &fd_except, &fd_max);
+
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+        if (fd_max < 0)
+                select (0, NULL, NULL, NULL, &tv);
+        else
+                select (fd_max + 1, &fd_read, &fd_write, &fd_except, &tv);
+#endif
+} /* }}} void wh_multi_wait */
+
+static int wh_flush_nolock (cdtime_t timeout, wh_callback_t *cb);
+
+/* The sender thread posts queued buffers with up to `requests_num' requests
+ * in flight, so that the write callback never waits for the server. */
+static void *wh_sender_thread (void *arg) /* {{{ */
+{
+        wh_callback_t *cb = arg;
+        wh_request_t *requests;
+        CURLM *multi;
+        int running = 0;
+        cdtime_t shutdown_deadline = 0;
+        int i;
+
+        multi = curl_multi_init ();
+        if (multi == NULL)
         {
-                size_t credentials_size;
+                ERROR ("write_http plugin: curl_multi_init failed.");
+                return ((void *) 0);
+        }
 
-                credentials_size = strlen (cb->user) + 2;
-                if (cb->pass != NULL)
-                        credentials_size += strlen (cb->pass);
+        requests = calloc ((size_t) cb->requests_num, sizeof (*requests));
+        if (requests == NULL)
+        {
+                ERROR ("write_http plugin: calloc failed.");
+                curl_multi_cleanup (multi);
+                return ((void *) 0);
+        }
 
-                cb->credentials = (char *) malloc (credentials_size);
-                if (cb->credentials == NULL)
+        for (i = 0; i < cb->requests_num; i++)
+        {
+                if (wh_request_init (cb, requests + i) != 0)
+                        break;
+        }
+        if (i < cb->requests_num)
+        {
+                while (i > 0)
+                        curl_easy_cleanup (requests[--i].curl);
+                sfree (requests);
+                curl_multi_cleanup (multi);
+                return ((void *) 0);
+        }
+
+        while (42)
+        {
+                wh_buffer_t *buffers = NULL;
+                CURLMsg *msg;
+                int msgs_left;
+                int idle = 0;
+
+                pthread_mutex_lock (&cb->send_lock);
+
+                /* Don't keep data in the buffer for more than one interval. */
+                if (!cb->shutdown)
+                        wh_flush_nolock (interval_g, cb);
+
+                /* Take as many buffers from the queue as there are idle
+                 * requests. */
+                for (i = 0; i < cb->requests_num; i++)
+                        if (requests[i].buffer == NULL)
+                                idle++;
+
+                while ((idle > 0) && (cb->queue_head != NULL))
                 {
-                        ERROR ("curl plugin: malloc failed.");
-                        return (-1);
+                        wh_buffer_t *buffer = cb->queue_head;
+
+                        cb->queue_head = buffer->next;
+                        if (cb->queue_head == NULL)
+                                cb->queue_tail = NULL;
+                        cb->queue_length--;
+
+                        buffer->next = buffers;
+                        buffers = buffer;
+                        idle--;
                 }
 
-                ssnprintf (cb->credentials, credentials_size, "%s:%s",
-                                cb->user, (cb->pass == NULL) ? "" : cb->pass);
-                curl_easy_setopt (cb->curl, CURLOPT_USERPWD, cb->credentials);
-                curl_easy_setopt (cb->curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
+                if ((running == 0) && (buffers == NULL))
+                {
+                        struct timespec ts_wait;
+
+                        if (cb->shutdown)
+                        {
+                                pthread_mutex_unlock (&cb->send_lock);
+                                break;
+                        }
+
+                        CDTIME_T_TO_TIMESPEC (cb->send_buffer_init_time
+                                        + interval_g, &ts_wait);
+                        pthread_cond_timedwait (&cb->send_cond,
+                                        &cb->send_lock, &ts_wait);
+                        pthread_mutex_unlock (&cb->send_lock);
+                        continue;
+                }
+
+                if (cb->shutdown && (shutdown_deadline == 0))
+                        shutdown_deadline = cdtime () + WH_SHUTDOWN_TIMEOUT;
+
+                pthread_mutex_unlock (&cb->send_lock);
+
+                /* Start new requests. */
+                for (i = 0; (i < cb->requests_num) && (buffers != NULL); i++)
+                {
+                        wh_buffer_t *buffer;
+
+                        if (requests[i].buffer != NULL)
+                                continue;
+
+                        buffer = buffers;
+                        buffers = buffer->next;
+                        buffer->next = NULL;
+
+                        if (wh_request_start (cb, multi, requests + i, buffer) != 0)
+                        {
+                                pthread_mutex_lock (&cb->send_lock);
+                                cb->stats_failed++;
+                                pthread_mutex_unlock (&cb->send_lock);
+                                wh_buffer_free (buffer);
+                        }
+                }
+                assert (buffers == NULL);
+
+                curl_multi_perform (multi, &running);
+
+                while ((msg = curl_multi_info_read (multi, &msgs_left)) != NULL)
+                {
+                        wh_request_t *req = NULL;
+
+                        if (msg->msg != CURLMSG_DONE)
+                                continue;
+
+                        curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE,
+                                        (char **) &req);
+                        wh_request_finish (cb, multi, req, msg->data.result);
+                }
+
+                if ((shutdown_deadline != 0) && (cdtime () >= shutdown_deadline))
+                {
+                        WARNING ("write_http plugin: Shutting down, giving up "
+                                        "on unsent data for <%s>.",
+                                        cb->location);
+                        break;
+                }
+
+                if (running > 0)
+                        wh_multi_wait (multi, 100);
+        } /* while (42) */
+
+        for (i = 0; i < cb->requests_num; i++)
+        {
+                if (requests[i].buffer != NULL)
+                {
+                        curl_multi_remove_handle (multi, requests[i].curl);
+                        wh_buffer_free (requests[i].buffer);
+                        sfree (requests[i].body);
+                }
+                curl_easy_cleanup (requests[i].curl);
         }
+        sfree (requests);
+        curl_multi_cleanup (multi);
 
-        curl_easy_setopt (cb->curl, CURLOPT_SSL_VERIFYPEER, cb->verify_peer);
-        curl_easy_setopt (cb->curl, CURLOPT_SSL_VERIFYHOST,
-                        cb->verify_host ? 2 : 0);
-        if (cb->cacert != NULL)
-                curl_easy_setopt (cb->curl, CURLOPT_CAINFO, cb->cacert);
+        return ((void *) 0);
+} /* }}} void *wh_sender_thread */
+
+/* Moves the current buffer to the queue and allocates a new one. */
+static int wh_send_buffer (wh_callback_t *cb) /* {{{ */
+{
+        wh_buffer_t *buffer;
+        char *send_buffer;
+
+        if (cb->queue_length >= WH_QUEUE_MAX_LENGTH)
+        {
+                c_complain (LOG_ERR, &cb->queue_complaint,
+                                "write_http plugin: %i requests to <%s> are "
+                                "waiting to be sent. Dropping data.",
+                                cb->queue_length, cb->location);
+                cb->stats_dropped++;
+                return (-1);
+        }
+        c_release (LOG_INFO, &cb->queue_complaint,
+                        "write_http plugin: Sending data to <%s> is "
+                        "keeping up again.", cb->location);
+
+        send_buffer = malloc (cb->send_buffer_size);
+        buffer = malloc (sizeof (*buffer));
+        if ((send_buffer == NULL) || (buffer == NULL))
+        {
+                ERROR ("write_http plugin: malloc failed.");
+                sfree (send_buffer);
+                sfree (buffer);
+                return (-1);
+        }
+
+        buffer->data = cb->send_buffer;
+        buffer->data_len = cb->send_buffer_fill;
+        buffer->next = NULL;
+        cb->send_buffer = send_buffer;
+
+        if (cb->queue_tail == NULL)
+                cb->queue_head = buffer;
+        else
+                cb->queue_tail->next = buffer;
+        cb->queue_tail = buffer;
+        cb->queue_length++;
+
+        pthread_cond_signal (&cb->send_cond);
+
+        return (0);
+} /* }}} wh_send_buffer */
+
+/* Allocates the send buffer and starts the sender thread. This happens on
+ * first use, because the daemon forks after reading the configuration.
+ * NOTE: You must hold cb->send_lock when calling this function! */
+static int wh_callback_init (wh_callback_t *cb) /* {{{ */
+{
+        int status;
+
+        if (cb->thread_running)
+                return (0);
+
+        if (cb->send_buffer == NULL)
+        {
+                cb->send_buffer = malloc (cb->send_buffer_size);
+                if (cb->send_buffer == NULL)
+                {
+                        ERROR ("write_http plugin: malloc failed.");
+                        return (-1);
+                }
+                wh_reset_buffer (cb);
+        }
 
-        wh_reset_buffer (cb);
+        status = pthread_create (&cb->thread, /* attr = */ NULL,
+                        wh_sender_thread, cb);
+        if (status != 0)
+        {
+                char errbuf[1024];
+                ERROR ("write_http plugin: pthread_create failed: %s",
+                                sstrerror (status, errbuf, sizeof (errbuf)));
+                return (-1);
+        }
+        cb->thread_running = 1;
 
         return (0);
 } /* }}} int wh_callback_init */
@@ -167,6 +609,9 @@ static int wh_flush_nolock (cdtime_t timeout, wh_callback_t *cb) /* {{{ */
                         CDTIME_T_TO_DOUBLE (timeout),
                         cb->send_buffer_fill);
 
+        if (cb->send_buffer == NULL)
+                return (0);
+
         /* timeout == 0  => flush unconditionally */
         if (timeout > 0)
         {
@@ -235,7 +680,7 @@ static int wh_flush (cdtime_t timeout, /* {{{ */
 
         pthread_mutex_lock (&cb->send_lock);
 
-        if (cb->curl == NULL)
+        if (!cb->thread_running)
         {
                 status = wh_callback_init (cb);
                 if (status != 0)
@@ -252,6 +697,62 @@ static int wh_flush (cdtime_t timeout, /* {{{ */
         return (status);
 } /* }}} int wh_flush */
 
+static int wh_stats_read (user_data_t *user_data) /* {{{ */
+{
+        wh_callback_t *cb = user_data->data;
+        value_list_t vl = VALUE_LIST_INIT;
+        value_t values[1];
+        int      copy_queue_length;
+        derive_t copy_requests;
+        derive_t copy_failed;
+        derive_t copy_dropped;
+        cdtime_t copy_time;
+
+        pthread_mutex_lock (&cb->send_lock);
+        copy_queue_length = cb->queue_length;
+        copy_requests = cb->stats_requests;
+        copy_failed = cb->stats_failed;
+        copy_dropped = cb->stats_dropped;
+        copy_time = cb->stats_time;
+        pthread_mutex_unlock (&cb->send_lock);
+
+        vl.values = values;
+        vl.values_len = 1;
+        vl.time = 0;
+        vl.interval = interval_g;
+        sstrncpy (vl.host, hostname_g, sizeof (vl.host));
+        sstrncpy (vl.plugin, "write_http", sizeof (vl.plugin));
+        sstrncpy (vl.plugin_instance, cb->stats_instance,
+                        sizeof (vl.plugin_instance));
+
+        /* Buffers waiting to be sent */
+        vl.values[0].gauge = (gauge_t) copy_queue_length;
+        sstrncpy (vl.type, "queue_length", sizeof (vl.type));
+        vl.type_instance[0] = 0;
+        plugin_dispatch_values (&vl);
+
+        /* Number of requests and the time spent in them */
+        vl.values[0].derive = copy_requests;
+        sstrncpy (vl.type, "total_requests", sizeof (vl.type));
+        sstrncpy (vl.type_instance, "post", sizeof (vl.type_instance));
+        plugin_dispatch_values (&vl);
+
+        vl.values[0].derive = (derive_t) CDTIME_T_TO_MS (copy_time);
+        sstrncpy (vl.type, "total_time_in_ms", sizeof (vl.type));
+        plugin_dispatch_values (&vl);
+
+        vl.values[0].derive = copy_failed;
+        sstrncpy (vl.type, "derive", sizeof (vl.type));
+        sstrncpy (vl.type_instance, "post-failed", sizeof (vl.type_instance));
+        plugin_dispatch_values (&vl);
+
+        vl.values[0].derive = copy_dropped;
+        sstrncpy (vl.type_instance, "post-dropped", sizeof (vl.type_instance));
+        plugin_dispatch_values (&vl);
+
+        return (0);
+} /* }}} int wh_stats_read */
+
 static void wh_callback_free (void *data) /* {{{ */
 {
         wh_callback_t *cb;
@@ -261,15 +762,37 @@ static void wh_callback_free (void *data) /* {{{ */
 
         cb = data;
 
+        /* Queue what's left and let the sender thread send it. */
+        pthread_mutex_lock (&cb->send_lock);
         wh_flush_nolock (/* timeout = */ 0, cb);
+        cb->shutdown = 1;
+        pthread_cond_signal (&cb->send_cond);
+        pthread_mutex_unlock (&cb->send_lock);
+
+        if (cb->thread_running)
+        {
+                pthread_join (cb->thread, NULL);
+                cb->thread_running = 0;
+        }
+
+        while (cb->queue_head != NULL)
+        {
+                wh_buffer_t *buffer = cb->queue_head;
+                cb->queue_head = buffer->next;
+                wh_buffer_free (buffer);
+        }
 
-        curl_easy_cleanup (cb->curl);
+        curl_slist_free_all (cb->headers);
+        sfree (cb->send_buffer);
         sfree (cb->location);
         sfree (cb->user);
         sfree (cb->pass);
         sfree (cb->credentials);
         sfree (cb->cacert);
 
+        pthread_cond_destroy (&cb->send_cond);
+        pthread_mutex_destroy (&cb->send_lock);
+
         sfree (cb);
 } /* }}} void wh_callback_free */
 
@@ -319,7 +842,7 @@ static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{
 
         pthread_mutex_lock (&cb->send_lock);
 
-        if (cb->curl == NULL)
+        if (!cb->thread_running)
         {
                 status = wh_callback_init (cb);
                 if (status != 0)
@@ -350,8 +873,8 @@ static int wh_write_command (const data_set_t *ds, const value_list_t *vl, /* {{
 
         DEBUG ("write_http plugin: <%s> buffer %zu/%zu (%g%%) \"%s\"",
                         cb->location,
-                        cb->send_buffer_fill, sizeof (cb->send_buffer),
-                        100.0 * ((double) cb->send_buffer_fill) / ((double) sizeof (cb->send_buffer)),
+                        cb->send_buffer_fill, cb->send_buffer_size,
+                        100.0 * ((double) cb->send_buffer_fill) / ((double) cb->send_buffer_size),
                         command);
 
         /* Check if we have enough space for this command. */
@@ -367,7 +890,7 @@ static int wh_write_json (const data_set_t *ds, const value_list_t *vl, /* {{{ *
 
         pthread_mutex_lock (&cb->send_lock);
 
-        if (cb->curl == NULL)
+        if (!cb->thread_running)
         {
                 status = wh_callback_init (cb);
                 if (status != 0)
@@ -405,8 +928,8 @@ static int wh_write_json (const data_set_t *ds, const value_list_t *vl, /* {{{ *
 
         DEBUG ("write_http plugin: <%s> buffer %zu/%zu (%g%%)",
                         cb->location,
-                        cb->send_buffer_fill, sizeof (cb->send_buffer),
-                        100.0 * ((double) cb->send_buffer_fill) / ((double) sizeof (cb->send_buffer)));
+                        cb->send_buffer_fill, cb->send_buffer_size,
+                        100.0 * ((double) cb->send_buffer_fill) / ((double) cb->send_buffer_size));
 
         /* Check if we have enough space for this command. */
         pthread_mutex_unlock (&cb->send_lock);
@@ -523,9 +1046,14 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
         cb->verify_host = 1;
         cb->cacert = NULL;
         cb->format = WH_FORMAT_COMMAND;
-        cb->curl = NULL;
+        cb->headers = NULL;
+        cb->send_buffer = NULL;
+        cb->send_buffer_size = WH_DEFAULT_BUFFER_SIZE;
+        cb->requests_num = 1;
+        C_COMPLAIN_INIT (&cb->queue_complaint);
 
         pthread_mutex_init (&cb->send_lock, /* attr = */ NULL);
+        pthread_cond_init (&cb->send_cond, /* attr = */ NULL);
 
         config_set_string (&cb->location, ci);
         if (cb->location == NULL)
@@ -549,6 +1077,42 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
                         config_set_format (cb, child);
                 else if (strcasecmp ("StoreRates", child->key) == 0)
                         config_set_boolean (&cb->store_rates, child);
+                else if (strcasecmp ("BufferSize", child->key) == 0)
+                {
+                        int tmp = (int) cb->send_buffer_size;
+                        cf_util_get_int (child, &tmp);
+                        if (tmp < 1024)
+                                ERROR ("write_http plugin: \"BufferSize\" "
+                                                "must be at least 1024.");
+                        else
+                                cb->send_buffer_size = (size_t) tmp;
+                }
+                else if (strcasecmp ("Connections", child->key) == 0)
+                {
+                        int tmp = cb->requests_num;
+                        cf_util_get_int (child, &tmp);
+                        if (tmp < 1)
+                                ERROR ("write_http plugin: \"Connections\" "
+                                                "must be at least 1.");
+                        else
+                                cb->requests_num = tmp;
+                }
+                else if (strcasecmp ("Compress", child->key) == 0)
+                {
+                        config_set_boolean (&cb->compress, child);
+#if !HAVE_LIBZ
+                        if (cb->compress)
+                        {
+                                ERROR ("write_http plugin: \"Compress\" "
+                                                "is not supported: zlib "
+                                                "was not available at "
+                                                "compile time.");
+                                cb->compress = 0;
+                        }
+#endif
+                }
+                else if (strcasecmp ("ReportStats", child->key) == 0)
+                        config_set_boolean (&cb->report_stats, child);
                 else
                 {
                         ERROR ("write_http plugin: Invalid configuration "
@@ -556,6 +1120,42 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
                 }
         }
 
+        cb->headers = curl_slist_append (cb->headers, "Accept:  */*");
+        if (cb->format == WH_FORMAT_JSON)
+                cb->headers = curl_slist_append (cb->headers,
+                                "Content-Type: application/json");
+        else
+                cb->headers = curl_slist_append (cb->headers,
+                                "Content-Type: text/plain");
+        if (cb->compress)
+                cb->headers = curl_slist_append (cb->headers,
+                                "Content-Encoding: gzip");
+        cb->headers = curl_slist_append (cb->headers, "Expect:");
+
+        if (cb->user != NULL)
+        {
+                size_t credentials_size;
+
+                credentials_size = strlen (cb->user) + 2;
+                if (cb->pass != NULL)
+                        credentials_size += strlen (cb->pass);
+
+                cb->credentials = (char *) malloc (credentials_size);
+                if (cb->credentials == NULL)
+                {
+                        ERROR ("write_http plugin: malloc failed.");
+                        wh_callback_free (cb);
+                        return (-1);
+                }
+
+                ssnprintf (cb->credentials, credentials_size, "%s:%s",
+                                cb->user, (cb->pass == NULL) ? "" : cb->pass);
+        }
+
+        ssnprintf (cb->stats_instance, sizeof (cb->stats_instance),
+                        "url%i", wh_instances_num);
+        wh_instances_num++;
+
         DEBUG ("write_http: Registering write callback with URL %s",
                         cb->location);
 
@@ -564,6 +1164,17 @@ static int wh_config_url (oconfig_item_t *ci) /* {{{ */
         user_data.free_func = NULL;
         plugin_register_flush ("write_http", wh_flush, &user_data);
 
+        if (cb->report_stats)
+        {
+                char callback_name[DATA_MAX_NAME_LEN];
+
+                ssnprintf (callback_name, sizeof (callback_name),
+                                "write_http/%s", cb->stats_instance);
+                plugin_register_complex_read (/* group = */ "write_http",
+                                callback_name, wh_stats_read,
+                                /* interval = */ NULL, &user_data);
+        }
+
         user_data.free_func = wh_callback_free;
         plugin_register_write ("write_http", wh_write, &user_data);
 
@@ -33,6 +33,7 @@
 #include "common.h"
 #include "configfile.h"
 #include "utils_cache.h"
+#include "utils_complain.h"
 
 #include <pthread.h>
 
@@ -43,6 +44,23 @@
 #endif
 #include <mongo.h>
 
+#define WM_DEFAULT_BATCH_SIZE 1000
+
+/* A BSON document together with the collection it is to be inserted into. */
+struct wm_document_s
+{
+  char collection[DATA_MAX_NAME_LEN + 16];
+  bson *record;
+  _Bool sent;
+};
+typedef struct wm_document_s wm_document_t;
+
+/* Documents are collected in a buffer and inserted with one batch insert per
+ * collection by a thread of the node. The two document arrays are swapped
+ * when a batch is sent, so the write threads never wait for the server and
+ * the arrays are reused for every batch. The `bson' structures themselves are
+ * allocated on the heap: they point into their own memory, so they must not
+ * be copied. */
 struct wm_node_s
 {
   char name[DATA_MAX_NAME_LEN];
@@ -53,36 +71,49 @@ struct wm_node_s
 
   _Bool store_rates;
 
+  int batch_size;
+  cdtime_t flush_interval;
+
+  /* Only used by the sender thread. */
   mongo conn[1];
+  wm_document_t *send_docs;
+  const bson **batch;
+
+  /* Everything below is protected by `lock'. */
   pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  _Bool thread_running;
+  _Bool flush_requested;
+  _Bool shutdown;
+
+  /* Up to twice `batch_size' documents waiting to be sent. */
+  wm_document_t *docs;
+  int docs_num;
+  cdtime_t docs_init_time;
+
+  c_complain_t drop_complaint; /* buffer full */
+  c_complain_t send_complaint; /* inserting a batch failed */
 };
 typedef struct wm_node_s wm_node_t;
 
 /*
  * Functions
  */
-static bson *wm_create_bson (const data_set_t *ds, /* {{{ */
+static int wm_create_bson (bson *ret, const data_set_t *ds, /* {{{ */
     const value_list_t *vl,
     _Bool store_rates)
 {
-  bson *ret;
   gauge_t *rates;
   int i;
 
-  ret = bson_create ();
-  if (ret == NULL)
-  {
-    ERROR ("write_mongodb plugin: bson_create failed.");
-    return (NULL);
-  }
-
   if (store_rates)
   {
     rates = uc_get_rate (ds, vl);
     if (rates == NULL)
     {
       ERROR ("write_mongodb plugin: uc_get_rate() failed.");
-      return (NULL);
+      return (-1);
     }
   }
   else
@@ -147,87 +178,332 @@ static bson *wm_create_bson (const data_set_t *ds, /* {{{ */
   bson_finish (ret);
 
   sfree (rates);
-  return (ret);
-} /* }}} bson *wm_create_bson */
+  return (0);
+} /* }}} int wm_create_bson */
+
+static int wm_connect (wm_node_t *node) /* {{{ */
+{
+  int status;
+
+  if (mongo_is_connected (node->conn))
+    return (0);
+
+  INFO ("write_mongodb plugin: Connecting to [%s]:%i",
+      (node->host != NULL) ? node->host : "localhost",
+      (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
+  status = mongo_connect (node->conn, node->host, node->port);
+  if (status != MONGO_OK) {
+    ERROR ("write_mongodb plugin: Connecting to [%s]:%i failed.",
+        (node->host != NULL) ? node->host : "localhost",
+        (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
+    mongo_destroy (node->conn);
+    return (-1);
+  }
+
+  if (node->timeout > 0) {
+    status = mongo_set_op_timeout (node->conn, node->timeout);
+    if (status != MONGO_OK) {
+      WARNING ("write_mongodb plugin: mongo_set_op_timeout(%i) failed: %s",
+          node->timeout, node->conn->errstr);
+    }
+  }
+
+  return (0);
+} /* }}} int wm_connect */
+
+static int wm_insert_batch (wm_node_t *node, /* {{{ */
+    const char *collection, int batch_num)
+{
+  int status;
+
+  status = mongo_insert_batch (node->conn, collection, node->batch, batch_num);
+  if (status == MONGO_OK)
+    return (0);
+
+  ERROR ("write_mongodb plugin: error inserting %i records into \"%s\": %d",
+      batch_num, collection, node->conn->err);
+  if (node->conn->err != MONGO_BSON_INVALID)
+    ERROR ("write_mongodb plugin: %s", node->conn->errstr);
+
+  /* Disconnect except on data errors. */
+  if ((node->conn->err != MONGO_BSON_INVALID)
+      && (node->conn->err != MONGO_BSON_NOT_FINISHED))
+  {
+    mongo_destroy (node->conn);
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int wm_insert_batch */
+
+/* Returns the number of documents in `docs' that have not been handed to
+ * the server yet. */
+static int wm_docs_pending (const wm_document_t *docs, int docs_num) /* {{{ */
+{
+  int pending = 0;
+  int i;
+
+  for (i = 0; i < docs_num; i++)
+    if (!docs[i].sent)
+      pending++;
+
+  return (pending);
+} /* }}} int wm_docs_pending */
+
+/* Inserts `docs' with one batch insert per collection, each containing at
+ * most `batch_size' documents. Returns the number of documents that could not
+ * be inserted. */
+static int wm_insert_docs (wm_node_t *node, /* {{{ */
+    wm_document_t *docs, int docs_num)
+{
+  int i;
+
+  if (wm_connect (node) != 0)
+    return (docs_num);
+
+  /* Assert if the connection has been established */
+  assert (mongo_is_connected (node->conn));
+
+  for (i = 0; i < docs_num; i++)
+    docs[i].sent = 0;
+
+  for (i = 0; i < docs_num; i++)
+  {
+    const char *collection = docs[i].collection;
+    int batch_num = 0;
+    int j;
+
+    if (docs[i].sent)
+      continue;
+
+    for (j = i; j < docs_num; j++)
+    {
+      if (docs[j].sent || (strcmp (collection, docs[j].collection) != 0))
+        continue;
+
+      node->batch[batch_num] = docs[j].record;
+      batch_num++;
+      docs[j].sent = 1;
+
+      if (batch_num < node->batch_size)
+        continue;
+
+      if (wm_insert_batch (node, collection, batch_num) != 0)
+        return (batch_num + wm_docs_pending (docs, docs_num));
+      batch_num = 0;
+    }
+
+    if ((batch_num > 0)
+        && (wm_insert_batch (node, collection, batch_num) != 0))
+      return (batch_num + wm_docs_pending (docs, docs_num));
+  } /* for (i) */
+
+  return (0);
+} /* }}} int wm_insert_docs */
+
+static void *wm_sender_thread (void *arg) /* {{{ */
+{
+  wm_node_t *node = arg;
+
+  pthread_mutex_lock (&node->lock);
+  while (42)
+  {
+    cdtime_t flush_interval;
+    wm_document_t *docs;
+    int docs_num;
+    int dropped;
+    int i;
+
+    flush_interval = (node->flush_interval > 0)
+      ? node->flush_interval : interval_g;
+
+    /* Wait until a batch is complete, the oldest document is one flush
+     * interval old or a flush has been requested. wm_write signals when it
+     * adds the first document, so the deadline is picked up right away. */
+    while (!node->shutdown && !node->flush_requested
+        && (node->docs_num < node->batch_size))
+    {
+      struct timespec ts_wait;
+
+      if (node->docs_num == 0)
+      {
+        pthread_cond_wait (&node->cond, &node->lock);
+        continue;
+      }
+
+      if (cdtime () >= (node->docs_init_time + flush_interval))
+        break;
+
+      CDTIME_T_TO_TIMESPEC (node->docs_init_time + flush_interval, &ts_wait);
+      pthread_cond_timedwait (&node->cond, &node->lock, &ts_wait);
+    }
+
+    node->flush_requested = 0;
+
+    if (node->docs_num == 0)
+    {
+      if (node->shutdown)
+        break;
+      continue;
+    }
+
+    docs = node->docs;
+    docs_num = node->docs_num;
+    node->docs = node->send_docs;
+    node->docs_num = 0;
+    node->send_docs = docs;
+
+    pthread_mutex_unlock (&node->lock);
+
+    dropped = wm_insert_docs (node, docs, docs_num);
+    for (i = 0; i < docs_num; i++)
+    {
+      bson_destroy (docs[i].record);
+      sfree (docs[i].record);
+    }
+
+    pthread_mutex_lock (&node->lock);
+
+    if (dropped > 0)
+      c_complain (LOG_WARNING, &node->send_complaint,
+          "write_mongodb plugin: Dropped %i records for node \"%s\".",
+          dropped, node->name);
+    else
+      c_release (LOG_INFO, &node->send_complaint,
+          "write_mongodb plugin: Inserting records into node \"%s\" "
+          "succeeded again.", node->name);
+  } /* while (42) */
+  pthread_mutex_unlock (&node->lock);
+
+  return ((void *) 0);
+} /* }}} void *wm_sender_thread */
 
 static int wm_write (const data_set_t *ds, /* {{{ */
     const value_list_t *vl,
     user_data_t *ud)
 {
   wm_node_t *node = ud->data;
-  char collection_name[512];
-  bson *bson_record;
+  wm_document_t *doc;
+  bson *record;
   int status;
 
-  ssnprintf (collection_name, sizeof (collection_name), "collectd.%s",
-      vl->plugin);
+  record = malloc (sizeof (*record));
+  if (record == NULL)
+  {
+    ERROR ("write_mongodb plugin: malloc failed.");
+    return (ENOMEM);
+  }
 
-  bson_record = wm_create_bson (ds, vl, node->store_rates);
-  if (bson_record == NULL)
+  if (wm_create_bson (record, ds, vl, node->store_rates) != 0)
+  {
+    sfree (record);
     return (ENOMEM);
+  }
 
   pthread_mutex_lock (&node->lock);
 
-  if (!mongo_is_connected (node->conn))
+  if (!node->thread_running)
   {
-    INFO ("write_mongodb plugin: Connecting to [%s]:%i",
-        (node->host != NULL) ? node->host : "localhost",
-        (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
-    status = mongo_connect (node->conn, node->host, node->port);
-    if (status != MONGO_OK) {
-      ERROR ("write_mongodb plugin: Connecting to [%s]:%i failed.",
-          (node->host != NULL) ? node->host : "localhost",
-          (node->port != 0) ? node->port : MONGO_DEFAULT_PORT);
-      mongo_destroy (node->conn);
+    status = pthread_create (&node->thread, /* attr = */ NULL,
+        wm_sender_thread, node);
+    if (status != 0)
+    {
       pthread_mutex_unlock (&node->lock);
+      ERROR ("write_mongodb plugin: pthread_create failed with status %i.",
+          status);
+      bson_destroy (record);
+      sfree (record);
       return (-1);
     }
-
-    if (node->timeout > 0) {
-      status = mongo_set_op_timeout (node->conn, node->timeout);
-      if (status != MONGO_OK) {
-        WARNING ("write_mongodb plugin: mongo_set_op_timeout(%i) failed: %s",
-            node->timeout, node->conn->errstr);
-      }
-    }
+    node->thread_running = 1;
   }
 
-  /* Assert if the connection has been established */
-  assert (mongo_is_connected (node->conn));
-
-  status = mongo_insert (node->conn, collection_name, bson_record);
-  if(status != MONGO_OK)
+  if (node->docs_num >= (2 * node->batch_size))
   {
-    ERROR ( "write_mongodb plugin: error inserting record: %d", node->conn->err);
-    if (node->conn->err != MONGO_BSON_INVALID)
-      ERROR ("write_mongodb plugin: %s", node->conn->errstr);
-    else if (bson_record->err)
-      ERROR ("write_mongodb plugin: %s", bson_record->errstr);
-
-    /* Disconnect except on data errors. */
-    if ((node->conn->err != MONGO_BSON_INVALID)
-        && (node->conn->err != MONGO_BSON_NOT_FINISHED))
-      mongo_destroy (node->conn);
+    c_complain (LOG_WARNING, &node->drop_complaint,
+        "write_mongodb plugin: The buffer of node \"%s\" is full. "
+        "Dropping values.", node->name);
+    pthread_mutex_unlock (&node->lock);
+    bson_destroy (record);
+    sfree (record);
+    return (-1);
   }
 
-  pthread_mutex_unlock (&node->lock);
+  c_release (LOG_INFO, &node->drop_complaint,
+      "write_mongodb plugin: The buffer of node \"%s\" has room again.",
+      node->name);
+
+  doc = node->docs + node->docs_num;
+  ssnprintf (doc->collection, sizeof (doc->collection), "collectd.%s",
+      vl->plugin);
+  doc->record = record;
+
+  if (node->docs_num == 0)
+    node->docs_init_time = cdtime ();
+  node->docs_num++;
 
-  /* free our resource as not to leak memory */
-  bson_dispose (bson_record);
+  /* Wake up the sender when the first document is added, so it starts
+   * timing the flush interval, and when a batch is complete. */
+  if ((node->docs_num == 1) || (node->docs_num == node->batch_size))
+    pthread_cond_signal (&node->cond);
+
+  pthread_mutex_unlock (&node->lock);
 
   return (0);
 } /* }}} int wm_write */
 
+static int wm_flush (cdtime_t __attribute__((unused)) timeout, /* {{{ */
+    const char __attribute__((unused)) *identifier,
+    user_data_t *ud)
+{
+  wm_node_t *node = ud->data;
+
+  pthread_mutex_lock (&node->lock);
+  if (node->docs_num > 0)
+  {
+    node->flush_requested = 1;
+    pthread_cond_signal (&node->cond);
+  }
+  pthread_mutex_unlock (&node->lock);
+
+  return (0);
+} /* }}} int wm_flush */
+
 static void wm_config_free (void *ptr) /* {{{ */
 {
   wm_node_t *node = ptr;
+  int i;
 
   if (node == NULL)
     return;
 
+  /* The sender thread inserts the remaining documents before it exits. */
+  pthread_mutex_lock (&node->lock);
+  node->shutdown = 1;
+  pthread_cond_signal (&node->cond);
+  pthread_mutex_unlock (&node->lock);
+
+  if (node->thread_running)
+  {
+    pthread_join (node->thread, /* retval = */ NULL);
+    node->thread_running = 0;
+  }
+
   if (mongo_is_connected (node->conn))
     mongo_destroy (node->conn);
 
+  for (i = 0; i < node->docs_num; i++)
+  {
+    bson_destroy (node->docs[i].record);
+    sfree (node->docs[i].record);
+  }
+
+  pthread_cond_destroy (&node->cond);
+  pthread_mutex_destroy (&node->lock);
+
+  sfree (node->docs);
+  sfree (node->send_docs);
+  sfree (node->batch);
   sfree (node->host);
   sfree (node);
 } /* }}} void wm_config_free */
@@ -245,13 +521,17 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
   mongo_init (node->conn);
   node->host = NULL;
   node->store_rates = 1;
+  node->batch_size = WM_DEFAULT_BATCH_SIZE;
+  C_COMPLAIN_INIT (&node->drop_complaint);
+  C_COMPLAIN_INIT (&node->send_complaint);
   pthread_mutex_init (&node->lock, /* attr = */ NULL);
+  pthread_cond_init (&node->cond, /* attr = */ NULL);
 
   status = cf_util_get_string_buffer (ci, node->name, sizeof (node->name));
 
   if (status != 0)
   {
-    sfree (node);
+    wm_config_free (node);
     return (status);
   }
 
@@ -274,6 +554,10 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
       status = cf_util_get_int (child, &node->timeout);
     else if (strcasecmp ("StoreRates", child->key) == 0)
       status = cf_util_get_boolean (child, &node->store_rates);
+    else if (strcasecmp ("BatchSize", child->key) == 0)
+      status = cf_util_get_int (child, &node->batch_size);
+    else if (strcasecmp ("FlushInterval", child->key) == 0)
+      status = cf_util_get_cdtime (child, &node->flush_interval);
     else
       WARNING ("write_mongodb plugin: Ignoring unknown config option \"%s\".",
           child->key);
@@ -282,6 +566,27 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
       break;
   } /* for (i = 0; i < ci->children_num; i++) */
 
+  if (status == 0)
+  {
+    if (node->batch_size < 1)
+    {
+      WARNING ("write_mongodb plugin: BatchSize must be at least one. "
+          "Using %i instead.", WM_DEFAULT_BATCH_SIZE);
+      node->batch_size = WM_DEFAULT_BATCH_SIZE;
+    }
+
+    node->docs = calloc (2 * node->batch_size, sizeof (*node->docs));
+    node->send_docs = calloc (2 * node->batch_size,
+        sizeof (*node->send_docs));
+    node->batch = calloc (node->batch_size, sizeof (*node->batch));
+    if ((node->docs == NULL) || (node->send_docs == NULL)
+        || (node->batch == NULL))
+    {
+      ERROR ("write_mongodb plugin: calloc failed.");
+      status = ENOMEM;
+    }
+  }
+
   if (status == 0)
   {
     char cb_name[DATA_MAX_NAME_LEN];
@@ -294,6 +599,12 @@ static int wm_config_node (oconfig_item_t *ci) /* {{{ */
 
     status = plugin_register_write (cb_name, wm_write, &ud);
     INFO ("write_mongodb plugin: registered write plugin %s %d",cb_name,status);
+    if (status == 0)
+    {
+      /* The write callback owns `node'. */
+      ud.free_func = NULL;
+      plugin_register_flush (cb_name, wm_flush, &ud);
+    }
   }
 
   if (status != 0)
@@ -30,6 +30,7 @@
 #endif
 #include <pthread.h>
 #include "utils_cache.h"
+#include "utils_complain.h"
 #include "utils_parse_option.h"
 #include "utils_avltree.c"
 #include <time.h>
@@ -45,13 +46,40 @@ struct dataset_s
   int type_id;
 };
 
+/* One row of the data table, queued by write_mysql_write and inserted by the
+ * writer thread. The names are kept so that cache misses are resolved in the
+ * writer thread, too. */
+typedef struct row_s row_t;
+struct row_s
+{
+  cdtime_t time;
+  char host[DATA_MAX_NAME_LEN];
+  char plugin[DATA_MAX_NAME_LEN];
+  char plugin_instance[DATA_MAX_NAME_LEN];
+  char type[DATA_MAX_NAME_LEN];
+  char type_instance[DATA_MAX_NAME_LEN];
+  data_source_t ds;
+  gauge_t value;
+  int host_id;
+  int plugin_id;
+  int type_id;
+  int dataset_id;
+};
+
+/* Upper bound of one formatted row: the two escaped instance strings take up
+ * to twice their length, the date, ids and value fit into the rest. */
+#define ROW_MAX_LENGTH (8 * DATA_MAX_NAME_LEN)
+
 static const char *config_keys[] = {
   "Host",
   "User",
   "Passwd",
   "Database",
   "Port",
-  "Replace"
+  "Replace",
+  "BatchSize",
+  "FlushInterval",
+  "MaxQueueLength"
 };
 
 static int config_keys_num = STATIC_ARRAY_SIZE (config_keys);
@@ -62,20 +90,41 @@ static char *passwd = "";
 static char *database = "collectd";
 static int  port = 0;
 static int  replace = 1;
+static int  batch_size = 1000;
+static cdtime_t flush_interval = 0;
+static int  max_queue_length = 100000;
 
 #define HOST_ITEM   0
 #define PLUGIN_ITEM 1
 #define TYPE_ITEM   2
 
 static MYSQL *conn;
-static MYSQL_BIND data_bind[8], notif_bind[8];
-static MYSQL_STMT *data_stmt, *notif_stmt;
+static MYSQL_BIND notif_bind[8];
+static MYSQL_STMT *notif_stmt;
 
 static pthread_mutex_t mutexdb;
 static pthread_mutex_t mutexhost_tree, mutexplugin_tree, mutextype_tree,
   mutexdataset_tree;
 
 static char data_query[1024];
+static char *query_buffer = NULL;
+static size_t query_buffer_size = 0;
+
+/* Rows are appended to "queue" by the write callback. The writer thread swaps
+ * it with "queue_send" once per flush interval and inserts all rows in one
+ * transaction. */
+static row_t *queue = NULL, *queue_send = NULL;
+static int queue_num = 0, queue_size = 0, queue_send_size = 0;
+static cdtime_t queue_init_time = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static _Bool writer_running = 0;
+static _Bool writer_shutdown = 0;
+static _Bool flush_requested = 0;
+static c_complain_t drop_complaint = C_COMPLAIN_INIT_STATIC;
+static c_complain_t insert_complaint = C_COMPLAIN_INIT_STATIC;
+
 static char notif_query[1024] =
   "INSERT INTO notification  (date,host_id,plugin_id,"
   "plugin_instance,type_id,type_instance,severity,message) VALUES "
@@ -115,46 +164,39 @@ write_mysql_config (const char *key, const char *value)
           replace = 0;
         }
     }
-}
-
-static int
-write_mysql_init (void)
-{
-  my_bool my_true = 1;
-  conn = mysql_init (NULL);
-  if (!mysql_thread_safe ())
+  else if (strcasecmp ("BatchSize", key) == 0)
     {
-      ERROR ("write_mysql plugin: mysqlclient Thread Safe OFF");
-      return (-1);
+      batch_size = atoi (value);
+      if (batch_size < 1)
+	{
+	  ERROR ("write_mysql plugin: BatchSize must be at least 1.");
+	  batch_size = 1000;
+	  return (-1);
+	}
     }
-  else
+  else if (strcasecmp ("FlushInterval", key) == 0)
     {
-      DEBUG ("write_mysql plugin: mysqlclient Thread Safe ON");
+      double tmp = atof (value);
+      if (tmp < 0.0)
+	{
+	  ERROR ("write_mysql plugin: FlushInterval must not be negative.");
+	  return (-1);
+	}
+      flush_interval = DOUBLE_TO_CDTIME_T (tmp);
     }
-  if (mysql_real_connect (conn, host, user, passwd, database, port, NULL, 0)
-      == NULL)
+  else if (strcasecmp ("MaxQueueLength", key) == 0)
     {
-      ERROR ("write_mysql plugin: Failed to connect to database %s "
-	     " at server %s with user %s : %s", database, host, user,
-	     mysql_error (conn));
+      max_queue_length = atoi (value);
+      if (max_queue_length < 1)
+	{
+	  ERROR ("write_mysql plugin: MaxQueueLength must be at least 1.");
+	  max_queue_length = 100000;
+	  return (-1);
+	}
     }
-  char tmpquery[1024] = "%s INTO data "
-    "(date,host_id,plugin_id,plugin_instance,type_id,type_instance,dataset_id,value)"
-    "VALUES (?,?,?,?,?,?,?,?)";
-  ssnprintf (data_query, sizeof (tmpquery), tmpquery, (replace == 1 ? "REPLACE" : "INSERT"));
-  mysql_options (conn, MYSQL_OPT_RECONNECT, &my_true);
-  data_stmt = mysql_stmt_init (conn);
-  notif_stmt = mysql_stmt_init (conn);
-  mysql_stmt_prepare (data_stmt, data_query, strlen (data_query));
-  mysql_stmt_prepare (notif_stmt, notif_query, strlen (notif_query));
-  host_tree = c_avl_create ((void *) strcmp);
-  plugin_tree = c_avl_create ((void *) strcmp);
-  type_tree = c_avl_create ((void *) strcmp);
-  dataset_tree = c_avl_create ((void *) strcmp);
   return (0);
 }
 
-
 static int
 add_item_id (const char *name, const int item)
 {
@@ -333,7 +375,7 @@ add_dataset_id (data_source_t * ds, int type_id)
   param_bind2[1].buffer_type = MYSQL_TYPE_LONG;
   param_bind2[1].buffer = (void *) &type_id;
   param_bind2[2].buffer_type = MYSQL_TYPE_STRING;
-  param_bind2[2].buffer = (char *) &type;
+  param_bind2[2].buffer = (char *) type;
   param_bind2[2].buffer_length = strlen (type);
   param_bind2[3].buffer_type = MYSQL_TYPE_DOUBLE;
   param_bind2[3].buffer = (void *) &ds->min;
@@ -435,7 +477,6 @@ add_dataset_id (data_source_t * ds, int type_id)
       DEBUG ("insert dataset_id in DB : %d (%s) (%d)", *id, ds->name,
 	     type_id);
     }
-  pthread_mutex_unlock (&mutexdb);
   ssnprintf (tree_key, sizeof (tree_key), "%s_%d", ds->name, type_id);
   newdataset = malloc (sizeof (dataset_t));
   sstrncpy (newdataset->name, ds->name, sizeof (newdataset->name));
@@ -513,116 +554,504 @@ get_dataset_id (data_source_t * ds, int type_id)
     }
 }
 
+/* Fills the host, plugin and type caches from the database, so that known
+ * names do not cost a round trip each after a restart. */
 static int
-write_mysql_write (const data_set_t * ds, const value_list_t * vl,
-		   user_data_t __attribute__ ((unused)) * user_data)
+warm_up_item_cache (const int item)
 {
-  int i;
-  int host_id, plugin_id, type_id, aa;
-  host_id = get_item_id ((char *) vl->host, HOST_ITEM);
-  plugin_id = get_item_id ((char *) vl->plugin, PLUGIN_ITEM);
-  type_id = get_item_id ((char *) vl->type, TYPE_ITEM);
-  if (host_id == -1 || plugin_id == -1 || type_id == -1)
+  char query[1024];
+  const char *table;
+  pthread_mutex_t *mutex;
+  c_avl_tree_t *tree;
+  MYSQL_RES *result;
+  MYSQL_ROW row;
+  int count = 0;
+  switch (item)
     {
+    case HOST_ITEM:
+      table = "host";
+      mutex = &mutexhost_tree;
+      tree = host_tree;
+      break;
+    case PLUGIN_ITEM:
+      table = "plugin";
+      mutex = &mutexplugin_tree;
+      tree = plugin_tree;
+      break;
+    default:
+      table = "type";
+      mutex = &mutextype_tree;
+      tree = type_tree;
+      break;
+    }
+  ssnprintf (query, sizeof (query), "SELECT id, name FROM %s", table);
+  pthread_mutex_lock (&mutexdb);
+  if (mysql_query (conn, query) != 0)
+    {
+      WARNING ("write_mysql plugin: Failed to warm up the %s cache : %s",
+	       table, mysql_error (conn));
+      pthread_mutex_unlock (&mutexdb);
       return -1;
     }
-  gauge_t *rates = NULL;
-  for (i = 0; i < ds->ds_num; i++)
+  result = mysql_store_result (conn);
+  pthread_mutex_unlock (&mutexdb);
+  if (result == NULL)
     {
-      int len;
-      data_source_t *dso = ds->ds + i;
-      int dataset_id = get_dataset_id (dso, type_id);
-      if (dataset_id == -1)
+      WARNING ("write_mysql plugin: Failed to store result : %s / %s",
+	       mysql_error (conn), query);
+      return -1;
+    }
+  pthread_mutex_lock (mutex);
+  while ((row = mysql_fetch_row (result)) != NULL)
+    {
+      int *id;
+      char *name;
+      if (row[0] == NULL || row[1] == NULL)
 	{
-	  return -1;
+	  continue;
+	}
+      id = malloc (sizeof (int));
+      name = strdup (row[1]);
+      if (id == NULL || name == NULL)
+	{
+	  sfree (id);
+	  sfree (name);
+	  break;
 	}
-      MYSQL_TIME mysql_date;
-      struct tm *time;
-      time_t timet;
-      timet = CDTIME_T_TO_TIME_T (vl->time);
-      time = localtime (&timet);
-      mysql_date.year = time->tm_year + 1900;
-      mysql_date.month = time->tm_mon + 1;
-      mysql_date.day = time->tm_mday;
-      mysql_date.hour = time->tm_hour;
-      mysql_date.minute = time->tm_min;
-      mysql_date.second = time->tm_sec;
-      pthread_mutex_lock (&mutexdb);
-      memset (data_bind, '\0', sizeof (MYSQL_BIND) * 8);
-      data_bind[0].buffer_type = MYSQL_TYPE_DATETIME;
-      data_bind[0].buffer = (char *) &mysql_date;
-      data_bind[1].buffer_type = MYSQL_TYPE_LONG;
-      data_bind[1].buffer = (void *) &host_id;
-      data_bind[2].buffer_type = MYSQL_TYPE_LONG;
-      data_bind[2].buffer = (void *) &plugin_id;
-      data_bind[3].buffer_type = MYSQL_TYPE_STRING;
-      data_bind[3].buffer = (void *) vl->plugin_instance;
-      data_bind[3].buffer_length = strlen (vl->plugin_instance);
-      data_bind[4].buffer_type = MYSQL_TYPE_LONG;
-      data_bind[4].buffer = (void *) &type_id;
-      data_bind[5].buffer_type = MYSQL_TYPE_STRING;
-      data_bind[5].buffer = (void *) vl->type_instance;
-      data_bind[5].buffer_length = strlen (vl->type_instance);
-      data_bind[6].buffer_type = MYSQL_TYPE_LONG;
-      data_bind[6].buffer = (void *) &dataset_id;
-      if (dso->type == DS_TYPE_GAUGE)
+      *id = atoi (row[0]);
+      if (c_avl_insert (tree, name, (void *) id) != 0)
 	{
-	  data_bind[7].buffer_type = MYSQL_TYPE_DOUBLE;
-	  data_bind[7].buffer = (void *) &(vl->values[i].gauge);
+	  sfree (id);
+	  sfree (name);
+	  continue;
+	}
+      count++;
+    }
+  pthread_mutex_unlock (mutex);
+  mysql_free_result (result);
+  DEBUG ("write_mysql plugin: Loaded %i %s ids from DB", count, table);
+  return 0;
+}
 
+static int
+warm_up_dataset_cache (void)
+{
+  char *query = "SELECT id, name, type_id FROM dataset";
+  MYSQL_RES *result;
+  MYSQL_ROW row;
+  int count = 0;
+  pthread_mutex_lock (&mutexdb);
+  if (mysql_query (conn, query) != 0)
+    {
+      WARNING ("write_mysql plugin: Failed to warm up the dataset cache : %s",
+	       mysql_error (conn));
+      pthread_mutex_unlock (&mutexdb);
+      return -1;
+    }
+  result = mysql_store_result (conn);
+  pthread_mutex_unlock (&mutexdb);
+  if (result == NULL)
+    {
+      WARNING ("write_mysql plugin: Failed to store result : %s / %s",
+	       mysql_error (conn), query);
+      return -1;
+    }
+  pthread_mutex_lock (&mutexdataset_tree);
+  while ((row = mysql_fetch_row (result)) != NULL)
+    {
+      char tree_key[DATA_MAX_NAME_LEN * 2];
+      dataset_t *newdataset;
+      char *key;
+      if (row[0] == NULL || row[1] == NULL || row[2] == NULL)
+	{
+	  continue;
 	}
-      else
+      newdataset = malloc (sizeof (dataset_t));
+      if (newdataset == NULL)
+	{
+	  break;
+	}
+      sstrncpy (newdataset->name, row[1], sizeof (newdataset->name));
+      newdataset->id = atoi (row[0]);
+      newdataset->type_id = atoi (row[2]);
+      ssnprintf (tree_key, sizeof (tree_key), "%s_%d", newdataset->name,
+		 newdataset->type_id);
+      key = strdup (tree_key);
+      if (key == NULL || c_avl_insert (dataset_tree, key, newdataset) != 0)
+	{
+	  sfree (key);
+	  sfree (newdataset);
+	  continue;
+	}
+      count++;
+    }
+  pthread_mutex_unlock (&mutexdataset_tree);
+  mysql_free_result (result);
+  DEBUG ("write_mysql plugin: Loaded %i dataset ids from DB", count);
+  return 0;
+}
+
+/* Looks up the ids of all rows. Cache misses insert the missing names into
+ * the database, which is why this runs in the writer thread. Rows which
+ * could not be resolved get a dataset_id of -1 and are skipped. */
+static void
+resolve_rows (row_t * rows, int rows_num)
+{
+  int i;
+  for (i = 0; i < rows_num; i++)
+    {
+      row_t *r = rows + i;
+      r->dataset_id = -1;
+      r->host_id = get_item_id (r->host, HOST_ITEM);
+      r->plugin_id = get_item_id (r->plugin, PLUGIN_ITEM);
+      r->type_id = get_item_id (r->type, TYPE_ITEM);
+      if (r->host_id == -1 || r->plugin_id == -1 || r->type_id == -1)
 	{
-	  if (rates == NULL)
+	  continue;
+	}
+      r->dataset_id = get_dataset_id (&r->ds, r->type_id);
+    }
+}
+
+/* Appends one "(...)" tuple to the query buffer. Must be called with
+ * mutexdb held, because escaping depends on the connection's charset. */
+static int
+format_row (const row_t * r, char *buffer, size_t buffer_size, int first)
+{
+  char date[32];
+  char plugin_instance[2 * DATA_MAX_NAME_LEN + 1];
+  char type_instance[2 * DATA_MAX_NAME_LEN + 1];
+  char value[64];
+  struct tm tm;
+  time_t timet;
+  int status;
+  timet = CDTIME_T_TO_TIME_T (r->time);
+  if (localtime_r (&timet, &tm) == NULL)
+    {
+      return -1;
+    }
+  strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S", &tm);
+  mysql_real_escape_string (conn, plugin_instance, r->plugin_instance,
+			    strlen (r->plugin_instance));
+  mysql_real_escape_string (conn, type_instance, r->type_instance,
+			    strlen (r->type_instance));
+  if (isnan (r->value) || isinf (r->value))
+    {
+      sstrncpy (value, "NULL", sizeof (value));
+    }
+  else
+    {
+      ssnprintf (value, sizeof (value), "%.15g", r->value);
+    }
+  status = ssnprintf (buffer, buffer_size, "%s('%s',%d,%d,'%s',%d,'%s',%d,%s)",
+		      first ? "" : ",", date, r->host_id, r->plugin_id,
+		      plugin_instance, r->type_id, type_instance,
+		      r->dataset_id, value);
+  if (status < 0 || (size_t) status >= buffer_size)
+    {
+      return -1;
+    }
+  return status;
+}
+
+/* Inserts the rows with multi-row statements of at most batch_size rows each,
+ * all in one transaction. */
+static int
+insert_rows (row_t * rows, int rows_num)
+{
+  size_t prefix_len = strlen (data_query);
+  int i = 0;
+  pthread_mutex_lock (&mutexdb);
+  if (mysql_ping (conn) != 0)
+    {
+      ERROR
+	("write_mysql plugin: insert_rows - Failed to re-connect to database : %s",
+	 mysql_error (conn));
+      pthread_mutex_unlock (&mutexdb);
+      return -1;
+    }
+  if (mysql_query (conn, "START TRANSACTION") != 0)
+    {
+      ERROR ("write_mysql plugin: Failed to start transaction : %s",
+	     mysql_error (conn));
+      pthread_mutex_unlock (&mutexdb);
+      return -1;
+    }
+  while (i < rows_num)
+    {
+      size_t offset = prefix_len;
+      int n = 0;
+      memcpy (query_buffer, data_query, prefix_len);
+      for (; i < rows_num && n < batch_size; i++)
+	{
+	  int len;
+	  if (rows[i].dataset_id == -1)
 	    {
-	      rates = uc_get_rate (ds, vl);
+	      continue;
 	    }
-	  if (rates == NULL || isnan (rates[i]))
+	  len = format_row (rows + i, query_buffer + offset,
+			    query_buffer_size - offset, n == 0);
+	  if (len < 0)
 	    {
-	      pthread_mutex_unlock (&mutexdb);
-	      sfree (rates);
+	      WARNING ("write_mysql plugin: Failed to format row for %s/%s-%s/%s-%s",
+		       rows[i].host, rows[i].plugin, rows[i].plugin_instance,
+		       rows[i].type, rows[i].type_instance);
 	      continue;
 	    }
-	  data_bind[7].buffer_type = MYSQL_TYPE_DOUBLE;
-	  data_bind[7].buffer = (void *) &(rates[i]);
+	  offset += len;
+	  n++;
 	}
-      if (mysql_ping (conn) != 0)
+      if (n == 0)
 	{
-	  ERROR
-	    ("write_mysql plugin: write_mysql_write - Failed to re-connect to database : %s",
-	     mysql_error (conn));
+	  break;
+	}
+      if (mysql_real_query (conn, query_buffer, offset) != 0)
+	{
+	  ERROR ("write_mysql plugin: Failed to insert %i rows : %s", n,
+		 mysql_error (conn));
+	  mysql_rollback (conn);
 	  pthread_mutex_unlock (&mutexdb);
-	  sfree (rates);
 	  return -1;
 	}
-      if (mysql_stmt_bind_param (data_stmt, data_bind) != 0)
+    }
+  if (mysql_commit (conn) != 0)
+    {
+      ERROR ("write_mysql plugin: Failed to commit transaction : %s",
+	     mysql_error (conn));
+      mysql_rollback (conn);
+      pthread_mutex_unlock (&mutexdb);
+      return -1;
+    }
+  pthread_mutex_unlock (&mutexdb);
+  return 0;
+}
+
+static void *
+write_mysql_thread (void __attribute__ ((unused)) * arg)
+{
+  pthread_mutex_lock (&queue_lock);
+  while (42)
+    {
+      cdtime_t interval = (flush_interval > 0) ? flush_interval : interval_g;
+      row_t *rows;
+      int rows_num, rows_size, status;
+      /* Wait until the oldest row is one flush interval old, the queue is
+       * half full or a flush has been requested. The write callback signals
+       * when it adds the first row, so the deadline is picked up right
+       * away. */
+      while (!writer_shutdown && !flush_requested
+	     && (queue_num < (max_queue_length / 2)))
 	{
-	  ERROR
-	    ("write_mysql plugin: Failed to bind param to statement : %s / %s",
-	     mysql_stmt_error (data_stmt), data_query);
-	  pthread_mutex_unlock (&mutexdb);
+	  struct timespec ts_wait;
+	  if (queue_num == 0)
+	    {
+	      pthread_cond_wait (&queue_cond, &queue_lock);
+	      continue;
+	    }
+	  if (cdtime () >= (queue_init_time + interval))
+	    {
+	      break;
+	    }
+	  CDTIME_T_TO_TIMESPEC (queue_init_time + interval, &ts_wait);
+	  pthread_cond_timedwait (&queue_cond, &queue_lock, &ts_wait);
+	}
+      flush_requested = 0;
+      if (queue_num == 0)
+	{
+	  if (writer_shutdown)
+	    {
+	      break;
+	    }
+	  continue;
+	}
+      rows = queue;
+      rows_num = queue_num;
+      rows_size = queue_size;
+      queue = queue_send;
+      queue_size = queue_send_size;
+      queue_num = 0;
+      queue_send = rows;
+      queue_send_size = rows_size;
+      pthread_mutex_unlock (&queue_lock);
+      resolve_rows (rows, rows_num);
+      status = insert_rows (rows, rows_num);
+      pthread_mutex_lock (&queue_lock);
+      if (status != 0)
+	{
+	  c_complain (LOG_WARNING, &insert_complaint,
+		      "write_mysql plugin: Dropped %i rows.", rows_num);
+	}
+      else
+	{
+	  c_release (LOG_INFO, &insert_complaint,
+		     "write_mysql plugin: Inserting rows succeeded again.");
+	}
+    }
+  pthread_mutex_unlock (&queue_lock);
+  return ((void *) 0);
+}
+
+static int
+write_mysql_init (void)
+{
+  my_bool my_true = 1;
+  int status;
+  conn = mysql_init (NULL);
+  if (!mysql_thread_safe ())
+    {
+      ERROR ("write_mysql plugin: mysqlclient Thread Safe OFF");
+      return (-1);
+    }
+  else
+    {
+      DEBUG ("write_mysql plugin: mysqlclient Thread Safe ON");
+    }
+  if (mysql_real_connect (conn, host, user, passwd, database, port, NULL, 0)
+      == NULL)
+    {
+      ERROR ("write_mysql plugin: Failed to connect to database %s "
+	     " at server %s with user %s : %s", database, host, user,
+	     mysql_error (conn));
+    }
+  ssnprintf (data_query, sizeof (data_query), "%s INTO data "
+	     "(date,host_id,plugin_id,plugin_instance,type_id,type_instance,dataset_id,value) "
+	     "VALUES ", (replace == 1 ? "REPLACE" : "INSERT IGNORE"));
+  mysql_options (conn, MYSQL_OPT_RECONNECT, &my_true);
+  notif_stmt = mysql_stmt_init (conn);
+  mysql_stmt_prepare (notif_stmt, notif_query, strlen (notif_query));
+  host_tree = c_avl_create ((void *) strcmp);
+  plugin_tree = c_avl_create ((void *) strcmp);
+  type_tree = c_avl_create ((void *) strcmp);
+  dataset_tree = c_avl_create ((void *) strcmp);
+  warm_up_item_cache (HOST_ITEM);
+  warm_up_item_cache (PLUGIN_ITEM);
+  warm_up_item_cache (TYPE_ITEM);
+  warm_up_dataset_cache ();
+  if (max_queue_length < batch_size)
+    {
+      max_queue_length = batch_size;
+    }
+  query_buffer_size = strlen (data_query) + batch_size * ROW_MAX_LENGTH;
+  query_buffer = malloc (query_buffer_size);
+  if (query_buffer == NULL)
+    {
+      ERROR ("write_mysql plugin: malloc failed.");
+      return (-1);
+    }
+  status = pthread_create (&writer_thread, NULL, write_mysql_thread, NULL);
+  if (status != 0)
+    {
+      ERROR ("write_mysql plugin: pthread_create failed with status %i.",
+	     status);
+      return (-1);
+    }
+  writer_running = 1;
+  return (0);
+}
+
+/* Queues one row per data source. Nothing in here talks to the database, so
+ * a slow or unreachable server never blocks the caller. */
+static int
+write_mysql_write (const data_set_t * ds, const value_list_t * vl,
+		   user_data_t __attribute__ ((unused)) * user_data)
+{
+  int i, queue_num_old;
+  gauge_t *rates = NULL;
+  for (i = 0; i < ds->ds_num; i++)
+    {
+      if (ds->ds[i].type != DS_TYPE_GAUGE)
+	{
+	  rates = uc_get_rate (ds, vl);
+	  break;
+	}
+    }
+  pthread_mutex_lock (&queue_lock);
+  if (queue_num + ds->ds_num > max_queue_length)
+    {
+      c_complain (LOG_WARNING, &drop_complaint,
+		  "write_mysql plugin: The queue is full. Dropping values.");
+      pthread_mutex_unlock (&queue_lock);
+      sfree (rates);
+      return -1;
+    }
+  c_release (LOG_INFO, &drop_complaint,
+	     "write_mysql plugin: The queue has room again.");
+  if (queue_num + ds->ds_num > queue_size)
+    {
+      int new_size = (queue_size > 0) ? 2 * queue_size : batch_size;
+      row_t *tmp;
+      while (new_size < queue_num + ds->ds_num)
+	{
+	  new_size *= 2;
+	}
+      if (new_size > max_queue_length)
+	{
+	  new_size = max_queue_length;
+	}
+      tmp = realloc (queue, new_size * sizeof (*queue));
+      if (tmp == NULL)
+	{
+	  ERROR ("write_mysql plugin: realloc failed.");
+	  pthread_mutex_unlock (&queue_lock);
 	  sfree (rates);
 	  return -1;
 	}
-      if (mysql_stmt_execute (data_stmt) != 0)
+      queue = tmp;
+      queue_size = new_size;
+    }
+  queue_num_old = queue_num;
+  if (queue_num == 0)
+    {
+      queue_init_time = cdtime ();
+    }
+  for (i = 0; i < ds->ds_num; i++)
+    {
+      row_t *r = queue + queue_num;
+      if (ds->ds[i].type == DS_TYPE_GAUGE)
 	{
-	  // Try to re-prepare statement
-	  data_stmt = mysql_stmt_init (conn);
-	  mysql_stmt_prepare (data_stmt, data_query, strlen (data_query));
-	  mysql_stmt_bind_param (data_stmt, data_bind);
-	  if (mysql_stmt_execute (data_stmt) != 0)
+	  r->value = vl->values[i].gauge;
+	}
+      else
+	{
+	  if (rates == NULL || isnan (rates[i]))
 	    {
-	      ERROR
-		("write_mysql plugin: Failed to execute re-prepared statement : %s / %s",
-		 mysql_stmt_error (data_stmt), data_query);
-	      pthread_mutex_unlock (&mutexdb);
-	      sfree (rates);
-	      return -1;
+	      continue;
 	    }
+	  r->value = rates[i];
 	}
-      sfree (rates);
-      pthread_mutex_unlock (&mutexdb);
+      r->time = vl->time;
+      sstrncpy (r->host, vl->host, sizeof (r->host));
+      sstrncpy (r->plugin, vl->plugin, sizeof (r->plugin));
+      sstrncpy (r->plugin_instance, vl->plugin_instance,
+		sizeof (r->plugin_instance));
+      sstrncpy (r->type, vl->type, sizeof (r->type));
+      sstrncpy (r->type_instance, vl->type_instance,
+		sizeof (r->type_instance));
+      memcpy (&r->ds, ds->ds + i, sizeof (r->ds));
+      queue_num++;
+    }
+  if ((queue_num_old == 0 && queue_num > 0)
+      || (queue_num >= (max_queue_length / 2)))
+    {
+      pthread_cond_signal (&queue_cond);
+    }
+  pthread_mutex_unlock (&queue_lock);
+  sfree (rates);
+  return (0);
+}
+
+static int
+write_mysql_flush (cdtime_t __attribute__ ((unused)) timeout,
+		   const char __attribute__ ((unused)) * identifier,
+		   user_data_t __attribute__ ((unused)) * user_data)
+{
+  pthread_mutex_lock (&queue_lock);
+  if (queue_num > 0)
+    {
+      flush_requested = 1;
+      pthread_cond_signal (&queue_cond);
     }
+  pthread_mutex_unlock (&queue_lock);
   return (0);
 }
 
@@ -735,6 +1164,20 @@ free_tree (c_avl_tree_t * tree)
 static int
 write_mysql_shutdown (void)
 {
+  /* The writer thread inserts the remaining rows before it exits. */
+  pthread_mutex_lock (&queue_lock);
+  writer_shutdown = 1;
+  pthread_cond_signal (&queue_cond);
+  pthread_mutex_unlock (&queue_lock);
+  if (writer_running)
+    {
+      pthread_join (writer_thread, NULL);
+      writer_running = 0;
+    }
+  sfree (queue);
+  sfree (queue_send);
+  queue_num = queue_size = queue_send_size = 0;
+  sfree (query_buffer);
   free_tree (host_tree);
   free_tree (plugin_tree);
   free_tree (type_tree);
@@ -751,6 +1194,8 @@ module_register (void)
 			  config_keys, config_keys_num);
   plugin_register_write ("write_mysql", write_mysql_write, /* user_data = */
 			 NULL);
+  plugin_register_flush ("write_mysql", write_mysql_flush, /* user_data = */
+			 NULL);
   plugin_register_shutdown ("write_mysql", write_mysql_shutdown);
   plugin_register_notification ("write_mysql", notify_write_mysql,
 				/* user_data = */ NULL);
@@ -28,10 +28,26 @@
 #include "plugin.h"
 #include "common.h"
 #include "configfile.h"
+#include "utils_avltree.h"
+#include "utils_complain.h"
 
 #include <pthread.h>
-#include <credis.h>
-
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+#define WR_DEFAULT_HOST "localhost"
+#define WR_DEFAULT_PORT 6379
+#define WR_DEFAULT_BUFFER_SIZE 65536
+
+/* Commands are sent to the server using the Redis protocol ("RESP") directly,
+ * because libcredis cannot send more than one command at a time. All value
+ * lists written during one flush interval are sent as one pipelined batch by
+ * a thread of the node, so the write threads never wait for the server. */
 struct wr_node_s
 {
   char name[DATA_MAX_NAME_LEN];
@@ -39,15 +55,433 @@ struct wr_node_s
   char *host;
   int port;
   int timeout;
-
-  REDIS conn;
+  cdtime_t flush_interval;
+  cdtime_t retention;
+  size_t buffer_size;
+
+  /* Only used by the sender thread. A batch that could not be sent is kept
+   * in `send_buffer' and sent once more, over a new connection, with the next
+   * batch. All commands used are idempotent, so sending them twice is
+   * harmless. */
+  int sock_fd;
+  char *send_buffer;
+  size_t retry_fill;
+  size_t retry_commands;
+  cdtime_t retry_time;
+  c_complain_t conn_complaint;
+  c_complain_t send_complaint;
+
+  /* Everything below is protected by `lock'. */
   pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  _Bool thread_running;
+  _Bool flush_requested;
+  _Bool shutdown;
+
+  /* Commands waiting to be sent. */
+  char *buffer;
+  size_t buffer_fill;
+  size_t buffer_commands;
+  cdtime_t buffer_init_time;
+
+  /* Identifiers which have been added to the "collectd/values" set. Maps the
+   * identifier to the time of the last ZREMRANGEBYSCORE. */
+  c_avl_tree_t *known;
+  c_complain_t drop_complaint;
 };
 typedef struct wr_node_s wr_node_t;
 
 /*
  * Functions
  */
+static void wr_known_clear (wr_node_t *node) /* {{{ */
+{
+  void *key;
+  void *value;
+
+  while (c_avl_pick (node->known, &key, &value) == 0)
+  {
+    sfree (key);
+    sfree (value);
+  }
+} /* }}} void wr_known_clear */
+
+static void wr_disconnect (wr_node_t *node) /* {{{ */
+{
+  if (node->sock_fd < 0)
+    return;
+
+  close (node->sock_fd);
+  node->sock_fd = -1;
+} /* }}} void wr_disconnect */
+
+static int wr_connect (wr_node_t *node) /* {{{ */
+{
+  struct addrinfo ai_hints;
+  struct addrinfo *ai_list = NULL;
+  struct addrinfo *ai_ptr;
+  const char *host = (node->host != NULL) ? node->host : WR_DEFAULT_HOST;
+  char service[16];
+  int status;
+
+  if (node->sock_fd >= 0)
+    return (0);
+
+  ssnprintf (service, sizeof (service), "%i",
+      (node->port != 0) ? node->port : WR_DEFAULT_PORT);
+
+  memset (&ai_hints, 0, sizeof (ai_hints));
+#ifdef AI_ADDRCONFIG
+  ai_hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+  ai_hints.ai_family = AF_UNSPEC;
+  ai_hints.ai_socktype = SOCK_STREAM;
+
+  status = getaddrinfo (host, service, &ai_hints, &ai_list);
+  if (status != 0)
+  {
+    c_complain (LOG_ERR, &node->conn_complaint,
+        "write_redis plugin: getaddrinfo (%s, %s) failed: %s",
+        host, service, gai_strerror (status));
+    return (-1);
+  }
+
+  for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+  {
+    node->sock_fd = socket (ai_ptr->ai_family, ai_ptr->ai_socktype,
+        ai_ptr->ai_protocol);
+    if (node->sock_fd < 0)
+      continue;
+
+    if (connect (node->sock_fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen) != 0)
+    {
+      wr_disconnect (node);
+      continue;
+    }
+
+    break;
+  }
+
+  freeaddrinfo (ai_list);
+
+  if (node->sock_fd < 0)
+  {
+    char errbuf[1024];
+    c_complain (LOG_ERR, &node->conn_complaint,
+        "write_redis plugin: Connecting to host \"%s\" (port %s) failed: %s",
+        host, service, sstrerror (errno, errbuf, sizeof (errbuf)));
+    return (-1);
+  }
+
+  if (node->timeout > 0)
+  {
+    struct timeval tv;
+
+    tv.tv_sec = node->timeout / 1000;
+    tv.tv_usec = (node->timeout % 1000) * 1000;
+    setsockopt (node->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+    setsockopt (node->sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  }
+
+  c_release (LOG_INFO, &node->conn_complaint,
+      "write_redis plugin: Successfully connected to host \"%s\" "
+      "(port %s).", host, service);
+
+  return (0);
+} /* }}} int wr_connect */
+
+/* Reads one reply per command sent. Only status, integer and error replies
+ * are expected, each of which is a single line. Returns the number of error
+ * replies or less than zero if the connection is unusable. */
+static int wr_read_replies (wr_node_t *node, size_t commands_num) /* {{{ */
+{
+  char buffer[4096];
+  size_t buffer_fill = 0;
+  char first_error[256] = "";
+  size_t replies_num = commands_num;
+  int errors_num = 0;
+
+  while (commands_num > 0)
+  {
+    char *line = buffer;
+    char *eol;
+    ssize_t status;
+
+    status = recv (node->sock_fd, buffer + buffer_fill,
+        sizeof (buffer) - buffer_fill, /* flags = */ 0);
+    if (status <= 0)
+    {
+      char errbuf[1024];
+      c_complain (LOG_ERR, &node->conn_complaint,
+          "write_redis plugin: Receiving replies from node \"%s\" failed: %s",
+          node->name, (status == 0) ? "Connection closed"
+          : sstrerror (errno, errbuf, sizeof (errbuf)));
+      return (-1);
+    }
+    buffer_fill += (size_t) status;
+
+    while ((commands_num > 0)
+        && ((eol = memchr (line, '\n', buffer_fill - (line - buffer))) != NULL))
+    {
+      if (line[0] == '-')
+      {
+        if (errors_num == 0)
+        {
+          *eol = 0;
+          if ((eol > line) && (eol[-1] == '\r'))
+            eol[-1] = 0;
+          sstrncpy (first_error, line + 1, sizeof (first_error));
+        }
+        errors_num++;
+      }
+      else if ((line[0] != ':') && (line[0] != '+'))
+      {
+        ERROR ("write_redis plugin: Received an unexpected reply from "
+            "node \"%s\".", node->name);
+        return (-1);
+      }
+
+      commands_num--;
+      line = eol + 1;
+    }
+
+    buffer_fill -= (size_t) (line - buffer);
+    if (buffer_fill >= sizeof (buffer))
+    {
+      ERROR ("write_redis plugin: Received an overlong reply from "
+          "node \"%s\".", node->name);
+      return (-1);
+    }
+    memmove (buffer, line, buffer_fill);
+  }
+
+  if (errors_num > 0)
+    WARNING ("write_redis plugin: %i of %zu commands sent to node \"%s\" "
+        "failed. The first error was: %s",
+        errors_num, replies_num, node->name, first_error);
+
+  return (errors_num);
+} /* }}} int wr_read_replies */
+
+static int wr_send_batch (wr_node_t *node, /* {{{ */
+    size_t buffer_fill, size_t commands_num)
+{
+  size_t sent = 0;
+  int status;
+
+  if (wr_connect (node) != 0)
+    return (-1);
+
+  while (sent < buffer_fill)
+  {
+    ssize_t n;
+
+    n = send (node->sock_fd, node->send_buffer + sent, buffer_fill - sent,
+        MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      char errbuf[1024];
+
+      if (errno == EINTR)
+        continue;
+
+      c_complain (LOG_ERR, &node->conn_complaint,
+          "write_redis plugin: Sending to node \"%s\" failed: %s",
+          node->name, sstrerror (errno, errbuf, sizeof (errbuf)));
+      wr_disconnect (node);
+      return (-1);
+    }
+    sent += (size_t) n;
+  }
+
+  /* Errors returned for single commands are logged, but don't affect the
+   * rest of the batch. */
+  status = wr_read_replies (node, commands_num);
+  if (status < 0)
+  {
+    wr_disconnect (node);
+    return (-1);
+  }
+
+  return (0);
+} /* }}} int wr_send_batch */
+
+/* NOTE: You must hold node->lock when calling this function! */
+static void wr_drop_batch (wr_node_t *node, size_t commands_num) /* {{{ */
+{
+  /* The batch is lost, and so are the SADD commands in it. */
+  c_complain (LOG_WARNING, &node->send_complaint,
+      "write_redis plugin: Dropped %zu commands for node \"%s\".",
+      commands_num, node->name);
+  wr_known_clear (node);
+} /* }}} void wr_drop_batch */
+
+static void *wr_sender_thread (void *arg) /* {{{ */
+{
+  wr_node_t *node = arg;
+
+  pthread_mutex_lock (&node->lock);
+  while (42)
+  {
+    cdtime_t flush_interval;
+    size_t buffer_fill;
+    size_t commands_num;
+    char *tmp;
+    int status;
+
+    flush_interval = (node->flush_interval > 0)
+      ? node->flush_interval : interval_g;
+
+    /* Wait until the oldest command, or the failed batch, is one flush
+     * interval old, the buffer is half full or a flush has been requested.
+     * wr_write signals when it adds the first command to an empty buffer, so
+     * the deadline is picked up right away. */
+    while (!node->shutdown && !node->flush_requested
+        && (node->buffer_fill < (node->buffer_size / 2)))
+    {
+      struct timespec ts_wait;
+      cdtime_t oldest;
+
+      if ((node->buffer_fill == 0) && (node->retry_fill == 0))
+      {
+        pthread_cond_wait (&node->cond, &node->lock);
+        continue;
+      }
+
+      if (node->buffer_fill == 0)
+        oldest = node->retry_time;
+      else if ((node->retry_fill != 0)
+          && (node->retry_time < node->buffer_init_time))
+        oldest = node->retry_time;
+      else
+        oldest = node->buffer_init_time;
+
+      if (cdtime () >= (oldest + flush_interval))
+        break;
+
+      CDTIME_T_TO_TIMESPEC (oldest + flush_interval, &ts_wait);
+      pthread_cond_timedwait (&node->cond, &node->lock, &ts_wait);
+    }
+
+    node->flush_requested = 0;
+
+    if (node->retry_fill != 0)
+    {
+      buffer_fill = node->retry_fill;
+      commands_num = node->retry_commands;
+      node->retry_fill = 0;
+      node->retry_commands = 0;
+
+      pthread_mutex_unlock (&node->lock);
+      status = wr_send_batch (node, buffer_fill, commands_num);
+      pthread_mutex_lock (&node->lock);
+
+      if (status != 0)
+        wr_drop_batch (node, commands_num);
+    }
+
+    if (node->buffer_fill == 0)
+    {
+      if (node->shutdown)
+        break;
+      continue;
+    }
+
+    /* Swap the buffers, so new commands can be added while sending. */
+    tmp = node->send_buffer;
+    node->send_buffer = node->buffer;
+    node->buffer = tmp;
+    buffer_fill = node->buffer_fill;
+    commands_num = node->buffer_commands;
+    node->buffer_fill = 0;
+    node->buffer_commands = 0;
+
+    pthread_mutex_unlock (&node->lock);
+    status = wr_send_batch (node, buffer_fill, commands_num);
+    pthread_mutex_lock (&node->lock);
+
+    if ((status != 0) && node->shutdown)
+    {
+      wr_drop_batch (node, commands_num);
+    }
+    else if (status != 0)
+    {
+      /* Keep the batch in `send_buffer' for one more attempt. */
+      node->retry_fill = buffer_fill;
+      node->retry_commands = commands_num;
+      node->retry_time = cdtime ();
+    }
+  } /* while (42) */
+  pthread_mutex_unlock (&node->lock);
+
+  wr_disconnect (node);
+  return ((void *) 0);
+} /* }}} void *wr_sender_thread */
+
+/* Appends one command in the Redis protocol to the buffer. Either the whole
+ * command is appended or nothing at all.
+ * NOTE: You must hold node->lock when calling this function! */
+static int wr_append_command (wr_node_t *node, /* {{{ */
+    int argc, const char **argv)
+{
+  size_t argv_len[4];
+  size_t len;
+  char *ptr;
+  int i;
+
+  assert (argc <= STATIC_ARRAY_SIZE (argv_len));
+
+  len = 16;
+  for (i = 0; i < argc; i++)
+  {
+    argv_len[i] = strlen (argv[i]);
+    len += 16 + argv_len[i];
+  }
+
+  if ((node->buffer_size - node->buffer_fill) < len)
+    return (ENOMEM);
+
+  ptr = node->buffer + node->buffer_fill;
+  ptr += ssnprintf (ptr, 16, "*%i\r\n", argc);
+  for (i = 0; i < argc; i++)
+  {
+    ptr += ssnprintf (ptr, 16, "$%zu\r\n", argv_len[i]);
+    memcpy (ptr, argv[i], argv_len[i]);
+    ptr += argv_len[i];
+    *(ptr++) = '\r';
+    *(ptr++) = '\n';
+  }
+
+  if (node->buffer_fill == 0)
+    node->buffer_init_time = cdtime ();
+  node->buffer_fill = (size_t) (ptr - node->buffer);
+  node->buffer_commands++;
+
+  return (0);
+} /* }}} int wr_append_command */
+
+/* NOTE: You must hold node->lock when calling this function! */
+static int wr_start_thread (wr_node_t *node) /* {{{ */
+{
+  int status;
+
+  if (node->thread_running)
+    return (0);
+
+  status = pthread_create (&node->thread, /* attr = */ NULL,
+      wr_sender_thread, node);
+  if (status != 0)
+  {
+    ERROR ("write_redis plugin: pthread_create failed with status %i.",
+        status);
+    return (-1);
+  }
+
+  node->thread_running = 1;
+  return (0);
+} /* }}} int wr_start_thread */
+
 static int wr_write (const data_set_t *ds, /* {{{ */
     const value_list_t *vl,
     user_data_t *ud)
@@ -56,8 +490,12 @@ static int wr_write (const data_set_t *ds, /* {{{ */
   char ident[512];
   char key[512];
   char value[512];
+  char score[32];
   size_t value_size;
   char *value_ptr;
+  size_t buffer_fill;
+  size_t commands_num;
+  cdtime_t *last_trim = NULL;
   int status;
   int i;
 
@@ -101,32 +539,109 @@ static int wr_write (const data_set_t *ds, /* {{{ */
 
 #undef APPEND
 
+  ssnprintf (score, sizeof (score), "%"PRIu64, (uint64_t) vl->time);
+
   pthread_mutex_lock (&node->lock);
 
-  if (node->conn == NULL)
+  if (wr_start_thread (node) != 0)
+  {
+    pthread_mutex_unlock (&node->lock);
+    return (-1);
+  }
+
+  /* Undo everything if not all commands fit into the buffer. */
+  buffer_fill = node->buffer_fill;
+  commands_num = node->buffer_commands;
+
+  {
+    const char *argv[] = { "ZADD", key, score, value };
+    status = wr_append_command (node, STATIC_ARRAY_SIZE (argv), argv);
+  }
+
+  if ((status == 0)
+      && (c_avl_get (node->known, ident, (void *) &last_trim) != 0))
+  {
+    const char *argv[] = { "SADD", "collectd/values", ident };
+    status = wr_append_command (node, STATIC_ARRAY_SIZE (argv), argv);
+    last_trim = NULL;
+  }
+
+  /* Trim each sorted set at most once per flush interval. */
+  if ((status == 0) && (node->retention > 0) && (vl->time > node->retention)
+      && ((last_trim == NULL)
+        || ((vl->time - *last_trim) >= ((node->flush_interval > 0)
+            ? node->flush_interval : interval_g))))
+  {
+    char max[32];
+    const char *argv[] = { "ZREMRANGEBYSCORE", key, "-inf", max };
+
+    ssnprintf (max, sizeof (max), "(%"PRIu64,
+        (uint64_t) (vl->time - node->retention));
+    status = wr_append_command (node, STATIC_ARRAY_SIZE (argv), argv);
+    if ((status == 0) && (last_trim != NULL))
+      *last_trim = vl->time;
+  }
+
+  if ((status == 0) && (last_trim == NULL))
   {
-    node->conn = credis_connect (node->host, node->port, node->timeout);
-    if (node->conn == NULL)
+    char *ident_copy = strdup (ident);
+    last_trim = malloc (sizeof (*last_trim));
+
+    if ((ident_copy == NULL) || (last_trim == NULL)
+        || (c_avl_insert (node->known, ident_copy, last_trim) != 0))
     {
-      ERROR ("write_redis plugin: Connecting to host \"%s\" (port %i) failed.",
-          (node->host != NULL) ? node->host : "localhost",
-          (node->port != 0) ? node->port : 6379);
-      pthread_mutex_unlock (&node->lock);
-      return (-1);
+      sfree (ident_copy);
+      sfree (last_trim);
+      status = ENOMEM;
+    }
+    else
+    {
+      *last_trim = (node->retention > 0) ? vl->time : 0;
     }
   }
 
-  /* "credis_zadd" doesn't handle a NULL pointer gracefully, so I'd rather
-   * have a meaningful assertion message than a normal segmentation fault. */
-  assert (node->conn != NULL);
-  status = credis_zadd (node->conn, key, (double) vl->time, value);
+  if (status != 0)
+  {
+    node->buffer_fill = buffer_fill;
+    node->buffer_commands = commands_num;
+    c_complain (LOG_WARNING, &node->drop_complaint,
+        "write_redis plugin: The send buffer of node \"%s\" is full. "
+        "Dropping values.", node->name);
+  }
+  else
+  {
+    c_release (LOG_INFO, &node->drop_complaint,
+        "write_redis plugin: The send buffer of node \"%s\" has room "
+        "again.", node->name);
+    /* Wake up the sender when the buffer is no longer empty, so it starts
+     * timing the flush interval, and when it is half full. */
+    if ((buffer_fill == 0)
+        || ((buffer_fill < (node->buffer_size / 2))
+          && (node->buffer_fill >= (node->buffer_size / 2))))
+      pthread_cond_signal (&node->cond);
+  }
 
-  credis_sadd (node->conn, "collectd/values", ident);
+  pthread_mutex_unlock (&node->lock);
+
+  return (status);
+} /* }}} int wr_write */
+
+static int wr_flush (cdtime_t timeout, /* {{{ */
+    const char __attribute__((unused)) *identifier,
+    user_data_t *ud)
+{
+  wr_node_t *node = ud->data;
 
+  pthread_mutex_lock (&node->lock);
+  if (node->buffer_fill > 0)
+  {
+    node->flush_requested = 1;
+    pthread_cond_signal (&node->cond);
+  }
   pthread_mutex_unlock (&node->lock);
 
   return (0);
-} /* }}} int wr_write */
+} /* }}} int wr_flush */
 
 static void wr_config_free (void *ptr) /* {{{ */
 {
@@ -135,12 +650,32 @@ static void wr_config_free (void *ptr) /* {{{ */
   if (node == NULL)
     return;
 
-  if (node->conn != NULL)
+  /* The sender thread sends whatever is left in the buffer before it
+   * exits. */
+  pthread_mutex_lock (&node->lock);
+  node->shutdown = 1;
+  pthread_cond_signal (&node->cond);
+  pthread_mutex_unlock (&node->lock);
+
+  if (node->thread_running)
+  {
+    pthread_join (node->thread, /* retval = */ NULL);
+    node->thread_running = 0;
+  }
+
+  wr_disconnect (node);
+
+  if (node->known != NULL)
   {
-    credis_close (node->conn);
-    node->conn = NULL;
+    wr_known_clear (node);
+    c_avl_destroy (node->known);
   }
 
+  pthread_cond_destroy (&node->cond);
+  pthread_mutex_destroy (&node->lock);
+
+  sfree (node->buffer);
+  sfree (node->send_buffer);
   sfree (node->host);
   sfree (node);
 } /* }}} void wr_config_free */
@@ -148,6 +683,7 @@ static void wr_config_free (void *ptr) /* {{{ */
 static int wr_config_node (oconfig_item_t *ci) /* {{{ */
 {
   wr_node_t *node;
+  int buffer_size = WR_DEFAULT_BUFFER_SIZE;
   int status;
   int i;
 
@@ -158,13 +694,24 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
   node->host = NULL;
   node->port = 0;
   node->timeout = 1000;
-  node->conn = NULL;
+  node->sock_fd = -1;
+  C_COMPLAIN_INIT (&node->conn_complaint);
+  C_COMPLAIN_INIT (&node->send_complaint);
+  C_COMPLAIN_INIT (&node->drop_complaint);
   pthread_mutex_init (&node->lock, /* attr = */ NULL);
+  pthread_cond_init (&node->cond, /* attr = */ NULL);
+
+  node->known = c_avl_create ((void *) strcmp);
+  if (node->known == NULL)
+  {
+    wr_config_free (node);
+    return (ENOMEM);
+  }
 
   status = cf_util_get_string_buffer (ci, node->name, sizeof (node->name));
   if (status != 0)
   {
-    sfree (node);
+    wr_config_free (node);
     return (status);
   }
 
@@ -185,6 +732,12 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
     }
     else if (strcasecmp ("Timeout", child->key) == 0)
       status = cf_util_get_int (child, &node->timeout);
+    else if (strcasecmp ("FlushInterval", child->key) == 0)
+      status = cf_util_get_cdtime (child, &node->flush_interval);
+    else if (strcasecmp ("BufferSize", child->key) == 0)
+      status = cf_util_get_int (child, &buffer_size);
+    else if (strcasecmp ("Retention", child->key) == 0)
+      status = cf_util_get_cdtime (child, &node->retention);
     else
       WARNING ("write_redis plugin: Ignoring unknown config option \"%s\".",
           child->key);
@@ -193,6 +746,26 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
       break;
   } /* for (i = 0; i < ci->children_num; i++) */
 
+  if (status == 0)
+  {
+    /* One command takes up to about 1.5 kByte. */
+    if (buffer_size < 4096)
+    {
+      WARNING ("write_redis plugin: BufferSize %i is too small. "
+          "Using 4096 instead.", buffer_size);
+      buffer_size = 4096;
+    }
+    node->buffer_size = (size_t) buffer_size;
+
+    node->buffer = malloc (node->buffer_size);
+    node->send_buffer = malloc (node->buffer_size);
+    if ((node->buffer == NULL) || (node->send_buffer == NULL))
+    {
+      ERROR ("write_redis plugin: malloc failed.");
+      status = ENOMEM;
+    }
+  }
+
   if (status == 0)
   {
     char cb_name[DATA_MAX_NAME_LEN];
@@ -204,6 +777,12 @@ static int wr_config_node (oconfig_item_t *ci) /* {{{ */
     ud.free_func = wr_config_free;
 
     status = plugin_register_write (cb_name, wr_write, &ud);
+    if (status == 0)
+    {
+      /* The write callback owns `node'. */
+      ud.free_func = NULL;
+      plugin_register_flush (cb_name, wr_flush, &ud);
+    }
   }
 
   if (status != 0)